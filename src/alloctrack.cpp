@@ -0,0 +1,167 @@
+#include "wiz2hue.h"
+
+#ifdef WIZ2HUE_ALLOC_TRACK
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Heap allocation tracking (build with -DWIZ2HUE_ALLOC_TRACK and the linker wraps from the
+// seeed_xiao_esp32c6-alloctrack environment). Once markAllocSteadyState() has been called,
+// every malloc/calloc/realloc is attributed to a call site; routine polling and command
+// forwarding should leave this table empty.
+//
+// The return address alone says little: nearly every allocation reaches malloc through operator
+// new or String, and the RISC-V build keeps no frame pointers to walk further up. So a site is
+// the innermost ALLOC_SCOPE() tag of the allocating task, or the task name outside any scope,
+// plus the immediate caller. Resolve the address with addr2line against firmware.elf.
+const int ALLOC_TRACK_SITES = 32; // Distinct call sites remembered; further sites are only counted
+
+struct AllocSite
+{
+    const char *tag;
+    void *caller;
+    uint32_t count;
+    uint32_t bytes;
+};
+
+static thread_local const char *allocScopeTag = nullptr; // Per task; only the owning task writes it
+
+static AllocSite allocSites[ALLOC_TRACK_SITES];
+static int allocSiteCount = 0;
+static uint32_t allocsBeforeSteadyState = 0;
+static uint32_t steadyStateAllocs = 0;
+static uint32_t steadyStateUntracked = 0; // site table full
+static volatile bool steadyState = false;
+static unsigned long steadyStateSince = 0;
+static portMUX_TYPE allocTrackMux = portMUX_INITIALIZER_UNLOCKED;
+
+extern "C"
+{
+    void *__real_malloc(size_t size);
+    void *__real_calloc(size_t count, size_t size);
+    void *__real_realloc(void *ptr, size_t size);
+}
+
+AllocScope::AllocScope(const char *tag) : previous(allocScopeTag)
+{
+    allocScopeTag = tag;
+}
+
+AllocScope::~AllocScope()
+{
+    allocScopeTag = previous;
+}
+
+static void recordAllocation(void *caller, size_t size)
+{
+    const char *tag = allocScopeTag != nullptr ? allocScopeTag : pcTaskGetName(nullptr);
+    portENTER_CRITICAL(&allocTrackMux);
+    if (!steadyState)
+    {
+        allocsBeforeSteadyState++;
+        portEXIT_CRITICAL(&allocTrackMux);
+        return;
+    }
+
+    steadyStateAllocs++;
+    int i = 0;
+    while (i < allocSiteCount && (allocSites[i].caller != caller || allocSites[i].tag != tag))
+    {
+        i++;
+    }
+    if (i == allocSiteCount && allocSiteCount < ALLOC_TRACK_SITES)
+    {
+        allocSites[i].tag = tag;
+        allocSites[i].caller = caller;
+        allocSites[i].count = 0;
+        allocSites[i].bytes = 0;
+        allocSiteCount++;
+    }
+    if (i < allocSiteCount)
+    {
+        allocSites[i].count++;
+        allocSites[i].bytes += size;
+    }
+    else
+    {
+        steadyStateUntracked++;
+    }
+    portEXIT_CRITICAL(&allocTrackMux);
+}
+
+extern "C"
+{
+    void *__wrap_malloc(size_t size)
+    {
+        recordAllocation(__builtin_return_address(0), size);
+        return __real_malloc(size);
+    }
+
+    void *__wrap_calloc(size_t count, size_t size)
+    {
+        recordAllocation(__builtin_return_address(0), count * size);
+        return __real_calloc(count, size);
+    }
+
+    void *__wrap_realloc(void *ptr, size_t size)
+    {
+        recordAllocation(__builtin_return_address(0), size);
+        return __real_realloc(ptr, size);
+    }
+}
+
+void markAllocSteadyState()
+{
+    portENTER_CRITICAL(&allocTrackMux);
+    steadyState = true;
+    portEXIT_CRITICAL(&allocTrackMux);
+    steadyStateSince = millis();
+    Serial.printf("Alloc tracking: steady state from now on (%lu allocations during startup)\n",
+                  (unsigned long)allocsBeforeSteadyState);
+}
+
+bool isAllocSteadyState()
+{
+    return steadyState;
+}
+
+uint32_t allocSteadyStateCount()
+{
+    portENTER_CRITICAL(&allocTrackMux);
+    uint32_t count = steadyStateAllocs;
+    portEXIT_CRITICAL(&allocTrackMux);
+    return count;
+}
+
+void logAllocStats()
+{
+    if (!steadyState)
+    {
+        Serial.printf("Alloc tracking: %lu allocations so far, steady state not reached\n",
+                      (unsigned long)allocsBeforeSteadyState);
+        return;
+    }
+
+    // Copy under the lock; printing allocates inside the UART driver on some cores
+    AllocSite sites[ALLOC_TRACK_SITES];
+    portENTER_CRITICAL(&allocTrackMux);
+    int siteCount = allocSiteCount;
+    uint32_t total = steadyStateAllocs;
+    uint32_t untracked = steadyStateUntracked;
+    memcpy(sites, allocSites, sizeof(AllocSite) * siteCount);
+    portEXIT_CRITICAL(&allocTrackMux);
+
+    if (total == 0)
+    {
+        Serial.printf("Alloc tracking: steady state clean for %lu s\n", (millis() - steadyStateSince) / 1000);
+        return;
+    }
+
+    Serial.printf("Alloc tracking: STEADY STATE VIOLATION - %lu allocations at %d call sites in %lu s (%lu untracked)\n",
+                  (unsigned long)total, siteCount, (millis() - steadyStateSince) / 1000, (unsigned long)untracked);
+    for (int i = 0; i < siteCount; i++)
+    {
+        Serial.printf("  %s @ %p: %lu allocations, %lu bytes\n", sites[i].tag, sites[i].caller,
+                      (unsigned long)sites[i].count, (unsigned long)sites[i].bytes);
+    }
+}
+#endif
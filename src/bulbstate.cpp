@@ -0,0 +1,347 @@
+#include "wiz2hue.h"
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Last-known bulb state, persisted in NVS so endpoints can register at boot with the state each
+// bulb last reported instead of waiting for a live getPilot. A state is packed into one 64-bit
+// NVS value keyed by MAC, a single 32-byte entry in NVS's wear-levelled log. Writes only happen
+// once a change has been stable for BULB_STATE_SETTLE_TIME and at most once per
+// BULB_STATE_MIN_WRITE_INTERVAL per bulb: a bulb that changes constantly costs at most
+// 144 writes (4.6 KB) a day. The storage writer task calls flushBulbStates; the communication
+// tasks only update the RAM slots.
+const char *BULB_STATE_NAMESPACE = "bulbstate";
+const uint8_t BULB_STATE_FORMAT = 0xB1;                    // Low byte of every stored value
+const unsigned long BULB_STATE_SETTLE_TIME = 30000;        // Change must be stable this long
+const unsigned long BULB_STATE_MIN_WRITE_INTERVAL = 600000; // Per bulb: 10 minutes
+const unsigned long BULB_STATE_FLUSH_INTERVAL = 1000;      // How often flushBulbStates looks
+const int BULB_STATE_WRITES_PER_FLUSH = 4;                 // Bounds the time spent in one loop pass
+const size_t BULB_STATE_ENTRY_BYTES = 32;                  // One NVS entry per 64-bit value
+
+const uint8_t BULB_STATE_ON = 0x01;
+const uint8_t BULB_STATE_DIMMING = 0x02;
+const uint8_t BULB_STATE_RGB = 0x04;
+const uint8_t BULB_STATE_TEMP = 0x08;
+
+// RAM copy per registry handle; the MAC detects a handle reused by another bulb
+struct BulbStateSlot
+{
+    uint8_t mac[6];
+    bool used;
+    bool dirty;
+    uint64_t current;   // Packed last reported state
+    uint64_t persisted; // Packed value in NVS, 0 = none
+    unsigned long changedAt;
+    unsigned long writtenAt; // 0 = not written this boot
+};
+
+static BulbStateSlot stateSlots[BULB_REGISTRY_CAPACITY];
+static SemaphoreHandle_t stateStoreMutex = nullptr;
+static Preferences stateStore;
+static bool stateStoreOpen = false;
+static unsigned long lastFlushCheck = 0;
+static BulbStateStoreStats storeStats;
+
+void initBulbStateStore()
+{
+    stateStoreMutex = xSemaphoreCreateMutex();
+    if (stateStoreMutex == nullptr)
+    {
+        Serial.println("Failed to create bulb state store mutex");
+    }
+}
+
+static bool takeStateStoreMutex()
+{
+    return stateStoreMutex != nullptr && xSemaphoreTake(stateStoreMutex, pdMS_TO_TICKS(20)) == pdTRUE;
+}
+
+static bool openStateStore()
+{
+    if (!stateStoreOpen)
+    {
+        stateStoreOpen = stateStore.begin(BULB_STATE_NAMESPACE, false);
+        if (!stateStoreOpen)
+        {
+            Serial.println("Bulb state store: failed to open NVS namespace");
+        }
+    }
+    return stateStoreOpen;
+}
+
+uint64_t packBulbState(const WizBulbState &state)
+{
+    uint8_t flags = state.state ? BULB_STATE_ON : 0;
+    uint64_t packed = BULB_STATE_FORMAT;
+    if (state.dimming >= 0)
+    {
+        flags |= BULB_STATE_DIMMING;
+        packed |= (uint64_t)(uint8_t)state.dimming << 16;
+    }
+    if (state.r >= 0 && state.g >= 0 && state.b >= 0)
+    {
+        flags |= BULB_STATE_RGB;
+        packed |= (uint64_t)(uint8_t)state.r << 24 | (uint64_t)(uint8_t)state.g << 32 | (uint64_t)(uint8_t)state.b << 40;
+    }
+    if (state.temp > 0)
+    {
+        flags |= BULB_STATE_TEMP;
+        packed |= (uint64_t)(uint16_t)state.temp << 48;
+    }
+    return packed | (uint64_t)flags << 8;
+}
+
+bool unpackBulbState(uint64_t packed, WizBulbState &state)
+{
+    if ((packed & 0xFF) != BULB_STATE_FORMAT)
+    {
+        return false;
+    }
+    uint8_t flags = packed >> 8;
+    state = WizBulbState();
+    state.state = flags & BULB_STATE_ON;
+    if (flags & BULB_STATE_DIMMING)
+    {
+        state.dimming = (uint8_t)(packed >> 16);
+    }
+    if (flags & BULB_STATE_RGB)
+    {
+        state.r = (uint8_t)(packed >> 24);
+        state.g = (uint8_t)(packed >> 32);
+        state.b = (uint8_t)(packed >> 40);
+    }
+    if (flags & BULB_STATE_TEMP)
+    {
+        state.temp = (uint16_t)(packed >> 48);
+    }
+    state.isValid = true;
+    return true;
+}
+
+// Slot for a registered bulb (caller holds stateStoreMutex), null if the bulb is not registered
+static BulbStateSlot *slotFor(const uint8_t *mac)
+{
+    int handle = bulbRegistryFindByMac(mac);
+    if (handle < 0 || handle >= BULB_REGISTRY_CAPACITY)
+    {
+        return nullptr;
+    }
+    BulbStateSlot &slot = stateSlots[handle];
+    if (!slot.used || memcmp(slot.mac, mac, sizeof(slot.mac)) != 0)
+    {
+        memcpy(slot.mac, mac, sizeof(slot.mac));
+        slot.used = true;
+        slot.dirty = false;
+        slot.current = 0;
+        slot.persisted = 0;
+        slot.changedAt = 0;
+        slot.writtenAt = 0;
+    }
+    return &slot;
+}
+
+bool restoreBulbState(const WizBulbInfo &bulb, WizBulbState &state)
+{
+    uint64_t persisted = openStateStore() ? stateStore.getULong64(MacStr(bulb.mac).c_str(), 0) : 0;
+
+    // After a warm restart the snapshot is newer than anything written to NVS
+    uint64_t packed = warmSnapshotState(bulb.mac);
+    if (packed == 0)
+    {
+        packed = persisted;
+    }
+    bool restored = unpackBulbState(packed, state);
+
+    if (takeStateStoreMutex())
+    {
+        BulbStateSlot *slot = slotFor(bulb.mac);
+        if (slot != nullptr && restored)
+        {
+            // A snapshot state may not be in NVS yet; it is written once it has settled
+            slot->current = packed;
+            slot->persisted = persisted;
+            slot->dirty = packed != persisted;
+            slot->changedAt = millis();
+        }
+        xSemaphoreGive(stateStoreMutex);
+    }
+
+    if (restored)
+    {
+        storeStats.restored++;
+    }
+    else
+    {
+        storeStats.missing++;
+    }
+    return restored;
+}
+
+void recordBulbState(const WizBulbInfo &bulb, const WizBulbState &state)
+{
+    if (!state.isValid)
+    {
+        return;
+    }
+    uint64_t packed = packBulbState(state);
+    if (!takeStateStoreMutex())
+    {
+        return; // The next poll records it again
+    }
+    BulbStateSlot *slot = slotFor(bulb.mac);
+    if (slot != nullptr && packed != slot->current)
+    {
+        if (slot->dirty)
+        {
+            storeStats.coalesced++; // Replaces a change that was never written
+        }
+        slot->current = packed;
+        slot->changedAt = millis();
+        slot->dirty = packed != slot->persisted;
+    }
+    xSemaphoreGive(stateStoreMutex);
+}
+
+uint64_t currentBulbState(const uint8_t *mac)
+{
+    uint64_t packed = 0;
+    int handle = bulbRegistryFindByMac(mac);
+    if (handle >= 0 && handle < BULB_REGISTRY_CAPACITY && takeStateStoreMutex())
+    {
+        const BulbStateSlot &slot = stateSlots[handle];
+        if (slot.used && memcmp(slot.mac, mac, sizeof(slot.mac)) == 0)
+        {
+            packed = slot.current;
+        }
+        xSemaphoreGive(stateStoreMutex);
+    }
+    return packed;
+}
+
+int flushBulbStates(bool force)
+{
+    unsigned long now = millis();
+    if (!force && now - lastFlushCheck < BULB_STATE_FLUSH_INTERVAL)
+    {
+        return 0;
+    }
+    lastFlushCheck = now;
+
+    // Pick due slots under the lock, write them outside it
+    uint8_t macs[BULB_STATE_WRITES_PER_FLUSH][6];
+    uint64_t values[BULB_STATE_WRITES_PER_FLUSH];
+    int due = 0;
+    if (!takeStateStoreMutex())
+    {
+        return 0;
+    }
+    for (int i = 0; i < BULB_REGISTRY_CAPACITY && due < BULB_STATE_WRITES_PER_FLUSH; i++)
+    {
+        BulbStateSlot &slot = stateSlots[i];
+        if (!slot.used || !slot.dirty)
+        {
+            continue;
+        }
+        if (!force && (now - slot.changedAt < BULB_STATE_SETTLE_TIME ||
+                       (slot.writtenAt != 0 && now - slot.writtenAt < BULB_STATE_MIN_WRITE_INTERVAL)))
+        {
+            continue;
+        }
+        memcpy(macs[due], slot.mac, sizeof(slot.mac));
+        values[due] = slot.current;
+        slot.dirty = false;
+        slot.persisted = slot.current;
+        slot.writtenAt = now;
+        due++;
+    }
+    xSemaphoreGive(stateStoreMutex);
+
+    if (due == 0 || !openStateStore())
+    {
+        return 0;
+    }
+    int writes = 0;
+    for (int i = 0; i < due; i++)
+    {
+        unsigned long writeStart = micros();
+        bool written = stateStore.putULong64(MacStr(macs[i]).c_str(), values[i]) == sizeof(uint64_t);
+        unsigned long writeMicros = micros() - writeStart;
+        if (written)
+        {
+            storeStats.writes++;
+            storeStats.writeMicros += writeMicros;
+            storeStats.maxWriteMicros = max(storeStats.maxWriteMicros, writeMicros);
+            writes++;
+            continue;
+        }
+
+        storeStats.writeFailures++;
+        if (takeStateStoreMutex())
+        {
+            BulbStateSlot *slot = slotFor(macs[i]);
+            if (slot != nullptr)
+            {
+                slot->persisted = 0;
+                slot->dirty = true; // Retried after the minimum interval
+            }
+            xSemaphoreGive(stateStoreMutex);
+        }
+    }
+    return writes;
+}
+
+void eraseBulbStates()
+{
+    if (openStateStore() && stateStore.clear())
+    {
+        Serial.println("Cleared stored bulb states");
+    }
+    if (takeStateStoreMutex())
+    {
+        for (auto &slot : stateSlots)
+        {
+            slot.used = false;
+        }
+        xSemaphoreGive(stateStoreMutex);
+    }
+}
+
+// A retired bulb's slot is freed for the next registry record and its NVS entry removed, so a
+// bulb that comes back later starts without a stale state
+void releaseBulbState(const uint8_t *mac)
+{
+    if (takeStateStoreMutex())
+    {
+        for (auto &slot : stateSlots)
+        {
+            if (slot.used && memcmp(slot.mac, mac, sizeof(slot.mac)) == 0)
+            {
+                slot.used = false;
+                slot.dirty = false;
+            }
+        }
+        xSemaphoreGive(stateStoreMutex);
+    }
+    MacStr key(mac);
+    if (openStateStore() && stateStore.isKey(key.c_str()))
+    {
+        stateStore.remove(key.c_str());
+    }
+}
+
+BulbStateStoreStats getBulbStateStoreStats()
+{
+    return storeStats;
+}
+
+void logBulbStateStoreStats()
+{
+    unsigned long uptime = millis();
+    float perDay = uptime > 0 ? 86400000.0f * storeStats.writes / uptime : 0.0f;
+    Serial.printf("Bulb state store: %lu restored, %lu without stored state, %lu writes (%.0f/day, %.1f KB/day), %lu coalesced, %lu failed, write avg %lu / max %lu us\n",
+                  (unsigned long)storeStats.restored, (unsigned long)storeStats.missing, (unsigned long)storeStats.writes,
+                  perDay, perDay * BULB_STATE_ENTRY_BYTES / 1024.0f, (unsigned long)storeStats.coalesced,
+                  (unsigned long)storeStats.writeFailures,
+                  storeStats.writes > 0 ? (unsigned long)(storeStats.writeMicros / storeStats.writes) : 0,
+                  storeStats.maxWriteMicros);
+}
@@ -0,0 +1,231 @@
+#include "wiz2hue.h"
+#include <Zigbee.h>
+
+// Fixed-point color conversion kernel.
+//
+// processWizStateUpdate() used to run every WiZ RGB reply through the Zigbee library's float
+// RGB -> XY -> RGB round trip at full level (espRgbColorToXYColor, espXYToRgbColor(255, ...)):
+// linearize, wide-gamut RGB -> XYZ, xy, back to XYZ with Y = 255/254, sRGB XYZ -> RGB, clamp,
+// re-encode and truncate, with two pow() calls per channel. The xy step keeps only the ratios
+// of X, Y and Z, so the whole trip is one 3x3 matrix (the product of the library's two
+// matrices) applied to the linear color and divided by its luminance. Here that is a 256-entry
+// Q24 linearization table, two integer dot products per channel and a binary search of the same
+// table for the inverse gamma.
+//
+// Tolerance: the host test (test/test_color) compares all 2^24 colors against a port of the
+// library code: at most 2 counts per channel, about 1% of colors differ at all. The differences
+// come from the library's 16-bit xy quantization. colorKernelSelfCheck() checks the same bound
+// against the library itself on the device.
+
+// sRGB 8-bit -> linear light, Q24 (round(srgbToLinear(i / 255) * 16777215))
+static const uint32_t SRGB_TO_LINEAR[256] = {
+    0, 5092, 10185, 15277, 20369, 25462, 30554, 35646,
+    40739, 45831, 50923, 56146, 61682, 67524, 73676, 80144,
+    86931, 94043, 101483, 109255, 117364, 125813, 134607, 143749,
+    153244, 163095, 173306, 183880, 194821, 206133, 217819, 229883,
+    242327, 255157, 268373, 281981, 295983, 310382, 325182, 340386,
+    355996, 372016, 388449, 405298, 422565, 440255, 458368, 476910,
+    495881, 515286, 535127, 555406, 576126, 597291, 618902, 640963,
+    663476, 686443, 709868, 733752, 758099, 782910, 808189, 833938,
+    860159, 886854, 914027, 941680, 969814, 998433, 1027538, 1057133,
+    1087218, 1117798, 1148873, 1180446, 1212520, 1245097, 1278179, 1311767,
+    1345865, 1380475, 1415598, 1451237, 1487394, 1524071, 1561270, 1598994,
+    1637244, 1676022, 1715332, 1755173, 1795550, 1836463, 1877914, 1919907,
+    1962442, 2005522, 2049148, 2093324, 2138049, 2183328, 2229160, 2275550,
+    2322497, 2370005, 2418074, 2466708, 2515908, 2565675, 2616012, 2666920,
+    2718402, 2770458, 2823092, 2876304, 2930097, 2984472, 3039431, 3094977,
+    3151109, 3207832, 3265145, 3323052, 3381553, 3440650, 3500346, 3560641,
+    3621538, 3683038, 3745143, 3807855, 3871175, 3935106, 3999647, 4064802,
+    4130573, 4196959, 4263964, 4331589, 4399836, 4468705, 4538200, 4608320,
+    4679069, 4750447, 4822457, 4895099, 4968375, 5042288, 5116838, 5192027,
+    5267856, 5344328, 5421443, 5499204, 5577611, 5656666, 5736372, 5816728,
+    5897738, 5979402, 6061722, 6144699, 6228334, 6312631, 6397588, 6483210,
+    6569496, 6656448, 6744068, 6832357, 6921316, 7010948, 7101253, 7192233,
+    7283889, 7376223, 7469236, 7562930, 7657306, 7752365, 7848109, 7944540,
+    8041658, 8139465, 8237962, 8337152, 8437034, 8537611, 8638884, 8740855,
+    8843524, 8946893, 9050963, 9155737, 9261214, 9367397, 9474286, 9581884,
+    9690191, 9799209, 9908939, 10019383, 10130541, 10242415, 10355007, 10468318,
+    10582348, 10697100, 10812574, 10928772, 11045696, 11163346, 11281723, 11400830,
+    11520667, 11641236, 11762537, 11884573, 12007344, 12130851, 12255097, 12380082,
+    12505807, 12632273, 12759483, 12887437, 13016136, 13145582, 13275776, 13406718,
+    13538412, 13670856, 13804054, 13938005, 14072711, 14208174, 14344395, 14481374,
+    14619114, 14757614, 14896877, 15036904, 15177695, 15319252, 15461577, 15604670,
+    15748532, 15893165, 16038570, 16184749, 16331701, 16479429, 16627933, 16777215,
+};
+const uint32_t LINEAR_ONE = 16777215;
+
+// Luminance row of the library's RGB -> XYZ matrix in Q16 (0.234327, 0.743075, 0.022598)
+static const int64_t XYZ_LUMA[3] = {15357, 48698, 1481};
+
+// sRGB XYZ -> RGB times wide-gamut RGB -> XYZ, times 255/254 for Y = level / 254, in Q16
+static const int64_t ROUND_TRIP[3][3] = {
+    {114873, -54837, 5762},
+    {-12512, 85258, -6948},
+    {-763, -5903, 72450},
+};
+
+// Largest sRGB code whose linear value does not exceed 'linear' (truncates like the float path)
+static uint8_t linearToSrgb(uint32_t linear)
+{
+    uint8_t code = 0;
+    for (int step = 128; step > 0; step >>= 1)
+    {
+        if (SRGB_TO_LINEAR[code + step] <= linear)
+        {
+            code += step;
+        }
+    }
+    return code;
+}
+
+void colorNormalizeRgb(uint8_t &r, uint8_t &g, uint8_t &b)
+{
+    const int64_t linear[3] = {SRGB_TO_LINEAR[r], SRGB_TO_LINEAR[g], SRGB_TO_LINEAR[b]};
+    // Q40 luminance, kept at Q32 so the scaled channels below fit in 64 bits
+    int64_t luma = (XYZ_LUMA[0] * linear[0] + XYZ_LUMA[1] * linear[1] + XYZ_LUMA[2] * linear[2]) >> 8;
+    if (luma == 0)
+    {
+        r = g = b = 0; // black has no chromaticity
+        return;
+    }
+
+    uint8_t *channels[3] = {&r, &g, &b};
+    for (int i = 0; i < 3; i++)
+    {
+        int64_t value = ROUND_TRIP[i][0] * linear[0] + ROUND_TRIP[i][1] * linear[1] + ROUND_TRIP[i][2] * linear[2];
+        int64_t scaled = value <= 0 ? 0 : (value << 16) / luma; // Q24, clamped below
+        *channels[i] = linearToSrgb(scaled > LINEAR_ONE ? LINEAR_ONE : (uint32_t)scaled);
+    }
+}
+
+void colorNormalizeRgbBatch(const uint8_t *rgbIn, uint8_t *rgbOut, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t r = rgbIn[i * 3];
+        uint8_t g = rgbIn[i * 3 + 1];
+        uint8_t b = rgbIn[i * 3 + 2];
+        colorNormalizeRgb(r, g, b);
+        rgbOut[i * 3] = r;
+        rgbOut[i * 3 + 1] = g;
+        rgbOut[i * 3 + 2] = b;
+    }
+}
+
+// A single divide is cheaper than any table here; these only guard against zero and range
+int miredsToKelvin(int mireds)
+{
+    return mireds > 0 ? 1000000 / mireds : 0;
+}
+
+int kelvinToMireds(int kelvin)
+{
+    return kelvin > 0 ? 1000000 / kelvin : 0;
+}
+
+uint8_t levelToPercent(uint8_t level)
+{
+    return map(level, 0, 255, 0, 100);
+}
+
+uint8_t percentToLevel(int percent)
+{
+    return map(percent < 0 ? 0 : percent > 100 ? 100 : percent, 0, 100, 0, 255);
+}
+
+#ifdef WIZ2HUE_COLOR_BENCH
+// Self-check against the Zigbee library's float conversion plus a timing comparison (build with
+// -DWIZ2HUE_COLOR_BENCH; results go to Serial at boot)
+const int COLOR_CHECK_STEP = 5;        // Grid spacing per channel for the self-check
+const int COLOR_CHECK_TOLERANCE = 2;   // Counts per channel, see the kernel description above
+const int COLOR_BENCH_ITERATIONS = 2000;
+const int COLOR_BENCH_BATCH = 16;      // Colors per batch call
+
+static void floatRoundTrip(uint8_t &r, uint8_t &g, uint8_t &b)
+{
+    espXyColor_t xy = espRgbColorToXYColor({r, g, b});
+    espRgbColor_t rgb = espXYToRgbColor(255, xy.x, xy.y);
+    r = rgb.r;
+    g = rgb.g;
+    b = rgb.b;
+}
+
+void colorKernelSelfCheck()
+{
+    int worst = 0;
+    uint32_t checked = 0;
+    uint32_t differing = 0;
+    for (int r = 0; r < 256; r += COLOR_CHECK_STEP)
+    {
+        for (int g = 0; g < 256; g += COLOR_CHECK_STEP)
+        {
+            for (int b = 0; b < 256; b += COLOR_CHECK_STEP)
+            {
+                if (r == 0 && g == 0 && b == 0)
+                {
+                    continue; // the float path divides by zero on black
+                }
+                uint8_t fr = r, fg = g, fb = b;
+                uint8_t xr = r, xg = g, xb = b;
+                floatRoundTrip(fr, fg, fb);
+                colorNormalizeRgb(xr, xg, xb);
+                int diff = max(abs(fr - xr), max(abs(fg - xg), abs(fb - xb)));
+                if (diff > 0)
+                {
+                    differing++;
+                }
+                if (diff > worst)
+                {
+                    worst = diff;
+                    Serial.printf("  Color check: %d,%d,%d -> float %d,%d,%d fixed %d,%d,%d\n",
+                                  r, g, b, fr, fg, fb, xr, xg, xb);
+                }
+                checked++;
+            }
+        }
+    }
+    Serial.printf("Color kernel self-check %s: %lu colors, %lu differ, worst deviation %d count(s), tolerance %d\n",
+                  worst <= COLOR_CHECK_TOLERANCE ? "passed" : "FAILED", (unsigned long)checked,
+                  (unsigned long)differing, worst, COLOR_CHECK_TOLERANCE);
+
+    // Timing: same pseudo-random colors through each path
+    uint8_t colors[COLOR_BENCH_BATCH * 3];
+    uint8_t out[COLOR_BENCH_BATCH * 3];
+    uint32_t seed = 0x12345678;
+    for (int i = 0; i < COLOR_BENCH_BATCH * 3; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        colors[i] = seed >> 24;
+    }
+
+    unsigned long start = micros();
+    for (int i = 0; i < COLOR_BENCH_ITERATIONS; i++)
+    {
+        const uint8_t *c = &colors[(i % COLOR_BENCH_BATCH) * 3];
+        uint8_t r = c[0], g = c[1], b = c[2];
+        floatRoundTrip(r, g, b);
+        out[0] = r;
+    }
+    unsigned long floatMicros = micros() - start;
+
+    start = micros();
+    for (int i = 0; i < COLOR_BENCH_ITERATIONS; i++)
+    {
+        const uint8_t *c = &colors[(i % COLOR_BENCH_BATCH) * 3];
+        uint8_t r = c[0], g = c[1], b = c[2];
+        colorNormalizeRgb(r, g, b);
+        out[0] = r;
+    }
+    unsigned long fixedMicros = micros() - start;
+
+    start = micros();
+    for (int i = 0; i < COLOR_BENCH_ITERATIONS / COLOR_BENCH_BATCH; i++)
+    {
+        colorNormalizeRgbBatch(colors, out, COLOR_BENCH_BATCH);
+    }
+    unsigned long batchMicros = micros() - start;
+
+    Serial.printf("Color kernel benchmark (%d conversions): float %lu us, fixed %lu us, batch %lu us\n",
+                  COLOR_BENCH_ITERATIONS, floatMicros, fixedMicros, batchMicros);
+}
+#endif
@@ -0,0 +1,234 @@
+#include "wiz2hue.h"
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Stable Zigbee endpoints: the endpoint of every bulb, and the Zigbee device type it was first
+// exposed as, are kept in NVS by MAC. The coordinator keeps seeing the same light on the same
+// endpoint whichever bulbs are added or retired around it. A bulb without an assignment takes
+// the lowest free endpoint; with an empty map and bulbs in MAC order this reproduces the
+// numbering used before assignments were stored. The table is one NVS blob, rewritten only when
+// an assignment changes.
+const char *ENDPOINT_NAMESPACE = "endpoints";
+const uint8_t FIRST_ENDPOINT = 10;
+const uint8_t LAST_ENDPOINT = 240; // Last Zigbee application endpoint
+const int ENDPOINT_COUNT = LAST_ENDPOINT - FIRST_ENDPOINT + 1;
+
+struct EndpointAssignment
+{
+    uint8_t mac[6];
+    uint8_t endpoint;
+    uint8_t zigbeeType; // es_zb_hue_light_type_t
+};
+
+static EndpointAssignment assignments[ENDPOINT_COUNT]; // Indexed by endpoint - FIRST_ENDPOINT
+static bool assignmentsLoaded = false;
+static SemaphoreHandle_t endpointMutex = nullptr;
+
+void initEndpointMap()
+{
+    endpointMutex = xSemaphoreCreateMutex();
+    if (endpointMutex == nullptr)
+    {
+        Serial.println("Failed to create endpoint map mutex");
+    }
+}
+
+static bool takeEndpointMutex()
+{
+    return endpointMutex != nullptr && xSemaphoreTake(endpointMutex, pdMS_TO_TICKS(100)) == pdTRUE;
+}
+
+// Caller holds endpointMutex
+static void loadAssignments()
+{
+    if (assignmentsLoaded)
+    {
+        return;
+    }
+    assignmentsLoaded = true;
+    memset(assignments, 0, sizeof(assignments));
+
+    Preferences prefs;
+    if (!prefs.begin(ENDPOINT_NAMESPACE, true))
+    {
+        return; // Nothing stored yet
+    }
+    size_t length = prefs.getBytesLength("map");
+    int stored = 0;
+    if (length > 0 && length % sizeof(EndpointAssignment) == 0 && length <= sizeof(assignments))
+    {
+        EndpointAssignment entries[ENDPOINT_COUNT];
+        prefs.getBytes("map", entries, length);
+        for (size_t i = 0; i < length / sizeof(EndpointAssignment); i++)
+        {
+            const EndpointAssignment &entry = entries[i];
+            if (entry.endpoint >= FIRST_ENDPOINT && entry.endpoint <= LAST_ENDPOINT && macIsSet(entry.mac))
+            {
+                assignments[entry.endpoint - FIRST_ENDPOINT] = entry;
+                stored++;
+            }
+        }
+    }
+    prefs.end();
+    Serial.printf("Endpoint map: %d stored assignments\n", stored);
+}
+
+// Caller holds endpointMutex
+static void saveAssignments()
+{
+    EndpointAssignment entries[ENDPOINT_COUNT];
+    int count = 0;
+    for (const EndpointAssignment &entry : assignments)
+    {
+        if (entry.endpoint != 0)
+        {
+            entries[count++] = entry;
+        }
+    }
+
+    Preferences prefs;
+    if (!prefs.begin(ENDPOINT_NAMESPACE, false))
+    {
+        Serial.println("Endpoint map: failed to open NVS namespace");
+        return;
+    }
+    if (count == 0)
+    {
+        prefs.remove("map");
+    }
+    else if (prefs.putBytes("map", entries, count * sizeof(EndpointAssignment)) != count * sizeof(EndpointAssignment))
+    {
+        Serial.println("Endpoint map: failed to save");
+    }
+    prefs.end();
+}
+
+// Caller holds endpointMutex
+static int findAssignment(const uint8_t *mac)
+{
+    for (int i = 0; i < ENDPOINT_COUNT; i++)
+    {
+        if (assignments[i].endpoint != 0 && memcmp(assignments[i].mac, mac, sizeof(assignments[i].mac)) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint8_t endpointFor(const uint8_t *mac, uint8_t *zigbeeType)
+{
+    if (!takeEndpointMutex())
+    {
+        return 0;
+    }
+    loadAssignments();
+    int index = findAssignment(mac);
+    uint8_t endpoint = 0;
+    if (index >= 0)
+    {
+        endpoint = assignments[index].endpoint;
+        if (zigbeeType != nullptr)
+        {
+            *zigbeeType = assignments[index].zigbeeType;
+        }
+    }
+    xSemaphoreGive(endpointMutex);
+    return endpoint;
+}
+
+uint8_t assignEndpoint(const uint8_t *mac, uint8_t zigbeeType, uint8_t endpoint)
+{
+    if (!macIsSet(mac) || !takeEndpointMutex())
+    {
+        return 0;
+    }
+    loadAssignments();
+
+    int index = findAssignment(mac);
+    if (index < 0)
+    {
+        if (endpoint != 0)
+        {
+            bool usable = endpoint >= FIRST_ENDPOINT && endpoint <= LAST_ENDPOINT &&
+                          assignments[endpoint - FIRST_ENDPOINT].endpoint == 0;
+            index = usable ? endpoint - FIRST_ENDPOINT : -1;
+        }
+        else
+        {
+            for (int i = 0; i < ENDPOINT_COUNT && index < 0; i++)
+            {
+                if (assignments[i].endpoint == 0)
+                {
+                    index = i;
+                }
+            }
+        }
+        if (index >= 0)
+        {
+            EndpointAssignment &entry = assignments[index];
+            memcpy(entry.mac, mac, sizeof(entry.mac));
+            entry.endpoint = FIRST_ENDPOINT + index;
+            entry.zigbeeType = zigbeeType;
+            saveAssignments();
+        }
+    }
+    uint8_t assigned = index >= 0 ? assignments[index].endpoint : 0;
+    xSemaphoreGive(endpointMutex);
+    return assigned;
+}
+
+uint8_t nextFreeEndpoint(uint8_t from)
+{
+    if (!takeEndpointMutex())
+    {
+        return 0;
+    }
+    loadAssignments();
+    uint8_t endpoint = 0;
+    for (int candidate = max((int)from, (int)FIRST_ENDPOINT); candidate <= LAST_ENDPOINT; candidate++)
+    {
+        if (assignments[candidate - FIRST_ENDPOINT].endpoint == 0)
+        {
+            endpoint = candidate;
+            break;
+        }
+    }
+    xSemaphoreGive(endpointMutex);
+    return endpoint;
+}
+
+void releaseEndpoint(const uint8_t *mac)
+{
+    if (!takeEndpointMutex())
+    {
+        return;
+    }
+    loadAssignments();
+    int index = findAssignment(mac);
+    if (index >= 0)
+    {
+        memset(&assignments[index], 0, sizeof(EndpointAssignment));
+        saveAssignments();
+    }
+    xSemaphoreGive(endpointMutex);
+}
+
+void eraseEndpointAssignments()
+{
+    if (!takeEndpointMutex())
+    {
+        return;
+    }
+    memset(assignments, 0, sizeof(assignments));
+    assignmentsLoaded = true;
+    Preferences prefs;
+    if (prefs.begin(ENDPOINT_NAMESPACE, false))
+    {
+        prefs.clear();
+        prefs.end();
+        Serial.println("Cleared endpoint assignments");
+    }
+    xSemaphoreGive(endpointMutex);
+}
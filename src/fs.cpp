@@ -38,41 +38,60 @@ std::vector<WizBulbInfo> loadLightsFromFile()
 {
     std::vector<WizBulbInfo> bulbs;
 
+    if (loadLightsFromCache(bulbs))
+    {
+        return bulbs;
+    }
+
+    // No usable binary cache (first boot with this firmware, or corrupt): import the JSON export
+    if (importLightsFromJson(bulbs) && bulbs.size() > 0)
+    {
+        saveLightsToCache(bulbs);
+    }
+    return bulbs;
+}
+
+bool saveLightsToFile(const std::vector<WizBulbInfo> &bulbs)
+{
+    bool cached = saveLightsToCache(bulbs);
+    bool exported = exportLightsToJson(bulbs);
+    return cached || exported;
+}
+
+bool importLightsFromJson(std::vector<WizBulbInfo> &bulbs)
+{
+    bulbs.clear();
+
     if (!LittleFS.exists("/lights.json"))
     {
         Serial.println("No lights.json file found");
-        return bulbs;
+        return false;
     }
 
     File file = LittleFS.open("/lights.json", "r");
     if (!file)
     {
         Serial.println("Failed to open lights.json for reading");
-        return bulbs;
+        return false;
     }
 
-    String jsonContent = file.readString();
-    file.close();
-
-    Serial.printf("Loading lights from file: %s\n", jsonContent.c_str());
-
+    // Parse straight from the file; each light is decoded from its element in the same document
     JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, jsonContent);
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
 
     if (error)
     {
         Serial.printf("Failed to parse lights.json: %s\n", error.c_str());
-        return bulbs;
+        return false;
     }
 
-    if (doc["lights"].is<JsonArray>())
+    if (doc["lights"].is<JsonArrayConst>())
     {
-        JsonArray lightsArray = doc["lights"];
-        for (JsonVariant lightVariant : lightsArray)
+        JsonArrayConst lightsArray = doc["lights"];
+        for (JsonVariantConst lightVariant : lightsArray)
         {
-            String lightJson;
-            serializeJson(lightVariant, lightJson);
-            WizBulbInfo bulb = wizBulbInfoFromJson(lightJson);
+            WizBulbInfo bulb = wizBulbInfoFromJson(lightVariant.as<JsonObjectConst>());
             if (bulb.isValid)
             {
                 bulbs.push_back(bulb);
@@ -80,11 +99,11 @@ std::vector<WizBulbInfo> loadLightsFromFile()
         }
     }
 
-    Serial.printf("Loaded %d lights from file\n", bulbs.size());
-    return bulbs;
+    Serial.printf("Loaded %d lights from lights.json\n", bulbs.size());
+    return true;
 }
 
-bool saveLightsToFile(const std::vector<WizBulbInfo> &bulbs)
+bool exportLightsToJson(const std::vector<WizBulbInfo> &bulbs)
 {
     JsonDocument doc;
     JsonArray lightsArray = doc["lights"].to<JsonArray>();
@@ -93,37 +112,39 @@ bool saveLightsToFile(const std::vector<WizBulbInfo> &bulbs)
     {
         if (bulb.isValid)
         {
-            String bulbJson = wizBulbInfoToJson(bulb);
-            JsonDocument bulbDoc;
-            DeserializationError error = deserializeJson(bulbDoc, bulbJson);
-            if (!error)
-            {
-                lightsArray.add(bulbDoc);
-            }
+            wizBulbInfoToJson(bulb, lightsArray.add<JsonObject>());
         }
     }
 
-    String jsonContent;
-    serializeJson(doc, jsonContent);
-
-    File file = LittleFS.open("/lights.json", "w");
+    // Write a temporary file and rename it over the old one, so a power cut leaves either
+    // the previous export or the new one, never a truncated file
+    File file = LittleFS.open("/lights.json.tmp", "w");
     if (!file)
     {
-        Serial.println("Failed to open lights.json for writing");
+        Serial.println("Failed to open lights.json.tmp for writing");
         return false;
     }
 
-    size_t bytesWritten = file.print(jsonContent);
+    size_t bytesWritten = serializeJson(doc, file);
     file.close();
 
-    Serial.printf("Saved %d lights to file (%d bytes)\n", bulbs.size(), bytesWritten);
-    Serial.printf("Saved content: %s\n", jsonContent.c_str());
+    if (bytesWritten == 0 || !LittleFS.rename("/lights.json.tmp", "/lights.json"))
+    {
+        Serial.println("Failed to replace lights.json");
+        LittleFS.remove("/lights.json.tmp");
+        return false;
+    }
 
-    return bytesWritten > 0;
+    Serial.printf("Exported %d lights to lights.json (%d bytes)\n", bulbs.size(), bytesWritten);
+    return true;
 }
 
 void clearFileSystemCache()
 {
+    eraseLightCache();
+    eraseBulbStates();
+    eraseEndpointAssignments();
+
     Serial.println("Clearing LittleFS cache...");
     if (LittleFS.exists("/lights.json"))
     {
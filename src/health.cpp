@@ -0,0 +1,499 @@
+#include "wiz2hue.h"
+#include <map>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+const int FAILURES_TO_OPEN = 2;              // Consecutive failed operations before a bulb is considered offline
+const unsigned long PROBE_BACKOFF_MIN = 2000;  // First probe 2 seconds after opening
+const unsigned long PROBE_BACKOFF_MAX = 60000; // Probe an offline bulb at most once a minute
+
+// Correlated-failure detection
+const unsigned long CORRELATION_WINDOW = 10000;  // Covers one poll interval plus a full getPilot timeout
+const float CORRELATED_FAILURE_RATIO = 0.6f;     // Share of reachable bulbs that must fail together
+const int CORRELATED_MIN_BULBS = 2;              // A single bulb can't tell network loss from bulb loss
+
+static std::map<uint64_t, BulbHealthInfo> bulbHealth; // keyed by macKey(), see healthKey()
+static SemaphoreHandle_t bulbHealthMutex = nullptr;
+
+static volatile bool bulbIoPaused = false;
+static volatile bool wifiCheckRequested = false;
+static unsigned long bulbIoPausedAt = 0;
+static bool pauseNetworkConfirmed = false;         // the link was seen down during the current pause
+static unsigned long firstFailureSinceSuccess = 0; // start of the current failure episode
+static uint32_t transmissionsSinceSuccess = 0;
+static NetworkFailureStats networkFailureStats;
+
+void initBulbHealth()
+{
+    bulbHealthMutex = xSemaphoreCreateMutex();
+    if (bulbHealthMutex == nullptr)
+    {
+        Serial.println("Failed to create bulb health mutex");
+    }
+}
+
+static bool takeBulbHealthMutex(TickType_t wait = pdMS_TO_TICKS(100))
+{
+    return bulbHealthMutex != nullptr && xSemaphoreTake(bulbHealthMutex, wait) == pdTRUE;
+}
+
+// The circuit belongs to the bulb, not to its address: a bulb that moves keeps it, and a bulb
+// that takes over a reused address starts with its own. 0 = not a registered bulb. Looked up
+// before the health mutex is taken, so the two locks are never nested.
+static uint64_t healthKey(IPAddress deviceIP)
+{
+    uint8_t mac[6];
+    return bulbRegistryMacForIp((uint32_t)deviceIP, mac) ? macKey(mac) : 0;
+}
+
+static const char *bulbHealthStateToString(BulbHealthState state)
+{
+    switch (state)
+    {
+    case BulbHealthState::CLOSED:
+        return "CLOSED";
+    case BulbHealthState::OPEN:
+        return "OPEN";
+    case BulbHealthState::HALF_OPEN:
+        return "HALF_OPEN";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static BulbHealthInfo &healthEntry(uint64_t key)
+{
+    BulbHealthInfo &info = bulbHealth[key];
+    if (info.trackedSince == 0)
+    {
+        info.trackedSince = millis();
+    }
+    return info;
+}
+
+// Returns false when the request must fail fast. When a probe is due the caller gets
+// isProbe = true and must report the outcome with bulbHealthRecordSuccess/Failure.
+bool bulbHealthAllowRequest(IPAddress deviceIP, bool *isProbe)
+{
+    *isProbe = false;
+    uint64_t key = healthKey(deviceIP);
+    if (!takeBulbHealthMutex())
+    {
+        return true; // Never block traffic because of bookkeeping
+    }
+
+    if (bulbIoPaused)
+    {
+        // Network is down - don't spend retries on any bulb
+        networkFailureStats.pausedRejects++;
+        xSemaphoreGive(bulbHealthMutex);
+        return false;
+    }
+
+    if (key == 0)
+    {
+        xSemaphoreGive(bulbHealthMutex);
+        return true;
+    }
+
+    BulbHealthInfo &info = healthEntry(key);
+    bool allowed = true;
+
+    if (info.state == BulbHealthState::OPEN)
+    {
+        if ((long)(millis() - info.nextProbeAt) >= 0)
+        {
+            info.state = BulbHealthState::HALF_OPEN;
+            info.probeCount++;
+            *isProbe = true;
+        }
+        else
+        {
+            info.failFastCount++;
+            allowed = false;
+        }
+    }
+    else if (info.state == BulbHealthState::HALF_OPEN)
+    {
+        // Only one probe in flight per bulb
+        info.failFastCount++;
+        allowed = false;
+    }
+
+    xSemaphoreGive(bulbHealthMutex);
+    return allowed;
+}
+
+// Check for fire-and-forget sends, which can't report an outcome: true while the bulb must not
+// get traffic. Unlike bulbHealthAllowRequest it never starts a probe; a due probe is left to the
+// next acknowledged request to the bulb.
+bool bulbHealthIsOpen(IPAddress deviceIP)
+{
+    uint64_t key = healthKey(deviceIP);
+    if (!takeBulbHealthMutex())
+    {
+        return false; // Never block traffic because of bookkeeping
+    }
+
+    bool open = bulbIoPaused;
+    if (!open && key != 0)
+    {
+        BulbHealthInfo &info = healthEntry(key);
+        open = info.state != BulbHealthState::CLOSED;
+        if (open)
+        {
+            info.failFastCount++;
+        }
+    }
+
+    xSemaphoreGive(bulbHealthMutex);
+    return open;
+}
+
+// Outcomes are never dropped on a busy mutex: a lost one could leave a probe HALF_OPEN for
+// good. Every critical section in this file is short, so waiting is cheap.
+void bulbHealthRecordSuccess(IPAddress deviceIP)
+{
+    uint64_t key = healthKey(deviceIP);
+    if (!takeBulbHealthMutex(portMAX_DELAY))
+    {
+        return;
+    }
+
+    // Any answer shows the network is up, tracked bulb or not
+    firstFailureSinceSuccess = 0;
+    transmissionsSinceSuccess = 0;
+    if (key == 0)
+    {
+        xSemaphoreGive(bulbHealthMutex);
+        return;
+    }
+
+    BulbHealthInfo &info = healthEntry(key);
+    info.lastSuccessAt = millis();
+    if (info.state != BulbHealthState::CLOSED)
+    {
+        unsigned long downtime = millis() - info.openedAt;
+        info.totalOpenTime += downtime;
+        Serial.printf("Bulb %s is back online after %lu ms - circuit CLOSED\n",
+                      deviceIP.toString().c_str(), downtime);
+    }
+    info.state = BulbHealthState::CLOSED;
+    info.consecutiveFailures = 0;
+    info.probeBackoff = 0;
+
+    xSemaphoreGive(bulbHealthMutex);
+}
+
+// Classify the current failure episode: returns true when most reachable bulbs failed within
+// the correlation window and none succeeded, i.e. the network rather than the bulbs is down
+static bool detectCorrelatedFailure(unsigned long now)
+{
+    int reachable = 0;
+    int failing = 0;
+    for (const auto &entry : bulbHealth)
+    {
+        const BulbHealthInfo &info = entry.second;
+
+        // Bulbs that were already offline before this episode, or found dark by the last WiFi check, don't count
+        if (info.state != BulbHealthState::CLOSED && (info.confirmedDown || now - info.openedAt > CORRELATION_WINDOW))
+        {
+            continue;
+        }
+        reachable++;
+
+        if (info.lastSuccessAt != 0 && now - info.lastSuccessAt <= CORRELATION_WINDOW &&
+            info.lastSuccessAt >= info.lastFailureAt)
+        {
+            return false; // Something answered recently - the network is fine
+        }
+        if (info.lastFailureAt != 0 && now - info.lastFailureAt <= CORRELATION_WINDOW)
+        {
+            failing++;
+        }
+    }
+
+    return reachable >= CORRELATED_MIN_BULBS && failing >= reachable * CORRELATED_FAILURE_RATIO;
+}
+
+// Network loss suspected: pause bulb I/O and ask for a WiFi check. Circuits opened during this
+// episode are held as they are until resumeBulbIo knows whether the network or the bulbs failed.
+static void enterNetworkFailure(unsigned long now)
+{
+    bulbIoPaused = true;
+    wifiCheckRequested = true;
+    bulbIoPausedAt = now;
+    pauseNetworkConfirmed = false;
+
+    for (auto &entry : bulbHealth)
+    {
+        BulbHealthInfo &info = entry.second;
+        info.heldByPause = info.state != BulbHealthState::CLOSED && !info.confirmedDown &&
+                           now - info.openedAt <= CORRELATION_WINDOW;
+    }
+
+    networkFailureStats.networkEvents++;
+    networkFailureStats.lastDetectionTime = firstFailureSinceSuccess != 0 ? now - firstFailureSinceSuccess : 0;
+    networkFailureStats.lastWastedTransmissions = transmissionsSinceSuccess;
+
+    Serial.printf("Correlated bulb failures - network loss detected after %lu ms (%lu packets wasted), pausing bulb I/O\n",
+                  networkFailureStats.lastDetectionTime, (unsigned long)networkFailureStats.lastWastedTransmissions);
+}
+
+void bulbHealthRecordFailure(IPAddress deviceIP)
+{
+    uint64_t key = healthKey(deviceIP);
+    if (!takeBulbHealthMutex(portMAX_DELAY))
+    {
+        return;
+    }
+    if (key == 0)
+    {
+        xSemaphoreGive(bulbHealthMutex);
+        return;
+    }
+
+    unsigned long now = millis();
+    BulbHealthInfo &info = healthEntry(key);
+    info.lastFailureAt = now;
+
+    if (bulbIoPaused)
+    {
+        // Failures of requests that started before the pause say nothing about this bulb, but a
+        // probe must not stay HALF_OPEN: it is due again once I/O resumes
+        if (info.state == BulbHealthState::HALF_OPEN)
+        {
+            info.state = BulbHealthState::OPEN;
+            info.nextProbeAt = now;
+        }
+        xSemaphoreGive(bulbHealthMutex);
+        return;
+    }
+
+    if (firstFailureSinceSuccess == 0)
+    {
+        firstFailureSinceSuccess = now;
+    }
+    info.consecutiveFailures++;
+
+    if (info.state == BulbHealthState::HALF_OPEN)
+    {
+        // Probe failed - stay open and back off further
+        info.state = BulbHealthState::OPEN;
+        info.probeBackoff = min(info.probeBackoff * 2, PROBE_BACKOFF_MAX);
+        info.nextProbeAt = millis() + info.probeBackoff;
+        Serial.printf("Bulb %s probe failed - next probe in %lu ms\n",
+                      deviceIP.toString().c_str(), info.probeBackoff);
+    }
+    else if (info.state == BulbHealthState::CLOSED && info.consecutiveFailures >= FAILURES_TO_OPEN)
+    {
+        info.state = BulbHealthState::OPEN;
+        info.openedAt = now;
+        info.probeBackoff = PROBE_BACKOFF_MIN;
+        info.nextProbeAt = info.openedAt + info.probeBackoff;
+        info.confirmedDown = false;
+        networkFailureStats.bulbEvents++;
+        Serial.printf("Bulb %s unreachable after %d failures - circuit OPEN\n",
+                      deviceIP.toString().c_str(), info.consecutiveFailures);
+    }
+
+    if (detectCorrelatedFailure(now))
+    {
+        enterNetworkFailure(now);
+    }
+
+    xSemaphoreGive(bulbHealthMutex);
+}
+
+void bulbHealthRecordTransmission()
+{
+    if (takeBulbHealthMutex())
+    {
+        if (firstFailureSinceSuccess != 0)
+        {
+            transmissionsSinceSuccess++;
+        }
+        xSemaphoreGive(bulbHealthMutex);
+    }
+}
+
+bool isBulbIoPaused()
+{
+    return bulbIoPaused;
+}
+
+unsigned long bulbIoPausedFor()
+{
+    return bulbIoPaused ? millis() - bulbIoPausedAt : 0;
+}
+
+void pauseBulbIo()
+{
+    if (!takeBulbHealthMutex())
+    {
+        return;
+    }
+
+    if (!bulbIoPaused)
+    {
+        bulbIoPaused = true;
+        bulbIoPausedAt = millis();
+    }
+    pauseNetworkConfirmed = true;
+
+    xSemaphoreGive(bulbHealthMutex);
+}
+
+void resumeBulbIo()
+{
+    if (!bulbIoPaused || !takeBulbHealthMutex())
+    {
+        return;
+    }
+
+    // A pause the link was never seen down for was the bulbs after all (e.g. switched off at the
+    // wall): their circuits stay open and keep probing, and they no longer count as reachable for
+    // correlation, so the same dark bulbs can't pause I/O again. After a real outage the circuits
+    // it opened are closed and their failures forgiven.
+    unsigned long now = millis();
+    int held = 0;
+    for (auto &entry : bulbHealth)
+    {
+        BulbHealthInfo &info = entry.second;
+        if (info.heldByPause && info.state != BulbHealthState::CLOSED)
+        {
+            held++;
+            if (pauseNetworkConfirmed)
+            {
+                info.totalOpenTime += now - info.openedAt;
+                info.state = BulbHealthState::CLOSED;
+                info.probeBackoff = 0;
+                networkFailureStats.bulbEvents--; // Counted when the circuit opened
+            }
+            else
+            {
+                info.confirmedDown = true;
+            }
+        }
+        if (pauseNetworkConfirmed)
+        {
+            info.consecutiveFailures = 0;
+        }
+        info.heldByPause = false;
+    }
+
+    if (pauseNetworkConfirmed)
+    {
+        Serial.printf("Network restored - resuming bulb I/O after %lu ms pause, %d circuits closed\n",
+                      now - bulbIoPausedAt, held);
+    }
+    else
+    {
+        networkFailureStats.networkEvents--; // Not a network loss after all
+        Serial.printf("WiFi link up - bulbs failed, not the network; resuming bulb I/O after %lu ms pause, %d circuits kept open\n",
+                      now - bulbIoPausedAt, held);
+    }
+    bulbIoPaused = false;
+    pauseNetworkConfirmed = false;
+    firstFailureSinceSuccess = 0;
+    transmissionsSinceSuccess = 0;
+
+    xSemaphoreGive(bulbHealthMutex);
+}
+
+bool consumeWifiCheckRequest()
+{
+    if (!wifiCheckRequested)
+    {
+        return false;
+    }
+    wifiCheckRequested = false;
+    return true;
+}
+
+NetworkFailureStats getNetworkFailureStats()
+{
+    NetworkFailureStats stats;
+    if (takeBulbHealthMutex())
+    {
+        stats = networkFailureStats;
+        xSemaphoreGive(bulbHealthMutex);
+    }
+    return stats;
+}
+
+static BulbHealthInfo healthOf(uint64_t key)
+{
+    BulbHealthInfo info;
+    if (key != 0 && takeBulbHealthMutex())
+    {
+        auto it = bulbHealth.find(key);
+        if (it != bulbHealth.end())
+        {
+            info = it->second;
+        }
+        xSemaphoreGive(bulbHealthMutex);
+    }
+    return info;
+}
+
+BulbHealthInfo getBulbHealth(IPAddress deviceIP)
+{
+    return healthOf(healthKey(deviceIP));
+}
+
+bool isBulbAvailable(const WizBulbInfo &bulbInfo)
+{
+    if (bulbInfo.ip == 0)
+    {
+        return false;
+    }
+    return healthOf(macKey(bulbInfo.mac)).state == BulbHealthState::CLOSED;
+}
+
+void bulbHealthRelease(const uint8_t *mac)
+{
+    if (!takeBulbHealthMutex(portMAX_DELAY))
+    {
+        return;
+    }
+    bulbHealth.erase(macKey(mac));
+    xSemaphoreGive(bulbHealthMutex);
+}
+
+void logBulbHealth()
+{
+    if (!takeBulbHealthMutex())
+    {
+        return;
+    }
+
+    unsigned long now = millis();
+    for (const auto &entry : bulbHealth)
+    {
+        const BulbHealthInfo &info = entry.second;
+        unsigned long openTime = info.totalOpenTime;
+        if (info.state != BulbHealthState::CLOSED)
+        {
+            openTime += now - info.openedAt;
+        }
+        unsigned long tracked = now - info.trackedSince;
+        float availability = tracked > 0 ? 100.0f * (tracked - min(openTime, tracked)) / tracked : 100.0f;
+
+        uint8_t mac[6];
+        macFromKey(entry.first, mac);
+        Serial.printf("Bulb %s: %s, availability %.1f%%, %lu fail-fast, %lu probes\n",
+                      MacStr(mac).c_str(), bulbHealthStateToString(info.state),
+                      availability, (unsigned long)info.failFastCount, (unsigned long)info.probeCount);
+    }
+
+    if (networkFailureStats.networkEvents > 0 || networkFailureStats.bulbEvents > 0)
+    {
+        Serial.printf("Failure classification: %lu network, %lu bulb; last network detection %lu ms, %lu packets wasted, %lu requests paused\n",
+                      (unsigned long)networkFailureStats.networkEvents, (unsigned long)networkFailureStats.bulbEvents,
+                      networkFailureStats.lastDetectionTime, (unsigned long)networkFailureStats.lastWastedTransmissions,
+                      (unsigned long)networkFailureStats.pausedRejects);
+    }
+
+    xSemaphoreGive(bulbHealthMutex);
+}
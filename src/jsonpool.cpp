@@ -0,0 +1,229 @@
+#include "wiz2hue.h"
+#include <ArduinoJson.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+
+// Fixed-block pool behind the JsonDocuments on the UDP paths. Every getPilot reply, setPilot
+// command and ack used to malloc and free its slot pool and strings within a few milliseconds,
+// from several tasks at once, on the heap the Zigbee stack also lives on. Blocks are handed out
+// from three size classes; anything larger, or any request when a class is empty, falls back to
+// the heap and is counted.
+const size_t JSON_POOL_SMALL_SIZE = 64;    // Strings (keys, values, string builder growth)
+const int JSON_POOL_SMALL_BLOCKS = 96;
+const size_t JSON_POOL_MEDIUM_SIZE = 256;  // Pool lists, long strings
+const int JSON_POOL_MEDIUM_BLOCKS = 16;
+const size_t JSON_POOL_LARGE_SIZE = 1024;  // ArduinoJson variant slot pools
+const int JSON_POOL_LARGE_BLOCKS = 10;
+
+struct JsonPoolClass
+{
+    uint8_t *base;
+    size_t blockSize;
+    int blockCount;
+    void *freeList;
+    int inUse;
+    int peakInUse;
+};
+
+static uint8_t smallBlocks[JSON_POOL_SMALL_BLOCKS * JSON_POOL_SMALL_SIZE] __attribute__((aligned(8)));
+static uint8_t mediumBlocks[JSON_POOL_MEDIUM_BLOCKS * JSON_POOL_MEDIUM_SIZE] __attribute__((aligned(8)));
+static uint8_t largeBlocks[JSON_POOL_LARGE_BLOCKS * JSON_POOL_LARGE_SIZE] __attribute__((aligned(8)));
+
+static JsonPoolClass poolClasses[] = {
+    {smallBlocks, JSON_POOL_SMALL_SIZE, JSON_POOL_SMALL_BLOCKS, nullptr, 0, 0},
+    {mediumBlocks, JSON_POOL_MEDIUM_SIZE, JSON_POOL_MEDIUM_BLOCKS, nullptr, 0, 0},
+    {largeBlocks, JSON_POOL_LARGE_SIZE, JSON_POOL_LARGE_BLOCKS, nullptr, 0, 0},
+};
+
+static portMUX_TYPE jsonPoolMux = portMUX_INITIALIZER_UNLOCKED;
+static bool jsonPoolInitialized = false;
+static JsonPoolStats jsonPoolStats;
+
+// Report bookkeeping
+static unsigned long lastReportTime = 0;
+static uint32_t lastReportHeapAllocs = 0;
+static uint32_t lastReportPoolAllocs = 0;
+static size_t minLargestFreeBlock = 0;
+
+// Caller holds jsonPoolMux
+static void initJsonPool()
+{
+    for (JsonPoolClass &poolClass : poolClasses)
+    {
+        poolClass.freeList = nullptr;
+        for (int i = poolClass.blockCount - 1; i >= 0; i--)
+        {
+            void *block = poolClass.base + i * poolClass.blockSize;
+            *(void **)block = poolClass.freeList;
+            poolClass.freeList = block;
+        }
+    }
+    jsonPoolInitialized = true;
+}
+
+static JsonPoolClass *poolClassOf(void *ptr)
+{
+    for (JsonPoolClass &poolClass : poolClasses)
+    {
+        uint8_t *p = (uint8_t *)ptr;
+        if (p >= poolClass.base && p < poolClass.base + poolClass.blockCount * poolClass.blockSize)
+        {
+            return &poolClass;
+        }
+    }
+    return nullptr;
+}
+
+static void *poolAllocate(size_t size)
+{
+    void *block = nullptr;
+    portENTER_CRITICAL(&jsonPoolMux);
+    if (!jsonPoolInitialized)
+    {
+        initJsonPool();
+    }
+    for (JsonPoolClass &poolClass : poolClasses)
+    {
+        if (size <= poolClass.blockSize && poolClass.freeList != nullptr)
+        {
+            block = poolClass.freeList;
+            poolClass.freeList = *(void **)block;
+            poolClass.inUse++;
+            if (poolClass.inUse > poolClass.peakInUse)
+            {
+                poolClass.peakInUse = poolClass.inUse;
+            }
+            jsonPoolStats.poolAllocs++;
+            break;
+        }
+    }
+    if (block == nullptr)
+    {
+        jsonPoolStats.heapAllocs++;
+        if (size > JSON_POOL_LARGE_SIZE)
+        {
+            jsonPoolStats.oversized++;
+        }
+    }
+    portEXIT_CRITICAL(&jsonPoolMux);
+
+    return block != nullptr ? block : malloc(size);
+}
+
+static void poolDeallocate(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    JsonPoolClass *poolClass = poolClassOf(ptr);
+    if (poolClass == nullptr)
+    {
+        free(ptr);
+        return;
+    }
+    portENTER_CRITICAL(&jsonPoolMux);
+    *(void **)ptr = poolClass->freeList;
+    poolClass->freeList = ptr;
+    poolClass->inUse--;
+    portEXIT_CRITICAL(&jsonPoolMux);
+}
+
+class JsonPoolAllocator : public ArduinoJson::Allocator
+{
+public:
+    void *allocate(size_t size) override
+    {
+        return poolAllocate(size);
+    }
+
+    void deallocate(void *ptr) override
+    {
+        poolDeallocate(ptr);
+    }
+
+    void *reallocate(void *ptr, size_t newSize) override
+    {
+        if (ptr == nullptr)
+        {
+            return poolAllocate(newSize);
+        }
+
+        JsonPoolClass *poolClass = poolClassOf(ptr);
+        if (poolClass == nullptr)
+        {
+            portENTER_CRITICAL(&jsonPoolMux);
+            jsonPoolStats.heapAllocs++;
+            portEXIT_CRITICAL(&jsonPoolMux);
+            return realloc(ptr, newSize);
+        }
+        if (newSize <= poolClass->blockSize)
+        {
+            return ptr; // Shrinks (shrinkToFit) and growth within the block stay in place
+        }
+
+        void *moved = poolAllocate(newSize);
+        if (moved != nullptr)
+        {
+            memcpy(moved, ptr, poolClass->blockSize);
+            poolDeallocate(ptr);
+        }
+        return moved;
+    }
+};
+
+static JsonPoolAllocator jsonPoolAllocatorInstance;
+
+ArduinoJson::Allocator *jsonPoolAllocator()
+{
+    return &jsonPoolAllocatorInstance;
+}
+
+JsonPoolStats getJsonPoolStats()
+{
+    JsonPoolStats stats;
+    portENTER_CRITICAL(&jsonPoolMux);
+    stats = jsonPoolStats;
+    int inUse = 0;
+    for (const JsonPoolClass &poolClass : poolClasses)
+    {
+        inUse += poolClass.inUse;
+    }
+    stats.blocksInUse = inUse;
+    portEXIT_CRITICAL(&jsonPoolMux);
+    stats.minLargestFreeBlock = minLargestFreeBlock;
+    return stats;
+}
+
+void logJsonPoolStats()
+{
+    size_t largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    if (minLargestFreeBlock == 0 || largestFreeBlock < minLargestFreeBlock)
+    {
+        minLargestFreeBlock = largestFreeBlock;
+    }
+    JsonPoolStats stats = getJsonPoolStats();
+    unsigned long now = millis();
+    unsigned long interval = now - lastReportTime;
+
+    uint32_t total = stats.poolAllocs + stats.heapAllocs;
+    Serial.printf("JSON pool: %lu allocations, %.1f%% from pool, %lu heap fallbacks (%lu oversized), %d blocks in use\n",
+                  (unsigned long)total, total > 0 ? 100.0f * stats.poolAllocs / total : 0.0f,
+                  (unsigned long)stats.heapAllocs, (unsigned long)stats.oversized, stats.blocksInUse);
+    if (interval > 0)
+    {
+        Serial.printf("JSON pool: %.2f heap allocations/s, %.2f pooled allocations/s over the last %lu s (%.2f heap/s since boot)\n",
+                      1000.0f * (stats.heapAllocs - lastReportHeapAllocs) / interval,
+                      1000.0f * (stats.poolAllocs - lastReportPoolAllocs) / interval, interval / 1000,
+                      now > 0 ? 1000.0f * stats.heapAllocs / now : 0.0f);
+    }
+    Serial.printf("JSON pool: peak blocks %d/%d x%u B, %d/%d x%u B, %d/%d x%u B; largest free heap block %u (min %u) bytes\n",
+                  poolClasses[0].peakInUse, poolClasses[0].blockCount, poolClasses[0].blockSize,
+                  poolClasses[1].peakInUse, poolClasses[1].blockCount, poolClasses[1].blockSize,
+                  poolClasses[2].peakInUse, poolClasses[2].blockCount, poolClasses[2].blockSize,
+                  largestFreeBlock, stats.minLargestFreeBlock);
+
+    lastReportTime = now;
+    lastReportHeapAllocs = stats.heapAllocs;
+    lastReportPoolAllocs = stats.poolAllocs;
+}
@@ -0,0 +1,221 @@
+#include "wiz2hue.h"
+#include <atomic>
+
+// WiZ round-trip latency histograms, per bulb and per operation. Buckets are log-scale: bucket 0
+// holds replies under 1 ms, bucket k replies under 2^k ms, the last one everything slower. Bulbs
+// are keyed by MAC, looked up in the registry from the address the request went to, so a bulb
+// keeps its histograms across DHCP changes; addresses not in the registry count only in the
+// totals. A bulb claims its slot with a single compare-and-swap on the MAC and gives it back when
+// it is retired. Percentiles are reported as the upper bound of the bucket they fall in, capped
+// at the exact maximum.
+const int LATENCY_BUCKETS = 13;     // < 1 ms ... < 2048 ms, then >= 2048 ms
+const int LATENCY_MAX_ATTEMPTS = 6; // 1..5 attempts, last bucket 6 or more
+const int LATENCY_MAX_BULBS = 64;   // Bulbs beyond this count only in the totals
+const unsigned long LATENCY_BUCKET_BASE = 1000; // Upper bound of bucket 0 in us
+
+struct LatencyHistogram
+{
+    std::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+    std::atomic<uint32_t> attempts[LATENCY_MAX_ATTEMPTS]; // Index = attempts - 1
+    std::atomic<uint32_t> timeouts;
+    std::atomic<uint32_t> maxMicros;
+};
+
+struct BulbLatency
+{
+    std::atomic<uint64_t> mac; // MAC in the low 48 bits, 0 = free slot
+    LatencyHistogram ops[(int)WizOp::COUNT];
+};
+
+static BulbLatency bulbLatency[LATENCY_MAX_BULBS];
+static LatencyHistogram totalLatency[(int)WizOp::COUNT];
+
+static const char *wizOpName(WizOp op)
+{
+    return op == WizOp::SET_PILOT ? "setPilot" : "getPilot";
+}
+
+static int latencyBucket(unsigned long micros)
+{
+    int bucket = 0;
+    unsigned long bound = LATENCY_BUCKET_BASE;
+    while (bucket < LATENCY_BUCKETS - 1 && micros >= bound)
+    {
+        bound <<= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static BulbLatency *findSlot(uint64_t key)
+{
+    for (BulbLatency &slot : bulbLatency)
+    {
+        if (slot.mac.load(std::memory_order_acquire) == key)
+        {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+// Slot of the bulb at this address, claimed on first use; null for unknown bulbs or a full table.
+// Released slots leave holes, so the whole table is searched before a free slot is claimed.
+static BulbLatency *latencySlot(uint32_t ip)
+{
+    uint8_t mac[6];
+    if (ip == 0 || !bulbRegistryMacForIp(ip, mac) || !macIsSet(mac))
+    {
+        return nullptr;
+    }
+    uint64_t key = macKey(mac);
+    BulbLatency *slot = findSlot(key);
+    for (int i = 0; slot == nullptr && i < LATENCY_MAX_BULBS; i++)
+    {
+        uint64_t expected = 0;
+        if (bulbLatency[i].mac.compare_exchange_strong(expected, key, std::memory_order_acq_rel) || expected == key)
+        {
+            slot = &bulbLatency[i];
+        }
+    }
+    return slot;
+}
+
+static void addSample(LatencyHistogram &histogram, unsigned long rttMicros, int attempts)
+{
+    histogram.buckets[latencyBucket(rttMicros)].fetch_add(1, std::memory_order_relaxed);
+    histogram.attempts[max(1, min(attempts, LATENCY_MAX_ATTEMPTS)) - 1].fetch_add(1, std::memory_order_relaxed);
+    uint32_t seen = histogram.maxMicros.load(std::memory_order_relaxed);
+    while (rttMicros > seen && !histogram.maxMicros.compare_exchange_weak(seen, rttMicros, std::memory_order_relaxed))
+    {
+    }
+}
+
+void recordWizLatency(WizOp op, uint32_t ip, unsigned long rttMicros, int attempts)
+{
+    addSample(totalLatency[(int)op], rttMicros, attempts);
+    BulbLatency *slot = latencySlot(ip);
+    if (slot != nullptr)
+    {
+        addSample(slot->ops[(int)op], rttMicros, attempts);
+    }
+}
+
+void recordWizTimeout(WizOp op, uint32_t ip)
+{
+    totalLatency[(int)op].timeouts.fetch_add(1, std::memory_order_relaxed);
+    BulbLatency *slot = latencySlot(ip);
+    if (slot != nullptr)
+    {
+        slot->ops[(int)op].timeouts.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void releaseWizLatency(const uint8_t *mac)
+{
+    BulbLatency *slot = findSlot(macKey(mac));
+    if (slot == nullptr)
+    {
+        return;
+    }
+    for (LatencyHistogram &histogram : slot->ops)
+    {
+        for (auto &bucket : histogram.buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        for (auto &attempts : histogram.attempts)
+        {
+            attempts.store(0, std::memory_order_relaxed);
+        }
+        histogram.timeouts.store(0, std::memory_order_relaxed);
+        histogram.maxMicros.store(0, std::memory_order_relaxed);
+    }
+    slot->mac.store(0, std::memory_order_release);
+}
+
+static LatencySummary summarize(const LatencyHistogram &histogram)
+{
+    LatencySummary summary;
+    uint32_t counts[LATENCY_BUCKETS];
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        counts[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+        summary.samples += counts[i];
+    }
+    uint64_t attemptTotal = 0;
+    uint32_t attemptSamples = 0;
+    for (int i = 0; i < LATENCY_MAX_ATTEMPTS; i++)
+    {
+        uint32_t count = histogram.attempts[i].load(std::memory_order_relaxed);
+        attemptTotal += (uint64_t)count * (i + 1);
+        attemptSamples += count;
+    }
+    summary.timeouts = histogram.timeouts.load(std::memory_order_relaxed);
+    summary.maxMicros = histogram.maxMicros.load(std::memory_order_relaxed);
+    summary.avgAttempts = attemptSamples > 0 ? (float)attemptTotal / attemptSamples : 0.0f;
+    if (summary.samples == 0)
+    {
+        return summary;
+    }
+
+    // Rank of each percentile, rounded up so p99 of few samples is the slowest one
+    const uint32_t ranks[3] = {(summary.samples * 50 + 99) / 100, (summary.samples * 90 + 99) / 100,
+                               (summary.samples * 99 + 99) / 100};
+    unsigned long *results[3] = {&summary.p50Micros, &summary.p90Micros, &summary.p99Micros};
+    uint32_t cumulative = 0;
+    int next = 0;
+    for (int i = 0; i < LATENCY_BUCKETS && next < 3; i++)
+    {
+        cumulative += counts[i];
+        unsigned long upper = i < LATENCY_BUCKETS - 1 ? LATENCY_BUCKET_BASE << i : summary.maxMicros;
+        while (next < 3 && cumulative >= ranks[next])
+        {
+            *results[next++] = min(upper, summary.maxMicros);
+        }
+    }
+    return summary;
+}
+
+LatencySummary getWizLatency(WizOp op, const uint8_t *mac)
+{
+    if (mac == nullptr)
+    {
+        return summarize(totalLatency[(int)op]);
+    }
+    BulbLatency *slot = findSlot(macKey(mac));
+    return slot != nullptr ? summarize(slot->ops[(int)op]) : LatencySummary();
+}
+
+static void printSummary(WizOp op, const LatencySummary &summary)
+{
+    Serial.printf(" %s %lu ok / %lu timeouts, p50 %.1f / p90 %.1f / p99 %.1f / max %.1f ms, %.2f attempts",
+                  wizOpName(op), (unsigned long)summary.samples, (unsigned long)summary.timeouts,
+                  summary.p50Micros / 1000.0f, summary.p90Micros / 1000.0f, summary.p99Micros / 1000.0f,
+                  summary.maxMicros / 1000.0f, summary.avgAttempts);
+}
+
+void logWizLatencyStats()
+{
+    Serial.print("WiZ latency (all bulbs):");
+    printSummary(WizOp::SET_PILOT, getWizLatency(WizOp::SET_PILOT, nullptr));
+    Serial.print(" |");
+    printSummary(WizOp::GET_PILOT, getWizLatency(WizOp::GET_PILOT, nullptr));
+    Serial.println();
+
+    for (const BulbLatency &slot : bulbLatency)
+    {
+        uint64_t key = slot.mac.load(std::memory_order_acquire);
+        if (key == 0)
+        {
+            continue;
+        }
+        uint8_t mac[6];
+        macFromKey(key, mac);
+        Serial.printf("WiZ latency %s:", MacStr(mac).c_str());
+        printSummary(WizOp::SET_PILOT, summarize(slot.ops[(int)WizOp::SET_PILOT]));
+        Serial.print(" |");
+        printSummary(WizOp::GET_PILOT, summarize(slot.ops[(int)WizOp::GET_PILOT]));
+        Serial.println();
+    }
+}
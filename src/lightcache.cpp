@@ -0,0 +1,917 @@
+#include "wiz2hue.h"
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <algorithm>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#ifdef WIZ2HUE_CACHE_BENCH
+#include <esp_heap_caps.h>
+#endif
+
+// Binary light cache in the "wizcache" data partition (zigbee_spiffs.csv), read in place through
+// esp_partition_mmap. The partition holds two image slots and an append-only journal:
+//   slot A, slot B   LightCacheHeader, LightCacheRecord[n], LightCacheIndexEntry[n] (MAC-sorted)
+//   journal          LightJournalEntry + payload, appended until the region is full
+// The valid slot with the highest sequence is the base image and the journal is replayed on top.
+// A single-bulb change appends one entry (20 bytes for an IP change); compaction writes a fresh
+// image into the other slot, header last, and only then erases the journal. Every entry and
+// image is CRC-checked, so a write torn by a power cut is ignored and at most that one change
+// is lost. The journal opens with the sequence of the image it applies to; a journal left over
+// from a compaction cut short before its erase belongs to the older image and is ignored.
+const char *LIGHT_CACHE_PARTITION = "wizcache";
+const esp_partition_subtype_t LIGHT_CACHE_SUBTYPE = (esp_partition_subtype_t)0x40;
+const uint32_t LIGHT_CACHE_MAGIC = 0x434C5A57; // "WZLC"
+const uint16_t LIGHT_CACHE_VERSION = 2;       // Bump on any change to the structs below
+const size_t LIGHT_CACHE_SLOT_SIZE = 0x6000;  // A 256-bulb image is 20.5 KB
+const size_t LIGHT_CACHE_JOURNAL_OFFSET = 2 * LIGHT_CACHE_SLOT_SIZE;
+const size_t LIGHT_CACHE_JOURNAL_SIZE = 0x4000;
+const size_t LIGHT_CACHE_COMPACT_AT = LIGHT_CACHE_JOURNAL_SIZE * 3 / 4; // Compact on load past this
+
+struct LightCacheHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint16_t recordSize;
+    uint16_t recordCount;
+    uint32_t sequence; // Higher wins between the two slots
+    uint32_t recordsOffset; // Relative to the slot
+    uint32_t indexOffset;
+    uint32_t payloadSize; // records + index
+    uint32_t payloadCrc;
+    uint32_t reserved;
+    uint32_t headerCrc; // over the fields above
+};
+
+struct LightCacheRecord
+{
+    uint32_t ip;
+    uint32_t homeId;
+    uint32_t roomId;
+    uint16_t kelvinMin;
+    uint16_t kelvinMax;
+    uint8_t mac[6];
+    uint8_t bulbClass;
+    uint8_t featureFlags; // LIGHT_CACHE_FEATURE_*
+    int8_t rssi;
+    uint8_t reserved0;
+    char fwVersion[12];
+    char src[8];
+    char moduleName[24]; // Stored as text: module ids are interned per boot
+    uint8_t reserved1[2];
+};
+
+struct LightCacheIndexEntry
+{
+    uint8_t mac[6];
+    uint16_t record;
+};
+
+struct LightJournalEntry
+{
+    uint8_t type;   // LIGHT_JOURNAL_*; 0xFF where nothing has been written yet
+    uint8_t length; // Payload bytes that follow, a multiple of 4
+    uint16_t reserved;
+    uint32_t crc; // over type, length and the payload
+};
+
+struct LightJournalIpUpdate
+{
+    uint8_t mac[6];
+    uint16_t reserved;
+    uint32_t ip;
+};
+
+static_assert(sizeof(LightCacheHeader) == 40, "light cache header layout changed");
+static_assert(sizeof(LightCacheRecord) == 72, "light cache record layout changed");
+static_assert(sizeof(LightCacheIndexEntry) == 8, "light cache index layout changed");
+static_assert(sizeof(LightJournalEntry) == 8, "light journal layout changed");
+
+const uint8_t LIGHT_JOURNAL_IP_UPDATE = 1; // LightJournalIpUpdate
+const uint8_t LIGHT_JOURNAL_RECORD = 2;    // LightCacheRecord, inserted or replaced by MAC
+const uint8_t LIGHT_JOURNAL_BASE = 3;      // uint32_t image sequence, always the first entry
+
+const uint8_t LIGHT_CACHE_FEATURE_BRIGHTNESS = 0x01;
+const uint8_t LIGHT_CACHE_FEATURE_COLOR = 0x02;
+const uint8_t LIGHT_CACHE_FEATURE_COLOR_TMP = 0x04;
+const uint8_t LIGHT_CACHE_FEATURE_EFFECT = 0x08;
+const uint8_t LIGHT_CACHE_FEATURE_FAN = 0x10;
+
+static const esp_partition_t *cachePartition = nullptr;
+static const uint8_t *cacheMap = nullptr;
+static esp_partition_mmap_handle_t cacheMapHandle;
+static SemaphoreHandle_t cacheMutex = nullptr;
+static LightCacheStats cacheStats;
+
+// What the last scan of the mapped partition found; rescanned after every compaction
+static bool cacheScanned = false;
+static const LightCacheHeader *cacheHeader = nullptr; // Base image, null if neither slot is valid
+static int activeSlot = -1;
+static size_t journalEnd = 0;       // Next append offset within the journal
+static bool journalDamaged = false; // Torn entry or unerased flash at journalEnd; compact before appending
+static bool journalStale = false;   // Written against another image; erase before appending
+
+#ifdef WIZ2HUE_CACHE_FAULT_TEST
+// Simulated power cut: the Nth flash operation from now is torn and every later one fails
+static int faultOpsLeft = -1;
+#endif
+
+void initLightCache()
+{
+    cacheMutex = xSemaphoreCreateMutex();
+    if (cacheMutex == nullptr)
+    {
+        Serial.println("Failed to create light cache mutex");
+    }
+}
+
+static bool takeCacheMutex()
+{
+    return cacheMutex != nullptr && xSemaphoreTake(cacheMutex, pdMS_TO_TICKS(1000)) == pdTRUE;
+}
+
+static const esp_partition_t *findCachePartition()
+{
+    if (cachePartition == nullptr)
+    {
+        cachePartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, LIGHT_CACHE_SUBTYPE, LIGHT_CACHE_PARTITION);
+        if (cachePartition == nullptr)
+        {
+            Serial.println("Light cache: no wizcache partition, using lights.json only");
+        }
+        else if (cachePartition->size < LIGHT_CACHE_JOURNAL_OFFSET + LIGHT_CACHE_JOURNAL_SIZE)
+        {
+            Serial.printf("Light cache: wizcache partition too small (%u bytes)\n", cachePartition->size);
+            cachePartition = nullptr;
+        }
+    }
+    return cachePartition;
+}
+
+static esp_err_t cacheErase(size_t offset, size_t size)
+{
+#ifdef WIZ2HUE_CACHE_FAULT_TEST
+    if (faultOpsLeft == 0)
+    {
+        return ESP_FAIL;
+    }
+    if (faultOpsLeft > 0 && --faultOpsLeft == 0)
+    {
+        // Interrupted erase: sector left erased but with garbage at its start
+        esp_partition_erase_range(cachePartition, offset, cachePartition->erase_size);
+        const uint8_t garbage[16] = {0x5A, 0x00, 0x13, 0x37, 0x5A, 0x00, 0x13, 0x37, 0x5A, 0x00, 0x13, 0x37, 0x5A, 0x00, 0x13, 0x37};
+        esp_partition_write(cachePartition, offset, garbage, sizeof(garbage));
+        return ESP_FAIL;
+    }
+#endif
+    cacheStats.sectorErases += size / cachePartition->erase_size;
+    return esp_partition_erase_range(cachePartition, offset, size);
+}
+
+static esp_err_t cacheWrite(size_t offset, const void *data, size_t size)
+{
+#ifdef WIZ2HUE_CACHE_FAULT_TEST
+    if (faultOpsLeft == 0)
+    {
+        return ESP_FAIL;
+    }
+    if (faultOpsLeft > 0 && --faultOpsLeft == 0)
+    {
+        esp_partition_write(cachePartition, offset, data, size / 2); // Torn write
+        return ESP_FAIL;
+    }
+#endif
+    return esp_partition_write(cachePartition, offset, data, size);
+}
+
+static size_t roundToSectors(size_t size)
+{
+    return (size + cachePartition->erase_size - 1) / cachePartition->erase_size * cachePartition->erase_size;
+}
+
+static uint32_t headerCrc(const LightCacheHeader &header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&header, offsetof(LightCacheHeader, headerCrc));
+}
+
+static uint32_t journalEntryCrc(uint8_t type, uint8_t length, const void *payload)
+{
+    const uint8_t prefix[2] = {type, length};
+    uint32_t crc = esp_rom_crc32_le(0, prefix, sizeof(prefix));
+    return esp_rom_crc32_le(crc, (const uint8_t *)payload, length);
+}
+
+static const LightCacheHeader *validateSlot(int slot)
+{
+    const uint8_t *base = cacheMap + slot * LIGHT_CACHE_SLOT_SIZE;
+    const LightCacheHeader *header = (const LightCacheHeader *)base;
+    if (header->magic != LIGHT_CACHE_MAGIC)
+    {
+        return nullptr; // Erased or never written
+    }
+    if (header->version != LIGHT_CACHE_VERSION || header->headerSize != sizeof(LightCacheHeader) ||
+        header->recordSize != sizeof(LightCacheRecord) || headerCrc(*header) != header->headerCrc)
+    {
+        Serial.printf("Light cache: slot %d has an unsupported or corrupt header (version %u)\n", slot, header->version);
+        return nullptr;
+    }
+    uint32_t expectedSize = header->recordCount * (sizeof(LightCacheRecord) + sizeof(LightCacheIndexEntry));
+    if (header->payloadSize != expectedSize || header->recordsOffset != sizeof(LightCacheHeader) ||
+        header->indexOffset != header->recordsOffset + header->recordCount * sizeof(LightCacheRecord) ||
+        header->recordsOffset + header->payloadSize > LIGHT_CACHE_SLOT_SIZE)
+    {
+        Serial.printf("Light cache: slot %d has an inconsistent header\n", slot);
+        return nullptr;
+    }
+    if (esp_rom_crc32_le(0, base + header->recordsOffset, header->payloadSize) != header->payloadCrc)
+    {
+        Serial.printf("Light cache: slot %d CRC mismatch\n", slot);
+        return nullptr;
+    }
+    return header;
+}
+
+// Walks the journal up to the first unwritten or damaged entry
+static void scanJournal()
+{
+    const uint8_t *journal = cacheMap + LIGHT_CACHE_JOURNAL_OFFSET;
+    size_t offset = 0;
+    journalDamaged = false;
+    while (offset + sizeof(LightJournalEntry) <= LIGHT_CACHE_JOURNAL_SIZE)
+    {
+        const LightJournalEntry *entry = (const LightJournalEntry *)(journal + offset);
+        if (entry->type == 0xFF && entry->length == 0xFF)
+        {
+            break;
+        }
+        size_t next = offset + sizeof(LightJournalEntry) + entry->length;
+        bool knownType = (entry->type == LIGHT_JOURNAL_IP_UPDATE && entry->length == sizeof(LightJournalIpUpdate)) ||
+                         (entry->type == LIGHT_JOURNAL_RECORD && entry->length == sizeof(LightCacheRecord)) ||
+                         (entry->type == LIGHT_JOURNAL_BASE && entry->length == sizeof(uint32_t));
+        if (!knownType || next > LIGHT_CACHE_JOURNAL_SIZE ||
+            journalEntryCrc(entry->type, entry->length, entry + 1) != entry->crc)
+        {
+            journalDamaged = true;
+            cacheStats.tornEntries++;
+            break;
+        }
+        offset = next;
+    }
+    journalEnd = offset;
+
+    const LightJournalEntry *first = (const LightJournalEntry *)journal;
+    journalStale = journalEnd > 0 &&
+                   (first->type != LIGHT_JOURNAL_BASE || cacheHeader == nullptr ||
+                    *(const uint32_t *)(first + 1) != cacheHeader->sequence);
+}
+
+// Maps the partition once and finds the base image and the end of the journal
+static bool scanCache()
+{
+    if (cacheScanned)
+    {
+        return cacheHeader != nullptr;
+    }
+    if (findCachePartition() == nullptr)
+    {
+        return false;
+    }
+    if (cacheMap == nullptr)
+    {
+        const void *mapped = nullptr;
+        esp_err_t err = esp_partition_mmap(cachePartition, 0, cachePartition->size, ESP_PARTITION_MMAP_DATA, &mapped, &cacheMapHandle);
+        if (err != ESP_OK)
+        {
+            Serial.printf("Light cache: mmap failed: %s\n", esp_err_to_name(err));
+            return false;
+        }
+        cacheMap = (const uint8_t *)mapped;
+    }
+
+    cacheHeader = nullptr;
+    activeSlot = -1;
+    for (int slot = 0; slot < 2; slot++)
+    {
+        const LightCacheHeader *header = validateSlot(slot);
+        if (header != nullptr && (cacheHeader == nullptr || (int32_t)(header->sequence - cacheHeader->sequence) > 0))
+        {
+            cacheHeader = header;
+            activeSlot = slot;
+        }
+    }
+    scanJournal();
+    cacheScanned = true;
+    return cacheHeader != nullptr;
+}
+
+static void recordToBulb(const LightCacheRecord &record, WizBulbInfo &bulb)
+{
+    bulb.ip = record.ip;
+    memcpy(bulb.mac, record.mac, sizeof(bulb.mac));
+    bulb.moduleId = internModuleName(record.moduleName);
+    memcpy(bulb.fwVersion, record.fwVersion, sizeof(bulb.fwVersion));
+    bulb.homeId = record.homeId;
+    bulb.roomId = record.roomId;
+    memcpy(bulb.src, record.src, sizeof(bulb.src));
+    bulb.rssi = record.rssi;
+    bulb.bulbClass = (BulbClass)record.bulbClass;
+    bulb.features.brightness = record.featureFlags & LIGHT_CACHE_FEATURE_BRIGHTNESS;
+    bulb.features.color = record.featureFlags & LIGHT_CACHE_FEATURE_COLOR;
+    bulb.features.color_tmp = record.featureFlags & LIGHT_CACHE_FEATURE_COLOR_TMP;
+    bulb.features.effect = record.featureFlags & LIGHT_CACHE_FEATURE_EFFECT;
+    bulb.features.fan = record.featureFlags & LIGHT_CACHE_FEATURE_FAN;
+    bulb.features.kelvin_range.min = record.kelvinMin;
+    bulb.features.kelvin_range.max = record.kelvinMax;
+    bulb.isValid = true;
+    bulb.error = WizError::NONE;
+}
+
+static void bulbToRecord(const WizBulbInfo &bulb, LightCacheRecord &record)
+{
+    memset(&record, 0, sizeof(record));
+    record.ip = bulb.ip;
+    record.homeId = bulb.homeId;
+    record.roomId = bulb.roomId;
+    record.kelvinMin = bulb.features.kelvin_range.min;
+    record.kelvinMax = bulb.features.kelvin_range.max;
+    memcpy(record.mac, bulb.mac, sizeof(record.mac));
+    record.bulbClass = (uint8_t)bulb.bulbClass;
+    record.featureFlags = (bulb.features.brightness ? LIGHT_CACHE_FEATURE_BRIGHTNESS : 0) |
+                          (bulb.features.color ? LIGHT_CACHE_FEATURE_COLOR : 0) |
+                          (bulb.features.color_tmp ? LIGHT_CACHE_FEATURE_COLOR_TMP : 0) |
+                          (bulb.features.effect ? LIGHT_CACHE_FEATURE_EFFECT : 0) |
+                          (bulb.features.fan ? LIGHT_CACHE_FEATURE_FAN : 0);
+    record.rssi = bulb.rssi;
+    memcpy(record.fwVersion, bulb.fwVersion, sizeof(record.fwVersion));
+    memcpy(record.src, bulb.src, sizeof(record.src));
+    strlcpy(record.moduleName, moduleNameOf(bulb.moduleId), sizeof(record.moduleName));
+}
+
+static const uint8_t *slotBase()
+{
+    return cacheMap + activeSlot * LIGHT_CACHE_SLOT_SIZE;
+}
+
+// Binary search of the base image's MAC index, in place
+static const LightCacheRecord *findImageRecord(const uint8_t *mac)
+{
+    const LightCacheIndexEntry *index = (const LightCacheIndexEntry *)(slotBase() + cacheHeader->indexOffset);
+    int low = 0;
+    int high = cacheHeader->recordCount - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        int order = memcmp(index[mid].mac, mac, sizeof(index[mid].mac));
+        if (order == 0)
+        {
+            const LightCacheRecord *records = (const LightCacheRecord *)(slotBase() + cacheHeader->recordsOffset);
+            return &records[index[mid].record];
+        }
+        if (order < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return nullptr;
+}
+
+static WizBulbInfo *findBulb(std::vector<WizBulbInfo> &bulbs, const uint8_t *mac)
+{
+    for (WizBulbInfo &bulb : bulbs)
+    {
+        if (memcmp(bulb.mac, mac, sizeof(bulb.mac)) == 0)
+        {
+            return &bulb;
+        }
+    }
+    return nullptr;
+}
+
+// Only the sectors in use, unless the tail is damaged and may hide leftovers further on
+static esp_err_t eraseJournal()
+{
+    size_t used = journalDamaged ? LIGHT_CACHE_JOURNAL_SIZE : journalEnd;
+    if (used == 0)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = cacheErase(LIGHT_CACHE_JOURNAL_OFFSET, roundToSectors(used));
+    if (err == ESP_OK)
+    {
+        journalEnd = 0;
+        journalDamaged = false;
+        journalStale = false;
+    }
+    return err;
+}
+
+// Caller holds cacheMutex and scanCache() succeeded
+static void loadMergedLocked(std::vector<WizBulbInfo> &bulbs)
+{
+    // Records are decoded straight out of flash; nothing is read into a buffer first
+    const LightCacheRecord *records = (const LightCacheRecord *)(slotBase() + cacheHeader->recordsOffset);
+    bulbs.clear();
+    bulbs.resize(cacheHeader->recordCount);
+    for (uint16_t i = 0; i < cacheHeader->recordCount; i++)
+    {
+        recordToBulb(records[i], bulbs[i]);
+    }
+
+    const uint8_t *journal = cacheMap + LIGHT_CACHE_JOURNAL_OFFSET;
+    for (size_t offset = 0; offset < journalEnd && !journalStale;)
+    {
+        const LightJournalEntry *entry = (const LightJournalEntry *)(journal + offset);
+        if (entry->type == LIGHT_JOURNAL_IP_UPDATE)
+        {
+            const LightJournalIpUpdate *update = (const LightJournalIpUpdate *)(entry + 1);
+            WizBulbInfo *bulb = findBulb(bulbs, update->mac);
+            if (bulb != nullptr)
+            {
+                bulb->ip = update->ip;
+            }
+        }
+        else if (entry->type == LIGHT_JOURNAL_RECORD)
+        {
+            const LightCacheRecord *record = (const LightCacheRecord *)(entry + 1);
+            WizBulbInfo *bulb = findBulb(bulbs, record->mac);
+            if (bulb == nullptr)
+            {
+                bulbs.push_back(WizBulbInfo());
+                bulb = &bulbs.back();
+            }
+            recordToBulb(*record, *bulb);
+        }
+        offset += sizeof(LightJournalEntry) + entry->length;
+    }
+}
+
+// Compaction: full image into the slot not holding the base image, header last, then the
+// journal is erased. Caller holds cacheMutex.
+static bool writeImageLocked(const std::vector<WizBulbInfo> &bulbs)
+{
+    if (findCachePartition() == nullptr)
+    {
+        return false;
+    }
+    scanCache();
+
+    std::vector<const WizBulbInfo *> valid;
+    for (const WizBulbInfo &bulb : bulbs)
+    {
+        if (bulb.isValid)
+        {
+            valid.push_back(&bulb);
+        }
+    }
+
+    size_t count = valid.size();
+    size_t recordsOffset = sizeof(LightCacheHeader);
+    size_t indexOffset = recordsOffset + count * sizeof(LightCacheRecord);
+    size_t imageSize = indexOffset + count * sizeof(LightCacheIndexEntry);
+    if (imageSize > LIGHT_CACHE_SLOT_SIZE)
+    {
+        Serial.printf("Light cache: %d lights do not fit the %u byte image slot\n", count, LIGHT_CACHE_SLOT_SIZE);
+        return false;
+    }
+
+    std::vector<uint8_t> image(imageSize, 0);
+    LightCacheRecord *records = (LightCacheRecord *)(image.data() + recordsOffset);
+    LightCacheIndexEntry *index = (LightCacheIndexEntry *)(image.data() + indexOffset);
+    for (size_t i = 0; i < count; i++)
+    {
+        bulbToRecord(*valid[i], records[i]);
+        memcpy(index[i].mac, valid[i]->mac, sizeof(index[i].mac));
+        index[i].record = i;
+    }
+    std::sort(index, index + count, [](const LightCacheIndexEntry &a, const LightCacheIndexEntry &b)
+              { return memcmp(a.mac, b.mac, sizeof(a.mac)) < 0; });
+
+    LightCacheHeader *header = (LightCacheHeader *)image.data();
+    header->magic = LIGHT_CACHE_MAGIC;
+    header->version = LIGHT_CACHE_VERSION;
+    header->headerSize = sizeof(LightCacheHeader);
+    header->recordSize = sizeof(LightCacheRecord);
+    header->recordCount = count;
+    header->sequence = cacheHeader != nullptr ? cacheHeader->sequence + 1 : 1;
+    header->recordsOffset = recordsOffset;
+    header->indexOffset = indexOffset;
+    header->payloadSize = imageSize - recordsOffset;
+    header->payloadCrc = esp_rom_crc32_le(0, image.data() + recordsOffset, header->payloadSize);
+    header->headerCrc = headerCrc(*header);
+
+    int targetSlot = activeSlot == 0 ? 1 : 0;
+    size_t slotOffset = targetSlot * LIGHT_CACHE_SLOT_SIZE;
+    cacheScanned = false; // Whatever happens below, look at the flash again next time
+
+    esp_err_t err = cacheErase(slotOffset, roundToSectors(imageSize));
+    if (err == ESP_OK)
+    {
+        err = cacheWrite(slotOffset + recordsOffset, image.data() + recordsOffset, header->payloadSize);
+    }
+    if (err == ESP_OK)
+    {
+        err = cacheWrite(slotOffset, header, sizeof(LightCacheHeader));
+    }
+    if (err == ESP_OK)
+    {
+        err = eraseJournal();
+    }
+    if (err != ESP_OK)
+    {
+        Serial.printf("Light cache: write failed: %s\n", esp_err_to_name(err));
+        return false;
+    }
+
+    cacheStats.compactions++;
+    cacheStats.compactionBytes += imageSize;
+    Serial.printf("Saved %d lights to binary cache slot %d (%d bytes, sequence %lu)\n",
+                  count, targetSlot, imageSize, (unsigned long)header->sequence);
+    return true;
+}
+
+// Appends one entry, compacting instead when the journal is full or has a torn tail
+static bool appendJournalLocked(uint8_t type, const void *payload, uint8_t length)
+{
+    if (!scanCache())
+    {
+        return false; // No base image to journal against
+    }
+
+    size_t entrySize = sizeof(LightJournalEntry) + length;
+    if (journalDamaged || journalEnd + entrySize > LIGHT_CACHE_JOURNAL_SIZE)
+    {
+        std::vector<WizBulbInfo> bulbs;
+        loadMergedLocked(bulbs);
+        if (type == LIGHT_JOURNAL_IP_UPDATE)
+        {
+            const LightJournalIpUpdate *update = (const LightJournalIpUpdate *)payload;
+            WizBulbInfo *bulb = findBulb(bulbs, update->mac);
+            if (bulb != nullptr)
+            {
+                bulb->ip = update->ip;
+            }
+        }
+        else if (type == LIGHT_JOURNAL_RECORD)
+        {
+            const LightCacheRecord *record = (const LightCacheRecord *)payload;
+            WizBulbInfo *bulb = findBulb(bulbs, record->mac);
+            if (bulb == nullptr)
+            {
+                bulbs.push_back(WizBulbInfo());
+                bulb = &bulbs.back();
+            }
+            recordToBulb(*record, *bulb);
+        }
+        return writeImageLocked(bulbs);
+    }
+
+    // A fresh journal first records which image it applies to
+    if (journalStale && eraseJournal() != ESP_OK)
+    {
+        cacheScanned = false;
+        return false;
+    }
+    if (journalEnd == 0 && type != LIGHT_JOURNAL_BASE &&
+        !appendJournalLocked(LIGHT_JOURNAL_BASE, &cacheHeader->sequence, sizeof(uint32_t)))
+    {
+        return false;
+    }
+
+    // Leftovers of an interrupted erase cannot be programmed over; fold into a new image instead
+    const uint8_t *target = cacheMap + LIGHT_CACHE_JOURNAL_OFFSET + journalEnd;
+    for (size_t i = 0; i < entrySize; i++)
+    {
+        if (target[i] != 0xFF)
+        {
+            journalDamaged = true;
+            return appendJournalLocked(type, payload, length);
+        }
+    }
+
+    uint8_t buffer[sizeof(LightJournalEntry) + sizeof(LightCacheRecord)];
+    LightJournalEntry *entry = (LightJournalEntry *)buffer;
+    entry->type = type;
+    entry->length = length;
+    entry->reserved = 0xFFFF;
+    entry->crc = journalEntryCrc(type, length, payload);
+    memcpy(entry + 1, payload, length);
+
+    esp_err_t err = cacheWrite(LIGHT_CACHE_JOURNAL_OFFSET + journalEnd, buffer, entrySize);
+    if (err != ESP_OK)
+    {
+        Serial.printf("Light cache: journal write failed: %s\n", esp_err_to_name(err));
+        cacheScanned = false;
+        return false;
+    }
+    journalEnd += entrySize;
+    cacheStats.journalAppends++;
+    cacheStats.journalBytes += entrySize;
+    return true;
+}
+
+bool loadLightsFromCache(std::vector<WizBulbInfo> &bulbs)
+{
+    if (!takeCacheMutex())
+    {
+        return false;
+    }
+    bool loaded = scanCache();
+    if (loaded)
+    {
+        loadMergedLocked(bulbs);
+        Serial.printf("Loaded %d lights from binary cache (slot %d, %u journal bytes%s)\n", bulbs.size(), activeSlot,
+                      journalEnd, journalDamaged ? ", torn tail dropped" : "");
+
+        // Fold a torn tail or a nearly full journal into a fresh image now, not on the next update
+        if (journalDamaged || journalEnd > LIGHT_CACHE_COMPACT_AT)
+        {
+            writeImageLocked(bulbs);
+        }
+        else if (journalStale)
+        {
+            eraseJournal();
+        }
+    }
+    xSemaphoreGive(cacheMutex);
+    return loaded;
+}
+
+bool lightCacheLookup(const uint8_t *mac, WizBulbInfo &info)
+{
+    if (!takeCacheMutex())
+    {
+        return false;
+    }
+    bool found = false;
+    if (scanCache())
+    {
+        const LightCacheRecord *record = findImageRecord(mac);
+        if (record != nullptr)
+        {
+            recordToBulb(*record, info);
+            found = true;
+        }
+
+        // Later journal entries override the image
+        const uint8_t *journal = cacheMap + LIGHT_CACHE_JOURNAL_OFFSET;
+        for (size_t offset = 0; offset < journalEnd && !journalStale;)
+        {
+            const LightJournalEntry *entry = (const LightJournalEntry *)(journal + offset);
+            if (entry->type == LIGHT_JOURNAL_IP_UPDATE)
+            {
+                const LightJournalIpUpdate *update = (const LightJournalIpUpdate *)(entry + 1);
+                if (found && memcmp(update->mac, mac, sizeof(update->mac)) == 0)
+                {
+                    info.ip = update->ip;
+                }
+            }
+            else if (entry->type == LIGHT_JOURNAL_RECORD)
+            {
+                const LightCacheRecord *journalRecord = (const LightCacheRecord *)(entry + 1);
+                if (memcmp(journalRecord->mac, mac, sizeof(journalRecord->mac)) == 0)
+                {
+                    recordToBulb(*journalRecord, info);
+                    found = true;
+                }
+            }
+            offset += sizeof(LightJournalEntry) + entry->length;
+        }
+    }
+    xSemaphoreGive(cacheMutex);
+    return found;
+}
+
+bool saveLightsToCache(const std::vector<WizBulbInfo> &bulbs)
+{
+    if (!takeCacheMutex())
+    {
+        return false;
+    }
+    bool saved = writeImageLocked(bulbs);
+    xSemaphoreGive(cacheMutex);
+    return saved;
+}
+
+bool journalLightIpUpdate(const uint8_t *mac, uint32_t ip)
+{
+    LightJournalIpUpdate update;
+    memcpy(update.mac, mac, sizeof(update.mac));
+    update.reserved = 0xFFFF;
+    update.ip = ip;
+
+    if (!takeCacheMutex())
+    {
+        return false;
+    }
+    bool journaled = appendJournalLocked(LIGHT_JOURNAL_IP_UPDATE, &update, sizeof(update));
+    xSemaphoreGive(cacheMutex);
+    return journaled;
+}
+
+bool journalLightRecord(const WizBulbInfo &bulb)
+{
+    LightCacheRecord record;
+    bulbToRecord(bulb, record);
+
+    if (!takeCacheMutex())
+    {
+        return false;
+    }
+    bool journaled = appendJournalLocked(LIGHT_JOURNAL_RECORD, &record, sizeof(record));
+    xSemaphoreGive(cacheMutex);
+    return journaled;
+}
+
+void eraseLightCache()
+{
+    if (findCachePartition() == nullptr || !takeCacheMutex())
+    {
+        return;
+    }
+    // Headers of both slots and the start of the journal; everything else is unreachable then
+    scanCache();
+    bool erased = cacheErase(0, cachePartition->erase_size) == ESP_OK &&
+                  cacheErase(LIGHT_CACHE_SLOT_SIZE, cachePartition->erase_size) == ESP_OK &&
+                  eraseJournal() == ESP_OK;
+    cacheScanned = false;
+    xSemaphoreGive(cacheMutex);
+    if (erased)
+    {
+        Serial.println("Erased binary light cache");
+    }
+}
+
+LightCacheStats getLightCacheStats()
+{
+    LightCacheStats stats;
+    if (takeCacheMutex())
+    {
+        stats = cacheStats;
+        xSemaphoreGive(cacheMutex);
+    }
+    return stats;
+}
+
+void logLightCacheStats()
+{
+    Serial.printf("Light cache: %lu journal appends (%lu bytes, %.1f per update), %lu compactions (%lu bytes), %lu sector erases, %lu torn entries recovered\n",
+                  (unsigned long)cacheStats.journalAppends, (unsigned long)cacheStats.journalBytes,
+                  cacheStats.journalAppends > 0 ? (float)cacheStats.journalBytes / cacheStats.journalAppends : 0.0f,
+                  (unsigned long)cacheStats.compactions, (unsigned long)cacheStats.compactionBytes,
+                  (unsigned long)cacheStats.sectorErases, (unsigned long)cacheStats.tornEntries);
+}
+
+#ifdef WIZ2HUE_CACHE_FAULT_TEST
+// Power-loss injection against the real partition: for every flash operation of an update
+// sequence (journal appends, a journal-full compaction, a full save), cut power at that
+// operation, "reboot" and check every bulb still loads with either its old or a new address.
+// Restores the cache it started with.
+void lightCacheFaultTest()
+{
+    std::vector<WizBulbInfo> original;
+    bool hadCache = loadLightsFromCache(original);
+
+    std::vector<WizBulbInfo> baseline;
+    for (int i = 0; i < 8; i++)
+    {
+        WizBulbInfo bulb;
+        const uint8_t mac[6] = {0x44, 0x4F, 0x8E, 0xFA, 0x17, (uint8_t)i};
+        memcpy(bulb.mac, mac, sizeof(bulb.mac));
+        bulb.ip = (uint32_t)IPAddress(192, 168, 1, 10 + i);
+        bulb.isValid = true;
+        baseline.push_back(bulb);
+    }
+    const uint32_t movedBase = (uint32_t)IPAddress(192, 168, 2, 0);
+
+    int scenarios = 0;
+    int failures = 0;
+    for (int scenario = 0; scenario < 2; scenario++)
+    {
+        for (int cut = 1;; cut++)
+        {
+            takeCacheMutex();
+            writeImageLocked(baseline);
+            if (scenario == 1)
+            {
+                // Fill the journal so the next append has to compact
+                scanCache();
+                LightJournalIpUpdate filler;
+                memcpy(filler.mac, baseline[0].mac, sizeof(filler.mac));
+                filler.reserved = 0xFFFF;
+                filler.ip = baseline[0].ip;
+                while (journalEnd + 2 * (sizeof(LightJournalEntry) + sizeof(filler)) <= LIGHT_CACHE_JOURNAL_SIZE)
+                {
+                    appendJournalLocked(LIGHT_JOURNAL_IP_UPDATE, &filler, sizeof(filler));
+                }
+            }
+            xSemaphoreGive(cacheMutex);
+
+            faultOpsLeft = cut;
+            std::vector<WizBulbInfo> moved = baseline;
+            for (size_t i = 0; i < baseline.size(); i++)
+            {
+                moved[i].ip = movedBase + i;
+                journalLightIpUpdate(moved[i].mac, moved[i].ip);
+            }
+            std::vector<WizBulbInfo> saved = moved;
+            if (scenario == 0)
+            {
+                for (size_t i = 0; i < saved.size(); i++)
+                {
+                    saved[i].ip = movedBase + 100 + i;
+                }
+                saveLightsToCache(saved);
+            }
+            bool finished = faultOpsLeft != 0;
+            faultOpsLeft = -1;
+
+            // Reboot: forget everything known about the flash contents
+            cacheScanned = false;
+            std::vector<WizBulbInfo> recovered;
+            bool ok = loadLightsFromCache(recovered) && recovered.size() == baseline.size();
+            int savedCount = 0; // Bulbs showing the full save: all or none, never mixed with the journal
+            for (size_t i = 0; ok && i < baseline.size(); i++)
+            {
+                const WizBulbInfo *bulb = nullptr;
+                for (const WizBulbInfo &candidate : recovered)
+                {
+                    if (memcmp(candidate.mac, baseline[i].mac, sizeof(candidate.mac)) == 0)
+                    {
+                        bulb = &candidate;
+                    }
+                }
+                ok = bulb != nullptr && (bulb->ip == baseline[i].ip || bulb->ip == moved[i].ip || bulb->ip == saved[i].ip);
+                ok = ok && (!finished || bulb->ip == saved[i].ip);
+                savedCount += ok && scenario == 0 && bulb->ip == saved[i].ip ? 1 : 0;
+            }
+            ok = ok && (savedCount == 0 || savedCount == (int)baseline.size());
+            scenarios++;
+            if (!ok)
+            {
+                failures++;
+                Serial.printf("Light cache fault test: scenario %d, power cut at flash operation %d lost data\n", scenario, cut);
+            }
+            if (finished)
+            {
+                break;
+            }
+        }
+    }
+    Serial.printf("Light cache fault test: %d power cuts injected, %d lost data\n", scenarios, failures);
+
+    if (hadCache)
+    {
+        saveLightsToCache(original);
+    }
+    else
+    {
+        eraseLightCache();
+    }
+}
+#endif
+
+#ifdef WIZ2HUE_CACHE_BENCH
+const int LIGHT_CACHE_BENCH_RUNS = 20;
+
+// Cold-boot light load through both formats: average time and peak heap over a few runs. Needs
+// both lights.json and the binary cache present, i.e. a boot after discovery has saved once.
+void lightCacheBenchmark()
+{
+    const char *names[] = {"lights.json", "binary cache"};
+    for (int format = 0; format < 2; format++)
+    {
+        unsigned long totalMicros = 0;
+        size_t peakHeap = 0;
+        size_t loaded = 0;
+        bool ok = true;
+        for (int run = 0; run < LIGHT_CACHE_BENCH_RUNS && ok; run++)
+        {
+            if (format == 1)
+            {
+                cacheScanned = false; // Include the slot and journal scan and CRC checks, as on a cold boot
+            }
+            std::vector<WizBulbInfo> bulbs;
+            size_t freeBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            heap_caps_monitor_local_minimum_free_size_start();
+            unsigned long start = micros();
+            ok = format == 0 ? importLightsFromJson(bulbs) : loadLightsFromCache(bulbs);
+            totalMicros += micros() - start;
+            size_t lowWater = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+            heap_caps_monitor_local_minimum_free_size_stop();
+            peakHeap = max(peakHeap, freeBefore > lowWater ? freeBefore - lowWater : 0);
+            loaded = bulbs.size();
+        }
+        if (!ok)
+        {
+            Serial.printf("Cache bench: %s not available\n", names[format]);
+            continue;
+        }
+        Serial.printf("Cache bench: %s, %d lights: %lu us per load, peak heap %u bytes\n",
+                      names[format], loaded, totalMicros / LIGHT_CACHE_BENCH_RUNS, peakHeap);
+    }
+}
+#endif
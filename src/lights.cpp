@@ -1,9 +1,11 @@
 #include <Arduino.h>
 #include "wiz2hue.h"
 #include <Zigbee.h>
+#include <zboss_api.h>
 #include <ArduinoJson.h>
 #include <vector>
-#include <map>
+#include <algorithm>
+#include <climits>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
@@ -13,9 +15,13 @@
 class ZigbeeWizLight;
 static void staticLightChangeCallback(bool state, uint8_t endpoint, uint8_t red, uint8_t green, uint8_t blue, uint8_t level, uint16_t temperature, esp_zb_zcl_color_control_color_mode_t color_mode);
 static void staticIdentifyCallback(uint16_t time);
+static bool zclCommandPeek(uint8_t bufid);
+static void notifyFanoutDispatcher(uint8_t endpoint, unsigned long now);
+static bool fanoutBurstSince(unsigned long since);
+es_zb_hue_light_type_t mapBulbToZigbeeType(const WizBulbInfo &bulb);
 
-// Global mapping
-static std::map<uint8_t, ZigbeeWizLight *> endpointToLight;
+// Per-command transition time not given; the same value ZCL uses for "use the default"
+const uint16_t NO_COMMAND_TRANSITION = 0xFFFF;
 
 // Global filesystem mutex for settings saving
 static SemaphoreHandle_t filesystemMutex = nullptr;
@@ -23,27 +29,35 @@ static SemaphoreHandle_t filesystemMutex = nullptr;
 // WiZ bulb health monitoring
 int wizBulbFailureCount = 0;
 
-// Class to manage Zigbee-WiZ light pair
+// Per-class hot path statistics, one instance per light adapter specialization
+struct LightClassStats
+{
+  const char *name;
+  size_t instanceSize;
+  uint32_t instances = 0;
+  uint32_t hueCommands = 0;
+  uint64_t hueCommandCycles = 0;
+  uint32_t wizApplies = 0;
+  uint64_t wizApplyCycles = 0;
+  uint32_t commandBuilds = 0;
+  uint64_t commandBuildCycles = 0;
+
+  LightClassStats(const char *className, size_t size) : name(className), instanceSize(size) {}
+};
+
+// Class to manage Zigbee-WiZ light pair. Capability-independent logic (leader modes, streaming,
+// transitions timing, reconciliation) lives here; color and temperature handling is compiled in
+// per light class by ZigbeeWizLightImpl<Caps> below.
 class ZigbeeWizLight
 {
-private:
+protected:
   ZigbeeHueLight *zigbeeLight;
   WizBulbInfo wizBulb;
   uint8_t endpoint;
 
   // Current Hue light state
   bool currentState;
-  int16_t currentRed; // Using signed int to allow -1
-  int16_t currentGreen;
-  int16_t currentBlue;
   uint8_t currentLevel;
-  int16_t currentTemperature; // Using signed int to allow -1
-
-  // Previous state for change detection
-  uint8_t prevRed;
-  uint8_t prevGreen;
-  uint8_t prevBlue;
-  uint16_t prevTemperature;
 
   // Leader mode state management
   LeaderMode currentLeaderMode;
@@ -52,40 +66,408 @@ private:
   unsigned long lastPeriodicReadRequest;
   bool awaitingHueVerification;
 
+  // Fingerprint of the last getPilot reply applied to Zigbee (0 = force next apply)
+  uint32_t lastAppliedFingerprint;
+
+  // Desired state from Hue that has not reached the bulb yet (bulb offline or network down)
+  WizBulbState desiredState;
+  volatile bool desiredPending;
+  volatile bool replayRequested; // Network is back: reconcile now instead of at the next poll
+  volatile bool zigbeeResyncRequested; // Rejoined: re-report the latest WiZ state to Zigbee
+  unsigned long desiredSince;
+  uint32_t reconcileCount;
+  unsigned long lastConvergenceTime;
+
   // Rate limiting
   unsigned long lastCommandTime;
   unsigned long lastPeriodicUpdate;
   bool hasPendingUpdate;
 
+  // Last-known state from the store, published to Zigbee when the communication task starts
+  WizBulbState restoredState;
+  bool restorePending;
+
+  // Spare endpoints have no bulb until one is adopted at runtime; the endpoint may be exposed
+  // with more capabilities than the adopted bulb has, so commands follow the bulb's own type
+  volatile bool vacant;
+  es_zb_hue_light_type_t endpointType;
+  es_zb_hue_light_type_t bulbType;
+  unsigned long lastSeenAt; // Last valid reply, for retirement
+  bool firstReadPending;    // Restored address not confirmed by a reply yet
+
+  // Transition time of the last ZCL command for this endpoint (1/10 s), captured before the stack
+  // applies it; NO_COMMAND_TRANSITION when the command carried none
+  volatile uint16_t commandTransitionTime;
+
   // FreeRTOS synchronization
   SemaphoreHandle_t stateMutex;
   volatile bool pendingStateUpdate;
+  volatile unsigned long pendingSince; // when the pending Hue command arrived
   volatile bool pendingWizStateSync;
   TaskHandle_t communicationTask;
+  volatile bool stopRequested;  // Ask the communication task to finish its iteration and exit
+  volatile bool taskRunning;    // Cleared by the communication task as its last access to this object
 
   static const unsigned long COMMAND_INTERVAL = 100;
   static const unsigned long HUE_LEADER_TIMEOUT = 5000;
   static const unsigned long PERIODIC_READ_INTERVAL = 5000;
+  static const unsigned long FANOUT_HOLD = 80; // Leave fresh group commands to the group dispatcher first
+
+  // Streaming mode: fast slider drags and effects send unacknowledged frames at a fixed rate
+  static const unsigned long STREAM_DETECT_WINDOW = 500;  // Window for counting Hue commands
+  static const int STREAM_ENTER_COMMANDS = 4;             // Commands within the window that start streaming
+  static const unsigned long STREAM_FRAME_INTERVAL = 40;  // 25 Hz target frame rate
+  static const unsigned long STREAM_IDLE_TIMEOUT = 300;   // Quiet time before the final acknowledged frame
+
+  // Transition engine: Hue fades longer than the bulb's own smoothing are interpolated
+  static const unsigned long NATIVE_FADE_TIME = 400;          // WiZ firmware smooths changes over roughly this long
+  static const unsigned long TRANSITION_FRAME_INTERVAL = 200; // Per-bulb send budget: at most 5 frames/s
+
+  bool transitionActive;
+  unsigned long transitionStart;
+  unsigned long transitionDuration;
+  unsigned long transitionLastFrame;
+  int16_t transitionFromLevel;
+  int16_t transitionOutLevel;
+
+  // Transition statistics
+  uint32_t transitionCount;
+  uint32_t transitionFrames;
+  unsigned long transitionActiveTime;
+  uint16_t transitionMaxStep;
+  unsigned long transitionMinFrameGap; // must never drop below TRANSITION_FRAME_INTERVAL
+
+  bool streaming;
+  unsigned long burstWindowStart;
+  int burstCount;
+  unsigned long lastCommandAt;
+  unsigned long lastFrameSentAt;
+  unsigned long streamStartedAt;
+
+  // Streaming statistics
+  uint32_t streamSessions;
+  uint32_t streamFramesSent;
+  uint32_t streamFramesDropped;
+  unsigned long streamActiveTime;
+  unsigned long streamLagTotal;
+  unsigned long streamLagMax;
+
+  // Capability-specific parts, implemented by ZigbeeWizLightImpl<Caps>
+  virtual bool supportsTransitions() const = 0;
+  virtual void seedInitialState(const WizBulbState &actualState) = 0;
+  virtual void applyHueColor(uint8_t red, uint8_t green, uint8_t blue, uint16_t temperature,
+                             esp_zb_zcl_color_control_color_mode_t color_mode) = 0;
+  virtual WizBulbState buildCommand() = 0;
+  virtual void captureTransitionOrigin(bool retarget) = 0;
+  virtual WizBulbState buildTransitionFrame(uint8_t level, unsigned long elapsed, unsigned long duration) = 0;
+  virtual void applyWizState(const WizBulbState &wizState) = 0;
+  virtual LightClassStats &classStats() = 0;
 
   // Static function for FreeRTOS communication task
   static void communicationTaskFunction(void *parameter)
   {
     ZigbeeWizLight *light = static_cast<ZigbeeWizLight *>(parameter);
     light->communicationTaskLoop();
+    light->taskRunning = false;
+    vTaskDelete(nullptr);
+  }
+
+  // Build the WiZ command for the current Hue state (caller holds stateMutex)
+  WizBulbState buildStateToSend()
+  {
+    uint32_t startCycles = ESP.getCycleCount();
+    WizBulbState state = buildCommand();
+    LightClassStats &stats = classStats();
+    stats.commandBuilds++;
+    stats.commandBuildCycles += ESP.getCycleCount() - startCycles;
+    return state;
+  }
+
+  // Transition time for the command being processed. The callback does not carry it: use the one
+  // captured from the command itself, else the endpoint's OnOffTransitionTime attribute (1/10 s),
+  // which is what ZCL specifies for commands without their own. Called from the Zigbee task.
+  unsigned long readTransitionTime()
+  {
+    uint16_t commanded = commandTransitionTime;
+    commandTransitionTime = NO_COMMAND_TRANSITION;
+    if (commanded != NO_COMMAND_TRANSITION)
+    {
+      return (unsigned long)commanded * 100;
+    }
+
+    esp_zb_zcl_attr_t *attr = esp_zb_zcl_get_attribute(endpoint, ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL,
+                                                       ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                                                       ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_ON_OFF_TRANSITION_TIME_ID);
+    if (attr == nullptr || attr->data_p == nullptr)
+    {
+      return 0; // As fast as possible
+    }
+    return (unsigned long)(*(uint16_t *)attr->data_p) * 100;
+  }
+
+  // Start interpolating from the value currently shown by the bulb to the new Hue target (caller holds
+  // stateMutex; color/temperature origins were captured by captureTransitionOrigin)
+  void startTransition(unsigned long duration, bool wasOn, uint8_t fromLevel)
+  {
+    if (transitionActive)
+    {
+      // Retarget from wherever the running transition has got to
+      fromLevel = transitionOutLevel;
+    }
+    else if (!wasOn)
+    {
+      fromLevel = 0; // Fade in from off
+    }
+
+    transitionFromLevel = fromLevel;
+    transitionStart = millis();
+    transitionDuration = duration;
+    transitionLastFrame = 0;
+    transitionActive = true;
+    transitionCount++;
+  }
+
+  static int16_t interpolate(int16_t from, int16_t to, unsigned long elapsed, unsigned long duration)
+  {
+    if (from < 0 || to < 0)
+    {
+      return to; // Mode switch (RGB <-> temperature) or unknown start - no meaningful path
+    }
+    return from + (int32_t)(to - from) * (int32_t)elapsed / (int32_t)duration;
+  }
+
+  // One transition step: send an interpolated frame when the send budget allows, final frame acknowledged
+  void transitionTick()
+  {
+    WizBulbState frame;
+    bool sendFrame = false;
+    bool finish = false;
+
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(20)) != pdTRUE)
+    {
+      return;
+    }
+    unsigned long now = millis();
+    unsigned long elapsed = now - transitionStart;
+    pendingStateUpdate = false; // Frames carry the target; no separate immediate send
+
+    if (elapsed >= transitionDuration)
+    {
+      frame = buildStateToSend();
+      transitionActive = false;
+      finish = true;
+    }
+    else if (transitionLastFrame == 0 || now - transitionLastFrame >= TRANSITION_FRAME_INTERVAL)
+    {
+      int16_t level = interpolate(transitionFromLevel, currentLevel, elapsed, transitionDuration);
+
+      // Smoothness: largest level jump between consecutive frames
+      if (transitionLastFrame != 0)
+      {
+        transitionMaxStep = max(transitionMaxStep, (uint16_t)abs(level - transitionOutLevel));
+        transitionMinFrameGap = min(transitionMinFrameGap, now - transitionLastFrame);
+      }
+
+      transitionOutLevel = level;
+      transitionLastFrame = now;
+      frame = buildTransitionFrame(level, elapsed, transitionDuration);
+      sendFrame = true;
+    }
+    xSemaphoreGive(stateMutex);
+
+    if (sendFrame && sendBulbStateUnacked(wizBulb, frame))
+    {
+      transitionFrames++;
+    }
+    else if (finish)
+    {
+      if (setBulbState(wizBulb, frame))
+      {
+        desiredPending = false;
+        awaitingHueVerification = false;
+      }
+      else
+      {
+        parkDesiredState(frame);
+      }
+      transitionFrames++;
+      transitionActiveTime += transitionDuration;
+    }
+  }
+
+  // Park a Hue command that could not be delivered; it is applied once the bulb is reachable again
+  void parkDesiredState(const WizBulbState &state)
+  {
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+      desiredState = state;
+      if (!desiredPending)
+      {
+        desiredPending = true;
+        desiredSince = millis();
+      }
+      xSemaphoreGive(stateMutex);
+    }
+    Serial.printf("HueLeader: Bulb %s unreachable, desired state parked for reconciliation\n", IpStr(wizBulb.ip).c_str());
+  }
+
+  // WiZ changes seen while Zigbee was down only reached the local attributes; push the latest
+  // recorded state again so the coordinator gets it, and let the next poll re-apply as well
+  void resyncZigbee()
+  {
+    WizBulbState latest;
+    bool known = unpackBulbState(currentBulbState(wizBulb.mac), latest);
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) != pdTRUE)
+    {
+      return;
+    }
+    if (known)
+    {
+      processWizStateUpdate(latest);
+    }
+    lastAppliedFingerprint = 0;
+    lastWizBroadcastReceived = 0;
+    xSemaphoreGive(stateMutex);
+  }
+
+  // Bulb answered again while a Hue command is parked: send exactly one corrective setPilot
+  void reconcileDesiredState(unsigned long bulbSeenAt)
+  {
+    WizBulbState stateToSend;
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) != pdTRUE)
+    {
+      return;
+    }
+    stateToSend = desiredState;
+    xSemaphoreGive(stateMutex);
+
+    bool success = setBulbState(wizBulb, stateToSend);
+
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+      if (success)
+      {
+        desiredPending = false;
+        lastAppliedFingerprint = 0; // Next poll resyncs Zigbee from the corrected bulb
+        reconcileCount++;
+        lastConvergenceTime = millis() - bulbSeenAt;
+        Serial.printf("Reconcile: EP:%d converged %lu ms after bulb %s returned (command parked for %lu ms)\n",
+                      endpoint, lastConvergenceTime, IpStr(wizBulb.ip).c_str(), millis() - desiredSince);
+      }
+      else
+      {
+        Serial.printf("Reconcile: EP:%d corrective setPilot to %s failed, keeping desired state\n",
+                      endpoint, IpStr(wizBulb.ip).c_str());
+      }
+      xSemaphoreGive(stateMutex);
+    }
+  }
+
+  // One streaming step: send the newest frame if one is due, or finish the stream once idle
+  void streamTick()
+  {
+    WizBulbState frame;
+    bool sendFrame = false;
+    bool finish = false;
+    unsigned long lag = 0;
+
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(20)) != pdTRUE)
+    {
+      return;
+    }
+    unsigned long now = millis();
+    if (pendingStateUpdate && now - lastFrameSentAt >= STREAM_FRAME_INTERVAL)
+    {
+      frame = buildStateToSend();
+      pendingStateUpdate = false;
+      lag = now - lastCommandAt;
+      lastFrameSentAt = now;
+      sendFrame = true;
+    }
+    else if (!pendingStateUpdate && now - lastCommandAt >= STREAM_IDLE_TIMEOUT)
+    {
+      frame = buildStateToSend();
+      streaming = false;
+      streamActiveTime += now - streamStartedAt;
+      finish = true;
+    }
+    xSemaphoreGive(stateMutex);
+
+    if (sendFrame)
+    {
+      if (sendBulbStateUnacked(wizBulb, frame))
+      {
+        streamFramesSent++;
+        streamLagTotal += lag;
+        streamLagMax = max(streamLagMax, lag);
+      }
+    }
+    else if (finish)
+    {
+      // Final frame is acknowledged so the bulb is guaranteed to end on the last Hue state
+      if (setBulbState(wizBulb, frame))
+      {
+        desiredPending = false;
+        awaitingHueVerification = false;
+      }
+      else
+      {
+        parkDesiredState(frame);
+      }
+      Serial.printf("Stream: EP:%d idle, final state sent (%lu frames, %lu dropped so far)\n",
+                    endpoint, (unsigned long)streamFramesSent, (unsigned long)streamFramesDropped);
+    }
   }
 
   // Communication task loop with dual-mode leader logic
   void communicationTaskLoop()
   {
     const TickType_t xDelay = pdMS_TO_TICKS(100);
-    const TickType_t periodicDelay = pdMS_TO_TICKS(10000);
     const TickType_t periodicReadDelay = pdMS_TO_TICKS(5000);
-    TickType_t lastPeriodicUpdate = xTaskGetTickCount();
-    TickType_t lastSettingsSave = xTaskGetTickCount();
-    TickType_t lastPeriodicRead = xTaskGetTickCount();
+    TickType_t lastPeriodicRead = xTaskGetTickCount() - periodicReadDelay; // First live read right away
+
+    if (restorePending)
+    {
+      if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) == pdTRUE)
+      {
+        processWizStateUpdate(restoredState);
+        xSemaphoreGive(stateMutex);
+      }
+      restorePending = false;
+    }
 
-    while (true)
+    while (!stopRequested)
     {
+      ALLOC_SCOPE("light task");
+      if (streaming)
+      {
+        streamTick();
+        vTaskDelay(pdMS_TO_TICKS(STREAM_FRAME_INTERVAL));
+        continue;
+      }
+
+      if (transitionActive)
+      {
+        transitionTick();
+        vTaskDelay(xDelay);
+        continue;
+      }
+
+      if (replayRequested)
+      {
+        replayRequested = false;
+        if (desiredPending)
+        {
+          reconcileDesiredState(millis());
+        }
+      }
+
+      if (zigbeeResyncRequested)
+      {
+        zigbeeResyncRequested = false;
+        resyncZigbee();
+      }
+
       TickType_t currentTime = xTaskGetTickCount();
       bool shouldSendToWiz = false;
       bool shouldReadFromWiz = false;
@@ -106,19 +488,12 @@ private:
         // Handle different modes
         if (currentLeaderMode == LeaderMode::HUE_LEADER)
         {
-          // Hue-Leader mode: Send commands to Wiz
-          if (pendingStateUpdate)
+          // Hue-Leader mode: Send commands to Wiz (unless they are part of a group the dispatcher may still claim)
+          if (pendingStateUpdate && (millis() - pendingSince >= FANOUT_HOLD || !fanoutBurstSince(pendingSince)))
           {
             shouldSendToWiz = true;
             pendingStateUpdate = false;
           }
-
-          // Periodic resend in Hue-Leader mode
-          if ((currentTime - lastPeriodicUpdate) >= periodicDelay)
-          {
-            shouldSendToWiz = true;
-            lastPeriodicUpdate = currentTime;
-          }
         }
         else
         {
@@ -140,53 +515,27 @@ private:
         if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(200)) == pdTRUE)
         {
           // Copy current state under mutex protection
-          WizBulbState stateToSend;
-          stateToSend.state = currentState;
-
-          if (currentState && wizBulb.features.brightness)
-          {
-            stateToSend.dimming = map(currentLevel, 0, 255, 0, 100);
-          }
-
-          // Smart parameter sending based on current mode
-          if (currentState && wizBulb.features.color &&
-              currentRed >= 0 && currentGreen >= 0 && currentBlue >= 0)
-          {
-            // RGB mode - send RGB values, exclude temperature
-            stateToSend.r = currentRed;
-            stateToSend.g = currentGreen;
-            stateToSend.b = currentBlue;
-          }
-          else if (currentState && wizBulb.features.color_tmp && currentTemperature > 0)
-          {
-            // Temperature mode - send temperature, exclude RGB
-            int kelvin = 1000000 / currentTemperature;
-            // Clamp to bulb's supported range
-            if (kelvin < wizBulb.features.kelvin_range.min)
-            {
-              kelvin = wizBulb.features.kelvin_range.min;
-            }
-            else if (kelvin > wizBulb.features.kelvin_range.max)
-            {
-              kelvin = wizBulb.features.kelvin_range.max;
-            }
-            stateToSend.temp = kelvin;
-          }
+          WizBulbState stateToSend = buildStateToSend();
 
           xSemaphoreGive(stateMutex);
 
           // Send to WiZ bulb (outside mutex to avoid blocking)
           bool success = setBulbState(wizBulb, stateToSend);
-          if (success && awaitingHueVerification)
+          if (success)
           {
-            // Command sent successfully, we can assume it worked
-            awaitingHueVerification = false;
-            Serial.printf("HueLeader: Command sent to Wiz EP:%d\n", endpoint);
+            // A delivered command supersedes anything parked earlier
+            desiredPending = false;
+            if (awaitingHueVerification)
+            {
+              // Command sent successfully, we can assume it worked
+              awaitingHueVerification = false;
+              Serial.printf("HueLeader: Command sent to Wiz EP:%d\n", endpoint);
+            }
           }
-          else if (!success)
+          else
           {
-            // Don't increment failure count in new system - just log
-            Serial.printf("HueLeader: Failed to send state to bulb %s\n", wizBulb.ip.c_str());
+            // Don't increment failure count in new system - keep the command for reconciliation
+            parkDesiredState(stateToSend);
           }
         }
       }
@@ -197,12 +546,43 @@ private:
         WizBulbState wizState = getBulbState(wizBulb);
         if (wizState.isValid)
         {
+          lastSeenAt = millis();
+        }
+        else if (firstReadPending)
+        {
+          // The bulb may have a new address since the cache was written; find it now instead
+          // of at the next background pass
+          Serial.printf("WizLeader: bulb %s does not answer at its restored address, requesting discovery\n",
+                        MacStr(wizBulb.mac).c_str());
+          requestDiscoveryNow();
+        }
+        firstReadPending = false;
+        if (wizState.isValid && desiredPending)
+        {
+          // Bulb is back while a Hue command is parked - Hue wins, don't overwrite it with WiZ state
+          lastWizBroadcastReceived = millis();
+          reconcileDesiredState(lastWizBroadcastReceived);
+        }
+        else if (wizState.isValid)
+        {
+          recordBulbState(wizBulb, wizState);
           if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-            currentLeaderMode = LeaderMode::IN_SYNC;
-            // Update from read state
             lastWizBroadcastReceived = millis(); // Reset timeout
-            processWizStateUpdate(wizState);
-            currentLeaderMode = LeaderMode::WIZ_LEADER;
+            if (wizState.payloadFingerprint != 0 && wizState.payloadFingerprint == lastAppliedFingerprint)
+            {
+              // Same reply as the one already applied - nothing to push to Zigbee
+              recordPilotApplySkip();
+            }
+            else
+            {
+              currentLeaderMode = LeaderMode::IN_SYNC;
+              // Update from read state
+              unsigned long applyStart = micros();
+              processWizStateUpdate(wizState);
+              recordPilotApply(micros() - applyStart);
+              lastAppliedFingerprint = wizState.payloadFingerprint;
+              currentLeaderMode = LeaderMode::WIZ_LEADER;
+            }
             xSemaphoreGive(stateMutex);
           } else {
             Serial.printf("WizLeader: Failed to acquire mutex for state update\n");
@@ -210,7 +590,7 @@ private:
         }
         else
         {
-          Serial.printf("WizLeader: Failed to read from bulb %s\n", wizBulb.ip.c_str());
+          Serial.printf("WizLeader: Failed to read from bulb %s\n", IpStr(wizBulb.ip).c_str());
         }
       }
 
@@ -219,61 +599,47 @@ private:
     }
   }
 
-public:
-  ZigbeeWizLight(uint8_t ep, const WizBulbInfo &bulb, es_zb_hue_light_type_t zigbeeType)
-      : wizBulb(bulb), endpoint(ep), currentState(false), currentRed(-1), currentGreen(-1),
-        currentBlue(-1), currentLevel(0), currentTemperature(-1), prevRed(0), prevGreen(0),
-        prevBlue(0), prevTemperature(0), currentLeaderMode(LeaderMode::WIZ_LEADER),
+  ZigbeeWizLight(uint8_t ep, const WizBulbInfo &bulb)
+      : zigbeeLight(nullptr), wizBulb(bulb), endpoint(ep), currentState(false), currentLevel(0),
+        currentLeaderMode(LeaderMode::WIZ_LEADER),
         hueLeaderModeStart(0), lastWizBroadcastReceived(0), lastPeriodicReadRequest(0),
-        awaitingHueVerification(false), lastCommandTime(0), lastPeriodicUpdate(0),
-        hasPendingUpdate(false),
-        pendingStateUpdate(false), pendingWizStateSync(false),
-        communicationTask(nullptr)
+        awaitingHueVerification(false), lastAppliedFingerprint(0), desiredPending(false),
+        replayRequested(false), zigbeeResyncRequested(false), desiredSince(0), reconcileCount(0), lastConvergenceTime(0), lastCommandTime(0), lastPeriodicUpdate(0),
+        hasPendingUpdate(false), restorePending(false), vacant(!bulb.isValid),
+        endpointType(ESP_ZB_HUE_LIGHT_TYPE_ON_OFF), bulbType(mapBulbToZigbeeType(bulb)), lastSeenAt(0), firstReadPending(false),
+        commandTransitionTime(NO_COMMAND_TRANSITION),
+        stateMutex(nullptr),
+        pendingStateUpdate(false), pendingSince(0), pendingWizStateSync(false),
+        communicationTask(nullptr), stopRequested(false), taskRunning(false),
+        transitionActive(false), transitionStart(0), transitionDuration(0), transitionLastFrame(0),
+        transitionFromLevel(0), transitionOutLevel(0), transitionCount(0), transitionFrames(0),
+        transitionActiveTime(0), transitionMaxStep(0), transitionMinFrameGap(ULONG_MAX),
+        streaming(false), burstWindowStart(0), burstCount(0), lastCommandAt(0), lastFrameSentAt(0),
+        streamStartedAt(0), streamSessions(0), streamFramesSent(0), streamFramesDropped(0),
+        streamActiveTime(0), streamLagTotal(0), streamLagMax(0)
   {
+  }
 
+  // Second construction phase, run from the ZigbeeWizLightImpl constructor so the capability hooks resolve
+  void start(es_zb_hue_light_type_t zigbeeType)
+  {
     // Create mutex for state synchronization
     stateMutex = xSemaphoreCreateMutex();
     if (stateMutex == nullptr)
     {
-      Serial.printf("Failed to create mutex for bulb %s\n", bulb.mac.c_str());
+      Serial.printf("Failed to create mutex for bulb %s\n", MacStr(wizBulb.mac).c_str());
       return;
     }
 
-    // read actual WiZ bulb state and use as initial state
-    WizBulbState actualState = getBulbState(wizBulb);
-    if (actualState.isValid)
+    endpointType = zigbeeType;
+    if (!vacant)
     {
-      Serial.printf("Reading initial state for bulb %s: %s\n",
-                    wizBulb.ip.c_str(), actualState.state ? "ON" : "OFF");
-
-      currentState = actualState.state;
-
-      if (actualState.dimming >= 0)
-      {
-        currentLevel = map(actualState.dimming, 0, 100, 0, 255);
-      }
-
-      if (actualState.r >= 0 && actualState.g >= 0 && actualState.b >= 0)
-      {
-        currentRed = actualState.r;
-        currentGreen = actualState.g;
-        currentBlue = actualState.b;
-        prevRed = currentRed;
-        prevGreen = currentGreen;
-        prevBlue = currentBlue;
-      }
-
-      if (actualState.temp >= 0)
-      {
-        // Convert Kelvin to mireds
-        currentTemperature = 1000000 / actualState.temp;
-        prevTemperature = currentTemperature;
-      }
+      restoreState();
     }
 
     // Convert Kelvin range to mireds for ZigbeeHueLight constructor
-    uint16_t min_mireds = 1000000 / bulb.features.kelvin_range.max; // Higher Kelvin = lower mireds
-    uint16_t max_mireds = 1000000 / bulb.features.kelvin_range.min; // Lower Kelvin = higher mireds
+    uint16_t min_mireds = kelvinToMireds(wizBulb.features.kelvin_range.max); // Higher Kelvin = lower mireds
+    uint16_t max_mireds = kelvinToMireds(wizBulb.features.kelvin_range.min); // Lower Kelvin = higher mireds
     zigbeeLight = new ZigbeeHueLight(endpoint, zigbeeType, min_mireds, max_mireds);
     currentLeaderMode = LeaderMode::WIZ_LEADER;
 
@@ -281,14 +647,47 @@ public:
     zigbeeLight->onLightChange(staticLightChangeCallback);
     zigbeeLight->onIdentify(staticIdentifyCallback);
 
-    String modelName = getHueModelName(bulb);
+    String modelName = getHueModelName(wizBulb);
     zigbeeLight->setManufacturerAndModel("nkey", modelName.c_str());
     zigbeeLight->setSwBuild("0.0.1");
     zigbeeLight->setOnOffOnTime(0);
     zigbeeLight->setOnOffGlobalSceneControl(false);
 
+    if (!vacant)
+    {
+      startCommunicationTask();
+    }
+  }
+
+  // Start from the state the bulb last reported; the communication task publishes it and
+  // reads the live state right away, so registration never waits for the bulb
+  void restoreState()
+  {
+    lastSeenAt = millis();
+    firstReadPending = true;
+    if (restoreBulbState(wizBulb, restoredState))
+    {
+      Serial.printf("Restored last-known state for bulb %s: %s\n",
+                    IpStr(wizBulb.ip).c_str(), restoredState.state ? "ON" : "OFF");
+
+      currentState = restoredState.state;
+
+      if (restoredState.dimming >= 0)
+      {
+        currentLevel = percentToLevel(restoredState.dimming);
+      }
+
+      seedInitialState(restoredState);
+      restorePending = true;
+    }
+  }
+
+  void startCommunicationTask()
+  {
     // Create communication task for this bulb
     String taskName = "WizComm_" + String(endpoint);
+    stopRequested = false;
+    taskRunning = true;
     BaseType_t taskResult = xTaskCreate(
         communicationTaskFunction,
         taskName.c_str(),
@@ -299,25 +698,38 @@ public:
 
     if (taskResult != pdPASS)
     {
-      Serial.printf("Failed to create communication task for bulb %s\n", bulb.mac.c_str());
+      taskRunning = false;
+      communicationTask = nullptr;
+      Serial.printf("Failed to create communication task for bulb %s\n", MacStr(wizBulb.mac).c_str());
     }
     else
     {
-      Serial.printf("Created communication task for bulb %s (endpoint %d)\n", bulb.mac.c_str(), endpoint);
+      Serial.printf("Created communication task for bulb %s (endpoint %d)\n", MacStr(wizBulb.mac).c_str(), endpoint);
     }
   }
 
-  ~ZigbeeWizLight()
+  // Stop the communication task; must run before the capability hooks go away. The task is never
+  // deleted from outside: it finishes the request in progress, which releases every mutex, socket
+  // and circuit probe it holds, and exits at the top of its loop. Requests are bounded by their
+  // timeouts, so the wait is too.
+  void stop()
   {
-    // Stop the communication task first
     if (communicationTask != nullptr)
     {
-      Serial.printf("Deleting communication task for bulb %s\n", wizBulb.mac.c_str());
-      vTaskDelete(communicationTask);
+      Serial.printf("Stopping communication task for bulb %s\n", MacStr(wizBulb.mac).c_str());
+      stopRequested = true;
+      while (taskRunning)
+      {
+        vTaskDelay(pdMS_TO_TICKS(10));
+      }
       communicationTask = nullptr;
-      // Small delay to ensure task cleanup completes
-      vTaskDelay(pdMS_TO_TICKS(100));
     }
+  }
+
+public:
+  virtual ~ZigbeeWizLight()
+  {
+    stop();
 
     // Delete the mutex after task is stopped
     if (stateMutex != nullptr)
@@ -347,38 +759,181 @@ public:
   {
     return wizBulb;
   }
-  void onLightChangeCallback(bool state, uint8_t ep, uint8_t red, uint8_t green, uint8_t blue, uint8_t level, uint16_t temperature, esp_zb_zcl_color_control_color_mode_t color_mode)
+
+  // Discovery found the bulb at a new address. An aligned 32-bit store: the communication task
+  // reads the address without the mutex and picks it up on its next request.
+  void updateAddress(uint32_t ip)
   {
-    if (ep != endpoint)
+    wizBulb.ip = ip;
+    lastAppliedFingerprint = 0;
+    lastWizBroadcastReceived = 0; // Read from the new address right away
+  }
+
+  bool isVacant() const
+  {
+    return vacant;
+  }
+
+  es_zb_hue_light_type_t getEndpointType() const
+  {
+    return endpointType;
+  }
+
+  unsigned long getLastSeen() const
+  {
+    return lastSeenAt;
+  }
+
+  // A spare endpoint takes over a bulb first seen at runtime (caller binds it in the registry)
+  void adopt(const WizBulbInfo &bulb)
+  {
+    wizBulb = bulb;
+    bulbType = mapBulbToZigbeeType(bulb);
+    lastAppliedFingerprint = 0;
+    lastWizBroadcastReceived = 0;
+    desiredPending = false;
+    restoreState();
+    vacant = false;
+    startCommunicationTask();
+  }
+
+  // Retired bulb: stop talking to it and make the endpoint a spare (caller unbinds it first)
+  void vacate()
+  {
+    stop();
+
+    // Only Zigbee callbacks still take the mutex, and only briefly
+    xSemaphoreTake(stateMutex, portMAX_DELAY);
+    vacant = true;
+    pendingStateUpdate = false;
+    desiredPending = false;
+    streaming = false;
+    transitionActive = false;
+    wizBulb.ip = 0;
+    wizBulb.isValid = false;
+    xSemaphoreGive(stateMutex);
+  }
+
+  // Called from the Zigbee task for every light command, right before the stack applies it
+  void noteCommandTransitionTime(uint16_t tenths)
+  {
+    commandTransitionTime = tenths;
+  }
+
+  // Ask the communication task to re-apply the latest WiZ state after a Zigbee rejoin
+  void requestZigbeeResync()
+  {
+    zigbeeResyncRequested = true;
+  }
+
+  // Ask the communication task to send the parked Hue command; false if nothing is parked
+  bool requestReplay()
+  {
+    if (!desiredPending)
     {
-      Serial.printf("WARNING: Received command for EP:%d but this is EP:%d\n", ep, endpoint);
-      return; // Ignore commands for wrong endpoint
+      return false;
     }
+    replayRequested = true;
+    return true;
+  }
 
-    if (currentLeaderMode == LeaderMode::IN_SYNC)
+  LightClassStats &getClassStats()
+  {
+    return classStats();
+  }
+
+  bool hasPendingCommand() const
+  {
+    return pendingStateUpdate && !streaming && !transitionActive && currentLeaderMode == LeaderMode::HUE_LEADER;
+  }
+
+  // Hand the pending Hue command over to the group dispatcher
+  bool claimPendingCommand(WizGroupCommand &command)
+  {
+    bool claimed = false;
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(20)) == pdTRUE)
+    {
+      if (pendingStateUpdate && !streaming && !transitionActive && currentLeaderMode == LeaderMode::HUE_LEADER)
+      {
+        command.bulb = wizBulb;
+        command.state = buildStateToSend();
+        command.endpoint = endpoint;
+        pendingStateUpdate = false;
+        claimed = true;
+      }
+      xSemaphoreGive(stateMutex);
+    }
+    return claimed;
+  }
+
+  // Result of a group dispatch: unacknowledged commands go back to the per-light retry path
+  void completeGroupCommand(const WizGroupCommand &command)
+  {
+    if (command.acked)
     {
+      desiredPending = false;
+      awaitingHueVerification = false;
       return;
     }
 
-    // Take mutex to update state safely
     if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) == pdTRUE)
     {
-      Serial.printf("HueCommand EP:%d State:%s RGB:(%d,%d,%d) Level:%d Temp:%d mireds Mode:%d\n",
-                    ep, state ? "ON" : "OFF", red, green, blue, level, temperature, color_mode);
-
-      // Detect what changed to send only relevant parameters
-      bool rgbChanged = (red != prevRed || green != prevGreen || blue != prevBlue);
-      bool tempChanged = (temperature != prevTemperature);
-      if (color_mode == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_HUE_SATURATION || color_mode == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_CURRENT_X_Y)
-      {
-        rgbChanged = true;
-        tempChanged = false;
-      }
-      else if (color_mode == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE)
+      if (!pendingStateUpdate)
       {
-        rgbChanged = false;
-        tempChanged = true;
+        pendingStateUpdate = true;
+        pendingSince = millis() - FANOUT_HOLD; // Send right away
       }
+      xSemaphoreGive(stateMutex);
+    }
+  }
+
+  void logStats()
+  {
+    Serial.printf("EP:%d (%s): %s, %lu reconciliations, last convergence %lu ms\n",
+                  endpoint, IpStr(wizBulb.ip).c_str(), desiredPending ? "desired state parked" : "in sync",
+                  (unsigned long)reconcileCount, lastConvergenceTime);
+
+    if (streamSessions > 0)
+    {
+      unsigned long activeTime = streamActiveTime + (streaming ? millis() - streamStartedAt : 0);
+      uint32_t offered = streamFramesSent + streamFramesDropped;
+      Serial.printf("EP:%d streaming: %lu sessions, %.1f fps achieved, %.1f%% frames dropped, lag avg %lu / max %lu ms\n",
+                    endpoint, (unsigned long)streamSessions,
+                    activeTime > 0 ? 1000.0f * streamFramesSent / activeTime : 0.0f,
+                    offered > 0 ? 100.0f * streamFramesDropped / offered : 0.0f,
+                    streamFramesSent > 0 ? streamLagTotal / streamFramesSent : 0, streamLagMax);
+    }
+
+    if (transitionCount > 0)
+    {
+      Serial.printf("EP:%d transitions: %lu, %.1f frames/s (budget %.1f), max level step %u, min frame gap %lu ms\n",
+                    endpoint, (unsigned long)transitionCount,
+                    transitionActiveTime > 0 ? 1000.0f * transitionFrames / transitionActiveTime : 0.0f,
+                    1000.0f / TRANSITION_FRAME_INTERVAL, transitionMaxStep,
+                    transitionMinFrameGap == ULONG_MAX ? 0 : transitionMinFrameGap);
+    }
+  }
+  void onLightChangeCallback(bool state, uint8_t ep, uint8_t red, uint8_t green, uint8_t blue, uint8_t level, uint16_t temperature, esp_zb_zcl_color_control_color_mode_t color_mode)
+  {
+    ALLOC_SCOPE("Hue command");
+    if (ep != endpoint)
+    {
+      Serial.printf("WARNING: Received command for EP:%d but this is EP:%d\n", ep, endpoint);
+      return; // Ignore commands for wrong endpoint
+    }
+
+    if (currentLeaderMode == LeaderMode::IN_SYNC)
+    {
+      return;
+    }
+
+    // Take mutex to update state safely
+    if (xSemaphoreTake(stateMutex, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+      Serial.printf("HueCommand EP:%d State:%s RGB:(%d,%d,%d) Level:%d Temp:%d mireds Mode:%d\n",
+                    ep, state ? "ON" : "OFF", red, green, blue, level, temperature, color_mode);
+
+      uint32_t startCycles = ESP.getCycleCount();
 
       // Switch to Hue-Leader mode on any command from Hue
       if (currentLeaderMode == LeaderMode::WIZ_LEADER)
@@ -394,42 +949,69 @@ public:
         hueLeaderModeStart = millis();
       }
 
-      // Update previous state for next comparison
-      prevRed = red;
-      prevGreen = green;
-      prevBlue = blue;
-      prevTemperature = temperature;
+      // Hue now diverges from the last applied WiZ reply - next poll must apply in full
+      lastAppliedFingerprint = 0;
+
+      // Remember what the bulb shows now as the starting point of a transition
+      bool wasOn = currentState;
+      uint8_t fromLevel = currentLevel;
+      captureTransitionOrigin(transitionActive);
 
       // Update current state
       currentState = state;
       currentLevel = level;
+      applyHueColor(red, green, blue, temperature, color_mode);
 
-      // Smart parameter selection: prioritize the parameter group that changed
-      if (rgbChanged && wizBulb.features.color)
+      // Streaming detection: a burst of commands switches to fixed-rate, newest-frame-only sending
+      unsigned long now = millis();
+      if (now - burstWindowStart > STREAM_DETECT_WINDOW)
+      {
+        burstWindowStart = now;
+        burstCount = 0;
+      }
+      burstCount++;
+      if (!streaming && burstCount >= STREAM_ENTER_COMMANDS)
+      {
+        streaming = true;
+        streamStartedAt = now;
+        lastFrameSentAt = 0;
+        streamSessions++;
+        Serial.printf("Stream: EP:%d entering streaming mode\n", endpoint);
+      }
+      else if (streaming && pendingStateUpdate)
       {
-        // RGB changed - use RGB mode, reset temperature
-        currentRed = red;
-        currentGreen = green;
-        currentBlue = blue;
-        currentTemperature = -1; // Reset temperature to avoid conflicts
+        // Previous frame was never sent - superseded by this one
+        streamFramesDropped++;
       }
-      else if (tempChanged && wizBulb.features.color_tmp)
+      lastCommandAt = now;
+
+      // Long Hue fades are interpolated; short ones are left to the bulb's native smoothing
+      unsigned long transitionTime = supportsTransitions() ? readTransitionTime() : 0;
+      if (!streaming && state && transitionTime > NATIVE_FADE_TIME)
+      {
+        startTransition(transitionTime, wasOn, fromLevel);
+      }
+      else
       {
-        // Temperature changed - use temperature mode, reset RGB
-        currentTemperature = temperature;
-        currentRed = -1; // Reset RGB to avoid conflicts
-        currentGreen = -1;
-        currentBlue = -1;
+        transitionActive = false;
       }
 
       // Set flag to notify communication task to send to Wiz
       pendingStateUpdate = true;
+      pendingSince = now;
+
+      LightClassStats &stats = classStats();
+      stats.hueCommands++;
+      stats.hueCommandCycles += ESP.getCycleCount() - startCycles;
 
       xSemaphoreGive(stateMutex);
+
+      // Commands for a whole room arrive together - let the dispatcher send them as one burst
+      notifyFanoutDispatcher(endpoint, now);
     }
     else
     {
-      Serial.printf("Failed to acquire mutex in onLightChangeCallback for bulb %s\n", wizBulb.ip.c_str());
+      Serial.printf("Failed to acquire mutex in onLightChangeCallback for bulb %s\n", IpStr(wizBulb.ip).c_str());
     }
   }
 
@@ -441,93 +1023,630 @@ public:
   // Process Wiz state update (from read request or broadcast)
   void processWizStateUpdate(const WizBulbState &wizState)
   {
-    // Update internal state from Wiz
-    currentState = wizState.state;
-    if (wizState.dimming >= 0)
-      currentLevel = map(wizState.dimming, 0, 100, 0, 255);
-    if (wizState.r >= 0)
-      currentRed = wizState.r;
+    if (zigbeeLight == nullptr) {
+      Serial.printf("ERROR: zigbeeLight is null in processWizStateUpdate\n");
+      return;
+    }
+
+    uint32_t startCycles = ESP.getCycleCount();
+    applyWizState(wizState);
+    LightClassStats &stats = classStats();
+    stats.wizApplies++;
+    stats.wizApplyCycles += ESP.getCycleCount() - startCycles;
+
+    Serial.printf("WizLeader: Updated Zigbee EP:%d from Wiz state\n", endpoint);
+  }
+
+private:
+  String getHueModelName(const WizBulbInfo &bulb)
+  {
+    switch (bulb.bulbClass)
+    {
+    case BulbClass::RGB:
+      return "WizHue(LCA001)"; // Extended color light (RGB + tunable white)
+    case BulbClass::TW:
+      return "WizHue(LWO003)"; // Color temperature light
+    case BulbClass::DW:
+      return bulb.features.brightness ? "WizHue(LTA005)" : "WizHue(OnOff)";
+    case BulbClass::SOCKET:
+      return "WizHue(Socket)";
+    case BulbClass::FAN:
+      return "WizHue(Fan)";
+    default:
+      return "WizHue(Unknown)";
+    }
+  }
+};
+
+// Compile-time capability set of a light adapter
+template <bool Level, bool Color, bool Temperature>
+struct LightCaps
+{
+  static constexpr bool LEVEL = Level;
+  static constexpr bool COLOR = Color;
+  static constexpr bool TEMPERATURE = Temperature;
+};
+
+struct OnOffLightCaps : LightCaps<false, false, false>       // SOCKET, FAN, on/off-only DW
+{
+  static constexpr const char *NAME = "OnOff";
+};
+struct DimmableLightCaps : LightCaps<true, false, false>     // DW
+{
+  static constexpr const char *NAME = "Dimmable";
+};
+struct TemperatureLightCaps : LightCaps<true, false, true>   // TW
+{
+  static constexpr const char *NAME = "Temperature";
+};
+struct ColorLightCaps : LightCaps<true, true, true>          // RGB
+{
+  static constexpr const char *NAME = "Color";
+};
+
+// Color and temperature state only exists in adapters that use it (empty bases take no space)
+template <bool Enabled>
+struct LightColorState
+{
+  int16_t currentRed = -1; // Using signed int to allow -1
+  int16_t currentGreen = -1;
+  int16_t currentBlue = -1;
+  uint8_t prevRed = 0; // Previous state for change detection
+  uint8_t prevGreen = 0;
+  uint8_t prevBlue = 0;
+  int16_t transitionFromRed = -1, transitionFromGreen = -1, transitionFromBlue = -1;
+  int16_t transitionOutRed = -1, transitionOutGreen = -1, transitionOutBlue = -1;
+};
+template <>
+struct LightColorState<false>
+{
+};
+
+template <bool Enabled>
+struct LightTemperatureState
+{
+  int16_t currentTemperature = -1; // mireds, -1 = not set
+  uint16_t prevTemperature = 0;
+  int16_t transitionFromTemperature = -1;
+  int16_t transitionOutTemperature = -1;
+};
+template <>
+struct LightTemperatureState<false>
+{
+};
+
+template <typename Caps>
+class ZigbeeWizLightImpl : public ZigbeeWizLight,
+                           private LightColorState<Caps::COLOR>,
+                           private LightTemperatureState<Caps::TEMPERATURE>
+{
+public:
+  ZigbeeWizLightImpl(uint8_t ep, const WizBulbInfo &bulb, es_zb_hue_light_type_t zigbeeType)
+      : ZigbeeWizLight(ep, bulb)
+  {
+    classStats().instances++;
+    start(zigbeeType);
+  }
+
+  ~ZigbeeWizLightImpl()
+  {
+    stop(); // The task calls into this class
+    classStats().instances--;
+  }
+
+protected:
+  int16_t red() const
+  {
+    if constexpr (Caps::COLOR)
+      return this->currentRed;
     else
-      currentRed = -1;
-    if (wizState.g >= 0)
-      currentGreen = wizState.g;
+      return -1;
+  }
+
+  int16_t green() const
+  {
+    if constexpr (Caps::COLOR)
+      return this->currentGreen;
     else
-      currentGreen = -1;
-    if (wizState.b >= 0)
-      currentBlue = wizState.b;
+      return -1;
+  }
+
+  int16_t blue() const
+  {
+    if constexpr (Caps::COLOR)
+      return this->currentBlue;
     else
-      currentBlue = -1;
-    if (currentRed >=0  && currentBlue >= 0 && currentGreen >= 0) 
+      return -1;
+  }
+
+  int16_t temperature() const
+  {
+    if constexpr (Caps::TEMPERATURE)
+      return this->currentTemperature;
+    else
+      return -1;
+  }
+
+  // Build a WiZ command from Hue-side values (-1 color/temperature = not set)
+  WizBulbState buildState(bool on, uint8_t level, int16_t red, int16_t green, int16_t blue, int16_t temperature)
+  {
+    WizBulbState stateToSend;
+    stateToSend.state = on;
+
+    if constexpr (Caps::LEVEL)
     {
-      espXyColor_t xy_color = espRgbColorToXYColor({(uint8_t) currentRed, (uint8_t) currentGreen, (uint8_t) currentBlue});
-      espRgbColor_t rgb = espXYToRgbColor(255, xy_color.x, xy_color.y);
-      currentRed = rgb.r;
-      currentGreen = rgb.g;
-      currentBlue = rgb.b;
+      if (on && this->bulbType != ESP_ZB_HUE_LIGHT_TYPE_ON_OFF)
+      {
+        stateToSend.dimming = levelToPercent(level);
+      }
+    }
 
+    // Smart parameter sending based on current mode
+    if constexpr (Caps::COLOR)
+    {
+      if (on && red >= 0 && green >= 0 && blue >= 0 && this->bulbType == ESP_ZB_HUE_LIGHT_TYPE_EXTENDED_COLOR)
+      {
+        // RGB mode - send RGB values, exclude temperature
+        stateToSend.r = red;
+        stateToSend.g = green;
+        stateToSend.b = blue;
+        return stateToSend;
+      }
     }
 
-    if (wizState.temp >= 0)
-      currentTemperature = 1000000 / wizState.temp;
-    else
-      currentTemperature = -1; // Kelvin to mireds
+    if constexpr (Caps::TEMPERATURE)
+    {
+      if (on && temperature > 0 &&
+          (this->bulbType == ESP_ZB_HUE_LIGHT_TYPE_EXTENDED_COLOR || this->bulbType == ESP_ZB_HUE_LIGHT_TYPE_TEMPERATURE))
+      {
+        // Temperature mode - send temperature, exclude RGB
+        int kelvin = miredsToKelvin(temperature);
+        // Clamp to bulb's supported range
+        if (kelvin < wizBulb.features.kelvin_range.min)
+        {
+          kelvin = wizBulb.features.kelvin_range.min;
+        }
+        else if (kelvin > wizBulb.features.kelvin_range.max)
+        {
+          kelvin = wizBulb.features.kelvin_range.max;
+        }
+        stateToSend.temp = kelvin;
+      }
+    }
 
-    if (zigbeeLight == nullptr) {
-      Serial.printf("ERROR: zigbeeLight is null in processWizStateUpdate\n");
-      return;
+    return stateToSend;
+  }
+
+  bool supportsTransitions() const override
+  {
+    return Caps::LEVEL;
+  }
+
+  void seedInitialState(const WizBulbState &actualState) override
+  {
+    if constexpr (Caps::COLOR)
+    {
+      if (actualState.r >= 0 && actualState.g >= 0 && actualState.b >= 0)
+      {
+        this->currentRed = actualState.r;
+        this->currentGreen = actualState.g;
+        this->currentBlue = actualState.b;
+        this->prevRed = this->currentRed;
+        this->prevGreen = this->currentGreen;
+        this->prevBlue = this->currentBlue;
+      }
     }
 
+    if constexpr (Caps::TEMPERATURE)
+    {
+      if (actualState.temp >= 0)
+      {
+        // Convert Kelvin to mireds
+        this->currentTemperature = kelvinToMireds(actualState.temp);
+        this->prevTemperature = this->currentTemperature;
+      }
+    }
+  }
+
+  void applyHueColor(uint8_t red, uint8_t green, uint8_t blue, uint16_t temperature,
+                     esp_zb_zcl_color_control_color_mode_t color_mode) override
+  {
+    if constexpr (Caps::COLOR || Caps::TEMPERATURE)
+    {
+      // Detect what changed to send only relevant parameters
+      bool rgbChanged = false;
+      bool tempChanged = false;
+      if constexpr (Caps::COLOR)
+      {
+        rgbChanged = (red != this->prevRed || green != this->prevGreen || blue != this->prevBlue);
+        this->prevRed = red;
+        this->prevGreen = green;
+        this->prevBlue = blue;
+      }
+      if constexpr (Caps::TEMPERATURE)
+      {
+        tempChanged = (temperature != this->prevTemperature);
+        this->prevTemperature = temperature;
+      }
+      if (color_mode == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_HUE_SATURATION || color_mode == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_CURRENT_X_Y)
+      {
+        rgbChanged = true;
+        tempChanged = false;
+      }
+      else if (color_mode == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE)
+      {
+        rgbChanged = false;
+        tempChanged = true;
+      }
+
+      // Smart parameter selection: prioritize the parameter group that changed
+      if constexpr (Caps::COLOR)
+      {
+        if (rgbChanged)
+        {
+          // RGB changed - use RGB mode, reset temperature
+          this->currentRed = red;
+          this->currentGreen = green;
+          this->currentBlue = blue;
+          if constexpr (Caps::TEMPERATURE)
+          {
+            this->currentTemperature = -1; // Reset temperature to avoid conflicts
+          }
+          return;
+        }
+      }
+      if constexpr (Caps::TEMPERATURE)
+      {
+        if (tempChanged)
+        {
+          // Temperature changed - use temperature mode, reset RGB
+          this->currentTemperature = temperature;
+          if constexpr (Caps::COLOR)
+          {
+            this->currentRed = -1; // Reset RGB to avoid conflicts
+            this->currentGreen = -1;
+            this->currentBlue = -1;
+          }
+        }
+      }
+    }
+  }
+
+  WizBulbState buildCommand() override
+  {
+    return buildState(currentState, currentLevel, red(), green(), blue(), temperature());
+  }
+
+  void captureTransitionOrigin(bool retarget) override
+  {
+    if constexpr (Caps::COLOR)
+    {
+      if (!retarget)
+      {
+        this->transitionFromRed = this->currentRed;
+        this->transitionFromGreen = this->currentGreen;
+        this->transitionFromBlue = this->currentBlue;
+      }
+      else
+      {
+        // Retarget from wherever the running transition has got to
+        this->transitionFromRed = this->transitionOutRed;
+        this->transitionFromGreen = this->transitionOutGreen;
+        this->transitionFromBlue = this->transitionOutBlue;
+      }
+    }
+    if constexpr (Caps::TEMPERATURE)
+    {
+      this->transitionFromTemperature = retarget ? this->transitionOutTemperature : this->currentTemperature;
+    }
+  }
+
+  WizBulbState buildTransitionFrame(uint8_t level, unsigned long elapsed, unsigned long duration) override
+  {
+    int16_t r = -1, g = -1, b = -1, t = -1;
+    if constexpr (Caps::COLOR)
+    {
+      r = this->transitionOutRed = interpolate(this->transitionFromRed, this->currentRed, elapsed, duration);
+      g = this->transitionOutGreen = interpolate(this->transitionFromGreen, this->currentGreen, elapsed, duration);
+      b = this->transitionOutBlue = interpolate(this->transitionFromBlue, this->currentBlue, elapsed, duration);
+    }
+    if constexpr (Caps::TEMPERATURE)
+    {
+      t = this->transitionOutTemperature =
+          interpolate(this->transitionFromTemperature, this->currentTemperature, elapsed, duration);
+    }
+    return buildState(true, level, r, g, b, t);
+  }
+
+  void applyWizState(const WizBulbState &wizState) override
+  {
+    // Update internal state from Wiz
+    currentState = wizState.state;
     zigbeeLight->setLightState(currentState);
-    if (wizBulb.features.brightness)
+
+    if constexpr (Caps::LEVEL)
     {
+      if (wizState.dimming >= 0)
+        currentLevel = percentToLevel(wizState.dimming);
       zigbeeLight->setLightLevel(currentLevel);
     }
-    if (wizBulb.features.color && currentRed >= 0 && currentGreen >= 0 && currentBlue >= 0)
+
+    bool colorApplied = false;
+    if constexpr (Caps::COLOR)
     {
-      if (zigbeeLight->getColorMode() == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE)
+      if (wizState.r >= 0 && wizState.g >= 0 && wizState.b >= 0)
+      {
+        // Same result as the library's RGB -> XY -> RGB round trip at full level, without floats
+        uint8_t r = wizState.r, g = wizState.g, b = wizState.b;
+        colorNormalizeRgb(r, g, b);
+        this->currentRed = r;
+        this->currentGreen = g;
+        this->currentBlue = b;
+
+        if (zigbeeLight->getColorMode() == ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE)
+        {
+          zigbeeLight->setColorMode(ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_CURRENT_X_Y);
+        }
+        zigbeeLight->setLightColor(this->currentRed, this->currentGreen, this->currentBlue);
+        colorApplied = true;
+      }
+      else
       {
-        zigbeeLight->setColorMode(ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_CURRENT_X_Y);
+        this->currentRed = -1;
+        this->currentGreen = -1;
+        this->currentBlue = -1;
       }
-      zigbeeLight->setLightColor(currentRed, currentGreen, currentBlue);
     }
-    else if (wizBulb.features.color_tmp && currentTemperature > 0)
+
+    if constexpr (Caps::TEMPERATURE)
     {
-      if (zigbeeLight->getColorMode() != ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE)
+      if (wizState.temp >= 0)
+        this->currentTemperature = kelvinToMireds(wizState.temp);
+      else
+        this->currentTemperature = -1; // Kelvin to mireds
+
+      if (!colorApplied && this->currentTemperature > 0)
       {
-        zigbeeLight->setColorMode(ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE);
+        if (zigbeeLight->getColorMode() != ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE)
+        {
+          zigbeeLight->setColorMode(ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE);
+        }
+        zigbeeLight->setLightTemperature(this->currentTemperature);
       }
-      zigbeeLight->setLightTemperature(currentTemperature);
     }
     zigbeeLight->zbUpdateStateFromAttributes();
+  }
 
-    Serial.printf("WizLeader: Updated Zigbee EP:%d from Wiz state\n", endpoint);
+  LightClassStats &classStats() override
+  {
+    static LightClassStats stats(Caps::NAME, sizeof(ZigbeeWizLightImpl<Caps>));
+    return stats;
   }
+};
 
-private:
-  String getHueModelName(const WizBulbInfo &bulb)
+// Pick the adapter specialization matching the Zigbee device type the bulb is exposed as
+static ZigbeeWizLight *createZigbeeWizLight(uint8_t endpoint, const WizBulbInfo &bulb, es_zb_hue_light_type_t zigbeeType)
+{
+  switch (zigbeeType)
   {
-    switch (bulb.bulbClass)
+  case ESP_ZB_HUE_LIGHT_TYPE_EXTENDED_COLOR:
+    return new ZigbeeWizLightImpl<ColorLightCaps>(endpoint, bulb, zigbeeType);
+  case ESP_ZB_HUE_LIGHT_TYPE_TEMPERATURE:
+    return new ZigbeeWizLightImpl<TemperatureLightCaps>(endpoint, bulb, zigbeeType);
+  case ESP_ZB_HUE_LIGHT_TYPE_DIMMABLE:
+    return new ZigbeeWizLightImpl<DimmableLightCaps>(endpoint, bulb, zigbeeType);
+  default:
+    return new ZigbeeWizLightImpl<OnOffLightCaps>(endpoint, bulb, zigbeeType);
+  }
+}
+
+// Dynamic light management; lookups by endpoint go through the bulb registry
+static std::vector<ZigbeeWizLight *> zigbeeWizLights;
+
+// Runtime hot-add: Zigbee endpoints can only be registered before the stack starts, so
+// setup_lights can also register WIZ2HUE_SPARE_ENDPOINTS spare endpoints with every capability.
+// A bulb first seen at runtime adopts one and keeps that endpoint from then on. Bulbs that stay
+// unreachable for WIZ2HUE_BULB_RETIRE_AFTER are retired and their endpoint becomes a spare.
+//
+// The coordinator sees a spare as an ordinary color light, so every spare shows up in the Hue
+// app as a light that does nothing until a bulb adopts it. Spares are therefore off by default:
+// a new bulb then gets its endpoint at the next restart.
+#ifndef WIZ2HUE_SPARE_ENDPOINTS
+#define WIZ2HUE_SPARE_ENDPOINTS 0
+#endif
+#ifndef WIZ2HUE_BULB_RETIRE_AFTER
+#define WIZ2HUE_BULB_RETIRE_AFTER 604800000UL // 7 days without a reply
+#endif
+const int SPARE_ENDPOINTS = WIZ2HUE_SPARE_ENDPOINTS;
+const unsigned long BULB_RETIRE_AFTER = WIZ2HUE_BULB_RETIRE_AFTER;
+
+struct HotplugStats
+{
+  uint32_t added = 0;
+  uint32_t deferred = 0; // No spare endpoint: exposed after the next restart
+  uint32_t retired = 0;
+  unsigned long lastAddMs = 0; // Discovery saw the bulb -> controllable from Hue
+  unsigned long maxAddMs = 0;
+};
+
+static HotplugStats hotplugStats;
+
+// Bulbs registered without a light for lack of a spare endpoint; only discovery sees them, so
+// they age by the last pass that found them. Hot-add and retire both run on the discovery task.
+struct DeferredBulb
+{
+  uint8_t mac[6];
+  unsigned long lastSeenAt;
+};
+
+static std::vector<DeferredBulb> deferredBulbs;
+
+static DeferredBulb *findDeferred(const uint8_t *mac)
+{
+  for (auto &deferred : deferredBulbs)
+  {
+    if (memcmp(deferred.mac, mac, sizeof(deferred.mac)) == 0)
     {
-    case BulbClass::RGB:
-      return "WizHue(LCA001)"; // Extended color light (RGB + tunable white)
-    case BulbClass::TW:
-      return "WizHue(LWO003)"; // Color temperature light
-    case BulbClass::DW:
-      return bulb.features.brightness ? "WizHue(LTA005)" : "WizHue(OnOff)";
-    case BulbClass::SOCKET:
-      return "WizHue(Socket)";
-    case BulbClass::FAN:
-      return "WizHue(Fan)";
-    default:
-      return "WizHue(Unknown)";
+      return &deferred;
     }
   }
+  return nullptr;
+}
+
+// Everything kept per bulb outside the light object: the registry record, the endpoint
+// assignment, the latency slot, the circuit breaker and the persisted state
+static void releaseBulb(const uint8_t *mac)
+{
+  bulbRegistryRemove(mac); // Unbinds the endpoint, Hue commands stop reaching the light
+  releaseEndpoint(mac);
+  releaseWizLatency(mac);
+  bulbHealthRelease(mac);
+  releaseBulbState(mac);
+  requestLightsSave();
+}
+
+// Placeholder bulb of a spare endpoint: vacant, exposed as a full color light
+static WizBulbInfo spareEndpointBulb()
+{
+  WizBulbInfo bulb;
+  bulb.bulbClass = BulbClass::RGB;
+  bulb.features.brightness = true;
+  bulb.features.color = true;
+  bulb.features.color_tmp = true;
+  return bulb;
+}
+
+// Group fan-out dispatcher: Hue group commands reach every endpoint within a few ms;
+// sending them as one burst keeps the bulbs of a room visually in step
+const unsigned long FANOUT_WINDOW = 40;      // Collect commands arriving within this window
+const size_t FANOUT_MIN_ENDPOINTS = 2;       // Fewer pending commands are left to the light tasks
+const unsigned long FANOUT_ACK_TIMEOUT = 500;
+
+struct FanoutStats
+{
+  uint32_t dispatches = 0;
+  uint32_t commands = 0;
+  uint32_t acked = 0;
+  unsigned long lastSendSkew = 0;
+  unsigned long maxSendSkew = 0;
+  unsigned long lastAckSkew = 0;
+  unsigned long maxAckSkew = 0;
 };
 
-// Dynamic light management
-static std::vector<ZigbeeWizLight *> zigbeeWizLights;
+static TaskHandle_t fanoutTask = nullptr;
+static portMUX_TYPE fanoutMux = portMUX_INITIALIZER_UNLOCKED; // Guards the burst tracking and fanoutStats
+static FanoutStats fanoutStats;
+static uint8_t lastCommandEndpoint = 0;
+static unsigned long lastCommandAt = 0;
+static bool burstSeen = false;
+static unsigned long lastBurstAt = 0; // Last command that followed one to another endpoint within FANOUT_WINDOW
+
+// Called from the Zigbee task for every Hue command. A command on its own is sent by its light
+// task straight away; only once a second endpoint is commanded within the window do the light
+// tasks hold back and the dispatcher collect the group. The Zigbee task delivers a group command
+// to all its endpoints before the light tasks get to run, so they see the burst in time.
+static void notifyFanoutDispatcher(uint8_t endpoint, unsigned long now)
+{
+  bool burst = false;
+  portENTER_CRITICAL(&fanoutMux);
+  if (lastCommandEndpoint != 0 && endpoint != lastCommandEndpoint && now - lastCommandAt < FANOUT_WINDOW)
+  {
+    burst = true;
+    burstSeen = true;
+    lastBurstAt = now;
+  }
+  lastCommandEndpoint = endpoint;
+  lastCommandAt = now;
+  portEXIT_CRITICAL(&fanoutMux);
+
+  if (burst && fanoutTask != nullptr)
+  {
+    xTaskNotifyGive(fanoutTask);
+  }
+}
+
+// True when a command arriving at or after `since` made a group with another endpoint
+static bool fanoutBurstSince(unsigned long since)
+{
+  portENTER_CRITICAL(&fanoutMux);
+  bool burst = burstSeen && (long)(lastBurstAt - since) >= 0;
+  portEXIT_CRITICAL(&fanoutMux);
+  return burst;
+}
 
-const uint8_t FIRST_ENDPOINT = 10;
+// Sends the pending commands as group dispatches of up to WIZ_GROUP_MAX_COMMANDS bulbs; a larger
+// group goes out in consecutive dispatches. Returns the commands dispatched.
+static size_t dispatchPendingCommands()
+{
+  // Only the fan-out task dispatches, so the commands are kept in static storage
+  static WizGroupCommand commands[WIZ_GROUP_MAX_COMMANDS];
+  static ZigbeeWizLight *owners[WIZ_GROUP_MAX_COMMANDS];
+
+  size_t dispatched = 0;
+  size_t next = 0;
+  while (next < zigbeeWizLights.size())
+  {
+    size_t count = 0;
+    for (; next < zigbeeWizLights.size() && count < WIZ_GROUP_MAX_COMMANDS; next++)
+    {
+      commands[count] = WizGroupCommand();
+      if (zigbeeWizLights[next]->claimPendingCommand(commands[count]))
+      {
+        owners[count++] = zigbeeWizLights[next];
+      }
+    }
+    if (count == 0)
+    {
+      continue;
+    }
+
+    GroupDispatchResult result = setBulbStatesGroup(commands, count, FANOUT_ACK_TIMEOUT);
+    for (size_t i = 0; i < count; i++)
+    {
+      owners[i]->completeGroupCommand(commands[i]);
+    }
+    dispatched += count;
+
+    portENTER_CRITICAL(&fanoutMux);
+    fanoutStats.dispatches++;
+    fanoutStats.commands += count;
+    fanoutStats.acked += result.acked;
+    fanoutStats.lastSendSkew = result.sendSkew;
+    fanoutStats.lastAckSkew = result.ackSkew;
+    fanoutStats.maxSendSkew = max(fanoutStats.maxSendSkew, result.sendSkew);
+    fanoutStats.maxAckSkew = max(fanoutStats.maxAckSkew, result.ackSkew);
+    portEXIT_CRITICAL(&fanoutMux);
+
+    Serial.printf("Fan-out: %u bulbs, %d sent, %d acked, send skew %lu us, ack skew %lu us\n",
+                  (unsigned)count, result.sent, result.acked, result.sendSkew, result.ackSkew);
+  }
+  return dispatched;
+}
+
+static void fanoutTaskFunction(void *parameter)
+{
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // Let the rest of the group arrive, then drop notifications that came in meanwhile
+    vTaskDelay(pdMS_TO_TICKS(FANOUT_WINDOW));
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    size_t pendingCount = 0;
+    for (auto *light : zigbeeWizLights)
+    {
+      if (light->hasPendingCommand())
+      {
+        pendingCount++;
+      }
+    }
+    if (pendingCount >= FANOUT_MIN_ENDPOINTS)
+    {
+      dispatchPendingCommands();
+    }
+  }
+}
 
 void hue_connect(int pin_to_blink, int button, const std::vector<WizBulbInfo> &bulbs)
 {
@@ -543,6 +1662,11 @@ void hue_connect(int pin_to_blink, int button, const std::vector<WizBulbInfo> &b
     ESP.restart();
   }
 
+  // Per-command transition times for the transition engine
+  esp_zb_lock_acquire(portMAX_DELAY);
+  esp_zb_raw_command_handler_register(zclCommandPeek);
+  esp_zb_lock_release();
+
   digitalWrite(GREEN_PIN, HIGH);
   Serial.println("Connecting Zigbee to network");
 
@@ -572,7 +1696,7 @@ void hue_connect(int pin_to_blink, int button, const std::vector<WizBulbInfo> &b
         {
           // Random brightness 10-100%
           newState.dimming = random(10, 101);
-          Serial.printf("Setting bulb %s brightness to %d%%", bulbs[i].ip.c_str(), newState.dimming);
+          Serial.printf("Setting bulb %s brightness to %d%%", IpStr(bulbs[i].ip).c_str(), newState.dimming);
         }
         else
         {
@@ -580,7 +1704,7 @@ void hue_connect(int pin_to_blink, int button, const std::vector<WizBulbInfo> &b
           static bool toggleState = true;
           newState.state = toggleState;
           toggleState = !toggleState;
-          Serial.printf("Toggling bulb %s %s", bulbs[i].ip.c_str(), newState.state ? "ON" : "OFF");
+          Serial.printf("Toggling bulb %s %s", IpStr(bulbs[i].ip).c_str(), newState.state ? "ON" : "OFF");
         }
 
         // Set random color if supported
@@ -617,7 +1741,7 @@ std::vector<WizBulbInfo> sortBulbsByMac(const std::vector<WizBulbInfo> &bulbs)
 {
   std::vector<WizBulbInfo> sorted = bulbs;
   std::sort(sorted.begin(), sorted.end(), [](const WizBulbInfo &a, const WizBulbInfo &b)
-            { return a.mac < b.mac; });
+            { return memcmp(a.mac, b.mac, sizeof(a.mac)) < 0; });
   return sorted;
 }
 
@@ -640,18 +1764,95 @@ es_zb_hue_light_type_t mapBulbToZigbeeType(const WizBulbInfo &bulb)
   }
 }
 
+// Vacant endpoints are unbound in the registry; the light list itself only changes in setup_lights
+static bool isSpareEndpoint(uint8_t endpoint)
+{
+  for (auto *light : zigbeeWizLights)
+  {
+    if (light->getEndpoint() == endpoint)
+    {
+      return light->isVacant();
+    }
+  }
+  return false;
+}
+
 // Static callback implementations
 static void staticLightChangeCallback(bool state, uint8_t endpoint, uint8_t red, uint8_t green, uint8_t blue, uint8_t level, uint16_t temperature, esp_zb_zcl_color_control_color_mode_t color_mode)
 {
-  auto it = endpointToLight.find(endpoint);
-  if (it != endpointToLight.end())
+  ZigbeeWizLight *light = bulbRegistryLightForEndpoint(endpoint);
+  if (light != nullptr)
   {
-    it->second->onLightChangeCallback(state, endpoint, red, green, blue, level, temperature, color_mode);
+    light->onLightChangeCallback(state, endpoint, red, green, blue, level, temperature, color_mode);
   }
-  else
+  else if (!isSpareEndpoint(endpoint))
   {
     Serial.printf("ERROR: No ZigbeeWizLight found for endpoint %d\n", endpoint);
   }
+  // Commands to a spare endpoint have no bulb to go to and are dropped
+}
+
+// ZCL light commands that carry a transition time, and its offset in the command payload
+struct ZclTransitionField
+{
+  uint16_t cluster;
+  uint8_t command;
+  uint8_t offset;
+};
+
+const uint16_t ZCL_CLUSTER_ON_OFF = 0x0006;
+const uint16_t ZCL_CLUSTER_LEVEL_CONTROL = 0x0008;
+const uint16_t ZCL_CLUSTER_COLOR_CONTROL = 0x0300;
+
+static const ZclTransitionField ZCL_TRANSITION_FIELDS[] = {
+    {ZCL_CLUSTER_LEVEL_CONTROL, 0x00, 1}, // Move to Level: level, time
+    {ZCL_CLUSTER_LEVEL_CONTROL, 0x02, 2}, // Step: mode, size, time
+    {ZCL_CLUSTER_LEVEL_CONTROL, 0x04, 1}, // Move to Level with On/Off
+    {ZCL_CLUSTER_LEVEL_CONTROL, 0x06, 2}, // Step with On/Off
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x00, 2}, // Move to Hue: hue, direction, time
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x03, 1}, // Move to Saturation: saturation, time
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x06, 2}, // Move to Hue and Saturation: hue, saturation, time
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x07, 4}, // Move to Color: x, y, time
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x0A, 2}, // Move to Color Temperature: mireds, time
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x40, 3}, // Enhanced Move to Hue: hue, direction, time
+    {ZCL_CLUSTER_COLOR_CONTROL, 0x43, 3}, // Enhanced Move to Hue and Saturation: hue, saturation, time
+};
+
+// Raw ZCL hook, run by the stack before it handles a command: the light change callback only sees
+// the resulting attributes, so the per-command transition time is taken from the payload here.
+// Every light command sets it, so a command without one never inherits an older command's.
+static bool zclCommandPeek(uint8_t bufid)
+{
+  zb_zcl_parsed_hdr_t *header = ZB_BUF_GET_PARAM(bufid, zb_zcl_parsed_hdr_t);
+  if (header->is_common_command ||
+      (header->cluster_id != ZCL_CLUSTER_ON_OFF && header->cluster_id != ZCL_CLUSTER_LEVEL_CONTROL &&
+       header->cluster_id != ZCL_CLUSTER_COLOR_CONTROL))
+  {
+    return false;
+  }
+
+  ZigbeeWizLight *light = bulbRegistryLightForEndpoint(header->addr_data.common_data.dst_endpoint);
+  if (light == nullptr)
+  {
+    return false;
+  }
+
+  uint16_t tenths = NO_COMMAND_TRANSITION;
+  for (const ZclTransitionField &field : ZCL_TRANSITION_FIELDS)
+  {
+    if (field.cluster == header->cluster_id && field.command == header->cmd_id)
+    {
+      // The buffer holds the command payload; the stack has already cut the ZCL header
+      const uint8_t *payload = (const uint8_t *)zb_buf_begin(bufid);
+      if (zb_buf_len(bufid) >= (zb_uint_t)field.offset + 2)
+      {
+        tenths = payload[field.offset] | (payload[field.offset + 1] << 8);
+      }
+      break;
+    }
+  }
+  light->noteCommandTransitionTime(tenths);
+  return false; // Let the stack process the command as usual
 }
 
 static void staticIdentifyCallback(uint16_t time)
@@ -664,19 +1865,296 @@ void hue_reset()
   Zigbee.factoryReset();
 }
 
-bool checkZigbeeConnection()
+void logLightStats()
 {
-  if (!Zigbee.connected())
+  int spares = 0;
+  for (auto *light : zigbeeWizLights)
   {
-    Serial.println("Zigbee connection lost - restart required");
-    return false;
+    if (light->isVacant())
+    {
+      spares++;
+      continue;
+    }
+    light->logStats();
+  }
+  Serial.printf("Hot-plug: %lu bulbs added at runtime (%lu waiting for a restart), %lu retired, %d spare endpoints free, discovery to controllable last %lu / max %lu ms\n",
+                (unsigned long)hotplugStats.added, (unsigned long)hotplugStats.deferred, (unsigned long)hotplugStats.retired,
+                spares, hotplugStats.lastAddMs, hotplugStats.maxAddMs);
+
+  // Per adapter specialization: instance footprint and average hot path cost
+  std::vector<LightClassStats *> classes;
+  for (auto *light : zigbeeWizLights)
+  {
+    LightClassStats *stats = &light->getClassStats();
+    if (std::find(classes.begin(), classes.end(), stats) == classes.end())
+    {
+      classes.push_back(stats);
+    }
+  }
+  for (auto *stats : classes)
+  {
+    Serial.printf("Light class %s: %lu lights, %u bytes each, Hue command %lu cycles, WiZ apply %lu cycles, command build %lu cycles (avg)\n",
+                  stats->name, (unsigned long)stats->instances, stats->instanceSize,
+                  stats->hueCommands > 0 ? (unsigned long)(stats->hueCommandCycles / stats->hueCommands) : 0,
+                  stats->wizApplies > 0 ? (unsigned long)(stats->wizApplyCycles / stats->wizApplies) : 0,
+                  stats->commandBuilds > 0 ? (unsigned long)(stats->commandBuildCycles / stats->commandBuilds) : 0);
+  }
+
+  portENTER_CRITICAL(&fanoutMux);
+  FanoutStats fanout = fanoutStats;
+  portEXIT_CRITICAL(&fanoutMux);
+  if (fanout.dispatches > 0)
+  {
+    Serial.printf("Fan-out: %lu dispatches, %lu/%lu commands acked, send skew last %lu / max %lu us, ack skew last %lu / max %lu us\n",
+                  (unsigned long)fanout.dispatches, (unsigned long)fanout.acked, (unsigned long)fanout.commands,
+                  fanout.lastSendSkew, fanout.maxSendSkew, fanout.lastAckSkew, fanout.maxAckSkew);
+  }
+}
+
+int refreshLightAddresses()
+{
+  int patched = 0;
+  for (auto *light : zigbeeWizLights)
+  {
+    WizBulbInfo info;
+    if (bulbRegistryGet(bulbRegistryFindByEndpoint(light->getEndpoint()), info) && info.ip != light->getWizBulb().ip)
+    {
+      Serial.printf("EP:%d now at %s\n", light->getEndpoint(), IpStr(info.ip).c_str());
+      light->updateAddress(info.ip);
+      patched++;
+    }
   }
-  return true;
+  return patched;
+}
+
+// Pick a spare for the bulb: same device type first, then a full color endpoint, then any
+static ZigbeeWizLight *findSpareEndpoint(es_zb_hue_light_type_t wanted)
+{
+  ZigbeeWizLight *best = nullptr;
+  for (auto *light : zigbeeWizLights)
+  {
+    if (!light->isVacant())
+    {
+      continue;
+    }
+    if (light->getEndpointType() == wanted)
+    {
+      return light;
+    }
+    if (best == nullptr || light->getEndpointType() == ESP_ZB_HUE_LIGHT_TYPE_EXTENDED_COLOR)
+    {
+      best = light;
+    }
+  }
+  return best;
+}
+
+int hotAddLights(const std::vector<WizBulbInfo> &discoveredBulbs, unsigned long seenAt)
+{
+  int added = 0;
+  for (const WizBulbInfo &bulb : discoveredBulbs)
+  {
+    if (!bulb.isValid || !macIsSet(bulb.mac))
+    {
+      continue;
+    }
+    if (bulbRegistryFindByMac(bulb.mac) >= 0)
+    {
+      DeferredBulb *deferred = findDeferred(bulb.mac);
+      if (deferred != nullptr)
+      {
+        deferred->lastSeenAt = seenAt;
+      }
+      continue;
+    }
+
+    es_zb_hue_light_type_t zigbeeType = mapBulbToZigbeeType(bulb);
+    ZigbeeWizLight *spare = findSpareEndpoint(zigbeeType);
+    if (spare == nullptr)
+    {
+      // Keep it for the next boot, at the endpoint it will keep from then on
+      uint8_t endpoint = assignEndpoint(bulb.mac, zigbeeType);
+      bulbRegistryAdd(bulb);
+      requestLightsSave();
+      DeferredBulb deferred;
+      memcpy(deferred.mac, bulb.mac, sizeof(deferred.mac));
+      deferred.lastSeenAt = seenAt;
+      deferredBulbs.push_back(deferred);
+      hotplugStats.deferred++;
+      Serial.printf("Hot-add: no spare endpoint for bulb %s (%s), exposed on EP:%d after the next restart\n",
+                    MacStr(bulb.mac).c_str(), IpStr(bulb.ip).c_str(), endpoint);
+      continue;
+    }
+
+    uint8_t endpoint = assignEndpoint(bulb.mac, spare->getEndpointType(), spare->getEndpoint());
+    if (endpoint != spare->getEndpoint())
+    {
+      Serial.printf("Hot-add: bulb %s already owns EP:%d, left for the next restart\n", MacStr(bulb.mac).c_str(), endpoint);
+      continue;
+    }
+
+    // Registry first: the stored state is kept per registry record; bind last so Hue commands
+    // only reach the endpoint once the light is running
+    int handle = bulbRegistryAdd(bulb);
+    spare->adopt(bulb);
+    bulbRegistryBindLight(handle, endpoint, spare);
+    requestLightsSave();
+
+    unsigned long addMs = millis() - seenAt;
+    hotplugStats.added++;
+    hotplugStats.lastAddMs = addMs;
+    hotplugStats.maxAddMs = max(hotplugStats.maxAddMs, addMs);
+    added++;
+    Serial.printf("Hot-add: bulb %s (%s) on EP:%d, controllable %lu ms after discovery saw it\n",
+                  MacStr(bulb.mac).c_str(), IpStr(bulb.ip).c_str(), endpoint, addMs);
+  }
+  return added;
+}
+
+int retireAbsentLights()
+{
+  if (isBulbIoPaused())
+  {
+    return 0; // Network outage, not absent bulbs
+  }
+
+  int retired = 0;
+  unsigned long now = millis();
+  for (auto *light : zigbeeWizLights)
+  {
+    if (light->isVacant() || now - light->getLastSeen() < BULB_RETIRE_AFTER)
+    {
+      continue;
+    }
+
+    WizBulbInfo bulb = light->getWizBulb();
+    releaseBulb(bulb.mac);
+    light->vacate();
+    hotplugStats.retired++;
+    retired++;
+    Serial.printf("Retire: bulb %s absent for %lu h, EP:%d is a spare now\n",
+                  MacStr(bulb.mac).c_str(), (now - light->getLastSeen()) / 3600000, light->getEndpoint());
+  }
+
+  for (auto it = deferredBulbs.begin(); it != deferredBulbs.end();)
+  {
+    if (now - it->lastSeenAt < BULB_RETIRE_AFTER)
+    {
+      ++it;
+      continue;
+    }
+    releaseBulb(it->mac);
+    hotplugStats.retired++;
+    retired++;
+    Serial.printf("Retire: deferred bulb %s absent for %lu h, released before it got an endpoint\n",
+                  MacStr(it->mac).c_str(), (now - it->lastSeenAt) / 3600000);
+    it = deferredBulbs.erase(it);
+  }
+  return retired;
+}
+
+int replayDesiredStates()
+{
+  int replayed = 0;
+  for (auto *light : zigbeeWizLights)
+  {
+    if (light->requestReplay())
+    {
+      replayed++;
+    }
+  }
+  return replayed;
+}
+
+// Zigbee supervisor: a lost connection is recovered by network steering (rejoin) with backoff
+// instead of a restart, so WiFi, the bulb tasks and the registry stay up. The stack retries on
+// its own first; steering is only kicked after the first backoff interval.
+const unsigned long ZIGBEE_REJOIN_BACKOFF_MIN = 2000;
+const unsigned long ZIGBEE_REJOIN_BACKOFF_MAX = 120000;
+
+static bool zigbeeDown = false;
+static unsigned long zigbeeOutageStart = 0;
+static unsigned long lastRejoinAt = 0;
+static unsigned long rejoinBackoff = ZIGBEE_REJOIN_BACKOFF_MIN;
+static uint32_t outageRejoins = 0;
+static ZigbeeRecoveryStats zigbeeStats;
+
+void zigbeeSupervisorTick()
+{
+  unsigned long now = millis();
+  bool connected = Zigbee.connected();
+
+  if (!zigbeeDown)
+  {
+    if (connected)
+    {
+      return;
+    }
+    Serial.println("Zigbee connection lost - rejoining in place, WiFi and bulbs stay up");
+    zigbeeDown = true;
+    zigbeeOutageStart = now;
+    lastRejoinAt = now;
+    rejoinBackoff = ZIGBEE_REJOIN_BACKOFF_MIN;
+    outageRejoins = 0;
+    zigbeeStats.outages++;
+    return;
+  }
+
+  if (connected)
+  {
+    unsigned long outage = now - zigbeeOutageStart;
+    zigbeeDown = false;
+    for (auto *light : zigbeeWizLights)
+    {
+      light->requestZigbeeResync();
+    }
+    zigbeeStats.recoveries++;
+    zigbeeStats.lastRecoveryMs = outage;
+    zigbeeStats.maxRecoveryMs = max(zigbeeStats.maxRecoveryMs, outage);
+    zigbeeStats.totalRecoveryMs += outage;
+    Serial.printf("Zigbee rejoined after %lu ms (%lu steering attempts), re-reporting %d endpoints\n",
+                  outage, (unsigned long)outageRejoins, zigbeeWizLights.size());
+    return;
+  }
+
+  if (now - lastRejoinAt >= rejoinBackoff)
+  {
+    lastRejoinAt = now;
+    rejoinBackoff = min(rejoinBackoff * 2, ZIGBEE_REJOIN_BACKOFF_MAX);
+    outageRejoins++;
+    zigbeeStats.rejoinAttempts++;
+    esp_zb_lock_acquire(portMAX_DELAY);
+    esp_err_t err = esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_STEERING);
+    esp_zb_lock_release();
+    Serial.printf("Zigbee rejoin attempt %lu (%s), next in %lu ms\n", (unsigned long)outageRejoins,
+                  err == ESP_OK ? "steering started" : "stack busy", rejoinBackoff);
+  }
+}
+
+unsigned long zigbeeOutageDuration()
+{
+  return zigbeeDown ? millis() - zigbeeOutageStart : 0;
+}
+
+ZigbeeRecoveryStats getZigbeeRecoveryStats()
+{
+  return zigbeeStats;
+}
+
+void logZigbeeStats()
+{
+  Serial.printf("Zigbee: %lu outages, %lu rejoined in place (%lu steering attempts), recovery last %lu / avg %lu / max %lu ms, last warm restart %lu ms%s\n",
+                (unsigned long)zigbeeStats.outages, (unsigned long)zigbeeStats.recoveries,
+                (unsigned long)zigbeeStats.rejoinAttempts, zigbeeStats.lastRecoveryMs,
+                zigbeeStats.recoveries > 0 ? (unsigned long)(zigbeeStats.totalRecoveryMs / zigbeeStats.recoveries) : 0,
+                zigbeeStats.maxRecoveryMs, lastWarmRestartTime(), zigbeeDown ? ", outage in progress" : "");
 }
 
 void setup_lights(const std::vector<WizBulbInfo> &bulbs)
 {
   Serial.printf("\n=== Setting up Zigbee lights for %d WiZ bulbs ===\n", bulbs.size());
+  unsigned long setupStart = millis();
+  uint32_t restoredBefore = getBulbStateStoreStats().restored;
 
   // Initialize global filesystem mutex if not already created
   if (filesystemMutex == nullptr)
@@ -690,46 +2168,93 @@ void setup_lights(const std::vector<WizBulbInfo> &bulbs)
     Serial.println("Created global filesystem mutex");
   }
 
-  // Clear existing lights
+  // Clear existing lights; unbind first so Zigbee callbacks stop reaching them
+  bulbRegistryUnbindLights();
   for (auto *light : zigbeeWizLights)
   {
     delete light;
   }
   zigbeeWizLights.clear();
-  endpointToLight.clear();
 
-  // Sort bulbs by MAC address for consistent endpoint assignment
+  // Endpoints come from the stored assignments; new bulbs take the lowest free endpoint in MAC
+  // order, which numbers a first boot the same way as before assignments were stored
   std::vector<WizBulbInfo> sortedBulbs = sortBulbsByMac(bulbs);
 
   // Create ZigbeeWizLight for each discovered WiZ bulb
-  uint8_t endpoint = FIRST_ENDPOINT;
   for (const auto &bulb : sortedBulbs)
   {
     if (!bulb.isValid)
     {
-      Serial.printf("Skipping invalid bulb: %s\n", bulb.ip.c_str());
+      Serial.printf("Skipping invalid bulb: %s\n", IpStr(bulb.ip).c_str());
       continue;
     }
 
+    // Exposed as before, even if the bulb was adopted by a spare endpoint with more capabilities
+    uint8_t storedType;
     es_zb_hue_light_type_t zigbeeType = mapBulbToZigbeeType(bulb);
+    uint8_t endpoint = endpointFor(bulb.mac, &storedType);
+    if (endpoint != 0)
+    {
+      zigbeeType = (es_zb_hue_light_type_t)storedType;
+    }
+    else
+    {
+      endpoint = assignEndpoint(bulb.mac, zigbeeType);
+    }
+    if (endpoint == 0)
+    {
+      Serial.printf("No free Zigbee endpoint for bulb %s, skipping\n", MacStr(bulb.mac).c_str());
+      continue;
+    }
 
     Serial.printf("Creating ZigbeeWiz light - IP: %s, MAC: %s, Type: %d, Endpoint: %d\n",
-                  bulb.ip.c_str(), bulb.mac.c_str(), zigbeeType, endpoint);
+                  IpStr(bulb.ip).c_str(), MacStr(bulb.mac).c_str(), zigbeeType, endpoint);
+
+    // Register first: the stored state is kept per registry record
+    int handle = bulbRegistryAdd(bulb);
 
     // Create new ZigbeeWizLight
-    ZigbeeWizLight *zigbeeWizLight = new ZigbeeWizLight(endpoint, bulb, zigbeeType);
+    ZigbeeWizLight *zigbeeWizLight = createZigbeeWizLight(endpoint, bulb, zigbeeType);
 
     // Add to Zigbee stack
     Zigbee.addEndpoint(zigbeeWizLight->getZigbeeLight());
 
-    // Store references
+    // Store references; the registry maps the endpoint back to this light
     zigbeeWizLights.push_back(zigbeeWizLight);
-    endpointToLight[endpoint] = zigbeeWizLight;
+    bulbRegistryBindLight(handle, endpoint, zigbeeWizLight);
 
     Serial.printf("Successfully created ZigbeeWiz light (endpoint %d)\n", endpoint);
+  }
 
-    endpoint++; // Next endpoint for next bulb
+  // Spare endpoints for bulbs that show up at runtime; not assigned until a bulb adopts one
+  uint8_t spareEndpoint = 0;
+  for (int i = 0; i < SPARE_ENDPOINTS; i++)
+  {
+    spareEndpoint = nextFreeEndpoint(spareEndpoint + 1);
+    if (spareEndpoint == 0)
+    {
+      break;
+    }
+    ZigbeeWizLight *spare = createZigbeeWizLight(spareEndpoint, spareEndpointBulb(), ESP_ZB_HUE_LIGHT_TYPE_EXTENDED_COLOR);
+    Zigbee.addEndpoint(spare->getZigbeeLight());
+    zigbeeWizLights.push_back(spare);
+    Serial.printf("Spare endpoint %d ready for bulbs added at runtime\n", spareEndpoint);
+  }
+
+  // Group dispatcher runs above the per-light tasks so it claims group commands first
+  if (fanoutTask == nullptr && zigbeeWizLights.size() >= FANOUT_MIN_ENDPOINTS)
+  {
+    if (xTaskCreate(fanoutTaskFunction, "WizFanout", 8192, nullptr, 11, &fanoutTask) != pdPASS)
+    {
+      Serial.println("Failed to create group fan-out task");
+      fanoutTask = nullptr;
+    }
   }
 
+  Serial.printf("Bulb records: %u bytes per bulb, fixed layout without heap strings\n", sizeof(WizBulbInfo));
+  Serial.printf("Bulb registry: %u bulbs, %u bytes including MAC/IP/endpoint indexes\n", bulbRegistryCount(), bulbRegistryMemoryBytes());
+  Serial.printf("Boot: all %d endpoints registered %lu ms after power-on (setup_lights %lu ms, %lu from stored state)\n",
+                zigbeeWizLights.size(), millis(), millis() - setupStart,
+                (unsigned long)(getBulbStateStoreStats().restored - restoredBefore));
   Serial.printf("=== Setup complete: %d ZigbeeWiz lights created ===\n\n", zigbeeWizLights.size());
 }
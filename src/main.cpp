@@ -18,15 +18,78 @@ int ledBuiltinLeft = LED_BUILTIN_PERIOD;
 
 uint8_t button = BOOT_PIN;
 
-// Global storage for discovered bulbs
-std::vector<WizBulbInfo> globalDiscoveredBulbs;
-
 // Connection monitoring variables
 unsigned long lastConnectionCheck = 0;
 unsigned long lastWiFiCheck = 0;
-unsigned long lastZigbeeCheck = 0;
-const unsigned long WIFI_CHECK_INTERVAL = 30000;       // 30 seconds
-const unsigned long ZIGBEE_CHECK_INTERVAL = 60000;     // 60 seconds
+unsigned long lastStatsReport = 0;
+const unsigned long STATS_REPORT_INTERVAL = 300000;    // 5 minutes
+const unsigned long PAUSED_WIFI_CHECK_INTERVAL = 5000; // Recheck often while bulb I/O is paused
+const unsigned long STORAGE_SYNC_TIMEOUT = 5000;       // Pending writes before a restart
+
+#ifndef WIZ2HUE_WIFI_RESTART_AFTER
+#define WIZ2HUE_WIFI_RESTART_AFTER 900000 // WiFi outage that still ends in a restart: 15 minutes
+#endif
+const unsigned long WIFI_RESTART_AFTER = WIZ2HUE_WIFI_RESTART_AFTER;
+
+#ifndef WIZ2HUE_ZIGBEE_RESTART_AFTER
+#define WIZ2HUE_ZIGBEE_RESTART_AFTER 600000 // Zigbee outage that still ends in a restart: 10 minutes
+#endif
+const unsigned long ZIGBEE_RESTART_AFTER = WIZ2HUE_ZIGBEE_RESTART_AFTER;
+
+#ifdef WIZ2HUE_ALLOC_TRACK
+// Startup, discovery, light creation and the first polls of every bulb have settled by now
+const unsigned long ALLOC_STEADY_STATE_AFTER = 180000;
+#endif
+
+#ifdef WIZ2HUE_NET_SIM
+// Network simulation: drop all bulb traffic for one minute every five minutes
+const unsigned long NET_SIM_PERIOD = 300000;
+const unsigned long NET_SIM_OUTAGE = 60000;
+unsigned long lastNetSimOutage = 0;
+#endif
+
+// Staged boot: end of each phase in millis() since power-on, logged once Zigbee is up
+struct BootPhase
+{
+  const char *name;
+  unsigned long endedAt;
+};
+const int MAX_BOOT_PHASES = 8;
+BootPhase bootPhases[MAX_BOOT_PHASES];
+int bootPhaseCount = 0;
+
+void markBootPhase(const char *name)
+{
+  if (bootPhaseCount < MAX_BOOT_PHASES)
+  {
+    bootPhases[bootPhaseCount++] = {name, millis()};
+  }
+}
+
+void logBootPhases(const char *lightSource, bool discoverInBackground)
+{
+  Serial.printf("Boot phases (bulbs from %s):", lightSource);
+  unsigned long phaseStart = 0;
+  for (int i = 0; i < bootPhaseCount; i++)
+  {
+    Serial.printf(" %s %lu ms", bootPhases[i].name, bootPhases[i].endedAt - phaseStart);
+    phaseStart = bootPhases[i].endedAt;
+  }
+  Serial.printf(" | Zigbee ready %lu ms after power-on", phaseStart);
+  if (discoverInBackground)
+  {
+    unsigned long discoveryDone = backgroundDiscoveryFinishedAt();
+    if (discoveryDone == 0)
+    {
+      Serial.print(", discovery still running");
+    }
+    else
+    {
+      Serial.printf(", discovery finished at %lu ms", discoveryDone);
+    }
+  }
+  Serial.println();
+}
 
 void setup()
 {
@@ -47,58 +110,70 @@ void setup()
   digitalWrite(GREEN_PIN, LOW);
   digitalWrite(YELLOW_PIN, LOW);
 
+#ifdef WIZ2HUE_COLOR_BENCH
+  colorKernelSelfCheck();
+#endif
+  markBootPhase("init");
+  initBulbRegistry();
+  initEndpointMap();
+  initBulbStateStore();
+  initLightCache();
+  initWizClient();
+#ifdef WIZ2HUE_REGISTRY_BENCH
+  bulbRegistryBenchmark();
+#endif
   wifi_connect(RED_PIN, button);
+  markBootPhase("wifi");
 
   // Initialize filesystem
   if (!initFileSystem())
   {
     Serial.println("Failed to initialize filesystem - continuing without caching");
   }
+  startStorageWriter();
 
-  delay(1000);
-  bool lightsFromCache = false;
-  globalDiscoveredBulbs = discoverOrLoadLights(broadcastIP(), &lightsFromCache);
+#ifdef WIZ2HUE_CACHE_FAULT_TEST
+  lightCacheFaultTest();
+#endif
 
-  if (lightsFromCache)
-  {
-    Serial.printf("Light discovery completed. Loaded %d Wiz bulbs from cache with full capability information.\n", globalDiscoveredBulbs.size());
-  }
-  else
-  {
-    Serial.printf("Light discovery completed. Discovered %d Wiz bulbs via network scan with full capability information.\n", globalDiscoveredBulbs.size());
-  }
+  markBootPhase("filesystem");
 
-  // Read and print current state of each discovered bulb
-  if (globalDiscoveredBulbs.size() > 0)
+  // Lights come from the warm-restart snapshot, else the cache (discovery then runs in the
+  // background once the endpoints exist), else a blocking network scan on the very first boot
+  std::vector<WizBulbInfo> bootBulbs;
+  const char *lightSource = "warm-restart snapshot";
+  bool discoverInBackground = false;
+  if (!loadWarmSnapshot(bootBulbs))
   {
-    Serial.println("\n=== Reading current bulb states ===");
-    for (size_t i = 0; i < globalDiscoveredBulbs.size(); i++)
+    bootBulbs = loadLightsFromFile();
+    lightSource = "cache";
+    discoverInBackground = !bootBulbs.empty();
+    if (!discoverInBackground)
     {
-      Serial.printf("\nReading state of bulb %d/%d: %s\n", i + 1, globalDiscoveredBulbs.size(), globalDiscoveredBulbs[i].ip.c_str());
-
-      WizBulbState currentState = getBulbState(globalDiscoveredBulbs[i]);
-
-      if (currentState.isValid)
-      {
-        Serial.printf("Current state: %s\n", wizBulbStateToJson(currentState).c_str());
-      }
-      else
-      {
-        Serial.printf("Failed to read state: %s\n", currentState.errorMessage.c_str());
-      }
-
-      // Add small delay between state requests
-      if (i < globalDiscoveredBulbs.size() - 1)
-      {
-        delay(300);
-      }
+      delay(1000);
+      bootBulbs = discoverAndSaveLights(broadcastIP()); // The cache was just found empty
+      lightSource = "network scan";
     }
-    Serial.println("\n=== All bulb states collected ===");
   }
-
-  setup_lights(globalDiscoveredBulbs);
-  hue_connect(YELLOW_PIN, button, globalDiscoveredBulbs);
+  bulbRegistryLoad(bootBulbs);
+  std::vector<WizBulbInfo> discoveredBulbs = bulbRegistrySnapshot();
+  Serial.printf("Loaded %d Wiz bulbs from %s with full capability information.\n", discoveredBulbs.size(), lightSource);
+  markBootPhase("bulbs");
+#ifdef WIZ2HUE_CACHE_BENCH
+  lightCacheBenchmark();
+#endif
+
+  // Endpoints start from stored states; the light tasks read live states concurrently
+  setup_lights(discoveredBulbs);
+  markBootPhase("endpoints");
+  startBackgroundDiscovery(discoverInBackground);
+
+  hue_connect(YELLOW_PIN, button, discoveredBulbs);
   Serial.println();
+  markBootPhase("zigbee");
+  logBootPhases(lightSource, discoverInBackground);
+  recordBootTime(millis());
+  saveWarmSnapshot();
 
   delay(500);
 
@@ -149,8 +224,10 @@ void resetSystem()
 {
   Serial.println("=== System Reset ===");
 
-  // Clear LittleFS cache
-  clearFileSystemCache();
+  // Clear LittleFS cache; the restart below must not resume the old bulbs from RTC memory
+  requestStorageClear();
+  storageSync(STORAGE_SYNC_TIMEOUT);
+  discardWarmSnapshot();
 
   // Reset Zigbee network
   Serial.println("Resetting Zigbee network...");
@@ -165,38 +242,121 @@ void checkConnections()
 {
   unsigned long currentTime = millis();
 
-  // Check WiFi connection
-  if (currentTime - lastWiFiCheck >= WIFI_CHECK_INTERVAL)
+  // WiFi supervisor reconnects in the background while Zigbee keeps running; a restart is the
+  // last resort once an outage has lasted WIZ2HUE_WIFI_RESTART_AFTER
+  wifiSupervisorTick();
+  if (wifiOutageDuration() >= WIFI_RESTART_AFTER)
+  {
+    Serial.printf("WiFi down for %lu s - restarting system\n", wifiOutageDuration() / 1000);
+    storageSync(STORAGE_SYNC_TIMEOUT);
+    saveWarmSnapshot();
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    ESP.restart();
+  }
+
+  // Correlated bulb failures point at the network - recheck right away, else while paused
+  bool wifiCheckRequested = consumeWifiCheckRequest();
+  if (wifiCheckRequested || (isBulbIoPaused() && currentTime - lastWiFiCheck >= PAUSED_WIFI_CHECK_INTERVAL))
   {
-    if (!checkWiFiConnection())
+    if (wifiCheckRequested)
     {
-      Serial.println("WiFi monitoring detected connection loss - restarting system");
-      vTaskDelay(pdMS_TO_TICKS(1000));
-      ESP.restart();
+      Serial.printf("Network loss suspected from bulb failures - WiFi link %s\n", isWifiConnected() ? "up" : "down");
     }
     lastWiFiCheck = currentTime;
-  }
 
-  // Check Zigbee connection
-  if (currentTime - lastZigbeeCheck >= ZIGBEE_CHECK_INTERVAL)
-  {
-    if (!checkZigbeeConnection())
+    // Link down confirms the network loss; link up resumes once the pause has lasted long enough
+    // to matter, and if the link was never seen down the failures go back to the bulbs
+    bool networkUp = isWifiConnected();
+#ifdef WIZ2HUE_NET_SIM
+    networkUp = networkUp && !isSimulatedNetworkDown();
+#endif
+    if (!networkUp)
+    {
+      pauseBulbIo();
+    }
+    else if (bulbIoPausedFor() >= PAUSED_WIFI_CHECK_INTERVAL)
     {
-      Serial.println("Zigbee monitoring detected connection loss - restarting system");
-      vTaskDelay(pdMS_TO_TICKS(1000));
-      ESP.restart();
+      resumeBulbIo();
+      replayDesiredStates();
     }
-    lastZigbeeCheck = currentTime;
   }
+
+  // Zigbee supervisor rejoins in place; restart only when that keeps failing
+  zigbeeSupervisorTick();
+  if (zigbeeOutageDuration() >= ZIGBEE_RESTART_AFTER)
+  {
+    Serial.printf("Zigbee down for %lu s - restarting system\n", zigbeeOutageDuration() / 1000);
+    storageSync(STORAGE_SYNC_TIMEOUT);
+    saveWarmSnapshot();
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    ESP.restart();
+  }
+}
+
+// Periodic runtime statistics
+void reportStats()
+{
+  unsigned long currentTime = millis();
+  if (currentTime - lastStatsReport < STATS_REPORT_INTERVAL)
+  {
+    return;
+  }
+  lastStatsReport = currentTime;
+
+  Serial.println("=== Runtime statistics ===");
+  logPilotFastPathStats();
+  logBulbStateCacheStats();
+  logBulbHealth();
+  logWizLatencyStats();
+  logLightStats();
+  logJsonPoolStats();
+  logLightCacheStats();
+  logBulbStateStoreStats();
+  logStorageStats();
+  logWifiStats();
+  logZigbeeStats();
+#ifdef WIZ2HUE_ALLOC_TRACK
+  logAllocStats();
+#endif
 }
 
+#ifdef WIZ2HUE_NET_SIM
+void simulateNetworkOutages()
+{
+  unsigned long currentTime = millis();
+  if (!isSimulatedNetworkDown() && currentTime - lastNetSimOutage >= NET_SIM_PERIOD)
+  {
+    setSimulatedNetworkDown(true);
+    lastNetSimOutage = currentTime;
+  }
+  else if (isSimulatedNetworkDown() && currentTime - lastNetSimOutage >= NET_SIM_OUTAGE)
+  {
+    setSimulatedNetworkDown(false);
+  }
+}
+#endif
+
 void loop()
 {
   ledDigital(&ledBuiltinLeft, LED_BUILTIN_PERIOD, LED_BUILTIN, SLEEP);
   vTaskDelay(pdMS_TO_TICKS(SLEEP));
 
+#ifdef WIZ2HUE_NET_SIM
+  simulateNetworkOutages();
+#endif
+
   // Monitor connections and restart if needed
   checkConnections();
 
+#ifdef WIZ2HUE_ALLOC_TRACK
+  if (!isAllocSteadyState() && millis() >= ALLOC_STEADY_STATE_AFTER)
+  {
+    markAllocSteadyState();
+  }
+#endif
+
+  updateWarmSnapshot();
+  reportStats();
+
   checkForReset(button);
 }
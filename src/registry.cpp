@@ -0,0 +1,555 @@
+#include "wiz2hue.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#ifdef WIZ2HUE_REGISTRY_BENCH
+#include <map>
+#endif
+
+// Bulb registry: the one owner of WizBulbInfo records at runtime. Records are addressed by a
+// small integer handle and indexed three ways:
+//  - MAC and IP through open-addressing hash tables (linear probing, backward-shift removal)
+//  - Zigbee endpoint through a direct 256-entry table, read without locking from Zigbee callbacks
+// Adding a bulb, changing its IP or removing it touches only that bulb's index entries.
+const int REGISTRY_INDEX_SLOTS = 512; // Per hash index, power of two; keeps the load factor <= 0.5
+const int16_t REGISTRY_EMPTY = -1;
+
+struct BulbRecord
+{
+    WizBulbInfo info;
+    uint8_t endpoint; // 0 = not bound to a Zigbee endpoint
+    bool inUse;
+};
+
+static std::vector<BulbRecord> records; // Indexed by handle; removed records are reused
+static int16_t macIndex[REGISTRY_INDEX_SLOTS];
+static int16_t ipIndex[REGISTRY_INDEX_SLOTS];
+static ZigbeeWizLight *endpointLights[256];
+static int16_t endpointHandles[256];
+static int recordCount = 0;
+static bool registryInitialized = false;
+static SemaphoreHandle_t registryMutex = nullptr;
+
+static bool takeRegistryMutex()
+{
+    return registryMutex != nullptr && xSemaphoreTake(registryMutex, pdMS_TO_TICKS(100)) == pdTRUE;
+}
+
+static void initRegistry()
+{
+    for (int i = 0; i < REGISTRY_INDEX_SLOTS; i++)
+    {
+        macIndex[i] = REGISTRY_EMPTY;
+        ipIndex[i] = REGISTRY_EMPTY;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        endpointLights[i] = nullptr;
+        endpointHandles[i] = REGISTRY_EMPTY;
+    }
+    registryInitialized = true;
+}
+
+static uint32_t macSlot(const uint8_t *mac)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        key = (key << 8) | mac[i];
+    }
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40) & (REGISTRY_INDEX_SLOTS - 1);
+}
+
+static uint32_t ipSlot(uint32_t ip)
+{
+    return ((ip * 2654435761u) >> 16) & (REGISTRY_INDEX_SLOTS - 1);
+}
+
+static uint32_t homeSlot(const int16_t *index, int16_t handle)
+{
+    const WizBulbInfo &info = records[handle].info;
+    return index == macIndex ? macSlot(info.mac) : ipSlot(info.ip);
+}
+
+// Caller has checked the key is not indexed yet
+static void indexInsert(int16_t *index, int16_t handle)
+{
+    uint32_t slot = homeSlot(index, handle);
+    while (index[slot] != REGISTRY_EMPTY)
+    {
+        slot = (slot + 1) & (REGISTRY_INDEX_SLOTS - 1);
+    }
+    index[slot] = handle;
+}
+
+// Removes the handle and shifts later members of its probe run back so lookups never stop early
+static void indexErase(int16_t *index, int16_t handle)
+{
+    uint32_t slot = homeSlot(index, handle);
+    while (index[slot] != handle)
+    {
+        if (index[slot] == REGISTRY_EMPTY)
+        {
+            return; // Not indexed (IP taken over by another bulb)
+        }
+        slot = (slot + 1) & (REGISTRY_INDEX_SLOTS - 1);
+    }
+
+    uint32_t hole = slot;
+    index[hole] = REGISTRY_EMPTY;
+    uint32_t next = hole;
+    while (true)
+    {
+        next = (next + 1) & (REGISTRY_INDEX_SLOTS - 1);
+        if (index[next] == REGISTRY_EMPTY)
+        {
+            return;
+        }
+        uint32_t home = homeSlot(index, index[next]);
+        // Move the entry into the hole unless its home lies cyclically in (hole, next]
+        bool homeBetween = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+        if (!homeBetween)
+        {
+            index[hole] = index[next];
+            index[next] = REGISTRY_EMPTY;
+            hole = next;
+        }
+    }
+}
+
+static int16_t findMac(const uint8_t *mac)
+{
+    uint32_t slot = macSlot(mac);
+    while (macIndex[slot] != REGISTRY_EMPTY)
+    {
+        if (memcmp(records[macIndex[slot]].info.mac, mac, 6) == 0)
+        {
+            return macIndex[slot];
+        }
+        slot = (slot + 1) & (REGISTRY_INDEX_SLOTS - 1);
+    }
+    return REGISTRY_EMPTY;
+}
+
+static int16_t findIp(uint32_t ip)
+{
+    uint32_t slot = ipSlot(ip);
+    while (ipIndex[slot] != REGISTRY_EMPTY)
+    {
+        if (records[ipIndex[slot]].info.ip == ip)
+        {
+            return ipIndex[slot];
+        }
+        slot = (slot + 1) & (REGISTRY_INDEX_SLOTS - 1);
+    }
+    return REGISTRY_EMPTY;
+}
+
+// IPs are unique on the network; a bulb that shows up on another bulb's old address takes it over
+static void indexIp(int16_t handle)
+{
+    uint32_t ip = records[handle].info.ip;
+    if (ip == 0)
+    {
+        return;
+    }
+    int16_t previousOwner = findIp(ip);
+    if (previousOwner != REGISTRY_EMPTY)
+    {
+        indexErase(ipIndex, previousOwner);
+    }
+    indexInsert(ipIndex, handle);
+}
+
+static void unbindEndpoint(int16_t handle)
+{
+    uint8_t endpoint = records[handle].endpoint;
+    if (endpoint != 0 && endpointHandles[endpoint] == handle)
+    {
+        endpointLights[endpoint] = nullptr;
+        endpointHandles[endpoint] = REGISTRY_EMPTY;
+    }
+    records[handle].endpoint = 0;
+}
+
+// Caller holds registryMutex
+static int addLocked(const WizBulbInfo &info)
+{
+    if (!macIsSet(info.mac))
+    {
+        return REGISTRY_EMPTY;
+    }
+
+    int16_t handle = findMac(info.mac);
+    if (handle != REGISTRY_EMPTY)
+    {
+        // Known bulb: refresh the record, reindexing only if the address moved
+        if (records[handle].info.ip != info.ip)
+        {
+            indexErase(ipIndex, handle);
+            records[handle].info = info;
+            indexIp(handle);
+        }
+        else
+        {
+            records[handle].info = info;
+        }
+        return handle;
+    }
+
+    if (recordCount >= BULB_REGISTRY_CAPACITY)
+    {
+        Serial.printf("Bulb registry full (%d bulbs), ignoring %s\n", BULB_REGISTRY_CAPACITY, MacStr(info.mac).c_str());
+        return REGISTRY_EMPTY;
+    }
+
+    handle = REGISTRY_EMPTY;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        if (!records[i].inUse)
+        {
+            handle = i;
+            break;
+        }
+    }
+    if (handle == REGISTRY_EMPTY)
+    {
+        handle = records.size();
+        records.push_back(BulbRecord());
+    }
+
+    BulbRecord &record = records[handle];
+    record.info = info;
+    record.endpoint = 0;
+    record.inUse = true;
+    recordCount++;
+    indexInsert(macIndex, handle);
+    indexIp(handle);
+    return handle;
+}
+
+void initBulbRegistry()
+{
+    registryMutex = xSemaphoreCreateMutex();
+    if (registryMutex == nullptr)
+    {
+        Serial.println("Failed to create bulb registry mutex");
+        return;
+    }
+    initRegistry();
+}
+
+// Caller holds registryMutex
+static void clearLocked()
+{
+    records.clear();
+    recordCount = 0;
+    initRegistry();
+}
+
+int bulbRegistryAdd(const WizBulbInfo &info)
+{
+    if (!takeRegistryMutex())
+    {
+        return REGISTRY_EMPTY;
+    }
+    if (!registryInitialized)
+    {
+        initRegistry();
+    }
+    int handle = addLocked(info);
+    xSemaphoreGive(registryMutex);
+    return handle;
+}
+
+void bulbRegistryLoad(const std::vector<WizBulbInfo> &bulbs)
+{
+    if (!takeRegistryMutex())
+    {
+        return;
+    }
+    clearLocked();
+    records.reserve(bulbs.size());
+    for (const WizBulbInfo &bulb : bulbs)
+    {
+        addLocked(bulb);
+    }
+    xSemaphoreGive(registryMutex);
+}
+
+bool bulbRegistryUpdateIp(const uint8_t *mac, uint32_t ip)
+{
+    if (!takeRegistryMutex())
+    {
+        return false;
+    }
+    bool changed = false;
+    int16_t handle = registryInitialized ? findMac(mac) : REGISTRY_EMPTY;
+    if (handle != REGISTRY_EMPTY && records[handle].info.ip != ip)
+    {
+        indexErase(ipIndex, handle);
+        records[handle].info.ip = ip;
+        indexIp(handle);
+        changed = true;
+    }
+    xSemaphoreGive(registryMutex);
+    return changed;
+}
+
+bool bulbRegistryRemove(const uint8_t *mac)
+{
+    if (!takeRegistryMutex())
+    {
+        return false;
+    }
+    int16_t handle = registryInitialized ? findMac(mac) : REGISTRY_EMPTY;
+    if (handle != REGISTRY_EMPTY)
+    {
+        indexErase(macIndex, handle);
+        indexErase(ipIndex, handle);
+        unbindEndpoint(handle);
+        records[handle].inUse = false;
+        recordCount--;
+    }
+    xSemaphoreGive(registryMutex);
+    return handle != REGISTRY_EMPTY;
+}
+
+void bulbRegistryClear()
+{
+    if (takeRegistryMutex())
+    {
+        clearLocked();
+        xSemaphoreGive(registryMutex);
+    }
+}
+
+int bulbRegistryFindByMac(const uint8_t *mac)
+{
+    if (!takeRegistryMutex())
+    {
+        return REGISTRY_EMPTY;
+    }
+    int handle = registryInitialized ? findMac(mac) : REGISTRY_EMPTY;
+    xSemaphoreGive(registryMutex);
+    return handle;
+}
+
+int bulbRegistryFindByIp(uint32_t ip)
+{
+    if (!takeRegistryMutex())
+    {
+        return REGISTRY_EMPTY;
+    }
+    int handle = registryInitialized && ip != 0 ? findIp(ip) : REGISTRY_EMPTY;
+    xSemaphoreGive(registryMutex);
+    return handle;
+}
+
+int bulbRegistryFindByEndpoint(uint8_t endpoint)
+{
+    return registryInitialized ? endpointHandles[endpoint] : REGISTRY_EMPTY;
+}
+
+bool bulbRegistryMacForIp(uint32_t ip, uint8_t *mac)
+{
+    if (!takeRegistryMutex())
+    {
+        return false;
+    }
+    int16_t handle = registryInitialized && ip != 0 ? findIp(ip) : REGISTRY_EMPTY;
+    if (handle != REGISTRY_EMPTY)
+    {
+        memcpy(mac, records[handle].info.mac, 6);
+    }
+    xSemaphoreGive(registryMutex);
+    return handle != REGISTRY_EMPTY;
+}
+
+bool bulbRegistryGet(int handle, WizBulbInfo &info)
+{
+    if (!takeRegistryMutex())
+    {
+        return false;
+    }
+    bool found = handle >= 0 && handle < (int)records.size() && records[handle].inUse;
+    if (found)
+    {
+        info = records[handle].info;
+    }
+    xSemaphoreGive(registryMutex);
+    return found;
+}
+
+bool bulbRegistryBindLight(int handle, uint8_t endpoint, ZigbeeWizLight *light)
+{
+    if (endpoint == 0 || !takeRegistryMutex())
+    {
+        return false;
+    }
+    bool bound = handle >= 0 && handle < (int)records.size() && records[handle].inUse;
+    if (bound)
+    {
+        unbindEndpoint(handle);
+        records[handle].endpoint = endpoint;
+        endpointHandles[endpoint] = handle;
+        endpointLights[endpoint] = light;
+    }
+    xSemaphoreGive(registryMutex);
+    return bound;
+}
+
+void bulbRegistryUnbindLights()
+{
+    if (!takeRegistryMutex())
+    {
+        return;
+    }
+    if (registryInitialized)
+    {
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            unbindEndpoint(i);
+        }
+    }
+    xSemaphoreGive(registryMutex);
+}
+
+// Hot path for every Zigbee attribute callback: one array read, no lock. Entries are single
+// pointer stores. Retire unbinds at runtime, so a callback may still read the old pointer; that
+// is safe because light objects are never freed: a retired light stays as a vacant spare, and
+// setup_lights only deletes lights before the Zigbee stack starts.
+ZigbeeWizLight *bulbRegistryLightForEndpoint(uint8_t endpoint)
+{
+    return registryInitialized ? endpointLights[endpoint] : nullptr;
+}
+
+std::vector<WizBulbInfo> bulbRegistrySnapshot()
+{
+    std::vector<WizBulbInfo> bulbs;
+    if (!takeRegistryMutex())
+    {
+        return bulbs;
+    }
+    bulbs.reserve(recordCount);
+    for (const BulbRecord &record : records)
+    {
+        if (record.inUse)
+        {
+            bulbs.push_back(record.info);
+        }
+    }
+    xSemaphoreGive(registryMutex);
+    return bulbs;
+}
+
+size_t bulbRegistryCount()
+{
+    return recordCount;
+}
+
+size_t bulbRegistryMemoryBytes()
+{
+    return sizeof(macIndex) + sizeof(ipIndex) + sizeof(endpointLights) + sizeof(endpointHandles) +
+           records.capacity() * sizeof(BulbRecord);
+}
+
+#ifdef WIZ2HUE_REGISTRY_BENCH
+const int REGISTRY_BENCH_LOOKUPS = 10000;
+
+static WizBulbInfo benchBulb(int i)
+{
+    WizBulbInfo bulb;
+    const uint8_t mac[6] = {0x44, 0x4F, 0x8E, (uint8_t)(i * 37), (uint8_t)(i >> 8), (uint8_t)i};
+    memcpy(bulb.mac, mac, sizeof(bulb.mac));
+    bulb.ip = (uint32_t)IPAddress(192, 168, 1 + i / 200, 10 + i % 200);
+    bulb.isValid = true;
+    return bulb;
+}
+
+// Lookup cost and footprint of the registry against the containers it replaced, at 10, 100 and
+// 250 bulbs. Runs before discovery; leaves the registry empty.
+void bulbRegistryBenchmark()
+{
+    const int sizes[] = {10, 100, 250};
+    ZigbeeWizLight *fakeLight = (ZigbeeWizLight *)&records; // Never dereferenced
+    volatile uint32_t sink = 0;
+
+    for (int size : sizes)
+    {
+        std::vector<WizBulbInfo> bulbs;
+        for (int i = 0; i < size; i++)
+        {
+            bulbs.push_back(benchBulb(i));
+        }
+
+        uint32_t heapBefore = ESP.getFreeHeap();
+        bulbRegistryLoad(bulbs);
+        for (int i = 0; i < size; i++)
+        {
+            bulbRegistryBindLight(i, 1 + i, fakeLight);
+        }
+        uint32_t registryHeap = heapBefore - ESP.getFreeHeap();
+
+        heapBefore = ESP.getFreeHeap();
+        std::map<uint8_t, ZigbeeWizLight *> endpointMap;
+        for (int i = 0; i < size; i++)
+        {
+            endpointMap[1 + i] = fakeLight;
+        }
+        uint32_t mapHeap = heapBefore - ESP.getFreeHeap();
+
+        uint32_t start = ESP.getCycleCount();
+        for (int n = 0; n < REGISTRY_BENCH_LOOKUPS; n++)
+        {
+            sink += (uintptr_t)bulbRegistryLightForEndpoint(1 + n % size);
+        }
+        uint32_t endpointCycles = ESP.getCycleCount() - start;
+
+        start = ESP.getCycleCount();
+        for (int n = 0; n < REGISTRY_BENCH_LOOKUPS; n++)
+        {
+            sink += (uintptr_t)endpointMap.find(1 + n % size)->second;
+        }
+        uint32_t mapCycles = ESP.getCycleCount() - start;
+
+        start = ESP.getCycleCount();
+        for (int n = 0; n < REGISTRY_BENCH_LOOKUPS; n++)
+        {
+            sink += bulbRegistryFindByMac(bulbs[n % size].mac);
+        }
+        uint32_t macCycles = ESP.getCycleCount() - start;
+
+        start = ESP.getCycleCount();
+        for (int n = 0; n < REGISTRY_BENCH_LOOKUPS; n++)
+        {
+            const uint8_t *mac = bulbs[n % size].mac;
+            for (const WizBulbInfo &bulb : bulbs)
+            {
+                if (memcmp(bulb.mac, mac, sizeof(bulb.mac)) == 0)
+                {
+                    sink += bulb.ip;
+                    break;
+                }
+            }
+        }
+        uint32_t scanCycles = ESP.getCycleCount() - start;
+
+        start = ESP.getCycleCount();
+        for (int n = 0; n < REGISTRY_BENCH_LOOKUPS; n++)
+        {
+            sink += bulbRegistryFindByIp(bulbs[n % size].ip);
+        }
+        uint32_t ipCycles = ESP.getCycleCount() - start;
+
+        Serial.printf("Registry bench %d bulbs: endpoint %lu cycles (std::map %lu), MAC %lu (linear scan %lu), IP %lu cycles per lookup\n",
+                      size, (unsigned long)(endpointCycles / REGISTRY_BENCH_LOOKUPS), (unsigned long)(mapCycles / REGISTRY_BENCH_LOOKUPS),
+                      (unsigned long)(macCycles / REGISTRY_BENCH_LOOKUPS), (unsigned long)(scanCycles / REGISTRY_BENCH_LOOKUPS),
+                      (unsigned long)(ipCycles / REGISTRY_BENCH_LOOKUPS));
+        Serial.printf("Registry bench %d bulbs: registry %u bytes (%lu heap), std::map endpoint index %lu heap bytes\n",
+                      size, bulbRegistryMemoryBytes(), (unsigned long)registryHeap, (unsigned long)mapHeap);
+    }
+
+    bulbRegistryClear();
+    records.shrink_to_fit();
+}
+#endif
@@ -0,0 +1,416 @@
+#include "wiz2hue.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+// Background storage writer: flash writes stall the CPU cache and with it Zigbee timing, so the
+// paths that change persistent data only post a write intent. A low-priority task collects the
+// intents, coalesces repeated intents for the same key until they have been quiet for
+// STORAGE_DEBOUNCE, and performs at most one write per STORAGE_MIN_WRITE_GAP. Intents carry no
+// data: a write always stores what is current at the time it runs.
+const unsigned long STORAGE_DEBOUNCE = 2000;       // Quiet time before a key is written
+const unsigned long STORAGE_MAX_DELAY = 10000;     // Keys requested continuously are written anyway
+const unsigned long STORAGE_MIN_WRITE_GAP = 250;   // Bounded write rate
+const unsigned long STORAGE_IDLE_TICK = 1000;      // Bulb state flush cadence when nothing is queued
+const int STORAGE_QUEUE_LENGTH = 16;
+const int STORAGE_MAX_PENDING = 16;                // More pending bulbs collapse into a full lights save
+const size_t NVS_ENTRY_BYTES = 32;                 // NVS keeps a 64-bit value in one entry
+
+enum class StorageIntent : uint8_t
+{
+    LIGHTS,   // Binary cache image and lights.json export from the registry
+    LIGHT_IP, // One bulb's address, journaled to the binary cache
+    CLEAR,    // Reset: remove cached lights, settings and stored bulb states
+    SYNC,     // Write everything pending now and notify the sender
+    COUNT
+};
+
+static const char *const storageIntentNames[] = {"lights", "light IP", "clear", "sync", "bulb states"};
+
+struct StorageRequest
+{
+    StorageIntent type;
+    uint8_t mac[6];
+    TaskHandle_t notify; // SYNC only
+};
+
+struct PendingWrite
+{
+    bool used;
+    StorageIntent type;
+    uint8_t mac[6];
+    unsigned long firstRequestAt;
+    unsigned long lastRequestAt;
+};
+
+// Per intent type, plus one row for the bulb state flushes
+struct StorageWriteStats
+{
+    uint32_t requests = 0;
+    uint32_t coalesced = 0; // Requests merged into one already pending
+    uint32_t writes = 0;
+    uint32_t failures = 0;
+    uint64_t writeMicros = 0;
+    unsigned long maxWriteMicros = 0;
+    uint64_t delayMs = 0; // First request to completed write
+    uint64_t bytes = 0;
+    uint32_t sectorErases = 0; // Light cache sectors erased by these writes
+};
+
+const int STORAGE_STATS_ROWS = (int)StorageIntent::COUNT + 1;
+const int STORAGE_BULB_STATE_ROW = (int)StorageIntent::COUNT;
+
+static QueueHandle_t storageQueue = nullptr;
+static TaskHandle_t storageTask = nullptr;
+static PendingWrite pendingWrites[STORAGE_MAX_PENDING];
+static StorageWriteStats storageStats[STORAGE_STATS_ROWS];
+static unsigned long lastWriteAt = 0;
+
+static bool sameKey(const PendingWrite &pending, StorageIntent type, const uint8_t *mac)
+{
+    return pending.used && pending.type == type &&
+           (type != StorageIntent::LIGHT_IP || memcmp(pending.mac, mac, sizeof(pending.mac)) == 0);
+}
+
+static void dropPending(StorageIntent type)
+{
+    for (auto &pending : pendingWrites)
+    {
+        if (pending.used && pending.type == type)
+        {
+            pending.used = false;
+        }
+    }
+}
+
+static void addPending(StorageIntent type, const uint8_t *mac)
+{
+    unsigned long now = millis();
+    storageStats[(int)type].requests++;
+
+    if (type == StorageIntent::CLEAR)
+    {
+        // Nothing written before the clear would survive it
+        dropPending(StorageIntent::LIGHTS);
+        dropPending(StorageIntent::LIGHT_IP);
+    }
+
+    PendingWrite *freeSlot = nullptr;
+    for (auto &pending : pendingWrites)
+    {
+        if (sameKey(pending, type, mac))
+        {
+            pending.lastRequestAt = now;
+            storageStats[(int)type].coalesced++;
+            return;
+        }
+        if (!pending.used && freeSlot == nullptr)
+        {
+            freeSlot = &pending;
+        }
+    }
+
+    if (freeSlot == nullptr)
+    {
+        // Table full of single-bulb updates: one full save covers all of them
+        dropPending(StorageIntent::LIGHT_IP);
+        addPending(StorageIntent::LIGHTS, nullptr);
+        if (type != StorageIntent::LIGHT_IP)
+        {
+            addPending(type, mac);
+        }
+        return;
+    }
+
+    freeSlot->used = true;
+    freeSlot->type = type;
+    memset(freeSlot->mac, 0, sizeof(freeSlot->mac));
+    if (mac != nullptr)
+    {
+        memcpy(freeSlot->mac, mac, sizeof(freeSlot->mac));
+    }
+    freeSlot->firstRequestAt = now;
+    freeSlot->lastRequestAt = now;
+}
+
+static size_t lightsExportBytes()
+{
+    File file = LittleFS.open("/lights.json", "r");
+    size_t size = file ? file.size() : 0;
+    file.close();
+    return size;
+}
+
+// Perform one write; the binary cache reports what it actually wrote and erased, the export
+// is counted at its file size
+static void performWrite(const PendingWrite &pending, bool &ok, size_t &bytes, uint32_t &sectorErases)
+{
+    LightCacheStats before = getLightCacheStats();
+    size_t exportBytes = 0;
+    switch (pending.type)
+    {
+    case StorageIntent::LIGHTS:
+        ok = saveLightsToFile(bulbRegistrySnapshot());
+        exportBytes = ok ? lightsExportBytes() : 0;
+        break;
+    case StorageIntent::LIGHT_IP:
+    {
+        WizBulbInfo info;
+        ok = bulbRegistryGet(bulbRegistryFindByMac(pending.mac), info) && journalLightIpUpdate(info.mac, info.ip);
+        break;
+    }
+    case StorageIntent::CLEAR:
+        clearFileSystemCache();
+        ok = true;
+        break;
+    default:
+        ok = true;
+        break;
+    }
+    LightCacheStats after = getLightCacheStats();
+    bytes = (after.journalBytes - before.journalBytes) + (after.compactionBytes - before.compactionBytes) + exportBytes;
+    sectorErases = after.sectorErases - before.sectorErases;
+}
+
+static void runPending(PendingWrite &pending)
+{
+    PendingWrite write = pending;
+    pending.used = false; // Requests arriving during the write start a new pending entry
+
+    bool ok = false;
+    size_t bytes = 0;
+    uint32_t sectorErases = 0;
+    unsigned long start = micros();
+    performWrite(write, ok, bytes, sectorErases);
+    unsigned long elapsed = micros() - start;
+    lastWriteAt = millis();
+
+    StorageWriteStats &stats = storageStats[(int)write.type];
+    stats.bytes += bytes; // A failed write may still have erased and written flash
+    stats.sectorErases += sectorErases;
+    if (!ok)
+    {
+        stats.failures++;
+        Serial.printf("Storage: %s write failed\n", storageIntentNames[(int)write.type]);
+        if (write.type == StorageIntent::LIGHT_IP)
+        {
+            addPending(StorageIntent::LIGHTS, nullptr); // Journal unavailable: fall back to a full save
+        }
+        return;
+    }
+    stats.writes++;
+    stats.writeMicros += elapsed;
+    stats.maxWriteMicros = max(stats.maxWriteMicros, elapsed);
+    stats.delayMs += lastWriteAt - write.firstRequestAt;
+}
+
+static void runBulbStateFlush(bool force)
+{
+    unsigned long start = micros();
+    int written = flushBulbStates(force);
+    if (written > 0)
+    {
+        unsigned long elapsed = micros() - start;
+        StorageWriteStats &stats = storageStats[STORAGE_BULB_STATE_ROW];
+        stats.writes += written;
+        stats.writeMicros += elapsed;
+        stats.maxWriteMicros = max(stats.maxWriteMicros, elapsed);
+        stats.bytes += written * NVS_ENTRY_BYTES;
+        lastWriteAt = millis();
+    }
+}
+
+static void runAllPending()
+{
+    // Second pass picks up the full save a failed journal write falls back to
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (auto &pending : pendingWrites)
+        {
+            if (pending.used)
+            {
+                runPending(pending);
+            }
+        }
+    }
+    runBulbStateFlush(true);
+}
+
+// Oldest pending write that is due, null if none
+static PendingWrite *nextDue(unsigned long now, unsigned long &waitMs)
+{
+    PendingWrite *due = nullptr;
+    waitMs = STORAGE_IDLE_TICK;
+    for (auto &pending : pendingWrites)
+    {
+        if (!pending.used)
+        {
+            continue;
+        }
+        unsigned long quiet = now - pending.lastRequestAt;
+        unsigned long age = now - pending.firstRequestAt;
+        if (pending.type == StorageIntent::CLEAR || quiet >= STORAGE_DEBOUNCE || age >= STORAGE_MAX_DELAY)
+        {
+            if (due == nullptr || pending.firstRequestAt - due->firstRequestAt > 0x80000000UL)
+            {
+                due = &pending;
+            }
+        }
+        else
+        {
+            waitMs = min(waitMs, min(STORAGE_DEBOUNCE - quiet, STORAGE_MAX_DELAY - age));
+        }
+    }
+    return due;
+}
+
+static void storageTaskFunction(void *parameter)
+{
+    while (true)
+    {
+        unsigned long waitMs;
+        PendingWrite *due = nextDue(millis(), waitMs);
+        if (due != nullptr)
+        {
+            unsigned long sinceWrite = millis() - lastWriteAt;
+            waitMs = sinceWrite >= STORAGE_MIN_WRITE_GAP ? 0 : STORAGE_MIN_WRITE_GAP - sinceWrite;
+        }
+
+        StorageRequest request;
+        if (xQueueReceive(storageQueue, &request, pdMS_TO_TICKS(waitMs)) == pdTRUE)
+        {
+            if (request.type == StorageIntent::SYNC)
+            {
+                storageStats[(int)StorageIntent::SYNC].requests++;
+                runAllPending();
+                xTaskNotifyGive(request.notify);
+            }
+            else
+            {
+                addPending(request.type, request.mac);
+            }
+            continue;
+        }
+
+        due = nextDue(millis(), waitMs);
+        if (due != nullptr && millis() - lastWriteAt >= STORAGE_MIN_WRITE_GAP)
+        {
+            runPending(*due);
+        }
+        runBulbStateFlush(false);
+    }
+}
+
+void startStorageWriter()
+{
+    if (storageTask != nullptr)
+    {
+        return;
+    }
+    storageQueue = xQueueCreate(STORAGE_QUEUE_LENGTH, sizeof(StorageRequest));
+    if (storageQueue == nullptr)
+    {
+        Serial.println("Failed to create storage queue - writes stay synchronous");
+        return;
+    }
+    // Priority 1: below the light and Zigbee tasks, writes only run when they are idle
+    if (xTaskCreate(storageTaskFunction, "WizStorage", 8192, nullptr, 1, &storageTask) != pdPASS)
+    {
+        Serial.println("Failed to create storage task - writes stay synchronous");
+        vQueueDelete(storageQueue);
+        storageQueue = nullptr;
+        storageTask = nullptr;
+    }
+}
+
+static void postIntent(StorageIntent type, const uint8_t *mac)
+{
+    StorageRequest request = {};
+    request.type = type;
+    if (mac != nullptr)
+    {
+        memcpy(request.mac, mac, sizeof(request.mac));
+    }
+
+    if (storageTask != nullptr && xQueueSend(storageQueue, &request, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+        return;
+    }
+
+    // No writer task (or it is hopelessly behind): write on the caller
+    PendingWrite pending = {};
+    pending.used = true;
+    pending.type = type;
+    memcpy(pending.mac, request.mac, sizeof(pending.mac));
+    pending.firstRequestAt = millis();
+    pending.lastRequestAt = pending.firstRequestAt;
+    bool ok = false;
+    size_t bytes = 0;
+    uint32_t sectorErases = 0;
+    performWrite(pending, ok, bytes, sectorErases);
+    if (!ok && type == StorageIntent::LIGHT_IP)
+    {
+        pending.type = StorageIntent::LIGHTS;
+        performWrite(pending, ok, bytes, sectorErases);
+    }
+}
+
+void requestLightsSave()
+{
+    postIntent(StorageIntent::LIGHTS, nullptr);
+}
+
+void requestLightIpSave(const uint8_t *mac)
+{
+    postIntent(StorageIntent::LIGHT_IP, mac);
+}
+
+void requestStorageClear()
+{
+    postIntent(StorageIntent::CLEAR, nullptr);
+}
+
+bool storageSync(unsigned long timeoutMs)
+{
+    if (storageTask == nullptr)
+    {
+        flushBulbStates(true);
+        return true;
+    }
+
+    StorageRequest request = {};
+    request.type = StorageIntent::SYNC;
+    request.notify = xTaskGetCurrentTaskHandle();
+    ulTaskNotifyTake(pdTRUE, 0); // Drop a stale notification from a sync that timed out
+    if (xQueueSend(storageQueue, &request, pdMS_TO_TICKS(timeoutMs)) != pdTRUE)
+    {
+        return false;
+    }
+    return ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs)) > 0;
+}
+
+void logStorageStats()
+{
+    unsigned long uptime = millis();
+    uint64_t totalBytes = 0;
+    uint32_t totalErases = 0;
+    for (int row = 0; row < STORAGE_STATS_ROWS; row++)
+    {
+        const StorageWriteStats &stats = storageStats[row];
+        totalBytes += stats.bytes;
+        totalErases += stats.sectorErases;
+        if (stats.requests == 0 && stats.writes == 0)
+        {
+            continue;
+        }
+        Serial.printf("Storage %s: %lu requests, %lu coalesced, %lu writes, %lu failed, %lu sector erases, write avg %lu / max %lu us, request to flash avg %lu ms\n",
+                      row == STORAGE_BULB_STATE_ROW ? storageIntentNames[STORAGE_BULB_STATE_ROW] : storageIntentNames[row],
+                      (unsigned long)stats.requests, (unsigned long)stats.coalesced, (unsigned long)stats.writes,
+                      (unsigned long)stats.failures, (unsigned long)stats.sectorErases,
+                      stats.writes > 0 ? (unsigned long)(stats.writeMicros / stats.writes) : 0, stats.maxWriteMicros,
+                      stats.writes > 0 && row != STORAGE_BULB_STATE_ROW ? (unsigned long)(stats.delayMs / stats.writes) : 0);
+    }
+    // Wear is counted in erases: a sector wears out after a fixed number of them, however few bytes each write changed
+    Serial.printf("Storage: %lu bytes written, %lu light cache sector erases (%.1f/day)\n", (unsigned long)totalBytes,
+                  (unsigned long)totalErases, uptime > 0 ? 86400000.0f * totalErases / uptime : 0.0f);
+}
@@ -0,0 +1,253 @@
+#include "wiz2hue.h"
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <esp_rom_crc.h>
+
+// Warm-restart snapshot in RTC no-init memory: the bulb registry and the last reported state of
+// every bulb survive ESP.restart(), a panic or a watchdog reset (not a power cycle). A software
+// restart then resumes from memory and skips LittleFS, discovery and the initial state reads.
+// The snapshot is CRC-checked and tied to the firmware build; a boot-count guard falls back to
+// a cold boot when warm restarts keep failing before the system has run for a while.
+const uint32_t WARM_SNAPSHOT_MAGIC = 0x53425A57; // "WZBS"
+const uint16_t WARM_SNAPSHOT_VERSION = 1;
+const int WARM_SNAPSHOT_MAX_BULBS = 64;                   // 88 bytes each in the 16 KB LP RAM
+const unsigned long WARM_SNAPSHOT_INTERVAL = 60000;       // Periodic refresh, also saved before restarts
+const unsigned long WARM_BOOT_HEALTHY_AFTER = 120000;     // Uptime that clears the boot-count guard
+const uint32_t WARM_BOOT_MAX_CONSECUTIVE = 3;             // Warm boots without reaching that uptime
+
+struct WarmBulbRecord
+{
+    WizBulbInfo info;    // moduleId is re-interned from moduleName
+    char moduleName[24]; // Module ids are interned per boot
+    uint64_t state;      // packBulbState(), 0 = unknown
+};
+
+struct WarmSnapshot
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t buildStamp;
+    uint16_t bulbCount;
+    uint16_t reserved;
+    uint32_t crc; // over bulbs[0..bulbCount)
+    WarmBulbRecord bulbs[WARM_SNAPSHOT_MAX_BULBS];
+};
+
+// Boot history, kept separately so it survives an invalidated snapshot
+struct WarmBootHistory
+{
+    uint32_t magic;
+    uint32_t consecutiveWarmBoots;
+    uint32_t coldBoots;
+    uint32_t warmBoots;
+    uint32_t lastColdBootMs;
+    uint32_t lastWarmBootMs;
+    uint32_t crc; // over the fields above
+};
+
+RTC_NOINIT_ATTR static WarmSnapshot warmSnapshot;
+RTC_NOINIT_ATTR static WarmBootHistory bootHistory;
+
+static bool warmBoot = false;
+static bool bootHealthy = false;
+static bool snapshotDiscarded = false; // Reset pending: keep the snapshot invalid until the restart
+static unsigned long lastSnapshotAt = 0;
+
+static uint32_t buildStamp()
+{
+    const char *stamp = __DATE__ " " __TIME__;
+    return esp_rom_crc32_le(0, (const uint8_t *)stamp, strlen(stamp));
+}
+
+static uint32_t historyCrc()
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&bootHistory, offsetof(WarmBootHistory, crc));
+}
+
+static void saveHistory()
+{
+    bootHistory.crc = historyCrc();
+}
+
+static void invalidateSnapshot()
+{
+    warmSnapshot.magic = 0;
+}
+
+static bool snapshotValid()
+{
+    return warmSnapshot.magic == WARM_SNAPSHOT_MAGIC && warmSnapshot.version == WARM_SNAPSHOT_VERSION &&
+           warmSnapshot.recordSize == sizeof(WarmBulbRecord) && warmSnapshot.buildStamp == buildStamp() &&
+           warmSnapshot.bulbCount <= WARM_SNAPSHOT_MAX_BULBS &&
+           warmSnapshot.crc == esp_rom_crc32_le(0, (const uint8_t *)warmSnapshot.bulbs,
+                                                warmSnapshot.bulbCount * sizeof(WarmBulbRecord));
+}
+
+static bool softwareReset(esp_reset_reason_t reason)
+{
+    switch (reason)
+    {
+    case ESP_RST_SW:
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+        return true;
+    default:
+        return false; // Power-on, brownout, reset pin: RTC memory holds garbage
+    }
+}
+
+bool loadWarmSnapshot(std::vector<WizBulbInfo> &bulbs)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool softReset = softwareReset(reason);
+    if (!softReset || bootHistory.magic != WARM_SNAPSHOT_MAGIC || bootHistory.crc != historyCrc())
+    {
+        memset(&bootHistory, 0, sizeof(bootHistory));
+        bootHistory.magic = WARM_SNAPSHOT_MAGIC;
+    }
+    if (!softReset)
+    {
+        invalidateSnapshot();
+    }
+
+    if (softReset && bootHistory.consecutiveWarmBoots >= WARM_BOOT_MAX_CONSECUTIVE)
+    {
+        Serial.printf("Warm restart: %lu restarts without %lu s of uptime, falling back to a cold boot\n",
+                      (unsigned long)bootHistory.consecutiveWarmBoots, WARM_BOOT_HEALTHY_AFTER / 1000);
+        invalidateSnapshot();
+    }
+
+    warmBoot = snapshotValid();
+    if (!warmBoot)
+    {
+        Serial.printf("Cold boot (reset reason %d)\n", reason);
+        bootHistory.consecutiveWarmBoots = 0;
+        bootHistory.coldBoots++;
+        saveHistory();
+        return false;
+    }
+
+    bulbs.clear();
+    bulbs.reserve(warmSnapshot.bulbCount);
+    for (int i = 0; i < warmSnapshot.bulbCount; i++)
+    {
+        WarmBulbRecord &record = warmSnapshot.bulbs[i];
+        record.moduleName[sizeof(record.moduleName) - 1] = '\0';
+        WizBulbInfo info = record.info;
+        info.moduleId = internModuleName(record.moduleName);
+        bulbs.push_back(info);
+    }
+    bootHistory.consecutiveWarmBoots++;
+    bootHistory.warmBoots++;
+    saveHistory();
+
+    Serial.printf("Warm restart (reset reason %d): %d bulbs restored from RTC memory, discovery skipped\n",
+                  reason, warmSnapshot.bulbCount);
+    return true;
+}
+
+bool isWarmBoot()
+{
+    return warmBoot;
+}
+
+uint64_t warmSnapshotState(const uint8_t *mac)
+{
+    if (!warmBoot)
+    {
+        return 0;
+    }
+    for (int i = 0; i < warmSnapshot.bulbCount; i++)
+    {
+        if (memcmp(warmSnapshot.bulbs[i].info.mac, mac, sizeof(warmSnapshot.bulbs[i].info.mac)) == 0)
+        {
+            return warmSnapshot.bulbs[i].state;
+        }
+    }
+    return 0;
+}
+
+void saveWarmSnapshot()
+{
+    invalidateSnapshot(); // A restart in the middle of this leaves no half-written snapshot behind
+    if (snapshotDiscarded)
+    {
+        return;
+    }
+
+    int count = 0;
+    WizBulbInfo info;
+    for (int handle = 0; handle < BULB_REGISTRY_CAPACITY; handle++)
+    {
+        if (!bulbRegistryGet(handle, info))
+        {
+            continue;
+        }
+        if (count == WARM_SNAPSHOT_MAX_BULBS)
+        {
+            Serial.printf("Warm restart: more than %d bulbs, no snapshot kept\n", WARM_SNAPSHOT_MAX_BULBS);
+            return;
+        }
+        WarmBulbRecord &record = warmSnapshot.bulbs[count++];
+        record.info = info;
+        strncpy(record.moduleName, moduleNameOf(info.moduleId), sizeof(record.moduleName) - 1);
+        record.moduleName[sizeof(record.moduleName) - 1] = '\0';
+        record.state = currentBulbState(info.mac);
+    }
+
+    warmSnapshot.version = WARM_SNAPSHOT_VERSION;
+    warmSnapshot.recordSize = sizeof(WarmBulbRecord);
+    warmSnapshot.buildStamp = buildStamp();
+    warmSnapshot.bulbCount = count;
+    warmSnapshot.reserved = 0;
+    warmSnapshot.crc = esp_rom_crc32_le(0, (const uint8_t *)warmSnapshot.bulbs, count * sizeof(WarmBulbRecord));
+    warmSnapshot.magic = WARM_SNAPSHOT_MAGIC;
+    lastSnapshotAt = millis();
+}
+
+void discardWarmSnapshot()
+{
+    invalidateSnapshot();
+    snapshotDiscarded = true;
+}
+
+void updateWarmSnapshot()
+{
+    unsigned long now = millis();
+    if (!bootHealthy && now >= WARM_BOOT_HEALTHY_AFTER)
+    {
+        bootHealthy = true;
+        bootHistory.consecutiveWarmBoots = 0;
+        saveHistory();
+    }
+    if (now - lastSnapshotAt >= WARM_SNAPSHOT_INTERVAL)
+    {
+        saveWarmSnapshot();
+    }
+}
+
+void recordBootTime(unsigned long bootMs)
+{
+    if (warmBoot)
+    {
+        bootHistory.lastWarmBootMs = bootMs;
+    }
+    else
+    {
+        bootHistory.lastColdBootMs = bootMs;
+    }
+    saveHistory();
+
+    Serial.printf("Boot: %s boot ready in %lu ms | last cold boot %lu ms, last warm restart %lu ms (%lu cold, %lu warm since power-on)\n",
+                  warmBoot ? "warm" : "cold", bootMs, (unsigned long)bootHistory.lastColdBootMs,
+                  (unsigned long)bootHistory.lastWarmBootMs, (unsigned long)bootHistory.coldBoots,
+                  (unsigned long)bootHistory.warmBoots);
+}
+
+unsigned long lastWarmRestartTime()
+{
+    return bootHistory.warmBoots > 0 ? bootHistory.lastWarmBootMs : 0;
+}
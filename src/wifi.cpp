@@ -1,80 +1,214 @@
 #include <WiFi.h>
 #include <esp_wifi.h>
+#include <Preferences.h>
 #include "secrets.h"
 #include "wiz2hue.h"
 
 const char *ssid = SSID;
 const char *password = PASSWORD;
-const int CHANNEL = 11; // TODO
 
-IPAddress broadcastIP()
+// Fast connect: the BSSID, channel and lease of the last successful association are kept in
+// NVS, so the next boot associates directly without scanning. A full scan runs only when the
+// fast path fails. With -DWIZ2HUE_WIFI_REUSE_LEASE the cached lease is also applied as a
+// static configuration, skipping DHCP (only safe if the router keeps leases per MAC).
+const char *WIFI_NAMESPACE = "wifi";
+const uint8_t WIFI_CACHE_VERSION = 1;
+const unsigned long FAST_CONNECT_TIMEOUT = 3000;  // Fast path: known AP on a known channel
+const unsigned long FULL_CONNECT_TIMEOUT = 10000; // Full scan over all channels
+const unsigned long RADIO_SETTLE_DELAY = 1000;    // Only when the radio was left in use
+const int WIFI_HISTORY_LENGTH = 8;                // Association times remembered across reboots
+
+struct WifiFastConnect
 {
-  return WiFi.calculateBroadcast(WiFi.localIP(), WiFi.subnetMask());
-}
+  uint8_t version;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint32_t ssidHash; // Cache belongs to the configured network only
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
 
-IPAddress wifi_connect(int pin_to_blink, int button)
+// Ring of recent association times, newest at (next - 1)
+struct WifiConnectHistory
 {
-  // Aggressive WiFi reset with debug information
-  Serial.println("Initializing WiFi...");
-  Serial.printf("SSID: %s\n", ssid);
-  Serial.printf("Initial WiFi Status: %d\n", WiFi.status());
+  uint8_t next;
+  uint8_t count;
+  uint8_t fastPath; // Bit per entry
+  uint8_t reserved;
+  uint16_t associateMs[WIFI_HISTORY_LENGTH];
+};
+
+static WifiFastConnect fastConnect;
+static bool fastConnectValid = false;
 
-  // Force complete WiFi shutdown
-  WiFi.mode(WIFI_OFF);
-  delay(1000);
-  Serial.println("WiFi turned OFF");
+static uint32_t ssidHash()
+{
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (const char *c = ssid; *c; c++)
+  {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  return hash;
+}
 
-  // Restart WiFi in station mode
-  WiFi.mode(WIFI_STA);
-  delay(1000);
-  Serial.println("WiFi set to STA mode");
+static void loadFastConnect(Preferences &prefs)
+{
+  fastConnectValid = prefs.getBytes("fast", &fastConnect, sizeof(fastConnect)) == sizeof(fastConnect) &&
+                     fastConnect.version == WIFI_CACHE_VERSION && fastConnect.ssidHash == ssidHash() &&
+                     fastConnect.channel != 0;
+}
 
-  // Disconnect any existing connections
-  WiFi.disconnect(true);
-  delay(1000);
-  Serial.println("WiFi disconnected");
+// Rewritten only when the AP, channel or lease changed
+static void saveFastConnect(Preferences &prefs)
+{
+  WifiFastConnect current = {};
+  current.version = WIFI_CACHE_VERSION;
+  current.channel = WiFi.channel();
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.ssidHash = ssidHash();
+  current.ip = (uint32_t)WiFi.localIP();
+  current.gateway = (uint32_t)WiFi.gatewayIP();
+  current.subnet = (uint32_t)WiFi.subnetMask();
+  current.dns = (uint32_t)WiFi.dnsIP();
 
-  Serial.printf("\n******************************************************Connecting to %s\n", ssid);
+  if (!fastConnectValid || memcmp(&current, &fastConnect, sizeof(current)) != 0)
+  {
+    prefs.putBytes("fast", &current, sizeof(current));
+    Serial.printf("WiFi: cached AP %02X:%02X:%02X:%02X:%02X:%02X on channel %d for fast connect\n",
+                  current.bssid[0], current.bssid[1], current.bssid[2], current.bssid[3], current.bssid[4],
+                  current.bssid[5], current.channel);
+  }
+  fastConnect = current;
+  fastConnectValid = true;
+}
 
-  // Try connection with explicit parameters
-  WiFi.begin(ssid, password, CHANNEL);
-  Serial.printf("WiFi.begin() called, status: %d\n", WiFi.status());
+static void recordAssociation(Preferences &prefs, unsigned long associateMs, bool fastPath)
+{
+  WifiConnectHistory history = {};
+  if (prefs.getBytes("history", &history, sizeof(history)) != sizeof(history) || history.next >= WIFI_HISTORY_LENGTH)
+  {
+    history = WifiConnectHistory();
+  }
+  history.associateMs[history.next] = min(associateMs, 65535UL);
+  history.fastPath = fastPath ? history.fastPath | (1 << history.next) : history.fastPath & ~(1 << history.next);
+  history.next = (history.next + 1) % WIFI_HISTORY_LENGTH;
+  history.count = min(history.count + 1, WIFI_HISTORY_LENGTH);
+  prefs.putBytes("history", &history, sizeof(history));
 
-  // Add timeout to prevent infinite loop
-  unsigned long startTime = millis();
-  const unsigned long WIFI_TIMEOUT = 5000; // 15 seconds timeout
-  int retryCount = 0;
+  Serial.print("WiFi: association times, newest first:");
+  for (int i = 1; i <= history.count; i++)
+  {
+    int index = (history.next + WIFI_HISTORY_LENGTH - i) % WIFI_HISTORY_LENGTH;
+    Serial.printf(" %u ms (%s)", history.associateMs[index], (history.fastPath & (1 << index)) ? "fast" : "scan");
+  }
+  Serial.println();
+}
 
+// Wait for the association; false on timeout
+static bool waitForConnection(int pin_to_blink, int button, unsigned long timeout)
+{
+  unsigned long startTime = millis();
   while (WiFi.status() != WL_CONNECTED)
   {
+    if (millis() - startTime > timeout)
+    {
+      return false;
+    }
     digitalWrite(pin_to_blink, HIGH);
     delay(100);
     digitalWrite(pin_to_blink, LOW);
     delay(100);
     Serial.print(".");
     checkForReset(button);
+  }
+  return true;
+}
 
-    // Check for timeout and retry connection
-    if (millis() - startTime > WIFI_TIMEOUT)
-    {
-      retryCount++;
-      Serial.printf("\nWiFi connection timeout (attempt %d), status: %d\n", retryCount, WiFi.status());
+IPAddress broadcastIP()
+{
+  return WiFi.calculateBroadcast(WiFi.localIP(), WiFi.subnetMask());
+}
 
-      if (retryCount >= 1)
-      {
-        Serial.println("Multiple WiFi failures - performing complete reset");
-        ESP.restart();
-      }
+IPAddress wifi_connect(int pin_to_blink, int button)
+{
+  Serial.println("Initializing WiFi...");
+  Serial.printf("SSID: %s\n", ssid);
+  Serial.printf("Initial WiFi Status: %d\n", WiFi.status());
+  unsigned long connectStart = millis();
+
+  Preferences prefs;
+  bool prefsOpen = prefs.begin(WIFI_NAMESPACE, false);
+  if (prefsOpen)
+  {
+    loadFastConnect(prefs);
+  }
 
-      Serial.println("Retrying WiFi connection...");
+  // The full reset with settle delays is only needed when something left the radio in use
+  if (WiFi.getMode() != WIFI_OFF)
+  {
+    WiFi.mode(WIFI_OFF);
+    delay(RADIO_SETTLE_DELAY);
+    Serial.println("WiFi turned OFF");
+    WiFi.mode(WIFI_STA);
+    delay(RADIO_SETTLE_DELAY);
+    WiFi.disconnect(true);
+    delay(RADIO_SETTLE_DELAY);
+    Serial.println("WiFi reset to STA mode");
+  }
+  else
+  {
+    WiFi.mode(WIFI_STA);
+  }
+
+  bool connected = false;
+  bool fastPath = false;
+  if (fastConnectValid)
+  {
+    Serial.printf("\nConnecting to %s via cached AP on channel %d\n", ssid, fastConnect.channel);
+#ifdef WIZ2HUE_WIFI_REUSE_LEASE
+    WiFi.config(IPAddress(fastConnect.ip), IPAddress(fastConnect.gateway), IPAddress(fastConnect.subnet),
+                IPAddress(fastConnect.dns));
+#endif
+    WiFi.begin(ssid, password, fastConnect.channel, fastConnect.bssid);
+    connected = waitForConnection(pin_to_blink, button, FAST_CONNECT_TIMEOUT);
+    fastPath = connected;
+    if (!connected)
+    {
+      Serial.printf("\nFast connect failed (status %d) - falling back to a full scan\n", WiFi.status());
       WiFi.disconnect(true);
-      delay(2000);
-      WiFi.begin(ssid, password);
-      startTime = millis(); // Reset timeout counter
+#ifdef WIZ2HUE_WIFI_REUSE_LEASE
+      WiFi.config(IPAddress(), IPAddress(), IPAddress()); // Back to DHCP
+#endif
     }
   }
 
-  Serial.printf("\nWiFi connected\nIP address: %s, Broadcast: %s\n", WiFi.localIP().toString().c_str(), broadcastIP().toString().c_str());
+  if (!connected)
+  {
+    Serial.printf("\n******************************************************Connecting to %s\n", ssid);
+    unsigned long scanStart = millis();
+    WiFi.begin(ssid, password);
+    connected = waitForConnection(pin_to_blink, button, FULL_CONNECT_TIMEOUT);
+    if (!connected)
+    {
+      Serial.printf("\nWiFi connection timeout after %lu ms, status: %d - performing complete reset\n",
+                    millis() - scanStart, WiFi.status());
+      ESP.restart();
+    }
+  }
+
+  unsigned long associateMs = millis() - connectStart;
+  Serial.printf("\nWiFi connected in %lu ms (%s)\nIP address: %s, Broadcast: %s\n", associateMs,
+                fastPath ? "fast connect" : "full scan", WiFi.localIP().toString().c_str(),
+                broadcastIP().toString().c_str());
+
+  if (prefsOpen)
+  {
+    saveFastConnect(prefs);
+    recordAssociation(prefs, associateMs, fastPath);
+    prefs.end();
+  }
 
   // Configure WiFi power save for ESP32-C6 UDP reliability
   esp_wifi_set_ps(WIFI_PS_NONE);
@@ -84,39 +218,139 @@ IPAddress wifi_connect(int pin_to_blink, int button)
   return WiFi.localIP();
 }
 
-bool checkWiFiConnection()
+// WiFi supervisor: loop() calls wifiSupervisorTick(), which never blocks. On link loss bulb I/O
+// is paused (Hue commands are parked per light), reconnect attempts run with exponential
+// backoff, and once the link is back bulb I/O resumes and the parked commands are replayed.
+// The first attempt goes to the cached AP, later ones scan in case the AP changed channel.
+const unsigned long RECONNECT_ATTEMPT_TIMEOUT = 10000;
+const unsigned long RECONNECT_BACKOFF_MIN = 1000;
+const unsigned long RECONNECT_BACKOFF_MAX = 60000;
+
+enum class WifiSupervisorState
 {
-  if (WiFi.status() != WL_CONNECTED)
+  CONNECTED,
+  RECONNECTING, // Attempt in progress
+  BACKOFF       // Waiting before the next attempt
+};
+
+static WifiSupervisorState supervisorState = WifiSupervisorState::CONNECTED;
+static unsigned long outageStart = 0;
+static unsigned long stateSince = 0;
+static unsigned long reconnectBackoff = RECONNECT_BACKOFF_MIN;
+static uint32_t outageAttempts = 0;
+static WifiOutageStats outageStats;
+
+static void startReconnectAttempt(unsigned long now)
+{
+  outageAttempts++;
+  if (outageAttempts == 1 && fastConnectValid)
   {
-    Serial.println("WiFi connection lost - attempting reconnection");
+    WiFi.begin(ssid, password, fastConnect.channel, fastConnect.bssid);
+  }
+  else
+  {
+    WiFi.begin(ssid, password);
+  }
+  supervisorState = WifiSupervisorState::RECONNECTING;
+  stateSince = now;
+}
 
-    // Try quick reconnection first
-    WiFi.disconnect(true);
-    delay(1000);
-    WiFi.begin(ssid, password, CHANNEL);
+static void linkRecovered(unsigned long now)
+{
+  unsigned long outage = now - outageStart;
+  supervisorState = WifiSupervisorState::CONNECTED;
+  reconnectBackoff = RECONNECT_BACKOFF_MIN;
+
+  // Re-disable power save after reconnection
+  esp_wifi_set_ps(WIFI_PS_NONE);
+
+  bool networkUp = true;
+#ifdef WIZ2HUE_NET_SIM
+  networkUp = !isSimulatedNetworkDown();
+#endif
+  int replayed = 0;
+  if (networkUp)
+  {
+    resumeBulbIo();
+    replayed = replayDesiredStates();
+  }
 
-    // Wait up to 10 seconds for reconnection
-    unsigned long startTime = millis();
-    const unsigned long RECONNECT_TIMEOUT = 10000;
+  outageStats.recoveries++;
+  outageStats.lastRecoveryMs = outage;
+  outageStats.maxRecoveryMs = max(outageStats.maxRecoveryMs, outage);
+  outageStats.totalRecoveryMs += outage;
+  Serial.printf("WiFi reconnected after %lu ms outage (%lu attempts) - IP: %s, %d parked commands replayed\n",
+                outage, (unsigned long)outageAttempts, WiFi.localIP().toString().c_str(), replayed);
+}
 
-    while (WiFi.status() != WL_CONNECTED && (millis() - startTime) < RECONNECT_TIMEOUT)
+void wifiSupervisorTick()
+{
+  unsigned long now = millis();
+  bool linkUp = WiFi.status() == WL_CONNECTED;
+
+  switch (supervisorState)
+  {
+  case WifiSupervisorState::CONNECTED:
+    if (linkUp)
     {
-      delay(500);
-      Serial.print(".");
+      return;
     }
+    Serial.println("WiFi connection lost - pausing bulb I/O and reconnecting in the background");
+    outageStart = now;
+    outageAttempts = 0;
+    outageStats.outages++;
+    pauseBulbIo();
+    startReconnectAttempt(now);
+    break;
 
-    if (WiFi.status() == WL_CONNECTED)
+  case WifiSupervisorState::RECONNECTING:
+    if (linkUp)
     {
-      Serial.printf("\nWiFi reconnected - IP: %s\n", WiFi.localIP().toString().c_str());
-      // Re-disable power save after reconnection
-      esp_wifi_set_ps(WIFI_PS_NONE);
-      return true;
+      linkRecovered(now);
     }
-    else
+    else if (now - stateSince >= RECONNECT_ATTEMPT_TIMEOUT)
     {
-      Serial.println("\nWiFi reconnection failed - system restart required");
-      return false;
+      WiFi.disconnect();
+      supervisorState = WifiSupervisorState::BACKOFF;
+      stateSince = now;
+      Serial.printf("WiFi reconnect attempt %lu failed (status %d), next in %lu ms\n",
+                    (unsigned long)outageAttempts, WiFi.status(), reconnectBackoff);
     }
+    break;
+
+  case WifiSupervisorState::BACKOFF:
+    if (linkUp)
+    {
+      linkRecovered(now);
+    }
+    else if (now - stateSince >= reconnectBackoff)
+    {
+      reconnectBackoff = min(reconnectBackoff * 2, RECONNECT_BACKOFF_MAX);
+      startReconnectAttempt(now);
+    }
+    break;
   }
-  return true;
+}
+
+bool isWifiConnected()
+{
+  return supervisorState == WifiSupervisorState::CONNECTED;
+}
+
+unsigned long wifiOutageDuration()
+{
+  return supervisorState == WifiSupervisorState::CONNECTED ? 0 : millis() - outageStart;
+}
+
+WifiOutageStats getWifiOutageStats()
+{
+  return outageStats;
+}
+
+void logWifiStats()
+{
+  Serial.printf("WiFi: %lu outages, %lu recovered in place, recovery last %lu / avg %lu / max %lu ms%s\n",
+                (unsigned long)outageStats.outages, (unsigned long)outageStats.recoveries, outageStats.lastRecoveryMs,
+                outageStats.recoveries > 0 ? (unsigned long)(outageStats.totalRecoveryMs / outageStats.recoveries) : 0,
+                outageStats.maxRecoveryMs, isWifiConnected() ? "" : ", outage in progress");
 }
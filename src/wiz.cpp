@@ -3,8 +3,10 @@
 #include <AsyncUDP.h>
 #include <ArduinoJson.h>
 #include <vector>
+#include <map>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 
 const int WIZ_PORT = 38899;
 const int DISCOVERY_TIMEOUT = 10000;       // 10 seconds total discovery time
@@ -14,6 +16,10 @@ const int BROADCAST_DELAY = 500;           // Delay between broadcasts in ms
 const int SOCKET_TIMEOUT = 1000;           // Socket receive timeout in ms
 const int RETRY_BROADCAST_INTERVAL = 3000; // Retry broadcast every 3 seconds
 
+// Bulb state cache (getBulbState(const WizBulbInfo &))
+const unsigned long DEFAULT_STATE_CACHE_TTL = 3000; // Shorter than the 5 s poll so polls stay live
+const unsigned long STATE_CACHE_WAIT_TIMEOUT = 5000; // Max time to wait for another caller's request
+
 // Global UDP transmission rate limiting to prevent buffer overflow
 static unsigned long lastGlobalUdpSend = 0;
 const int GLOBAL_UDP_DELAY = 10;
@@ -29,6 +35,174 @@ static void enforceGlobalUdpDelay()
     lastGlobalUdpSend = millis();
 }
 
+#ifdef WIZ2HUE_NET_SIM
+static volatile bool simulatedNetworkDown = false;
+
+void setSimulatedNetworkDown(bool down)
+{
+    simulatedNetworkDown = down;
+    Serial.printf("Network simulation: bulb traffic %s\n", down ? "DROPPED" : "restored");
+}
+
+bool isSimulatedNetworkDown()
+{
+    return simulatedNetworkDown;
+}
+#endif
+
+// True when a bulb packet should be dropped instead of sent (network simulation builds only)
+static bool simulatedDrop()
+{
+#ifdef WIZ2HUE_NET_SIM
+    return simulatedNetworkDown;
+#else
+    return false;
+#endif
+}
+
+// getPilot fast path: remember the fingerprint and parsed state of the last reply per bulb
+struct PilotReplyCacheEntry
+{
+    uint32_t fingerprint = 0;
+    WizBulbState state;
+};
+
+static std::map<uint32_t, PilotReplyCacheEntry> lastPilotReplies; // keyed by bulb IP
+static SemaphoreHandle_t pilotReplyMutex = nullptr;
+static PilotFastPathStats pilotFastPathStats;
+
+// Fields that change between otherwise identical replies and must not affect the fingerprint
+static const char *const VOLATILE_PILOT_FIELDS[] = {"\"rssi\":"};
+
+// FNV-1a hash over the raw reply, skipping the values of volatile fields
+static uint32_t pilotPayloadFingerprint(const char *payload, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i = 0;
+    while (i < len)
+    {
+        bool skipped = false;
+        if (payload[i] == '"')
+        {
+            for (const char *field : VOLATILE_PILOT_FIELDS)
+            {
+                size_t fieldLen = strlen(field);
+                if (len - i >= fieldLen && memcmp(payload + i, field, fieldLen) == 0)
+                {
+                    // Skip key and value up to the next separator
+                    i += fieldLen;
+                    while (i < len && payload[i] != ',' && payload[i] != '}')
+                    {
+                        i++;
+                    }
+                    skipped = true;
+                    break;
+                }
+            }
+        }
+        if (skipped)
+        {
+            continue;
+        }
+        hash ^= (uint8_t)payload[i];
+        hash *= 16777619u;
+        i++;
+    }
+    return hash == 0 ? 1 : hash; // 0 is reserved for "no fingerprint"
+}
+
+// Single-flight, TTL-bounded cache of bulb states keyed by IP
+struct BulbStateCacheEntry
+{
+    WizBulbState state;
+    unsigned long fetchedAt = 0;
+    bool fresh = false;      // false after invalidation or before the first fetch
+    bool inFlight = false;   // a caller is currently fetching this bulb
+    bool staleOnArrival = false; // invalidated while in flight - don't serve the result later
+    uint32_t generation = 0; // incremented whenever a fetch completes
+};
+
+static std::map<uint32_t, BulbStateCacheEntry> bulbStateCache;
+static SemaphoreHandle_t bulbStateCacheMutex = nullptr;
+static unsigned long bulbStateCacheTtl = DEFAULT_STATE_CACHE_TTL;
+static BulbStateCacheStats bulbStateCacheStats;
+
+// Shared socket for streaming frames; replies are ignored
+static AsyncUDP *streamUdp = nullptr;
+static SemaphoreHandle_t streamUdpMutex = nullptr;
+
+// Create the client's mutexes; runs in setup() before any task can issue a WiZ request
+void initWizClient()
+{
+    pilotReplyMutex = xSemaphoreCreateMutex();
+    bulbStateCacheMutex = xSemaphoreCreateMutex();
+    streamUdpMutex = xSemaphoreCreateMutex();
+    initBulbHealth();
+    if (pilotReplyMutex == nullptr || bulbStateCacheMutex == nullptr || streamUdpMutex == nullptr)
+    {
+        Serial.println("Failed to create WiZ client mutexes");
+    }
+}
+
+static bool takeBulbStateCacheMutex()
+{
+    return bulbStateCacheMutex != nullptr && xSemaphoreTake(bulbStateCacheMutex, pdMS_TO_TICKS(100)) == pdTRUE;
+}
+
+static bool takePilotReplyMutex()
+{
+    return pilotReplyMutex != nullptr && xSemaphoreTake(pilotReplyMutex, pdMS_TO_TICKS(100)) == pdTRUE;
+}
+
+void recordPilotApply(unsigned long applyMicros)
+{
+    if (takePilotReplyMutex())
+    {
+        pilotFastPathStats.applyMicros += applyMicros;
+        pilotFastPathStats.applies++;
+        xSemaphoreGive(pilotReplyMutex);
+    }
+}
+
+void recordPilotApplySkip()
+{
+    if (takePilotReplyMutex())
+    {
+        pilotFastPathStats.applySkips++;
+        xSemaphoreGive(pilotReplyMutex);
+    }
+}
+
+PilotFastPathStats getPilotFastPathStats()
+{
+    PilotFastPathStats stats;
+    if (takePilotReplyMutex())
+    {
+        stats = pilotFastPathStats;
+        xSemaphoreGive(pilotReplyMutex);
+    }
+    return stats;
+}
+
+void logPilotFastPathStats()
+{
+    PilotFastPathStats stats = getPilotFastPathStats();
+    if (stats.replies == 0)
+    {
+        return;
+    }
+
+    unsigned long avgParse = stats.parses > 0 ? (unsigned long)(stats.parseMicros / stats.parses) : 0;
+    unsigned long avgApply = stats.applies > 0 ? (unsigned long)(stats.applyMicros / stats.applies) : 0;
+    uint64_t savedMicros = (uint64_t)stats.hits * avgParse + (uint64_t)stats.applySkips * avgApply;
+
+    Serial.printf("getPilot fast path: %lu/%lu replies matched (%.1f%%), %lu Zigbee updates skipped\n",
+                  (unsigned long)stats.hits, (unsigned long)stats.replies,
+                  100.0f * stats.hits / stats.replies, (unsigned long)stats.applySkips);
+    Serial.printf("getPilot fast path: avg parse %lu us, avg apply %lu us, saved %lu us per poll\n",
+                  avgParse, avgApply, (unsigned long)(savedMicros / stats.replies));
+}
+
 std::vector<WizBulbInfo> scanForWiz(IPAddress broadcastIP)
 {
     std::vector<WizBulbInfo> discoveredBulbs;
@@ -137,7 +311,7 @@ std::vector<WizBulbInfo> scanForWiz(IPAddress broadcastIP)
             Serial.printf("Response length: %d bytes\n", len);
 
             // Parse initial response for quick info
-            JsonDocument doc;
+            JsonDocument doc(jsonPoolAllocator());
             DeserializationError error = deserializeJson(doc, incomingPacket);
 
             if (!error && doc["result"].is<JsonObject>())
@@ -212,7 +386,7 @@ std::vector<WizBulbInfo> scanForWiz(IPAddress broadcastIP)
 
             if (!bulbInfo.isValid)
             {
-                Serial.printf("  Failed to get configuration: %s\n", bulbInfo.errorMessage.c_str());
+                Serial.printf("  Failed to get configuration: %s\n", wizErrorToString(bulbInfo.error));
             }
             else
             {
@@ -248,7 +422,7 @@ std::vector<WizBulbInfo> scanForWiz(IPAddress broadcastIP)
     return discoveredBulbs;
 }
 
-BulbClass determineBulbClass(const String &moduleName)
+BulbClass determineBulbClass(const char *moduleName)
 {
     String moduleNameUpper = moduleName;
     moduleNameUpper.toUpperCase();
@@ -354,7 +528,7 @@ Features determineBulbFeatures(BulbClass bulbClass)
 WizBulbInfo getSystemConfig(IPAddress deviceIP)
 {
     WizBulbInfo bulbInfo;
-    bulbInfo.ip = deviceIP.toString();
+    bulbInfo.ip = (uint32_t)deviceIP;
 
     AsyncUDP udp;
 
@@ -380,8 +554,8 @@ WizBulbInfo getSystemConfig(IPAddress deviceIP)
 
         Serial.println("System Configuration:");
 
-        // Use JsonDocument to save memory
-        JsonDocument doc;
+        // Document memory comes from the JSON block pool
+        JsonDocument doc(jsonPoolAllocator());
         DeserializationError error = deserializeJson(doc, response);
 
         if (!error)
@@ -391,16 +565,17 @@ WizBulbInfo getSystemConfig(IPAddress deviceIP)
                 JsonObject result = doc["result"];
 
                 // Extract key information safely
-                bulbInfo.moduleName = result["moduleName"] | "Unknown";
-                bulbInfo.fwVersion = result["fwVersion"] | "Unknown";
-                bulbInfo.mac = result["mac"] | "Unknown";
+                const char *moduleName = result["moduleName"] | "Unknown";
+                bulbInfo.moduleId = internModuleName(moduleName);
+                strlcpy(bulbInfo.fwVersion, result["fwVersion"] | "", sizeof(bulbInfo.fwVersion));
+                parseMac(result["mac"] | "", bulbInfo.mac);
                 bulbInfo.rssi = result["rssi"] | 0;
-                bulbInfo.src = result["src"] | "Unknown";
-                bulbInfo.homeId = result["homeId"] | "Unknown";
-                bulbInfo.roomId = result["roomId"] | "Unknown";
+                strlcpy(bulbInfo.src, result["src"] | "", sizeof(bulbInfo.src));
+                bulbInfo.homeId = result["homeId"] | 0;
+                bulbInfo.roomId = result["roomId"] | 0;
 
                 // Determine bulb class and features
-                bulbInfo.bulbClass = determineBulbClass(bulbInfo.moduleName);
+                bulbInfo.bulbClass = determineBulbClass(moduleName);
                 bulbInfo.features = determineBulbFeatures(bulbInfo.bulbClass);
                 bulbInfo.isValid = true;
 
@@ -423,14 +598,14 @@ WizBulbInfo getSystemConfig(IPAddress deviceIP)
             {
                 Serial.println("  Response doesn't contain 'result' field");
                 Serial.printf("  Raw response: %s\n", response);
-                bulbInfo.errorMessage = "Invalid response format";
+                bulbInfo.error = WizError::INVALID_RESPONSE;
                 configReceived = true; // Still count as received
             }
         }
         else
         {
             Serial.printf("  Failed to parse JSON response: %s\n", error.c_str());
-            bulbInfo.errorMessage = "JSON parse error: " + String(error.c_str());
+            bulbInfo.error = WizError::JSON_PARSE;
             // Only print response if it's not too large
             if (strlen(response) < 1024)
             {
@@ -449,7 +624,7 @@ WizBulbInfo getSystemConfig(IPAddress deviceIP)
     if (!udp.listen(0))
     {
         Serial.println("Failed to start AsyncUDP for system config request");
-        bulbInfo.errorMessage = "Failed to start AsyncUDP";
+        bulbInfo.error = WizError::UDP_START_FAILED;
         return bulbInfo;
     }
 
@@ -489,30 +664,56 @@ WizBulbInfo getSystemConfig(IPAddress deviceIP)
     {
         Serial.println("  System Configuration: Timeout - no response received");
         Serial.printf("  Failed to get system config after %d attempts\n", CONFIG_ATTEMPTS);
-        bulbInfo.errorMessage = "Timeout - no response";
+        bulbInfo.error = WizError::TIMEOUT;
     }
 
     udp.close();
     return bulbInfo;
 }
 
-WizBulbState getBulbState(IPAddress deviceIP)
+// getPilot request with a configurable retry budget (full reads use 2 x 1.5 s, health probes a single short attempt)
+static WizBulbState requestBulbState(IPAddress deviceIP, int stateAttempts, int responseTimeout)
 {
-    WizBulbState bulbState;
+    // Everything the receive callback touches lives in one struct so the lambda captures a single
+    // reference and fits std::function's inline storage instead of allocating per request
+    struct PilotRequest
+    {
+        WizBulbState bulbState;
+        bool stateReceived = false;
+        bool responseReceived = false;
+        PilotReplyCacheEntry previousReply;
+        bool fastPathHit = false;
+        unsigned long parseMicros = 0;
+        unsigned long repliedAt = 0; // micros() of the first reply
+    } request;
+    WizBulbState &bulbState = request.bulbState;
+    bool &stateReceived = request.stateReceived;
+    bool &responseReceived = request.responseReceived;
+    PilotReplyCacheEntry &previousReply = request.previousReply;
     AsyncUDP udp;
 
     // State request - getPilot command
-    String stateMessage = "{\"method\":\"getPilot\",\"params\":{}}";
-    const int STATE_ATTEMPTS = 2;
+    static const char stateMessage[] = "{\"method\":\"getPilot\",\"params\":{}}";
+    const size_t stateMessageLength = sizeof(stateMessage) - 1;
     const int STATE_RETRY_DELAY = 300;
 
-    bool stateReceived = false;
-    bool responseReceived = false;
-
+    // Snapshot the previous reply so the callback can compare without locking
+    uint32_t ipKey = (uint32_t)deviceIP;
+    if (takePilotReplyMutex())
+    {
+        auto it = lastPilotReplies.find(ipKey);
+        if (it != lastPilotReplies.end())
+        {
+            previousReply = it->second;
+        }
+        xSemaphoreGive(pilotReplyMutex);
+    }
     // Set up callback for received packets
-    udp.onPacket([&](AsyncUDPPacket packet)
+    udp.onPacket([&request](AsyncUDPPacket packet)
                  {
-        if (stateReceived) return; // Already got response
+        WizBulbState &bulbState = request.bulbState;
+        if (request.stateReceived) return; // Already got response
+        if (request.repliedAt == 0) request.repliedAt = micros();
         
         const int MAX_RESPONSE_SIZE = 512;
         char response[MAX_RESPONSE_SIZE];
@@ -520,7 +721,20 @@ WizBulbState getBulbState(IPAddress deviceIP)
         memcpy(response, packet.data(), len);
         response[len] = '\0';
 
-        JsonDocument doc;
+        // Fast path: identical payload to the previous reply, reuse its parsed state
+        uint32_t fingerprint = pilotPayloadFingerprint(response, len);
+        if (request.previousReply.fingerprint != 0 && fingerprint == request.previousReply.fingerprint)
+        {
+            bulbState = request.previousReply.state;
+            bulbState.lastUpdated = millis();
+            request.fastPathHit = true;
+            request.stateReceived = true;
+            request.responseReceived = true;
+            return;
+        }
+
+        unsigned long parseStart = micros();
+        JsonDocument doc(jsonPoolAllocator());
         DeserializationError error = deserializeJson(doc, response);
 
         if (!error)
@@ -552,45 +766,53 @@ WizBulbState getBulbState(IPAddress deviceIP)
 
                 bulbState.isValid = true;
                 bulbState.lastUpdated = millis();
+                bulbState.payloadFingerprint = fingerprint;
+                request.parseMicros = micros() - parseStart;
 
                 Serial.printf(" Bulb State raw response: %s\n", response);
 
-                stateReceived = true;
+                request.stateReceived = true;
             }
             else
             {
                 Serial.println("  State response doesn't contain 'result' field");
-                bulbState.errorMessage = "Invalid state response format";
-                stateReceived = true;
+                bulbState.error = WizError::INVALID_RESPONSE;
+                request.stateReceived = true;
             }
         }
         else
         {
             Serial.printf("  Failed to parse state JSON: %s\n", error.c_str());
-            bulbState.errorMessage = "JSON parse error: " + String(error.c_str());
-            stateReceived = true;
+            bulbState.error = WizError::JSON_PARSE;
+            request.stateReceived = true;
         }
         
-        responseReceived = true; });
+        request.responseReceived = true; });
 
     // Start listening on a random port
     if (!udp.listen(0))
     {
         Serial.println("Failed to start AsyncUDP for bulb state request");
-        bulbState.errorMessage = "Failed to start AsyncUDP";
+        bulbState.error = WizError::UDP_START_FAILED;
         return bulbState;
     }
 
-    for (int attempt = 1; attempt <= STATE_ATTEMPTS && !stateReceived; attempt++)
+    int attemptsUsed = 0;
+    unsigned long sentAt = 0;
+    for (int attempt = 1; attempt <= stateAttempts && !stateReceived; attempt++)
     {
         if (attempt > 1)
         {
-            Serial.printf("  Retrying state request (attempt %d/%d)...\n", attempt, STATE_ATTEMPTS);
+            Serial.printf("  Retrying state request (attempt %d/%d)...\n", attempt, stateAttempts);
             delay(STATE_RETRY_DELAY);
         }
 
         // Send request to specific device with error checking
-        size_t sentBytes = udp.writeTo((const uint8_t *)stateMessage.c_str(), stateMessage.length(), deviceIP, WIZ_PORT);
+        attemptsUsed = attempt;
+        sentAt = micros();
+        size_t sentBytes = simulatedDrop() ? stateMessageLength
+                                           : udp.writeTo((const uint8_t *)stateMessage, stateMessageLength, deviceIP, WIZ_PORT);
+        bulbHealthRecordTransmission();
 
         if (sentBytes == 0)
         {
@@ -602,7 +824,7 @@ WizBulbState getBulbState(IPAddress deviceIP)
         responseReceived = false;
 
         // Wait for response
-        while (millis() - startTime < (RESPONSE_TIMEOUT / STATE_ATTEMPTS) && !responseReceived)
+        while (millis() - startTime < (unsigned long)(responseTimeout / stateAttempts) && !responseReceived)
         {
             delay(10);
         }
@@ -616,26 +838,68 @@ WizBulbState getBulbState(IPAddress deviceIP)
     if (!stateReceived)
     {
         Serial.println("  Bulb State: Timeout - no response received");
-        bulbState.errorMessage = "Timeout - no state response";
+        bulbState.error = WizError::TIMEOUT;
     }
 
     udp.close();
+
+    // A late reply to an earlier attempt is timed against the last send
+    if (request.repliedAt != 0)
+    {
+        recordWizLatency(WizOp::GET_PILOT, ipKey, request.repliedAt - min(sentAt, request.repliedAt), attemptsUsed);
+    }
+    else
+    {
+        recordWizTimeout(WizOp::GET_PILOT, ipKey);
+    }
+
+    // Remember this reply for the next poll and account for the fast path
+    if (bulbState.isValid && takePilotReplyMutex())
+    {
+        pilotFastPathStats.replies++;
+        if (request.fastPathHit)
+        {
+            pilotFastPathStats.hits++;
+        }
+        else
+        {
+            PilotReplyCacheEntry &entry = lastPilotReplies[ipKey];
+            entry.fingerprint = bulbState.payloadFingerprint;
+            entry.state = bulbState;
+            pilotFastPathStats.parseMicros += request.parseMicros;
+            pilotFastPathStats.parses++;
+        }
+        xSemaphoreGive(pilotReplyMutex);
+    }
+
     return bulbState;
 }
 
-bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const Features &features)
+WizBulbState getBulbState(IPAddress deviceIP)
 {
-    WiFiUDP udp;
+    const int STATE_ATTEMPTS = 2;
+    return requestBulbState(deviceIP, STATE_ATTEMPTS, RESPONSE_TIMEOUT);
+}
 
-    // Start UDP on a random port for listening to response
-    if (!udp.begin(0))
-    {
-        Serial.printf("Failed to start UDP for setPilot to %s\n", deviceIP.toString().c_str());
-        return false;
-    }
+// Cheap reachability check for bulbs whose circuit is open: one getPilot, short timeout
+static WizBulbState probeBulbState(IPAddress deviceIP)
+{
+    const int PROBE_TIMEOUT = 500;
+    return requestBulbState(deviceIP, 1, PROBE_TIMEOUT);
+}
+
+// Serialized setPilot command; a full RGBW + temperature + scene + fan payload is about 160 bytes
+struct SetPilotMessage
+{
+    char text[192];
+    size_t length;
+};
 
+// Build the setPilot command for a state, including only the parameters the bulb supports
+static SetPilotMessage buildSetPilotMessage(const WizBulbState &state, const Features &features)
+{
     // Build setPilot command JSON with capability checking
-    JsonDocument doc;
+    JsonDocument doc(jsonPoolAllocator());
     doc["method"] = "setPilot";
     JsonObject params = doc["params"].to<JsonObject>();
 
@@ -690,25 +954,48 @@ bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const F
         params["fanspd"] = state.fanspd;
     }
 
-    // Serialize to string
-    String controlMessage;
-    serializeJson(doc, controlMessage);
+    // Serialize into the fixed buffer rather than a heap String
+    SetPilotMessage message;
+    message.length = serializeJson(doc, message.text, sizeof(message.text));
+    return message;
+}
 
-    Serial.printf("%s : %s\n", deviceIP.toString().c_str(), controlMessage.c_str());
+bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const Features &features)
+{
+    WiFiUDP udp;
+
+    // Start UDP on a random port for listening to response
+    if (!udp.begin(0))
+    {
+        Serial.printf("Failed to start UDP for setPilot to %s\n", IpStr(deviceIP).c_str());
+        return false;
+    }
+
+    SetPilotMessage controlMessage = buildSetPilotMessage(state, features);
+    IpStr deviceName(deviceIP);
+
+    Serial.printf("%s : %s\n", deviceName.c_str(), controlMessage.text);
 
     // Send control command with retry mechanism and wait for response
     const int MAX_UDP_RETRIES = 5;
     const int UDP_RETRY_DELAY = 50;    // 50ms delay between retries
     const int RESPONSE_TIMEOUT = 1000; // 1 second timeout for response
     bool success = false;
+    bool answered = false;
 
     for (int attempt = 1; attempt <= MAX_UDP_RETRIES && !success; attempt++)
     {
+        unsigned long sentAt = micros();
 
         // Send setPilot command
-        udp.beginPacket(deviceIP, WIZ_PORT);
-        udp.print(controlMessage);
-        bool packetSent = udp.endPacket();
+        bool packetSent = true;
+        if (!simulatedDrop())
+        {
+            udp.beginPacket(deviceIP, WIZ_PORT);
+            udp.write((const uint8_t *)controlMessage.text, controlMessage.length);
+            packetSent = udp.endPacket();
+        }
+        bulbHealthRecordTransmission();
         // Enforce global rate limiting before sending
         enforceGlobalUdpDelay();
 
@@ -739,7 +1026,7 @@ bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const F
                     responseBuffer[bytesRead] = '\0';
 
                     // Parse JSON response
-                    JsonDocument responseDoc;
+                    JsonDocument responseDoc(jsonPoolAllocator());
                     DeserializationError error = deserializeJson(responseDoc, responseBuffer);
 
                     if (!error)
@@ -747,22 +1034,24 @@ bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const F
                         // Check if response indicates success
                         if (responseDoc["result"].is<JsonObject>() && responseDoc["result"]["success"].as<bool>())
                         {
-                            Serial.printf("  setPilot success confirmed from %s\n", deviceIP.toString().c_str());
+                            recordWizLatency(WizOp::SET_PILOT, (uint32_t)deviceIP, micros() - sentAt, attempt);
+                            Serial.printf("  setPilot success confirmed from %s\n", deviceName.c_str());
                             success = true;
                             break;
                         }
                         else if (responseDoc["error"].is<JsonObject>())
                         {
+                            answered = true;
                             Serial.printf("  setPilot error from %s: %s\n",
-                                          deviceIP.toString().c_str(),
-                                          responseDoc["error"]["message"].as<String>().c_str());
+                                          deviceName.c_str(),
+                                          (const char *)(responseDoc["error"]["message"] | "unknown"));
                             break; // Don't retry on explicit error
                         }
                     }
                     else
                     {
                         Serial.printf("  Invalid JSON response from %s: %s\n",
-                                      deviceIP.toString().c_str(), responseBuffer);
+                                      deviceName.c_str(), responseBuffer);
                     }
                 }
                 else
@@ -777,7 +1066,7 @@ bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const F
         if (!success && attempt < MAX_UDP_RETRIES)
         {
             Serial.printf("  No response from %s (attempt %d/%d) - retrying...\n",
-                          deviceIP.toString().c_str(), attempt, MAX_UDP_RETRIES);
+                          deviceName.c_str(), attempt, MAX_UDP_RETRIES);
             vTaskDelay(pdMS_TO_TICKS(UDP_RETRY_DELAY));
         }
     }
@@ -788,53 +1077,425 @@ bool setBulbStateInternal(IPAddress deviceIP, const WizBulbState &state, const F
     {
         return true;
     }
-    else
+    if (!answered)
     {
-        Serial.printf("  Failed to set bulb state on %s after %d attempts\n",
-                      deviceIP.toString().c_str(), MAX_UDP_RETRIES);
-        return false;
+        recordWizTimeout(WizOp::SET_PILOT, (uint32_t)deviceIP);
     }
+    Serial.printf("  Failed to set bulb state on %s after %d attempts\n",
+                  deviceName.c_str(), MAX_UDP_RETRIES);
+    return false;
 }
 
 bool setBulbState(const WizBulbInfo &bulbInfo, const WizBulbState &state)
 {
-    IPAddress deviceIP;
-    if (!deviceIP.fromString(bulbInfo.ip))
+    ALLOC_SCOPE("setPilot");
+    IPAddress deviceIP(bulbInfo.ip);
+    if (bulbInfo.ip == 0)
     {
-        Serial.printf("Invalid IP address in bulb info: %s\n", bulbInfo.ip.c_str());
+        Serial.println("Invalid IP address in bulb info");
         return false;
     }
 
+    // Fail fast for bulbs known to be offline; a due probe decides whether to send
+    bool probe = false;
+    if (!bulbHealthAllowRequest(deviceIP, &probe))
+    {
+        return false;
+    }
+    if (probe)
+    {
+        WizBulbState probeState = probeBulbState(deviceIP);
+        if (!probeState.isValid)
+        {
+            bulbHealthRecordFailure(deviceIP);
+            return false;
+        }
+        bulbHealthRecordSuccess(deviceIP);
+    }
+
     // Use the bulb's known capabilities directly
     bool success = setBulbStateInternal(deviceIP, state, bulbInfo.features);
 
+    // Any cached state is outdated once a command has been sent
+    invalidateBulbStateCache(bulbInfo);
+
     // Track failures for health monitoring
 
     if (!success)
     {
         wizBulbFailureCount++;
+        bulbHealthRecordFailure(deviceIP);
         Serial.printf("WiZ bulb command failed. Failure count: %d\n", wizBulbFailureCount);
     }
     else
     {
         wizBulbFailureCount = 0; // Reset on success
+        bulbHealthRecordSuccess(deviceIP);
     }
 
     return success;
 }
 
+bool sendBulbStateUnacked(const WizBulbInfo &bulbInfo, const WizBulbState &state)
+{
+    ALLOC_SCOPE("stream frame");
+    IPAddress deviceIP(bulbInfo.ip);
+    if (bulbInfo.ip == 0)
+    {
+        return false;
+    }
+
+    if (bulbHealthIsOpen(deviceIP))
+    {
+        return false; // Offline bulbs get no frames; the final acknowledged frame probes them
+    }
+
+    if (streamUdpMutex == nullptr)
+    {
+        return false;
+    }
+
+    SetPilotMessage message = buildSetPilotMessage(state, bulbInfo.features);
+    size_t sentBytes = 0;
+
+    if (xSemaphoreTake(streamUdpMutex, pdMS_TO_TICKS(20)) == pdTRUE)
+    {
+        if (streamUdp == nullptr)
+        {
+            streamUdp = new AsyncUDP();
+            if (!streamUdp->listen(0))
+            {
+                Serial.println("Failed to start AsyncUDP for streaming");
+                delete streamUdp;
+                streamUdp = nullptr;
+            }
+        }
+        if (streamUdp != nullptr)
+        {
+            sentBytes = simulatedDrop() ? message.length
+                                        : streamUdp->writeTo((const uint8_t *)message.text, message.length, deviceIP, WIZ_PORT);
+            bulbHealthRecordTransmission();
+        }
+        xSemaphoreGive(streamUdpMutex);
+    }
+
+    return sentBytes > 0;
+}
+
+// Payloads and targets of the group being dispatched; only the fan-out task dispatches groups
+static SetPilotMessage groupMessages[WIZ_GROUP_MAX_COMMANDS];
+static IPAddress groupTargets[WIZ_GROUP_MAX_COMMANDS];
+
+GroupDispatchResult setBulbStatesGroup(WizGroupCommand *commands, size_t count, unsigned long ackTimeout)
+{
+    ALLOC_SCOPE("group dispatch");
+    GroupDispatchResult result;
+    AsyncUDP udp;
+    count = min(count, WIZ_GROUP_MAX_COMMANDS);
+    SetPilotMessage *messages = groupMessages;
+    IPAddress *targets = groupTargets;
+
+    // Prebuild every payload so the send loop does nothing but transmit
+    for (size_t i = 0; i < count; i++)
+    {
+        if (commands[i].bulb.ip == 0)
+        {
+            Serial.println("Invalid IP address in bulb info");
+        }
+        targets[i] = IPAddress(commands[i].bulb.ip);
+        messages[i] = buildSetPilotMessage(commands[i].state, commands[i].bulb.features);
+    }
+
+    // Acknowledgements arrive asynchronously and are matched by source IP; the handler captures
+    // two references, small enough for std::function's inline storage
+    udp.onPacket([&commands, &count](AsyncUDPPacket packet)
+                 {
+        unsigned long receivedAt = micros();
+        IPAddress responseIP = packet.remoteIP();
+
+        const int MAX_RESPONSE_SIZE = 256;
+        char response[MAX_RESPONSE_SIZE];
+        int len = min((int)packet.length(), MAX_RESPONSE_SIZE - 1);
+        memcpy(response, packet.data(), len);
+        response[len] = '\0';
+
+        JsonDocument responseDoc(jsonPoolAllocator());
+        if (deserializeJson(responseDoc, response) || !responseDoc["result"]["success"].as<bool>())
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (commands[i].sent && !commands[i].acked && groupTargets[i] == responseIP)
+            {
+                commands[i].ackedAt = receivedAt;
+                commands[i].acked = true;
+                break;
+            }
+        } });
+
+    if (!udp.listen(0))
+    {
+        Serial.println("Failed to start AsyncUDP for group dispatch");
+        return result;
+    }
+
+    // Back-to-back send; bulbs that are offline or paused are left unsent for the per-light path,
+    // whose acknowledged send also runs any probe that is due
+    unsigned long firstSend = 0;
+    unsigned long lastSend = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if ((uint32_t)targets[i] == 0 || bulbHealthIsOpen(targets[i]))
+        {
+            continue;
+        }
+
+        const SetPilotMessage &message = messages[i];
+        size_t sentBytes = simulatedDrop() ? message.length
+                                           : udp.writeTo((const uint8_t *)message.text, message.length, targets[i], WIZ_PORT);
+        bulbHealthRecordTransmission();
+        if (sentBytes == 0)
+        {
+            continue;
+        }
+
+        commands[i].sentAt = micros();
+        commands[i].sent = true;
+        if (result.sent == 0)
+        {
+            firstSend = commands[i].sentAt;
+        }
+        lastSend = commands[i].sentAt;
+        result.sent++;
+    }
+    result.sendSkew = lastSend - firstSend;
+
+    // Collect acknowledgements
+    unsigned long startTime = millis();
+    while (millis() - startTime < ackTimeout)
+    {
+        int pending = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (commands[i].sent && !commands[i].acked)
+            {
+                pending++;
+            }
+        }
+        if (pending == 0)
+        {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    udp.close();
+
+    // Acknowledgement times relative to the first send (wrap-safe)
+    unsigned long firstAck = 0;
+    unsigned long lastAck = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        WizGroupCommand &command = commands[i];
+        if (!command.sent)
+        {
+            continue;
+        }
+
+        // Same bookkeeping as setBulbState for each bulb
+        invalidateBulbStateCache(command.bulb);
+        if (command.acked)
+        {
+            unsigned long ackOffset = command.ackedAt - firstSend;
+            if (result.acked == 0 || ackOffset < firstAck)
+            {
+                firstAck = ackOffset;
+            }
+            if (result.acked == 0 || ackOffset > lastAck)
+            {
+                lastAck = ackOffset;
+            }
+            result.acked++;
+            bulbHealthRecordSuccess(targets[i]);
+            // sent is set after sentAt, and the callback only acks sent commands
+            recordWizLatency(WizOp::SET_PILOT, command.bulb.ip, command.ackedAt - command.sentAt, 1);
+        }
+    }
+    result.ackSkew = lastAck - firstAck;
+
+    return result;
+}
+
 WizBulbState getBulbState(const WizBulbInfo &bulbInfo)
 {
-    IPAddress deviceIP;
-    if (!deviceIP.fromString(bulbInfo.ip))
+    ALLOC_SCOPE("getPilot");
+    IPAddress deviceIP(bulbInfo.ip);
+    if (bulbInfo.ip == 0)
     {
         WizBulbState invalidState;
-        invalidState.errorMessage = "Invalid IP address: " + bulbInfo.ip;
-        Serial.printf("Invalid IP address in bulb info: %s\n", bulbInfo.ip.c_str());
+        invalidState.error = WizError::INVALID_IP;
+        Serial.println("Invalid IP address in bulb info");
         return invalidState;
     }
 
-    return getBulbState(deviceIP);
+    // Offline bulbs are only contacted by an occasional single-packet probe
+    bool probe = false;
+    if (!bulbHealthAllowRequest(deviceIP, &probe))
+    {
+        WizBulbState offlineState;
+        offlineState.error = WizError::BULB_OFFLINE;
+        return offlineState;
+    }
+    if (probe)
+    {
+        WizBulbState probeState = probeBulbState(deviceIP);
+        if (probeState.isValid)
+        {
+            bulbHealthRecordSuccess(deviceIP);
+        }
+        else
+        {
+            bulbHealthRecordFailure(deviceIP);
+        }
+        return probeState;
+    }
+
+    uint32_t ipKey = (uint32_t)deviceIP;
+    if (!takeBulbStateCacheMutex())
+    {
+        // Cache unavailable - fall back to a direct request
+        WizBulbState directState = getBulbState(deviceIP);
+        if (directState.isValid)
+        {
+            bulbHealthRecordSuccess(deviceIP);
+        }
+        else
+        {
+            bulbHealthRecordFailure(deviceIP);
+        }
+        return directState;
+    }
+
+    BulbStateCacheEntry &entry = bulbStateCache[ipKey];
+
+    // Serve a fresh result from memory
+    if (entry.fresh && entry.state.isValid && millis() - entry.fetchedAt < bulbStateCacheTtl)
+    {
+        WizBulbState cached = entry.state;
+        bulbStateCacheStats.hits++;
+        xSemaphoreGive(bulbStateCacheMutex);
+        return cached;
+    }
+
+    // Another caller is already fetching this bulb - share its result
+    if (entry.inFlight)
+    {
+        uint32_t waitGeneration = entry.generation;
+        bulbStateCacheStats.coalesced++;
+        xSemaphoreGive(bulbStateCacheMutex);
+
+        unsigned long waitStart = millis();
+        while (millis() - waitStart < STATE_CACHE_WAIT_TIMEOUT)
+        {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            if (takeBulbStateCacheMutex())
+            {
+                BulbStateCacheEntry &shared = bulbStateCache[ipKey];
+                if (shared.generation != waitGeneration)
+                {
+                    WizBulbState sharedState = shared.state;
+                    xSemaphoreGive(bulbStateCacheMutex);
+                    return sharedState;
+                }
+                xSemaphoreGive(bulbStateCacheMutex);
+            }
+        }
+
+        WizBulbState timeoutState;
+        timeoutState.error = WizError::SHARED_REQUEST_TIMEOUT;
+        return timeoutState;
+    }
+
+    // Fetch from the bulb; concurrent callers will wait for this result
+    entry.inFlight = true;
+    bulbStateCacheStats.misses++;
+    xSemaphoreGive(bulbStateCacheMutex);
+
+    WizBulbState state = getBulbState(deviceIP);
+    if (state.isValid)
+    {
+        bulbHealthRecordSuccess(deviceIP);
+    }
+    else
+    {
+        bulbHealthRecordFailure(deviceIP);
+    }
+
+    // Must not be skipped on a busy mutex: a stuck inFlight would make every later caller wait
+    // on a fetch that never completes. The cache's critical sections are short.
+    xSemaphoreTake(bulbStateCacheMutex, portMAX_DELAY);
+    BulbStateCacheEntry &done = bulbStateCache[ipKey];
+    done.state = state;
+    done.fetchedAt = millis();
+    done.fresh = state.isValid && !done.staleOnArrival;
+    done.staleOnArrival = false;
+    done.inFlight = false;
+    done.generation++;
+    xSemaphoreGive(bulbStateCacheMutex);
+
+    return state;
+}
+
+void setBulbStateCacheTtl(unsigned long ttlMs)
+{
+    bulbStateCacheTtl = ttlMs;
+    Serial.printf("Bulb state cache TTL set to %lu ms\n", ttlMs);
+}
+
+void invalidateBulbStateCache(const WizBulbInfo &bulbInfo)
+{
+    IPAddress deviceIP(bulbInfo.ip);
+    if (bulbInfo.ip == 0)
+    {
+        return;
+    }
+
+    if (takeBulbStateCacheMutex())
+    {
+        auto it = bulbStateCache.find((uint32_t)deviceIP);
+        if (it != bulbStateCache.end())
+        {
+            it->second.fresh = false;
+            it->second.staleOnArrival = it->second.inFlight;
+        }
+        xSemaphoreGive(bulbStateCacheMutex);
+    }
+}
+
+BulbStateCacheStats getBulbStateCacheStats()
+{
+    BulbStateCacheStats stats;
+    if (takeBulbStateCacheMutex())
+    {
+        stats = bulbStateCacheStats;
+        xSemaphoreGive(bulbStateCacheMutex);
+    }
+    return stats;
+}
+
+void logBulbStateCacheStats()
+{
+    BulbStateCacheStats stats = getBulbStateCacheStats();
+    uint32_t total = stats.hits + stats.misses + stats.coalesced;
+    if (total == 0)
+    {
+        return;
+    }
+
+    Serial.printf("Bulb state cache: %lu hits, %lu misses, %lu coalesced (%.1f%% served without a new request, TTL %lu ms)\n",
+                  (unsigned long)stats.hits, (unsigned long)stats.misses, (unsigned long)stats.coalesced,
+                  100.0f * (stats.hits + stats.coalesced) / total, bulbStateCacheTtl);
 }
 
 String wizBulbStateToJson(const WizBulbState &state)
@@ -864,8 +1525,8 @@ String wizBulbStateToJson(const WizBulbState &state)
         doc["fanspd"] = state.fanspd;
 
     doc["isValid"] = state.isValid;
-    if (!state.errorMessage.isEmpty())
-        doc["errorMessage"] = state.errorMessage;
+    if (state.error != WizError::NONE)
+        doc["errorMessage"] = wizErrorToString(state.error);
     if (state.lastUpdated > 0)
         doc["lastUpdated"] = state.lastUpdated;
 
@@ -908,21 +1569,184 @@ BulbClass bulbClassFromString(const String &str)
     return BulbClass::UNKNOWN;
 }
 
-String wizBulbInfoToJson(const WizBulbInfo &bulbInfo)
+IpStr::IpStr(uint32_t ip)
 {
-    JsonDocument doc;
+    IPAddress address(ip);
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
+}
+
+MacStr::MacStr(const uint8_t *mac)
+{
+    // WiZ reports MACs as 12 lowercase hex digits without separators
+    snprintf(text, sizeof(text), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+bool parseMac(const char *text, uint8_t *mac)
+{
+    uint8_t parsed[6];
+    for (int i = 0; i < 6; i++)
+    {
+        char *end = nullptr;
+        char digits[3] = {text[0], text[0] ? text[1] : '\0', '\0'};
+        parsed[i] = (uint8_t)strtoul(digits, &end, 16);
+        if (end != digits + 2)
+        {
+            memset(mac, 0, 6);
+            return false;
+        }
+        text += 2;
+        if (*text == ':' || *text == '-')
+        {
+            text++;
+        }
+    }
+    memcpy(mac, parsed, 6);
+    return true;
+}
+
+bool macIsSet(const uint8_t *mac)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        if (mac[i] != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t macKey(const uint8_t *mac)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        key = (key << 8) | mac[i];
+    }
+    return key;
+}
+
+void macFromKey(uint64_t key, uint8_t *mac)
+{
+    for (int i = 5; i >= 0; i--, key >>= 8)
+    {
+        mac[i] = key & 0xFF;
+    }
+}
+
+// Module names are shared by every bulb of the same model, so each is stored once
+const int MAX_MODULE_NAMES = 32;
+static const char *moduleNames[MAX_MODULE_NAMES] = {"Unknown"};
+static int moduleNameCount = 1;
+static SemaphoreHandle_t moduleNameMutex = nullptr;
+
+uint8_t internModuleName(const char *moduleName)
+{
+    if (moduleName == nullptr || *moduleName == '\0')
+    {
+        return 0;
+    }
+    if (moduleNameMutex == nullptr)
+    {
+        moduleNameMutex = xSemaphoreCreateMutex();
+    }
+    if (moduleNameMutex == nullptr || xSemaphoreTake(moduleNameMutex, pdMS_TO_TICKS(100)) != pdTRUE)
+    {
+        return 0;
+    }
+
+    uint8_t id = 0;
+    for (int i = 0; i < moduleNameCount; i++)
+    {
+        if (strcmp(moduleNames[i], moduleName) == 0)
+        {
+            id = i;
+            break;
+        }
+    }
+    if (id == 0 && strcmp(moduleName, moduleNames[0]) != 0)
+    {
+        if (moduleNameCount < MAX_MODULE_NAMES)
+        {
+            char *copy = strdup(moduleName); // Never freed - names live for the whole run
+            if (copy != nullptr)
+            {
+                moduleNames[moduleNameCount] = copy;
+                id = moduleNameCount++;
+            }
+        }
+        else
+        {
+            Serial.printf("Module name table full, storing %s as Unknown\n", moduleName);
+        }
+    }
+    xSemaphoreGive(moduleNameMutex);
+    return id;
+}
 
+const char *moduleNameOf(uint8_t moduleId)
+{
+    return moduleId < moduleNameCount ? moduleNames[moduleId] : moduleNames[0];
+}
+
+const char *wizErrorToString(WizError error)
+{
+    switch (error)
+    {
+    case WizError::NONE:
+        return "";
+    case WizError::INVALID_IP:
+        return "Invalid IP address";
+    case WizError::UDP_START_FAILED:
+        return "Failed to start AsyncUDP";
+    case WizError::TIMEOUT:
+        return "Timeout - no response";
+    case WizError::INVALID_RESPONSE:
+        return "Invalid response format";
+    case WizError::JSON_PARSE:
+        return "JSON parse error";
+    case WizError::BULB_OFFLINE:
+        return "Bulb offline (circuit open)";
+    case WizError::SHARED_REQUEST_TIMEOUT:
+        return "Timeout waiting for shared state request";
+    }
+    return "Unknown error";
+}
+
+WizError wizErrorFromString(const char *message)
+{
+    // Inverse of wizErrorToString for exported JSON; older free-form messages map by prefix
+    const WizError errors[] = {WizError::INVALID_IP, WizError::UDP_START_FAILED, WizError::TIMEOUT,
+                               WizError::INVALID_RESPONSE, WizError::JSON_PARSE, WizError::BULB_OFFLINE,
+                               WizError::SHARED_REQUEST_TIMEOUT};
+    if (message == nullptr || *message == '\0')
+    {
+        return WizError::NONE;
+    }
+    for (WizError error : errors)
+    {
+        const char *text = wizErrorToString(error);
+        if (strncmp(message, text, strlen(text)) == 0)
+        {
+            return error;
+        }
+    }
+    return WizError::INVALID_RESPONSE;
+}
+
+void wizBulbInfoToJson(const WizBulbInfo &bulbInfo, JsonObject doc)
+{
     // Device identification
-    doc["ip"] = bulbInfo.ip;
-    doc["mac"] = bulbInfo.mac;
-    doc["moduleName"] = bulbInfo.moduleName;
-    doc["fwVersion"] = bulbInfo.fwVersion;
+    doc["ip"] = IpStr(bulbInfo.ip).c_str();
+    doc["mac"] = MacStr(bulbInfo.mac).c_str();
+    doc["moduleName"] = moduleNameOf(bulbInfo.moduleId);
+    doc["fwVersion"] = (const char *)bulbInfo.fwVersion;
 
     // Network info
     doc["rssi"] = bulbInfo.rssi;
     doc["homeId"] = bulbInfo.homeId;
     doc["roomId"] = bulbInfo.roomId;
-    doc["src"] = bulbInfo.src;
+    doc["src"] = (const char *)bulbInfo.src;
 
     // Capabilities
     doc["bulbClass"] = bulbClassToString(bulbInfo.bulbClass);
@@ -940,8 +1764,14 @@ String wizBulbInfoToJson(const WizBulbInfo &bulbInfo)
 
     // Additional info
     doc["isValid"] = bulbInfo.isValid;
-    if (!bulbInfo.errorMessage.isEmpty())
-        doc["errorMessage"] = bulbInfo.errorMessage;
+    if (bulbInfo.error != WizError::NONE)
+        doc["errorMessage"] = wizErrorToString(bulbInfo.error);
+}
+
+String wizBulbInfoToJson(const WizBulbInfo &bulbInfo)
+{
+    JsonDocument doc;
+    wizBulbInfoToJson(bulbInfo, doc.to<JsonObject>());
 
     String json;
     serializeJson(doc, json);
@@ -956,7 +1786,7 @@ WizBulbState wizBulbStateFromJson(const String &json)
     DeserializationError error = deserializeJson(doc, json);
     if (error)
     {
-        state.errorMessage = "JSON parse error: " + String(error.c_str());
+        state.error = WizError::JSON_PARSE;
         return state;
     }
 
@@ -973,7 +1803,7 @@ WizBulbState wizBulbStateFromJson(const String &json)
     state.fanspd = doc["fanspd"] | -1;
 
     state.isValid = doc["isValid"] | false;
-    state.errorMessage = doc["errorMessage"] | "";
+    state.error = wizErrorFromString(doc["errorMessage"] | "");
     state.lastUpdated = doc["lastUpdated"] | 0;
 
     return state;
@@ -981,44 +1811,54 @@ WizBulbState wizBulbStateFromJson(const String &json)
 
 WizBulbInfo wizBulbInfoFromJson(const String &json)
 {
-    WizBulbInfo bulbInfo;
     JsonDocument doc;
 
     DeserializationError error = deserializeJson(doc, json);
     if (error)
     {
-        bulbInfo.errorMessage = "JSON parse error: " + String(error.c_str());
+        WizBulbInfo bulbInfo;
+        bulbInfo.error = WizError::JSON_PARSE;
         return bulbInfo;
     }
+    return wizBulbInfoFromJson(doc.as<JsonObjectConst>());
+}
+
+WizBulbInfo wizBulbInfoFromJson(JsonObjectConst doc)
+{
+    WizBulbInfo bulbInfo;
 
     // Device identification
-    bulbInfo.ip = doc["ip"] | "";
-    bulbInfo.mac = doc["mac"] | "";
-    bulbInfo.moduleName = doc["moduleName"] | "";
-    bulbInfo.fwVersion = doc["fwVersion"] | "";
+    IPAddress ip;
+    if (ip.fromString(doc["ip"] | ""))
+    {
+        bulbInfo.ip = (uint32_t)ip;
+    }
+    parseMac(doc["mac"] | "", bulbInfo.mac);
+    bulbInfo.moduleId = internModuleName(doc["moduleName"] | "Unknown");
+    strlcpy(bulbInfo.fwVersion, doc["fwVersion"] | "", sizeof(bulbInfo.fwVersion));
 
     // Network info
     bulbInfo.rssi = doc["rssi"] | 0;
-    bulbInfo.homeId = doc["homeId"] | "";
-    bulbInfo.roomId = doc["roomId"] | "";
-    bulbInfo.src = doc["src"] | "";
+    bulbInfo.homeId = doc["homeId"] | 0;
+    bulbInfo.roomId = doc["roomId"] | 0;
+    strlcpy(bulbInfo.src, doc["src"] | "", sizeof(bulbInfo.src));
 
     // Capabilities
     String bulbClassStr = doc["bulbClass"] | "UNKNOWN";
     bulbInfo.bulbClass = bulbClassFromString(bulbClassStr);
 
-    if (doc["features"].is<JsonObject>())
+    if (doc["features"].is<JsonObjectConst>())
     {
-        JsonObject features = doc["features"];
+        JsonObjectConst features = doc["features"];
         bulbInfo.features.brightness = features["brightness"] | false;
         bulbInfo.features.color = features["color"] | false;
         bulbInfo.features.color_tmp = features["color_tmp"] | false;
         bulbInfo.features.effect = features["effect"] | false;
         bulbInfo.features.fan = features["fan"] | false;
 
-        if (features["kelvin_range"].is<JsonObject>())
+        if (features["kelvin_range"].is<JsonObjectConst>())
         {
-            JsonObject kelvinRange = features["kelvin_range"];
+            JsonObjectConst kelvinRange = features["kelvin_range"];
             bulbInfo.features.kelvin_range.min = kelvinRange["min"] | 2200;
             bulbInfo.features.kelvin_range.max = kelvinRange["max"] | 6500;
         }
@@ -1026,61 +1866,134 @@ WizBulbInfo wizBulbInfoFromJson(const String &json)
 
     // Additional info
     bulbInfo.isValid = doc["isValid"] | false;
-    bulbInfo.errorMessage = doc["errorMessage"] | "";
+    bulbInfo.error = wizErrorFromString(doc["errorMessage"] | "");
 
     return bulbInfo;
 }
 
-std::vector<WizBulbInfo> updateBulbIPs(const std::vector<WizBulbInfo> &cachedBulbs, const std::vector<WizBulbInfo> &discoveredBulbs)
+// Patch the addresses of registered bulbs in place (bindings stay intact); returns bulbs moved
+int applyDiscoveredIPs(const std::vector<WizBulbInfo> &discoveredBulbs)
 {
-    std::vector<WizBulbInfo> updatedBulbs = cachedBulbs;
-    bool anyUpdated = false;
-
-    Serial.printf("Updating IP addresses for %d cached bulbs using %d discovered bulbs\n", cachedBulbs.size(), discoveredBulbs.size());
-
-    for (size_t i = 0; i < updatedBulbs.size(); i++)
+    int moved = 0;
+    for (const WizBulbInfo &discovered : discoveredBulbs)
     {
-        WizBulbInfo &cached = updatedBulbs[i];
+        if (!macIsSet(discovered.mac))
+        {
+            continue;
+        }
+        int handle = bulbRegistryFindByMac(discovered.mac);
+        WizBulbInfo cached;
+        if (!bulbRegistryGet(handle, cached))
+        {
+            continue;
+        }
+        if (bulbRegistryUpdateIp(discovered.mac, discovered.ip))
+        {
+            Serial.printf("Updating IP for MAC %s: %s -> %s\n",
+                          MacStr(cached.mac).c_str(), IpStr(cached.ip).c_str(), IpStr(discovered.ip).c_str());
+            moved++;
 
-        // Find matching bulb by MAC address
-        for (const WizBulbInfo &discovered : discoveredBulbs)
+            // One journal entry per moved bulb instead of rewriting the whole cache; the storage
+            // writer falls back to a full save if journaling fails
+            requestLightIpSave(discovered.mac);
+        }
+        else
         {
-            if (discovered.mac == cached.mac && !discovered.mac.isEmpty())
-            {
-                if (discovered.ip != cached.ip)
-                {
-                    Serial.printf("Updating IP for MAC %s: %s -> %s\n",
-                                  cached.mac.c_str(), cached.ip.c_str(), discovered.ip.c_str());
-                    cached.ip = discovered.ip;
-                    anyUpdated = true;
-                }
-                else
-                {
-                    Serial.printf("IP unchanged for MAC %s: %s\n", cached.mac.c_str(), cached.ip.c_str());
-                }
-                break;
-            }
+            Serial.printf("IP unchanged for MAC %s: %s\n", MacStr(cached.mac).c_str(), IpStr(cached.ip).c_str());
         }
     }
 
-    if (anyUpdated)
+    if (moved > 0)
+    {
+        Serial.println("IP addresses updated, queued for the binary cache journal");
+    }
+    else
+    {
+        Serial.println("No IP address changes detected");
+    }
+    return moved;
+}
+
+std::vector<WizBulbInfo> updateBulbIPs(const std::vector<WizBulbInfo> &cachedBulbs, const std::vector<WizBulbInfo> &discoveredBulbs)
+{
+    Serial.printf("Updating IP addresses for %d cached bulbs using %d discovered bulbs\n", cachedBulbs.size(), discoveredBulbs.size());
+
+    // Cached bulbs go into the registry; each discovered bulb is then one MAC lookup
+    bulbRegistryLoad(cachedBulbs);
+    applyDiscoveredIPs(discoveredBulbs);
+    return bulbRegistrySnapshot();
+}
+
+// Background discovery: after a cached boot the first pass runs right away while the endpoints
+// already run on the cached addresses; then a pass every BACKGROUND_DISCOVERY_INTERVAL. Moved
+// bulbs are patched into the registry and the running lights, new bulbs are hot-added and bulbs
+// absent for too long are retired.
+const unsigned long BACKGROUND_DISCOVERY_INTERVAL = 600000; // 10 minutes
+
+static volatile unsigned long backgroundDiscoveryDoneAt = 0;
+static TaskHandle_t backgroundDiscoveryHandle = nullptr;
+
+static void backgroundDiscoveryPass()
+{
+    unsigned long start = millis();
+
+    std::vector<WizBulbInfo> discoveredBulbs = scanForWiz(broadcastIP());
+    int moved = applyDiscoveredIPs(discoveredBulbs);
+    int patched = moved > 0 ? refreshLightAddresses() : 0;
+    int added = hotAddLights(discoveredBulbs, start);
+    int retired = retireAbsentLights();
+
+    unsigned long doneAt = millis();
+    if (backgroundDiscoveryDoneAt == 0)
+    {
+        backgroundDiscoveryDoneAt = doneAt;
+    }
+    Serial.printf("Background discovery: %d bulbs seen in %lu ms (done %lu ms after power-on), %d moved, %d lights patched, %d added, %d retired\n",
+                  discoveredBulbs.size(), doneAt - start, doneAt, moved, patched, added, retired);
+}
+
+static void backgroundDiscoveryTask(void *parameter)
+{
+    bool scanNow = parameter != nullptr;
+    while (true)
     {
-        Serial.println("IP addresses updated, saving to cache");
-        if (saveLightsToFile(updatedBulbs))
+        if (!scanNow)
         {
-            Serial.println("Successfully updated and saved lights cache");
+            // Woken early by requestDiscoveryNow
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BACKGROUND_DISCOVERY_INTERVAL));
         }
-        else
+        scanNow = false;
+        if (isWifiConnected())
         {
-            Serial.println("Failed to save updated lights cache");
+            backgroundDiscoveryPass();
         }
+        // Requests made while the pass was listening are answered by it
+        ulTaskNotifyTake(pdTRUE, 0);
     }
-    else
+}
+
+bool startBackgroundDiscovery(bool scanNow)
+{
+    // Below the light tasks: discovery is a 10 s listen and must not delay live traffic
+    if (xTaskCreate(backgroundDiscoveryTask, "WizDiscovery", 8192, scanNow ? (void *)1 : nullptr, 2, &backgroundDiscoveryHandle) != pdPASS)
     {
-        Serial.println("No IP address changes detected");
+        Serial.println("Failed to create background discovery task");
+        return false;
+    }
+    return true;
+}
+
+void requestDiscoveryNow()
+{
+    if (backgroundDiscoveryHandle != nullptr)
+    {
+        xTaskNotifyGive(backgroundDiscoveryHandle);
     }
+}
 
-    return updatedBulbs;
+unsigned long backgroundDiscoveryFinishedAt()
+{
+    return backgroundDiscoveryDoneAt;
 }
 
 std::vector<WizBulbInfo> discoverOrLoadLights(IPAddress broadcastIP, bool *fromCache)
@@ -1114,21 +2027,21 @@ std::vector<WizBulbInfo> discoverOrLoadLights(IPAddress broadcastIP, bool *fromC
 
     // No cached lights, perform discovery
     Serial.println("No cached lights found, performing network discovery...");
-    std::vector<WizBulbInfo> bulbs = scanForWiz(broadcastIP);
     if (fromCache)
         *fromCache = false;
+    return discoverAndSaveLights(broadcastIP);
+}
+
+std::vector<WizBulbInfo> discoverAndSaveLights(IPAddress broadcastIP)
+{
+    std::vector<WizBulbInfo> bulbs = scanForWiz(broadcastIP);
 
     if (bulbs.size() > 0)
     {
-        // Save discovered lights to file
-        if (saveLightsToFile(bulbs))
-        {
-            Serial.println("Successfully saved discovered lights to cache");
-        }
-        else
-        {
-            Serial.println("Failed to save lights to cache");
-        }
+        // The storage writer saves whatever the registry holds when the write runs
+        bulbRegistryLoad(bulbs);
+        requestLightsSave();
+        Serial.println("Discovered lights queued for saving to cache");
     }
 
     return bulbs;
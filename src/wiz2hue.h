@@ -5,6 +5,7 @@
 #include <Arduino.h>
 #include <vector>
 #include <LittleFS.h>
+#include <ArduinoJson.h>
 
 const int RED_PIN = D0;
 const int BLUE_PIN = D1;
@@ -12,7 +13,7 @@ const int GREEN_PIN = D2;
 const int YELLOW_PIN = D3;
 
 // Bulb capability and feature structures
-enum class BulbClass
+enum class BulbClass : uint8_t
 {
     UNKNOWN,
     RGB,    // Full color RGB + Tunable White (SHRGB modules)
@@ -24,8 +25,8 @@ enum class BulbClass
 
 struct KelvinRange
 {
-    int min = 2200;
-    int max = 6500;
+    uint16_t min = 2200;
+    uint16_t max = 6500;
 };
 
 struct Features
@@ -38,6 +39,19 @@ struct Features
     KelvinRange kelvin_range;
 };
 
+// Request failure reasons; the text is only produced when printed or exported
+enum class WizError : uint8_t
+{
+    NONE,
+    INVALID_IP,
+    UDP_START_FAILED,
+    TIMEOUT,
+    INVALID_RESPONSE,
+    JSON_PARSE,
+    BULB_OFFLINE,
+    SHARED_REQUEST_TIMEOUT
+};
+
 struct WizBulbState
 {
     // Basic state
@@ -62,24 +76,26 @@ struct WizBulbState
     int fanspd = -1; // fan speed 0-100 (-1 = unknown)
 
     // Additional state info
-    bool isValid = false;          // whether state was successfully read
-    String errorMessage;           // error description if read failed
-    unsigned long lastUpdated = 0; // timestamp of last state read
+    bool isValid = false;            // whether state was successfully read
+    WizError error = WizError::NONE; // why the read failed
+    unsigned long lastUpdated = 0;   // timestamp of last state read
+    uint32_t payloadFingerprint = 0; // hash of raw getPilot reply without volatile fields (0 = none)
 };
 
+// Fixed-layout bulb record (no heap); see IpStr/MacStr/moduleNameOf for the text forms
 struct WizBulbInfo
 {
     // Device identification
-    String ip;
-    String mac;
-    String moduleName;
-    String fwVersion;
+    uint32_t ip = 0;       // IPAddress as uint32 (0 = unknown)
+    uint8_t mac[6] = {};   // all zero = unknown
+    uint8_t moduleId = 0;  // interned module name (0 = "Unknown")
+    char fwVersion[12] = "";
 
     // Network info
-    int rssi = 0;
-    String homeId;
-    String roomId;
-    String src;
+    uint32_t homeId = 0;
+    uint32_t roomId = 0;
+    char src[8] = "";
+    int8_t rssi = 0;
 
     // Capabilities
     BulbClass bulbClass = BulbClass::UNKNOWN;
@@ -87,17 +103,77 @@ struct WizBulbInfo
 
     // Additional info
     bool isValid = false;
-    String errorMessage;
+    WizError error = WizError::NONE;
+};
+
+// Text forms of compact bulb fields, formatted into a stack buffer. Use within a single
+// expression, e.g. Serial.printf("%s", IpStr(bulb.ip).c_str()).
+struct IpStr
+{
+    char text[16];
+    explicit IpStr(uint32_t ip);
+    const char *c_str() const { return text; }
 };
 
+struct MacStr
+{
+    char text[13];
+    explicit MacStr(const uint8_t *mac);
+    const char *c_str() const { return text; }
+};
+
+bool parseMac(const char *text, uint8_t *mac);
+bool macIsSet(const uint8_t *mac);
+uint64_t macKey(const uint8_t *mac); // The MAC as a 48-bit number, 0 = unknown
+void macFromKey(uint64_t key, uint8_t *mac);
+uint8_t internModuleName(const char *moduleName);
+const char *moduleNameOf(uint8_t moduleId);
+const char *wizErrorToString(WizError error);
+WizError wizErrorFromString(const char *message);
+
 IPAddress wifi_connect(int pin_to_blink, int button);
 IPAddress broadcastIP();
-bool checkWiFiConnection();
+
+// WiFi supervisor (wifi.cpp): non-blocking reconnect with backoff while Zigbee stays up
+struct WifiOutageStats
+{
+    uint32_t outages = 0;
+    uint32_t recoveries = 0;          // outages that ended without a restart
+    unsigned long lastRecoveryMs = 0; // link lost -> link back
+    unsigned long maxRecoveryMs = 0;
+    uint64_t totalRecoveryMs = 0;
+};
+
+void wifiSupervisorTick(); // From loop()
+bool isWifiConnected();
+unsigned long wifiOutageDuration(); // 0 while connected
+WifiOutageStats getWifiOutageStats();
+void logWifiStats();
 
 void setup_lights(const std::vector<WizBulbInfo> &bulbs);
 void hue_connect(int pin_to_blink, int button, const std::vector<WizBulbInfo> &bulbs = std::vector<WizBulbInfo>());
 void hue_reset();
-bool checkZigbeeConnection();
+void logLightStats();
+int refreshLightAddresses(); // Push registry address changes into the running lights
+int replayDesiredStates(); // Send parked Hue commands now; returns the lights that had one
+int hotAddLights(const std::vector<WizBulbInfo> &discoveredBulbs, unsigned long seenAt); // New MACs onto spare endpoints
+int retireAbsentLights(); // Free the endpoints of bulbs absent for WIZ2HUE_BULB_RETIRE_AFTER
+
+// Zigbee supervisor (lights.cpp): rejoins in place with backoff while WiFi and the bulbs stay up
+struct ZigbeeRecoveryStats
+{
+    uint32_t outages = 0;
+    uint32_t recoveries = 0; // rejoined without a restart
+    uint32_t rejoinAttempts = 0;
+    unsigned long lastRecoveryMs = 0; // connection lost -> connected again
+    unsigned long maxRecoveryMs = 0;
+    uint64_t totalRecoveryMs = 0;
+};
+
+void zigbeeSupervisorTick(); // From loop()
+unsigned long zigbeeOutageDuration(); // 0 while connected
+ZigbeeRecoveryStats getZigbeeRecoveryStats();
+void logZigbeeStats();
 
 // Leader mode enumeration
 enum class LeaderMode
@@ -110,6 +186,67 @@ enum class LeaderMode
 // WiZ bulb health monitoring globals
 extern int wizBulbFailureCount;
 
+// Per-bulb circuit breaker: CLOSED = normal, OPEN = offline (fail fast), HALF_OPEN = probe in progress
+enum class BulbHealthState
+{
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+};
+
+struct BulbHealthInfo
+{
+    BulbHealthState state = BulbHealthState::CLOSED;
+    int consecutiveFailures = 0;
+    unsigned long probeBackoff = 0;   // current delay between probes while open
+    unsigned long nextProbeAt = 0;    // millis() when the next probe is allowed
+    unsigned long openedAt = 0;       // millis() when the circuit last opened
+    unsigned long trackedSince = 0;   // millis() of the first recorded result
+    unsigned long totalOpenTime = 0;  // accumulated time spent open (closed periods excluded)
+    uint32_t failFastCount = 0;       // requests rejected without network traffic
+    uint32_t probeCount = 0;          // probes sent while open
+    unsigned long lastFailureAt = 0;  // millis() of the last failed operation
+    unsigned long lastSuccessAt = 0;  // millis() of the last successful operation
+    bool heldByPause = false;         // circuit opened in the failure episode that paused bulb I/O
+    bool confirmedDown = false;       // open circuit the WiFi check blamed on the bulb, not the network
+};
+
+// Correlated-failure detection: most bulbs failing together means the network is down, not the bulbs
+struct NetworkFailureStats
+{
+    uint32_t networkEvents = 0;           // failures classified as network loss
+    uint32_t bulbEvents = 0;              // failures attributed to individual bulbs (circuits opened)
+    unsigned long lastDetectionTime = 0;  // first failure -> classification, ms
+    uint32_t lastWastedTransmissions = 0; // packets sent between first failure and classification
+    uint32_t pausedRejects = 0;           // bulb requests rejected while I/O was paused
+};
+
+// Circuits are kept per bulb MAC, looked up in the registry from the address; addresses of
+// unregistered bulbs are not tracked and always allowed
+void initBulbHealth(); // Creates the health mutex; called by initWizClient
+bool bulbHealthAllowRequest(IPAddress deviceIP, bool *isProbe);
+bool bulbHealthIsOpen(IPAddress deviceIP); // Non-consuming check for unacknowledged sends
+void bulbHealthRecordSuccess(IPAddress deviceIP);
+void bulbHealthRecordFailure(IPAddress deviceIP);
+BulbHealthInfo getBulbHealth(IPAddress deviceIP);
+void bulbHealthRelease(const uint8_t *mac); // Forgets the bulb's circuit when it is retired
+bool isBulbAvailable(const WizBulbInfo &bulbInfo);
+void logBulbHealth();
+
+void bulbHealthRecordTransmission();
+bool isBulbIoPaused();
+void pauseBulbIo(); // Link known to be down
+void resumeBulbIo(); // Closes the pause's circuits only if the link was seen down
+bool consumeWifiCheckRequest();
+unsigned long bulbIoPausedFor();
+NetworkFailureStats getNetworkFailureStats();
+
+#ifdef WIZ2HUE_NET_SIM
+// Simulated network loss: bulb packets are silently dropped while enabled
+void setSimulatedNetworkDown(bool down);
+bool isSimulatedNetworkDown();
+#endif
+
 // System reset functions
 void checkForReset(int button);
 void resetSystem();
@@ -117,6 +254,7 @@ void resetSystem();
 void ledDigital(int *left, int period, int pin, int sleep);
 void ledAnalog(int *left, int period, int pin, int sleep);
 
+void initWizClient(); // Call once in setup(), before any WiZ request
 std::vector<WizBulbInfo> scanForWiz(IPAddress broadcastIP);
 WizBulbInfo getSystemConfig(IPAddress deviceIP);
 
@@ -127,18 +265,268 @@ bool setBulbState(const WizBulbInfo &bulbInfo, const WizBulbState &state);
 // Convenience functions for WizBulbInfo state management
 WizBulbState getBulbState(const WizBulbInfo &bulbInfo);
 
+// Group dispatch: one setPilot per bulb, all sent back-to-back on a single socket. The payloads
+// live in fixed buffers, so a dispatch takes at most WIZ_GROUP_MAX_COMMANDS bulbs.
+const size_t WIZ_GROUP_MAX_COMMANDS = 32;
+
+struct WizGroupCommand
+{
+    WizBulbInfo bulb;
+    WizBulbState state;
+    uint8_t endpoint = 0;
+    bool sent = false;
+    volatile bool acked = false;
+    unsigned long sentAt = 0;  // micros()
+    unsigned long ackedAt = 0; // micros()
+};
+
+struct GroupDispatchResult
+{
+    int sent = 0;
+    int acked = 0;
+    unsigned long sendSkew = 0; // first to last send, us
+    unsigned long ackSkew = 0;  // first to last acknowledgement, us
+};
+
+GroupDispatchResult setBulbStatesGroup(WizGroupCommand *commands, size_t count, unsigned long ackTimeout);
+
+// Streaming: single unacknowledged setPilot frame (no retries, no wait)
+bool sendBulbStateUnacked(const WizBulbInfo &bulbInfo, const WizBulbState &state);
+
+// WiZ round-trip latency (latency.cpp): lock-free log-scale histograms per bulb and operation
+enum class WizOp : uint8_t
+{
+    SET_PILOT,
+    GET_PILOT,
+    COUNT
+};
+
+struct LatencySummary
+{
+    uint32_t samples = 0;  // requests that got a reply
+    uint32_t timeouts = 0; // requests that ran out of attempts
+    unsigned long p50Micros = 0;
+    unsigned long p90Micros = 0;
+    unsigned long p99Micros = 0;
+    unsigned long maxMicros = 0;
+    float avgAttempts = 0.0f; // attempts per answered request
+};
+
+void recordWizLatency(WizOp op, uint32_t ip, unsigned long rttMicros, int attempts); // RTT of the answered attempt
+void recordWizTimeout(WizOp op, uint32_t ip);
+void releaseWizLatency(const uint8_t *mac); // Frees the bulb's histograms when it is retired
+LatencySummary getWizLatency(WizOp op, const uint8_t *mac); // nullptr = all bulbs
+void logWizLatencyStats();
+
+// getPilot fast path statistics (replies identical to the previous one skip JSON parsing)
+struct PilotFastPathStats
+{
+    uint32_t replies = 0;        // valid getPilot replies received
+    uint32_t hits = 0;           // replies matching the previous fingerprint (parse skipped)
+    uint32_t applySkips = 0;     // polls where the Zigbee update was skipped as well
+    uint64_t parseMicros = 0;    // total time spent parsing non-matching replies
+    uint32_t parses = 0;
+    uint64_t applyMicros = 0;    // total time spent applying state to Zigbee
+    uint32_t applies = 0;
+};
+
+// Bulb state cache in front of getBulbState(const WizBulbInfo &): fresh results are served from
+// memory and concurrent callers for the same bulb share one in-flight request
+struct BulbStateCacheStats
+{
+    uint32_t hits = 0;      // served from a fresh cache entry
+    uint32_t misses = 0;    // required a network round trip
+    uint32_t coalesced = 0; // waited for another caller's in-flight request
+};
+
+void setBulbStateCacheTtl(unsigned long ttlMs);
+void invalidateBulbStateCache(const WizBulbInfo &bulbInfo);
+BulbStateCacheStats getBulbStateCacheStats();
+void logBulbStateCacheStats();
+
+void recordPilotApply(unsigned long applyMicros);
+void recordPilotApplySkip();
+PilotFastPathStats getPilotFastPathStats();
+void logPilotFastPathStats();
+
+// Fixed-point color kernel (replaces the float RGB -> XY -> RGB round trip)
+void colorNormalizeRgb(uint8_t &r, uint8_t &g, uint8_t &b);
+void colorNormalizeRgbBatch(const uint8_t *rgbIn, uint8_t *rgbOut, size_t count); // packed RGB triplets
+int miredsToKelvin(int mireds);
+int kelvinToMireds(int kelvin);
+uint8_t levelToPercent(uint8_t level);
+uint8_t percentToLevel(int percent);
+#ifdef WIZ2HUE_COLOR_BENCH
+void colorKernelSelfCheck();
+#endif
+
+// Pooled allocator for short-lived JsonDocuments on the UDP paths: JsonDocument doc(jsonPoolAllocator());
+struct JsonPoolStats
+{
+    uint32_t poolAllocs = 0;          // served from the fixed blocks
+    uint32_t heapAllocs = 0;          // fell back to malloc/realloc
+    uint32_t oversized = 0;           // larger than the biggest block class
+    int blocksInUse = 0;
+    size_t minLargestFreeBlock = 0;   // smallest largest-free-heap-block seen at a report
+};
+
+ArduinoJson::Allocator *jsonPoolAllocator();
+JsonPoolStats getJsonPoolStats();
+void logJsonPoolStats();
+
+// Bulb registry (registry.cpp): owns the bulb records, O(1) lookup by MAC, IP and endpoint.
+// Handles are small integers, -1 when not found; they stay valid until the bulb is removed.
+class ZigbeeWizLight;
+const int BULB_REGISTRY_CAPACITY = 256;
+
+void initBulbRegistry(); // Runs in setup() before any task can use the registry
+int bulbRegistryAdd(const WizBulbInfo &info); // Adds, or refreshes the record with the same MAC
+void bulbRegistryLoad(const std::vector<WizBulbInfo> &bulbs); // Replaces the whole registry
+bool bulbRegistryUpdateIp(const uint8_t *mac, uint32_t ip); // true if the address changed
+bool bulbRegistryRemove(const uint8_t *mac);
+void bulbRegistryClear();
+int bulbRegistryFindByMac(const uint8_t *mac);
+int bulbRegistryFindByIp(uint32_t ip);
+bool bulbRegistryMacForIp(uint32_t ip, uint8_t *mac); // false if no registered bulb has the address
+int bulbRegistryFindByEndpoint(uint8_t endpoint);
+bool bulbRegistryGet(int handle, WizBulbInfo &info);
+bool bulbRegistryBindLight(int handle, uint8_t endpoint, ZigbeeWizLight *light);
+void bulbRegistryUnbindLights();
+ZigbeeWizLight *bulbRegistryLightForEndpoint(uint8_t endpoint);
+std::vector<WizBulbInfo> bulbRegistrySnapshot(); // In insertion order
+size_t bulbRegistryCount();
+size_t bulbRegistryMemoryBytes();
+#ifdef WIZ2HUE_REGISTRY_BENCH
+void bulbRegistryBenchmark();
+#endif
+
+#ifdef WIZ2HUE_ALLOC_TRACK
+// Heap allocation tracking (malloc/calloc/realloc are linker-wrapped in the alloctrack env)
+void markAllocSteadyState();
+bool isAllocSteadyState();
+uint32_t allocSteadyStateCount(); // Allocations since markAllocSteadyState()
+void logAllocStats();
+
+// Attributes the current task's allocations to a named hot path until the scope ends
+class AllocScope
+{
+public:
+    explicit AllocScope(const char *tag);
+    ~AllocScope();
+
+private:
+    const char *previous;
+};
+#define ALLOC_SCOPE(tag) AllocScope allocScope(tag)
+#else
+#define ALLOC_SCOPE(tag)
+#endif
+
 // JSON serialization/deserialization functions
 String wizBulbStateToJson(const WizBulbState &state);
 String wizBulbInfoToJson(const WizBulbInfo &bulbInfo);
+void wizBulbInfoToJson(const WizBulbInfo &bulbInfo, JsonObject obj);
 WizBulbState wizBulbStateFromJson(const String &json);
 WizBulbInfo wizBulbInfoFromJson(const String &json);
+WizBulbInfo wizBulbInfoFromJson(JsonObjectConst obj);
 
-// File management functions
+// File management functions; lights are cached in the binary wizcache partition, lights.json is
+// kept as a human-readable export and imported when the binary cache is missing or invalid
 bool initFileSystem();
 std::vector<WizBulbInfo> loadLightsFromFile();
 bool saveLightsToFile(const std::vector<WizBulbInfo> &bulbs);
+bool importLightsFromJson(std::vector<WizBulbInfo> &bulbs);
+bool exportLightsToJson(const std::vector<WizBulbInfo> &bulbs);
+
+// Binary light cache (lightcache.cpp): versioned, CRC-checked fixed-size records plus a MAC
+// index, read in place through a memory-mapped partition. Two image slots make full saves
+// atomic; single-bulb changes go to an append-only journal that is compacted when full.
+struct LightCacheStats
+{
+    uint32_t journalAppends = 0;
+    uint32_t journalBytes = 0;
+    uint32_t compactions = 0;
+    uint32_t compactionBytes = 0;
+    uint32_t sectorErases = 0;
+    uint32_t tornEntries = 0; // Damaged journal entries found at load
+};
+
+void initLightCache(); // Runs in setup() before the storage writer and discovery tasks start
+bool loadLightsFromCache(std::vector<WizBulbInfo> &bulbs);
+bool saveLightsToCache(const std::vector<WizBulbInfo> &bulbs);
+bool journalLightIpUpdate(const uint8_t *mac, uint32_t ip);
+bool journalLightRecord(const WizBulbInfo &bulb); // Insert or replace by MAC
+bool lightCacheLookup(const uint8_t *mac, WizBulbInfo &info);
+void eraseLightCache();
+LightCacheStats getLightCacheStats();
+void logLightCacheStats();
+#ifdef WIZ2HUE_CACHE_BENCH
+void lightCacheBenchmark();
+#endif
+#ifdef WIZ2HUE_CACHE_FAULT_TEST
+void lightCacheFaultTest();
+#endif
+// Last-known bulb state (bulbstate.cpp): what each bulb last reported, kept in NVS so endpoints
+// register at boot without a live read. Writes are rate limited per bulb; flushBulbStates()
+// runs on the storage writer task and persists states that have settled.
+struct BulbStateStoreStats
+{
+    uint32_t restored = 0;      // bulbs started from a stored state
+    uint32_t missing = 0;       // bulbs without a stored state
+    uint32_t writes = 0;        // NVS writes
+    uint32_t coalesced = 0;     // changes superseded before they were written
+    uint32_t writeFailures = 0;
+    uint64_t writeMicros = 0;
+    unsigned long maxWriteMicros = 0;
+};
+
+void initBulbStateStore(); // Runs in setup() before the light tasks start
+bool restoreBulbState(const WizBulbInfo &bulb, WizBulbState &state);
+void recordBulbState(const WizBulbInfo &bulb, const WizBulbState &state);
+uint64_t currentBulbState(const uint8_t *mac); // Packed, 0 = unknown
+uint64_t packBulbState(const WizBulbState &state);
+bool unpackBulbState(uint64_t packed, WizBulbState &state);
+int flushBulbStates(bool force = false); // force: write every changed state now; returns writes
+void releaseBulbState(const uint8_t *mac); // Retired bulb: drops the RAM slot and the NVS entry
+void eraseBulbStates();
+BulbStateStoreStats getBulbStateStoreStats();
+void logBulbStateStoreStats();
+
+// Background storage writer (storage.cpp): persistent writes are posted as intents and performed
+// by a low-priority task, coalesced per key and rate limited. Without the task they run inline.
+void startStorageWriter();
+void requestLightsSave(); // Binary cache + lights.json from the current registry
+void requestLightIpSave(const uint8_t *mac); // Journal one bulb's registry address
+void requestStorageClear(); // clearFileSystemCache() and stored bulb states
+bool storageSync(unsigned long timeoutMs); // Write everything pending now, e.g. before ESP.restart()
+void logStorageStats();
+
+// Warm restart (warmboot.cpp): registry and bulb states kept in RTC no-init memory across
+// software restarts, so the next boot can skip LittleFS, discovery and the initial state reads
+bool loadWarmSnapshot(std::vector<WizBulbInfo> &bulbs); // false on a cold boot
+bool isWarmBoot();
+uint64_t warmSnapshotState(const uint8_t *mac); // Packed, 0 = none or cold boot
+void saveWarmSnapshot(); // Call right before ESP.restart()
+void discardWarmSnapshot();
+void updateWarmSnapshot(); // From loop(): periodic refresh and boot-count guard
+void recordBootTime(unsigned long bootMs);
+unsigned long lastWarmRestartTime(); // Boot time of the last warm restart, 0 if none since power-on
+
+// Stable Zigbee endpoints (endpoints.cpp): endpoint and exposed device type per bulb MAC, in NVS
+void initEndpointMap(); // Runs in setup() before the lights and discovery tasks start
+uint8_t endpointFor(const uint8_t *mac, uint8_t *zigbeeType); // 0 = not assigned
+uint8_t assignEndpoint(const uint8_t *mac, uint8_t zigbeeType, uint8_t endpoint = 0); // 0 = lowest free; returns 0 if none
+uint8_t nextFreeEndpoint(uint8_t from); // Lowest unassigned endpoint >= from, 0 if none
+void releaseEndpoint(const uint8_t *mac);
+void eraseEndpointAssignments();
+
+int applyDiscoveredIPs(const std::vector<WizBulbInfo> &discoveredBulbs);
+bool startBackgroundDiscovery(bool scanNow); // After setup_lights; scanNow on a cached boot, else first pass after the interval
+void requestDiscoveryNow(); // Run a background pass now, e.g. when a restored bulb does not answer
+unsigned long backgroundDiscoveryFinishedAt(); // millis(), 0 while running or never started
 std::vector<WizBulbInfo> updateBulbIPs(const std::vector<WizBulbInfo> &cachedBulbs, const std::vector<WizBulbInfo> &discoveredBulbs);
 std::vector<WizBulbInfo> discoverOrLoadLights(IPAddress broadcastIP, bool *fromCache = nullptr);
+std::vector<WizBulbInfo> discoverAndSaveLights(IPAddress broadcastIP); // Scan only, for a boot without cache
 void clearFileSystemCache();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,242 @@
+// Host build of the Arduino API subset used by the modules under test (PlatformIO native env).
+// Single process, real clocks; Serial writes to stdout.
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+using std::max;
+using std::min;
+
+const int D0 = 0;
+const int D1 = 1;
+const int D2 = 2;
+const int D3 = 3;
+const int LED_BUILTIN = 15;
+const int LOW = 0;
+const int HIGH = 1;
+const int INPUT = 0;
+const int OUTPUT = 1;
+const int INPUT_PULLUP = 2;
+
+inline unsigned long millis()
+{
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return (unsigned long)duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+inline unsigned long micros()
+{
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return (unsigned long)duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+inline void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax)
+{
+    return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+// newlib has it; glibc only from 2.38
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t length = strlen(src);
+    if (size > 0)
+    {
+        size_t copied = min(length, size - 1);
+        memcpy(dst, src, copied);
+        dst[copied] = '\0';
+    }
+    return length;
+}
+#endif
+
+inline long random(long howBig)
+{
+    return howBig > 0 ? random() % howBig : 0;
+}
+
+inline long random(long howSmall, long howBig)
+{
+    return howSmall < howBig ? howSmall + random(howBig - howSmall) : howSmall;
+}
+
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+inline int digitalRead(int) { return HIGH; }
+
+class String
+{
+public:
+    String() {}
+    String(const char *text) : value(text != nullptr ? text : "") {}
+    String(const std::string &text) : value(text) {}
+    explicit String(int number) : value(std::to_string(number)) {}
+    explicit String(unsigned int number) : value(std::to_string(number)) {}
+    explicit String(long number) : value(std::to_string(number)) {}
+    explicit String(unsigned long number) : value(std::to_string(number)) {}
+
+    const char *c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.length(); }
+    bool isEmpty() const { return value.empty(); }
+    void reserve(unsigned int size) { value.reserve(size); }
+    bool startsWith(const char *prefix) const { return value.compare(0, strlen(prefix), prefix) == 0; }
+    bool endsWith(const char *suffix) const
+    {
+        size_t length = strlen(suffix);
+        return value.size() >= length && value.compare(value.size() - length, length, suffix) == 0;
+    }
+    int indexOf(const char *text) const
+    {
+        size_t position = value.find(text);
+        return position == std::string::npos ? -1 : (int)position;
+    }
+    void toUpperCase()
+    {
+        for (char &c : value)
+        {
+            c = (char)toupper((unsigned char)c);
+        }
+    }
+    String &operator+=(const String &other)
+    {
+        value += other.value;
+        return *this;
+    }
+    String &operator+=(const char *other)
+    {
+        value += other;
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        value += c;
+        return *this;
+    }
+    bool concat(const char *text, unsigned int length)
+    {
+        value.append(text, length);
+        return true;
+    }
+    friend String operator+(const String &a, const String &b) { return String(a.value + b.value); }
+    friend String operator+(const String &a, const char *b) { return String(a.value + b); }
+    friend String operator+(const char *a, const String &b) { return String(a + b.value); }
+    bool operator==(const String &other) const { return value == other.value; }
+    bool operator==(const char *other) const { return value == other; }
+    bool operator!=(const String &other) const { return value != other.value; }
+    char operator[](unsigned int index) const { return value[index]; }
+
+    // ArduinoJson reads and writes Arduino Strings through these
+    size_t write(uint8_t c)
+    {
+        value += (char)c;
+        return 1;
+    }
+    size_t write(const uint8_t *data, size_t length)
+    {
+        value.append((const char *)data, length);
+        return length;
+    }
+
+private:
+    std::string value;
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *data, size_t length)
+    {
+        size_t written = 0;
+        while (written < length && write(data[written]) == 1)
+        {
+            written++;
+        }
+        return written;
+    }
+    size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t print(const String &text) { return print(text.c_str()); }
+    size_t print(int number) { return printf("%d", number); }
+    size_t println(const char *text) { return print(text) + println(); }
+    size_t println(const String &text) { return println(text.c_str()); }
+    size_t println() { return print("\n"); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buffer[512];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (length < 0)
+        {
+            return 0;
+        }
+        return write((const uint8_t *)buffer, min((size_t)length, sizeof(buffer) - 1));
+    }
+};
+
+class HardwareSerial : public Print
+{
+public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c) override { return fputc(c, stdout) == EOF ? 0 : 1; }
+    size_t write(const uint8_t *data, size_t length) override { return fwrite(data, 1, length, stdout); }
+};
+
+inline HardwareSerial Serial;
+
+class IPAddress
+{
+public:
+    IPAddress() {}
+    IPAddress(uint32_t address) : address(address) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+    bool fromString(const char *text)
+    {
+        unsigned a, b, c, d;
+        char end;
+        if (sscanf(text, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4 || a > 255 || b > 255 || c > 255 || d > 255)
+        {
+            return false;
+        }
+        address = a | (b << 8) | (c << 16) | ((uint32_t)d << 24);
+        return true;
+    }
+    operator uint32_t() const { return address; }
+    uint8_t operator[](int index) const { return (address >> (index * 8)) & 0xFF; }
+    String toString() const
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+        return String(text);
+    }
+
+private:
+    uint32_t address = 0;
+};
+
+class EspClass
+{
+public:
+    uint32_t getCycleCount() { return (uint32_t)micros() * 160; } // Nominal 160 MHz
+    uint32_t getFreeHeap() { return 0; }
+    void restart() { exit(0); }
+};
+
+inline EspClass ESP;
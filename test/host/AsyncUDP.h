@@ -0,0 +1,178 @@
+// Host build of AsyncUDP: a sent packet is answered through hostUdpResponder, and the reply
+// reaches onPacket from a network thread HOST_UDP_LATENCY_US later, as replies reach the
+// handler from the lwIP task on the target. Replies wait in a fixed ring, so delivering one
+// does not allocate; a reply to a closed socket is dropped.
+#pragma once
+#include "HostUdp.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+const unsigned long HOST_UDP_LATENCY_US = 2000;
+
+class AsyncUDPPacket
+{
+public:
+    AsyncUDPPacket(const uint8_t *data, size_t length, IPAddress from) : bytes(data), size(length), from(from) {}
+    uint8_t *data() { return (uint8_t *)bytes; }
+    size_t length() { return size; }
+    IPAddress remoteIP() { return from; }
+    uint16_t remotePort() { return HOST_UDP_BULB_PORT; }
+
+private:
+    const uint8_t *bytes;
+    size_t size;
+    IPAddress from;
+};
+
+typedef std::function<void(AsyncUDPPacket &packet)> AuPacketHandlerFunction;
+
+class AsyncUDP;
+
+class HostUdpNetwork
+{
+public:
+    void post(AsyncUDP *socket, IPAddress from, const char *data, size_t length);
+    void drop(AsyncUDP *socket);
+
+private:
+    struct Delivery
+    {
+        AsyncUDP *socket;
+        IPAddress from;
+        unsigned long dueAt;
+        size_t length;
+        uint8_t data[HOST_UDP_MAX_PACKET];
+    };
+    static const size_t QUEUE_LENGTH = 32;
+
+    void run();
+
+    std::mutex mutex;      // Guards the ring
+    std::mutex delivering; // Held while a handler runs, so drop() can wait it out
+    std::condition_variable wake;
+    Delivery ring[QUEUE_LENGTH];
+    size_t head = 0;
+    size_t count = 0;
+    bool started = false;
+};
+
+// Never destroyed: the network thread runs until the process exits
+inline HostUdpNetwork &hostUdpNetwork()
+{
+    static HostUdpNetwork *network = new HostUdpNetwork();
+    return *network;
+}
+
+class AsyncUDP
+{
+public:
+    ~AsyncUDP() { close(); }
+
+    void onPacket(AuPacketHandlerFunction callback) { handler = callback; }
+    bool listen(uint16_t)
+    {
+        open = true;
+        return true;
+    }
+    bool connected() { return open; }
+    size_t writeTo(const uint8_t *data, size_t length, const IPAddress &ip, uint16_t port)
+    {
+        if (!open)
+        {
+            return 0;
+        }
+        char reply[HOST_UDP_MAX_PACKET];
+        size_t replyLength = hostUdpExchange(ip, data, length, reply, sizeof(reply));
+        if (replyLength > 0)
+        {
+            hostUdpNetwork().post(this, ip, reply, replyLength);
+        }
+        return length;
+    }
+    void close()
+    {
+        if (open)
+        {
+            open = false;
+            hostUdpNetwork().drop(this);
+        }
+    }
+
+private:
+    friend class HostUdpNetwork;
+    AuPacketHandlerFunction handler;
+    bool open = false;
+};
+
+inline void HostUdpNetwork::post(AsyncUDP *socket, IPAddress from, const char *data, size_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!started)
+    {
+        std::thread(&HostUdpNetwork::run, this).detach();
+        started = true;
+    }
+    if (count == QUEUE_LENGTH)
+    {
+        return; // Lost, as UDP does
+    }
+    Delivery &delivery = ring[(head + count) % QUEUE_LENGTH];
+    delivery.socket = socket;
+    delivery.from = from;
+    delivery.dueAt = micros() + HOST_UDP_LATENCY_US;
+    delivery.length = min(length, sizeof(delivery.data));
+    memcpy(delivery.data, data, delivery.length);
+    count++;
+    wake.notify_one();
+}
+
+inline void HostUdpNetwork::drop(AsyncUDP *socket)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < count; i++)
+        {
+            Delivery &delivery = ring[(head + i) % QUEUE_LENGTH];
+            if (delivery.socket == socket)
+            {
+                delivery.socket = nullptr;
+            }
+        }
+    }
+    std::lock_guard<std::mutex> busy(delivering);
+}
+
+inline void HostUdpNetwork::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        if (count == 0)
+        {
+            wake.wait(lock);
+            continue;
+        }
+        long wait = (long)(ring[head].dueAt - micros());
+        if (wait > 0)
+        {
+            wake.wait_for(lock, std::chrono::microseconds(wait));
+            continue;
+        }
+
+        Delivery &delivery = ring[head];
+        std::unique_lock<std::mutex> busy(delivering);
+        AsyncUDP *socket = delivery.socket;
+        AsyncUDPPacket packet(delivery.data, delivery.length, delivery.from);
+        lock.unlock();
+        if (socket != nullptr && socket->handler)
+        {
+            socket->handler(packet);
+        }
+        busy.unlock();
+        lock.lock();
+        head = (head + 1) % QUEUE_LENGTH;
+        count--;
+    }
+}
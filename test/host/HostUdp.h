@@ -0,0 +1,16 @@
+// Host stand-in for the bulbs on the LAN. A test installs hostUdpResponder, which answers a
+// datagram sent to a bulb by writing the reply; no responder or an empty reply means the bulb
+// stays silent. WiFiUDP and AsyncUDP deliver the replies; nothing touches the real network.
+#pragma once
+#include <Arduino.h>
+
+const size_t HOST_UDP_MAX_PACKET = 512;
+const uint16_t HOST_UDP_BULB_PORT = 38899;
+
+typedef size_t (*HostUdpResponder)(IPAddress to, const uint8_t *request, size_t length, char *reply, size_t capacity);
+inline HostUdpResponder hostUdpResponder = nullptr;
+
+inline size_t hostUdpExchange(IPAddress to, const uint8_t *request, size_t length, char *reply, size_t capacity)
+{
+    return hostUdpResponder != nullptr ? hostUdpResponder(to, request, length, reply, capacity) : 0;
+}
@@ -0,0 +1,131 @@
+// Host build of LittleFS: paths live under a directory on the host file system. Tests can make
+// the next open, write or rename fail to exercise the error paths.
+#pragma once
+#include <Arduino.h>
+#include <dirent.h>
+#include <memory>
+#include <sys/stat.h>
+
+class File
+{
+public:
+    File() {}
+    File(FILE *handle, bool *failWrites) : handle(handle, fclose), failWrites(failWrites) {}
+    File(DIR *directory, const std::string &path, bool *failWrites)
+        : directory(directory, closedir), path(path), failWrites(failWrites) {}
+
+    explicit operator bool() const { return handle != nullptr || directory != nullptr; }
+    void close()
+    {
+        handle.reset();
+        directory.reset();
+    }
+    const char *name() const { return fileName.c_str(); }
+
+    // Directories only: the next regular file in it, named without its path
+    File openNextFile()
+    {
+        while (directory != nullptr)
+        {
+            dirent *entry = readdir(directory.get());
+            if (entry == nullptr)
+            {
+                break;
+            }
+            struct stat info;
+            std::string entryPath = path + "/" + entry->d_name;
+            FILE *next = stat(entryPath.c_str(), &info) == 0 && S_ISREG(info.st_mode) ? fopen(entryPath.c_str(), "rb") : nullptr;
+            if (next != nullptr)
+            {
+                File file(next, failWrites);
+                file.fileName = entry->d_name;
+                return file;
+            }
+        }
+        return File();
+    }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *data, size_t length)
+    {
+        if (handle == nullptr || (failWrites != nullptr && *failWrites))
+        {
+            return 0;
+        }
+        return fwrite(data, 1, length, handle.get());
+    }
+
+    int read()
+    {
+        return handle != nullptr ? fgetc(handle.get()) : -1;
+    }
+    size_t readBytes(char *buffer, size_t length)
+    {
+        return handle != nullptr ? fread(buffer, 1, length, handle.get()) : 0;
+    }
+    size_t size()
+    {
+        struct stat info;
+        return handle != nullptr && fstat(fileno(handle.get()), &info) == 0 ? info.st_size : 0;
+    }
+
+private:
+    std::shared_ptr<FILE> handle;
+    std::shared_ptr<DIR> directory;
+    std::string path;
+    std::string fileName;
+    bool *failWrites = nullptr;
+};
+
+class LittleFSFS
+{
+public:
+    // Host only: where the file system lives, and injected faults
+    std::string root = ".";
+    bool failOpen = false;
+    bool failWrites = false;
+    bool failRename = false;
+
+    bool begin(bool = false) { return true; }
+    bool format() { return true; }
+    void end() {}
+    size_t totalBytes() { return 0; }
+    size_t usedBytes() { return 0; }
+
+    bool exists(const char *path)
+    {
+        struct stat info;
+        return stat(hostPath(path).c_str(), &info) == 0;
+    }
+    bool exists(const String &path) { return exists(path.c_str()); }
+
+    File open(const char *path, const char *mode = "r")
+    {
+        if (failOpen)
+        {
+            return File();
+        }
+        struct stat info;
+        if (stat(hostPath(path).c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+        {
+            DIR *directory = opendir(hostPath(path).c_str());
+            return directory != nullptr ? File(directory, hostPath(path), &failWrites) : File();
+        }
+        FILE *handle = fopen(hostPath(path).c_str(), strcmp(mode, "w") == 0 ? "wb" : strcmp(mode, "a") == 0 ? "ab" : "rb");
+        return handle != nullptr ? File(handle, &failWrites) : File();
+    }
+    File open(const String &path, const char *mode = "r") { return open(path.c_str(), mode); }
+
+    bool remove(const char *path) { return ::remove(hostPath(path).c_str()) == 0; }
+    bool remove(const String &path) { return remove(path.c_str()); }
+
+    bool rename(const char *from, const char *to)
+    {
+        return !failRename && ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+    }
+
+private:
+    std::string hostPath(const char *path) const { return root + path; }
+};
+
+inline LittleFSFS LittleFS;
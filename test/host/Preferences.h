@@ -0,0 +1,59 @@
+// Host build of Preferences: NVS namespaces kept in RAM for the life of the process
+#pragma once
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string, std::vector<uint8_t>> HostNvsNamespace;
+inline std::map<std::string, HostNvsNamespace> hostNvs;
+
+class Preferences
+{
+public:
+    bool begin(const char *name, bool readOnly = false, const char *partition = nullptr)
+    {
+        values = &hostNvs[name];
+        return true;
+    }
+    void end() { values = nullptr; }
+    bool clear()
+    {
+        values->clear();
+        return true;
+    }
+    bool remove(const char *key) { return values->erase(key) > 0; }
+    bool isKey(const char *key) { return values->count(key) > 0; }
+
+    size_t putBytes(const char *key, const void *value, size_t length)
+    {
+        const uint8_t *bytes = (const uint8_t *)value;
+        (*values)[key].assign(bytes, bytes + length);
+        return length;
+    }
+    size_t getBytesLength(const char *key)
+    {
+        auto it = values->find(key);
+        return it != values->end() ? it->second.size() : 0;
+    }
+    size_t getBytes(const char *key, void *buffer, size_t length)
+    {
+        auto it = values->find(key);
+        if (it == values->end() || it->second.size() > length)
+        {
+            return 0;
+        }
+        memcpy(buffer, it->second.data(), it->second.size());
+        return it->second.size();
+    }
+
+    size_t putULong64(const char *key, uint64_t value) { return putBytes(key, &value, sizeof(value)); }
+    uint64_t getULong64(const char *key, uint64_t defaultValue = 0)
+    {
+        uint64_t value = defaultValue;
+        return getBytesLength(key) == sizeof(value) && getBytes(key, &value, sizeof(value)) ? value : defaultValue;
+    }
+
+private:
+    HostNvsNamespace *values = nullptr;
+};
@@ -0,0 +1,60 @@
+// Host build of WiFiUDP: a sent packet is answered through hostUdpResponder, and the reply is
+// what the next parsePacket returns
+#pragma once
+#include "HostUdp.h"
+
+class WiFiUDP : public Print
+{
+public:
+    uint8_t begin(uint16_t) { return 1; }
+    void stop() {}
+
+    int beginPacket(IPAddress ip, uint16_t port)
+    {
+        target = ip;
+        outLength = 0;
+        return 1;
+    }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *data, size_t length) override
+    {
+        size_t room = min(length, sizeof(out) - outLength);
+        memcpy(out + outLength, data, room);
+        outLength += room;
+        return room;
+    }
+    int endPacket()
+    {
+        inLength = hostUdpExchange(target, out, outLength, (char *)in, sizeof(in));
+        replyFrom = target;
+        return 1;
+    }
+
+    int parsePacket()
+    {
+        available = inLength;
+        readOffset = 0;
+        inLength = 0;
+        return (int)available;
+    }
+    IPAddress remoteIP() { return replyFrom; }
+    uint16_t remotePort() { return HOST_UDP_BULB_PORT; }
+    int read(uint8_t *buffer, size_t length)
+    {
+        size_t count = min(length, available - readOffset);
+        memcpy(buffer, in + readOffset, count);
+        readOffset += count;
+        return (int)count;
+    }
+    int read(char *buffer, size_t length) { return read((uint8_t *)buffer, length); }
+
+private:
+    IPAddress target;
+    IPAddress replyFrom;
+    uint8_t out[HOST_UDP_MAX_PACKET];
+    size_t outLength = 0;
+    uint8_t in[HOST_UDP_MAX_PACKET];
+    size_t inLength = 0;
+    size_t available = 0;
+    size_t readOffset = 0;
+};
@@ -0,0 +1,110 @@
+// Host build of the Zigbee library subset used by the modules under test: the color types, and
+// endpoints that keep the last attribute values the firmware set instead of reporting them
+#pragma once
+#include <Arduino.h>
+#include "esp_err.h"
+
+struct espXyColor_t
+{
+    uint16_t x;
+    uint16_t y;
+};
+
+struct espRgbColor_t
+{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+typedef enum
+{
+    ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_HUE_SATURATION = 0,
+    ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_CURRENT_X_Y = 1,
+    ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE = 2,
+} esp_zb_zcl_color_control_color_mode_t;
+
+typedef enum
+{
+    ESP_ZB_HUE_LIGHT_TYPE_ON_OFF,
+    ESP_ZB_HUE_LIGHT_TYPE_DIMMABLE,
+    ESP_ZB_HUE_LIGHT_TYPE_TEMPERATURE,
+    ESP_ZB_HUE_LIGHT_TYPE_EXTENDED_COLOR,
+} es_zb_hue_light_type_t;
+
+class ZigbeeEP
+{
+public:
+    virtual ~ZigbeeEP() {}
+};
+
+class ZigbeeHueLight : public ZigbeeEP
+{
+public:
+    typedef void (*LightChangeCallback)(bool, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint16_t, esp_zb_zcl_color_control_color_mode_t);
+
+    ZigbeeHueLight(uint8_t endpoint, es_zb_hue_light_type_t type, uint16_t minMireds, uint16_t maxMireds)
+        : endpoint(endpoint), type(type) {}
+
+    void onLightChange(LightChangeCallback callback) { lightChange = callback; }
+    void onIdentify(void (*callback)(uint16_t)) {}
+    bool setManufacturerAndModel(const char *, const char *) { return true; }
+    void setSwBuild(const char *) {}
+    void setOnOffOnTime(int) {}
+    void setOnOffGlobalSceneControl(bool) {}
+    void setLightState(bool on) { state = on; }
+    void setLightLevel(uint8_t value) { level = value; }
+    void setLightColor(uint8_t r, uint8_t g, uint8_t b) { color = {r, g, b}; }
+    void setLightTemperature(uint16_t mireds) { temperature = mireds; }
+    esp_zb_zcl_color_control_color_mode_t getColorMode() { return colorMode; }
+    void setColorMode(esp_zb_zcl_color_control_color_mode_t mode) { colorMode = mode; }
+    void zbUpdateStateFromAttributes() {}
+
+    uint8_t endpoint;
+    es_zb_hue_light_type_t type;
+    LightChangeCallback lightChange = nullptr;
+    bool state = false;
+    uint8_t level = 0;
+    espRgbColor_t color = {0, 0, 0};
+    uint16_t temperature = 0;
+    esp_zb_zcl_color_control_color_mode_t colorMode = ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_TEMPERATURE;
+};
+
+#define ZIGBEE_ROUTER 1
+
+// Never joins a network on the host
+class ZigbeeCore
+{
+public:
+    void setEnableJoiningToDistributed(bool) {}
+    void setStandardDistributedKey(uint8_t *) {}
+    bool begin(int) { return false; }
+    bool connected() { return false; }
+    bool started() { return false; }
+    void addEndpoint(ZigbeeEP *) {}
+    void factoryReset() {}
+};
+
+inline ZigbeeCore Zigbee;
+
+typedef enum
+{
+    ESP_ZB_BDB_MODE_NETWORK_STEERING = 2,
+} esp_zb_bdb_commissioning_mode_mask_t;
+
+typedef struct
+{
+    uint16_t id;
+    uint8_t type;
+    uint8_t access;
+    void *data_p;
+} esp_zb_zcl_attr_t;
+
+#define ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL 0x0008
+#define ESP_ZB_ZCL_CLUSTER_SERVER_ROLE 1
+#define ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_ON_OFF_TRANSITION_TIME_ID 0x0010
+
+inline esp_err_t esp_zb_bdb_start_top_level_commissioning(uint8_t) { return ESP_OK; }
+inline void esp_zb_lock_acquire(uint32_t) {}
+inline void esp_zb_lock_release() {}
+inline esp_zb_zcl_attr_t *esp_zb_zcl_get_attribute(uint8_t, uint16_t, uint8_t, uint16_t) { return nullptr; }
@@ -0,0 +1,12 @@
+// Host build of the heap capability queries; the host heap is not measured
+#pragma once
+#include <cstddef>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+inline size_t heap_caps_get_free_size(unsigned) { return 0; }
+inline size_t heap_caps_get_largest_free_block(unsigned) { return 0; }
+inline size_t heap_caps_get_minimum_free_size(unsigned) { return 0; }
+inline int heap_caps_monitor_local_minimum_free_size_start() { return 0; }
+inline int heap_caps_monitor_local_minimum_free_size_stop() { return 0; }
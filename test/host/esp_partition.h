@@ -0,0 +1,163 @@
+// Host build of the esp_partition API: one "wizcache" data partition in RAM with NOR flash
+// rules (erase sets a whole sector to 0xFF, a write can only clear bits). Tests can cut power
+// at the Nth write or erase from now: that operation is torn and every later one fails until
+// the test restores power.
+#pragma once
+#include "esp_err.h"
+#include <cstdint>
+#include <cstring>
+
+typedef enum
+{
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef int esp_partition_subtype_t;
+
+typedef enum
+{
+    ESP_PARTITION_MMAP_DATA,
+    ESP_PARTITION_MMAP_INST,
+} esp_partition_mmap_memory_t;
+
+typedef uint32_t esp_partition_mmap_handle_t;
+
+typedef struct
+{
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    uint32_t erase_size;
+    char label[17];
+} esp_partition_t;
+
+struct HostFlash
+{
+    static const uint32_t SIZE = 0x10000; // wizcache in zigbee_spiffs.csv
+    static const uint32_t SECTOR = 0x1000;
+
+    esp_partition_t partition = {ESP_PARTITION_TYPE_DATA, 0x40, 0x3F0000, SIZE, SECTOR, "wizcache"};
+    uint8_t data[SIZE];
+    int cutAt = -1;     // Operations until the power cut, -1 = no cut scheduled
+    bool cut = false;   // Power is off: every write and erase fails
+    int operations = 0; // Writes and erases since the last reset
+
+    HostFlash() { reset(); }
+
+    // Blank flash, power on
+    void reset()
+    {
+        memset(data, 0xFF, sizeof(data));
+        restorePower();
+        operations = 0;
+    }
+
+    void cutPowerAt(int operation)
+    {
+        cutAt = operation;
+        cut = false;
+    }
+
+    void restorePower()
+    {
+        cutAt = -1;
+        cut = false;
+    }
+
+    // true if this operation is the one the power cut tears
+    bool tearsNext()
+    {
+        operations++;
+        if (cutAt > 0 && --cutAt == 0)
+        {
+            cut = true;
+            return true;
+        }
+        return false;
+    }
+};
+
+inline HostFlash hostFlash;
+
+inline const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    const esp_partition_t &partition = hostFlash.partition;
+    if (type != partition.type || subtype != partition.subtype || (label != nullptr && strcmp(label, partition.label) != 0))
+    {
+        return nullptr;
+    }
+    return &partition;
+}
+
+inline esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size)
+{
+    if (offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, hostFlash.data + offset, size);
+    return ESP_OK;
+}
+
+// A torn write programs the first half of the data
+inline esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size)
+{
+    if (offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (hostFlash.cut)
+    {
+        return ESP_FAIL;
+    }
+    bool torn = hostFlash.tearsNext();
+    size_t programmed = torn ? size / 2 : size;
+    const uint8_t *bytes = (const uint8_t *)src;
+    for (size_t i = 0; i < programmed; i++)
+    {
+        hostFlash.data[offset + i] &= bytes[i];
+    }
+    return torn ? ESP_FAIL : ESP_OK;
+}
+
+// A torn erase clears the first half of the sectors; the sector it stopped in is half erased
+// with stray bits at its start
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (offset % partition->erase_size != 0 || size % partition->erase_size != 0 || offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (hostFlash.cut)
+    {
+        return ESP_FAIL;
+    }
+    if (!hostFlash.tearsNext())
+    {
+        memset(hostFlash.data + offset, 0xFF, size);
+        return ESP_OK;
+    }
+    size_t erased = size / partition->erase_size / 2 * partition->erase_size;
+    memset(hostFlash.data + offset, 0xFF, erased);
+    uint8_t *stopped = hostFlash.data + offset + erased;
+    memset(stopped, 0xFF, partition->erase_size / 2);
+    const uint8_t stray[8] = {0x5A, 0x00, 0x13, 0x37, 0x5A, 0x00, 0x13, 0x37};
+    memcpy(stopped, stray, sizeof(stray));
+    return ESP_FAIL;
+}
+
+// Reads see every later write, as the cache-coherent mapping on the target does
+inline esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                                    esp_partition_mmap_memory_t memory, const void **out_ptr,
+                                    esp_partition_mmap_handle_t *out_handle)
+{
+    if (offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *out_ptr = hostFlash.data + offset;
+    *out_handle = 1;
+    return ESP_OK;
+}
@@ -0,0 +1,27 @@
+// Host build of the FreeRTOS primitives used by the modules under test
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms)) // 1 kHz tick
+
+// Critical sections: a spinlock, as on the single-core target
+struct portMUX_TYPE
+{
+    std::atomic_flag locked = ATOMIC_FLAG_INIT;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux)                                          \
+    while ((mux)->locked.test_and_set(std::memory_order_acquire))        \
+    {                                                                    \
+    }
+#define portEXIT_CRITICAL(mux) (mux)->locked.clear(std::memory_order_release)
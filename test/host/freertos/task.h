@@ -0,0 +1,51 @@
+#pragma once
+#include "FreeRTOS.h"
+#include <chrono>
+#include <thread>
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// No scheduler on the host: tasks are never started, tests call the task bodies themselves
+inline BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *handle)
+{
+    if (handle != nullptr)
+    {
+        *handle = nullptr;
+    }
+    return pdFAIL;
+}
+
+inline void vTaskDelete(TaskHandle_t) {}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t)
+{
+    return pdPASS;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t)
+{
+    return 0;
+}
+
+inline void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+inline TickType_t xTaskGetTickCount()
+{
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return (TickType_t)duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+inline const char *pcTaskGetName(TaskHandle_t)
+{
+    return "host";
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    return nullptr;
+}
@@ -0,0 +1,33 @@
+// Host build of the ZBOSS buffer API used by the ZCL command peek; no buffers exist on the host
+#pragma once
+#include <cstdint>
+
+typedef uint8_t zb_bufid_t;
+typedef uint32_t zb_uint_t;
+
+typedef struct
+{
+    struct
+    {
+        uint16_t source_nwk;
+        uint8_t src_endpoint;
+        uint8_t dst_endpoint;
+    } common_data;
+} zb_zcl_addr_data_t;
+
+typedef struct
+{
+    uint16_t cluster_id;
+    uint16_t profile_id;
+    uint8_t cmd_id;
+    uint8_t is_common_command;
+    zb_zcl_addr_data_t addr_data;
+} zb_zcl_parsed_hdr_t;
+
+typedef bool (*esp_zb_zcl_raw_command_callback_t)(uint8_t bufid);
+
+inline void *zb_buf_get_tail_func(zb_bufid_t, uint32_t) { return nullptr; }
+#define ZB_BUF_GET_PARAM(buf, type) ((type *)zb_buf_get_tail_func((buf), sizeof(type)))
+inline void *zb_buf_begin(zb_bufid_t) { return nullptr; }
+inline zb_uint_t zb_buf_len(zb_bufid_t) { return 0; }
+inline void esp_zb_raw_command_handler_register(esp_zb_zcl_raw_command_callback_t) {}
@@ -0,0 +1,329 @@
+// Steady-state allocation guard. Once warmed up, the per-poll and per-command paths that run for
+// every bulb must not touch the heap: registry lookups, circuit breaker, latency histograms and
+// color kernel, and the real wiz.cpp and lights.cpp paths on top of them - getPilot reply parse,
+// setPilot build and acknowledgement, WiZ state applied to the Zigbee light, Hue commands and the
+// group dispatch. Built by the native-alloctrack env, which wraps malloc/calloc/realloc like the
+// device alloctrack env; operator new goes through malloc so C++ allocations count too. The bulbs
+// are the model in bulbReply, reached through the host AsyncUDP and WiFiUDP.
+#include <unity.h>
+#include <new>
+#include "alloctrack.cpp"
+#include "color.cpp"
+#include "health.cpp"
+#include "latency.cpp"
+#include "registry.cpp"
+#include "jsonpool.cpp"
+#include "bulbstate.cpp"
+#include "endpoints.cpp"
+#include "wiz.cpp"
+#include "lights.cpp"
+
+void *operator new(size_t size)
+{
+    void *block = malloc(size);
+    if (block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+    free(block);
+}
+
+// Boot, Wi-Fi and file storage are not under test here
+IPAddress broadcastIP()
+{
+    return IPAddress(192, 168, 1, 255);
+}
+
+bool isWifiConnected()
+{
+    return true;
+}
+
+void checkForReset(int button)
+{
+}
+
+std::vector<WizBulbInfo> loadLightsFromFile()
+{
+    return std::vector<WizBulbInfo>();
+}
+
+void requestLightsSave()
+{
+}
+
+void requestLightIpSave(const uint8_t *mac)
+{
+}
+
+uint64_t warmSnapshotState(const uint8_t *mac)
+{
+    return 0;
+}
+
+unsigned long lastWarmRestartTime()
+{
+    return 0;
+}
+
+const int GUARD_BULBS = 24;
+const int GUARD_ROUNDS = 200;
+const int WIZ_ROUNDS = 5;
+const unsigned long COMMAND_SPACING = 600; // Keeps the Hue commands under the lights' streaming detection
+
+// Dimming the bulbs report, changed every round so each reply is parsed rather than served by the
+// fingerprint fast path
+static int pilotDimming = 40;
+static int setPilotsAnswered = 0;
+
+// Every bulb answers getPilot with its state and acknowledges setPilot
+static size_t bulbReply(IPAddress to, const uint8_t *request, size_t length, char *reply, size_t capacity)
+{
+    char text[HOST_UDP_MAX_PACKET];
+    length = min(length, sizeof(text) - 1);
+    memcpy(text, request, length);
+    text[length] = '\0';
+
+    int written = 0;
+    if (strstr(text, "\"getPilot\"") != nullptr)
+    {
+        written = snprintf(reply, capacity,
+                           "{\"method\":\"getPilot\",\"env\":\"pro\",\"result\":{\"mac\":\"a8bb5000%04x\",\"rssi\":-61,"
+                           "\"state\":true,\"sceneId\":0,\"r\":255,\"g\":120,\"b\":%d,\"c\":0,\"w\":0,\"dimming\":%d}}",
+                           to[3] - 10, to[3], pilotDimming);
+    }
+    else if (strstr(text, "\"setPilot\"") != nullptr)
+    {
+        setPilotsAnswered++;
+        written = snprintf(reply, capacity, "{\"method\":\"setPilot\",\"env\":\"pro\",\"result\":{\"success\":true}}");
+    }
+    return written > 0 ? min((size_t)written, capacity - 1) : 0;
+}
+
+static WizBulbInfo guardBulb(int i)
+{
+    WizBulbInfo bulb;
+    uint8_t mac[6] = {0xa8, 0xbb, 0x50, 0x00, (uint8_t)(i >> 8), (uint8_t)i};
+    memcpy(bulb.mac, mac, sizeof(mac));
+    bulb.ip = IPAddress(192, 168, 1, 10 + i);
+    bulb.bulbClass = BulbClass::RGB;
+    bulb.features.brightness = true;
+    bulb.features.color = true;
+    bulb.features.color_tmp = true;
+    bulb.isValid = true;
+    return bulb;
+}
+
+// One poll and one Hue command for every bulb, as the light tasks do them; returns the number
+// of bulbs the bookkeeping got wrong
+static int steadyStateRound(int round)
+{
+    int wrong = 0;
+    for (int i = 0; i < GUARD_BULBS; i++)
+    {
+        WizBulbInfo bulb = guardBulb(i);
+        WizBulbInfo stored;
+        int handle = bulbRegistryFindByIp(bulb.ip);
+        if (handle < 0 || !bulbRegistryGet(handle, stored) || bulbRegistryFindByEndpoint(10 + i) != handle)
+        {
+            wrong++;
+        }
+        bulbRegistryLightForEndpoint(10 + i);
+
+        IPAddress deviceIP(bulb.ip);
+        bool probe = false;
+        if (!bulbHealthAllowRequest(deviceIP, &probe))
+        {
+            wrong++;
+        }
+        bulbHealthRecordSuccess(deviceIP);
+        recordWizLatency(WizOp::GET_PILOT, bulb.ip, 4000 + round, 1);
+        recordWizLatency(WizOp::SET_PILOT, bulb.ip, 9000 + round, 1);
+
+        uint8_t r = round, g = i * 10, b = 255 - round;
+        colorNormalizeRgb(r, g, b);
+        kelvinToMireds(2200 + round * 10);
+        miredsToKelvin(153 + round);
+        levelToPercent(round);
+        percentToLevel(round % 101);
+    }
+    return wrong;
+}
+
+// One poll of every bulb applied to its light, then a Hue command for every light sent as one
+// group, and one command through the acknowledged single-bulb path, as the light and fan-out
+// tasks do them; returns the number of bulbs that did not get through
+static int wizRound(int round)
+{
+    int wrong = 0;
+    pilotDimming = 10 + round % 90;
+    for (int i = 0; i < GUARD_BULBS; i++)
+    {
+        WizBulbInfo bulb = guardBulb(i);
+        WizBulbState state = getBulbState(IPAddress(bulb.ip));
+        ZigbeeWizLight *light = bulbRegistryLightForEndpoint(10 + i);
+        if (!state.isValid || state.dimming != pilotDimming || light == nullptr)
+        {
+            wrong++;
+            continue;
+        }
+        light->processWizStateUpdate(state);
+    }
+
+    for (int i = 0; i < GUARD_BULBS; i++)
+    {
+        staticLightChangeCallback(true, 10 + i, 255, round, 40, percentToLevel(pilotDimming), 250,
+                                  ESP_ZB_ZCL_COLOR_CONTROL_COLOR_MODE_CURRENT_X_Y);
+    }
+    uint32_t ackedBefore = fanoutStats.acked;
+    wrong += GUARD_BULBS - (int)dispatchPendingCommands();
+    wrong += GUARD_BULBS - (int)(fanoutStats.acked - ackedBefore);
+
+    WizBulbState command;
+    command.state = true;
+    command.dimming = pilotDimming;
+    command.temp = 2700 + round * 10;
+    if (!setBulbState(guardBulb(round % GUARD_BULBS), command))
+    {
+        wrong++;
+    }
+    return wrong;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_guard_sees_allocations(void)
+{
+    uint32_t before = allocSteadyStateCount();
+    void *block = malloc(16);
+    free(block);
+    int *number = new int(1);
+    delete number;
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(before + 2, allocSteadyStateCount(),
+                                     "malloc and operator new must be counted, or the guard proves nothing");
+}
+
+void test_steady_state_does_not_allocate(void)
+{
+    uint32_t before = allocSteadyStateCount();
+    int wrong = 0;
+    for (int round = 0; round < GUARD_ROUNDS; round++)
+    {
+        wrong += steadyStateRound(round);
+    }
+    uint32_t allocations = allocSteadyStateCount() - before;
+    if (allocations != 0)
+    {
+        logAllocStats();
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, wrong, "registry or circuit breaker lost track of a bulb");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, allocations, "a steady-state path allocated; see the call sites above");
+}
+
+void test_wiz_paths_do_not_allocate(void)
+{
+    uint32_t before = allocSteadyStateCount();
+    int answeredBefore = setPilotsAnswered;
+    int wrong = 0;
+    for (int round = 1; round <= WIZ_ROUNDS; round++)
+    {
+        delay(COMMAND_SPACING);
+        wrong += wizRound(round);
+    }
+    uint32_t allocations = allocSteadyStateCount() - before;
+    if (allocations != 0)
+    {
+        logAllocStats();
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, wrong, "a poll or command did not reach its bulb");
+    TEST_ASSERT_EQUAL_INT(WIZ_ROUNDS * (GUARD_BULBS + 1), setPilotsAnswered - answeredBefore);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, allocations, "a WiZ or light path allocated; see the call sites above");
+}
+
+void test_latency_follows_the_bulb_and_is_released(void)
+{
+    WizBulbInfo bulb = guardBulb(0);
+    uint32_t samples = getWizLatency(WizOp::GET_PILOT, bulb.mac).samples;
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(GUARD_ROUNDS + 1 + WIZ_ROUNDS + 1, samples, "samples must land in the bulb's own slot");
+
+    // A new address for the same bulb keeps its histograms
+    uint32_t newIp = IPAddress(192, 168, 1, 200);
+    bulbRegistryUpdateIp(bulb.mac, newIp);
+    recordWizLatency(WizOp::GET_PILOT, newIp, 4000, 1);
+    TEST_ASSERT_EQUAL_UINT32(samples + 1, getWizLatency(WizOp::GET_PILOT, bulb.mac).samples);
+
+    // Retiring frees the slot; unregistered addresses only count in the totals
+    bulbRegistryRemove(bulb.mac);
+    releaseWizLatency(bulb.mac);
+    TEST_ASSERT_EQUAL_UINT32(0, getWizLatency(WizOp::GET_PILOT, bulb.mac).samples);
+    recordWizLatency(WizOp::GET_PILOT, newIp, 4000, 1);
+    TEST_ASSERT_EQUAL_UINT32(0, getWizLatency(WizOp::GET_PILOT, bulb.mac).samples);
+    for (const BulbLatency &slot : bulbLatency)
+    {
+        TEST_ASSERT_TRUE(slot.mac.load() != macKey(bulb.mac));
+    }
+}
+
+void test_circuit_follows_the_bulb_not_the_address(void)
+{
+    WizBulbInfo bulb = guardBulb(1);
+    IPAddress deviceIP(bulb.ip);
+    bulbHealthRecordFailure(deviceIP);
+    bulbHealthRecordFailure(deviceIP);
+    TEST_ASSERT_TRUE(getBulbHealth(deviceIP).state == BulbHealthState::OPEN);
+
+    // The bulb is retired and another one gets its address from DHCP
+    bulbRegistryRemove(bulb.mac);
+    bulbHealthRelease(bulb.mac);
+    WizBulbInfo newcomer = guardBulb(GUARD_BULBS + 1);
+    newcomer.ip = bulb.ip;
+    bulbRegistryAdd(newcomer);
+    bool probe = false;
+    TEST_ASSERT_TRUE(bulbHealthAllowRequest(deviceIP, &probe));
+    TEST_ASSERT_TRUE(getBulbHealth(deviceIP).state == BulbHealthState::CLOSED);
+    TEST_ASSERT_TRUE(getBulbHealth(deviceIP).consecutiveFailures == 0);
+}
+
+int main(int argc, char **argv)
+{
+    // Startup: bulbs get their lights and endpoints 10.., and one round of everything fills the
+    // per-bulb tables, reply caches and JSON pool
+    initBulbRegistry();
+    initBulbHealth();
+    initEndpointMap();
+    initBulbStateStore();
+    std::vector<WizBulbInfo> bulbs;
+    for (int i = 0; i < GUARD_BULBS; i++)
+    {
+        bulbs.push_back(guardBulb(i));
+    }
+    setup_lights(bulbs);
+    hostUdpResponder = bulbReply;
+    steadyStateRound(0);
+    wizRound(0);
+    markAllocSteadyState();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_guard_sees_allocations);
+    RUN_TEST(test_steady_state_does_not_allocate);
+    RUN_TEST(test_wiz_paths_do_not_allocate);
+    RUN_TEST(test_latency_follows_the_bulb_and_is_released);
+    RUN_TEST(test_circuit_follows_the_bulb_not_the_address);
+    return UNITY_END();
+}
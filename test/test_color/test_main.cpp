@@ -0,0 +1,234 @@
+// Fixed-point color kernel against the library code it replaces: the RGB normalization must stay
+// within 2 counts per channel of the Zigbee library's float round trip, and the mired/Kelvin and
+// level/percent helpers must match the divide and map() they wrap exactly. The benchmark prints
+// host timings for both RGB paths.
+#include <unity.h>
+#include <chrono>
+#include "color.cpp"
+
+// The library round trip, ported from the Arduino core's ColorFormat.c (espRgbToXYColor and
+// espXYToRgb) with only the types adapted: processWizStateUpdate() used
+// espXYToRgbColor(255, espRgbColorToXYColor(rgb)). Black is not passed in (x and y are 0/0).
+const float MAX_CIE_XY_VALUE = 0xFEFF;
+
+static espXyColor_t libraryRgbToXY(uint8_t r, uint8_t g, uint8_t b)
+{
+    espXyColor_t xy;
+
+    float red = (float)r / 255;
+    float green = (float)g / 255;
+    float blue = (float)b / 255;
+
+    // Apply gamma correction
+    red = (red > 0.04045f) ? pow((red + 0.055f) / (1.0f + 0.055f), 2.4f) : (red / 12.92f);
+    green = (green > 0.04045f) ? pow((green + 0.055f) / (1.0f + 0.055f), 2.4f) : (green / 12.92f);
+    blue = (blue > 0.04045f) ? pow((blue + 0.055f) / (1.0f + 0.055f), 2.4f) : (blue / 12.92f);
+
+    // Convert to XYZ using the Wide RGB D65 conversion
+    float X = red * 0.649926f + green * 0.103455f + blue * 0.197109f;
+    float Y = red * 0.234327f + green * 0.743075f + blue * 0.022598f;
+    float Z = red * 0.000000f + green * 0.053077f + blue * 1.035763f;
+
+    // Calculate xy values
+    float x = X / (X + Y + Z);
+    float y = Y / (X + Y + Z);
+
+    xy.x = (uint16_t)(x * MAX_CIE_XY_VALUE);
+    xy.y = (uint16_t)(y * MAX_CIE_XY_VALUE);
+    return xy;
+}
+
+static espRgbColor_t libraryXYToRgb(uint8_t Level, uint16_t current_X, uint16_t current_Y)
+{
+    espRgbColor_t rgb;
+
+    float x, y, z;
+    float X, Y, Z;
+    float r, g, b;
+
+    x = ((float)current_X) / MAX_CIE_XY_VALUE;
+    y = ((float)current_Y) / MAX_CIE_XY_VALUE;
+    z = 1.0f - x - y;
+
+    // Y - given brightness in 0 - 1 range
+    Y = ((float)Level) / 0xfe;
+    X = (Y / y) * x;
+    Z = (Y / y) * z;
+
+    // X, Y and Z input refer to a D65/2 degree standard illuminant
+    r = (X * 3.2406f) - (Y * 1.5372f) - (Z * 0.4986f);
+    g = -(X * 0.9689f) + (Y * 1.8758f) + (Z * 0.0415f);
+    b = (X * 0.0557f) - (Y * 0.2040f) + (Z * 1.0570f);
+
+    // apply gamma 2.2 correction
+    r = (r <= 0.0031308f ? 12.92f * r : (1.055f) * pow(r, (1.0f / 2.4f)) - 0.055f);
+    g = (g <= 0.0031308f ? 12.92f * g : (1.055f) * pow(g, (1.0f / 2.4f)) - 0.055f);
+    b = (b <= 0.0031308f ? 12.92f * b : (1.055f) * pow(b, (1.0f / 2.4f)) - 0.055f);
+
+    // Round off
+    r = r < 0 ? 0 : r > 1 ? 1 : r;
+    g = g < 0 ? 0 : g > 1 ? 1 : g;
+    b = b < 0 ? 0 : b > 1 ? 1 : b;
+
+    rgb.r = (uint8_t)(r * 255);
+    rgb.g = (uint8_t)(g * 255);
+    rgb.b = (uint8_t)(b * 255);
+    return rgb;
+}
+
+static void libraryRoundTrip(uint8_t &r, uint8_t &g, uint8_t &b)
+{
+    espXyColor_t xy = libraryRgbToXY(r, g, b);
+    espRgbColor_t rgb = libraryXYToRgb(255, xy.x, xy.y);
+    r = rgb.r;
+    g = rgb.g;
+    b = rgb.b;
+}
+
+const int COLOR_TEST_TOLERANCE = 2;       // Counts per channel
+const float COLOR_TEST_MAX_DIFFERING = 0.02f; // Share of colors allowed to differ at all
+const int BENCH_ITERATIONS = 200000;
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_normalize_matches_library(void)
+{
+    int worst = 0;
+    uint32_t checked = 0;
+    uint32_t differing = 0;
+    for (int r = 0; r < 256; r++)
+    {
+        for (int g = 0; g < 256; g++)
+        {
+            for (int b = 0; b < 256; b++)
+            {
+                if (r == 0 && g == 0 && b == 0)
+                {
+                    continue;
+                }
+                uint8_t fr = r, fg = g, fb = b;
+                uint8_t xr = r, xg = g, xb = b;
+                libraryRoundTrip(fr, fg, fb);
+                colorNormalizeRgb(xr, xg, xb);
+                int diff = max(abs(fr - xr), max(abs(fg - xg), abs(fb - xb)));
+                if (diff > 0)
+                {
+                    differing++;
+                }
+                if (diff > worst)
+                {
+                    worst = diff;
+                    printf("  %d,%d,%d -> library %d,%d,%d fixed %d,%d,%d\n", r, g, b, fr, fg, fb, xr, xg, xb);
+                }
+                checked++;
+            }
+        }
+    }
+    printf("  %u colors, %u differ, worst deviation %d count(s)\n", checked, differing, worst);
+    TEST_ASSERT_LESS_OR_EQUAL_INT_MESSAGE(COLOR_TEST_TOLERANCE, worst, "fixed-point kernel drifted from the library conversion");
+    TEST_ASSERT_TRUE_MESSAGE(differing <= checked * COLOR_TEST_MAX_DIFFERING, "too many colors differ from the library conversion");
+    uint8_t r = 0, g = 0, b = 0;
+    colorNormalizeRgb(r, g, b);
+    TEST_ASSERT_TRUE(r == 0 && g == 0 && b == 0);
+}
+
+void test_batch_matches_single(void)
+{
+    uint8_t in[256 * 3];
+    uint8_t out[256 * 3];
+    for (int i = 0; i < 256 * 3; i++)
+    {
+        in[i] = (uint8_t)(i * 37 + 11);
+    }
+    colorNormalizeRgbBatch(in, out, 256);
+    for (int i = 0; i < 256; i++)
+    {
+        uint8_t r = in[i * 3], g = in[i * 3 + 1], b = in[i * 3 + 2];
+        colorNormalizeRgb(r, g, b);
+        TEST_ASSERT_TRUE(out[i * 3] == r && out[i * 3 + 1] == g && out[i * 3 + 2] == b);
+    }
+}
+
+void test_temperature_matches_division(void)
+{
+    for (int mireds = 1; mireds <= 1000; mireds++)
+    {
+        TEST_ASSERT_EQUAL_INT(1000000 / mireds, miredsToKelvin(mireds));
+    }
+    for (int kelvin = 1000; kelvin <= 10000; kelvin++)
+    {
+        TEST_ASSERT_EQUAL_INT(1000000 / kelvin, kelvinToMireds(kelvin));
+    }
+}
+
+void test_level_matches_map(void)
+{
+    for (int level = 0; level < 256; level++)
+    {
+        TEST_ASSERT_EQUAL_INT(map(level, 0, 255, 0, 100), levelToPercent(level));
+    }
+    for (int percent = 0; percent <= 100; percent++)
+    {
+        TEST_ASSERT_EQUAL_INT(map(percent, 0, 100, 0, 255), percentToLevel(percent));
+    }
+    TEST_ASSERT_EQUAL_INT(0, percentToLevel(-5));
+    TEST_ASSERT_EQUAL_INT(255, percentToLevel(150));
+    TEST_ASSERT_EQUAL_INT(0, kelvinToMireds(0));
+    TEST_ASSERT_EQUAL_INT(0, miredsToKelvin(0));
+}
+
+// Timing only: host numbers show the ratio, the device ones come from colorKernelSelfCheck()
+void test_benchmark(void)
+{
+    uint8_t colors[64 * 3];
+    uint32_t seed = 0x12345678;
+    for (uint8_t &c : colors)
+    {
+        seed = seed * 1664525 + 1013904223;
+        c = seed >> 24;
+    }
+
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        const uint8_t *c = &colors[(i % 64) * 3];
+        uint8_t r = c[0], g = c[1], b = c[2];
+        libraryRoundTrip(r, g, b);
+        sink += r + g + b;
+    }
+    auto floatTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        const uint8_t *c = &colors[(i % 64) * 3];
+        uint8_t r = c[0], g = c[1], b = c[2];
+        colorNormalizeRgb(r, g, b);
+        sink += r + g + b;
+    }
+    auto fixedTime = std::chrono::steady_clock::now() - start;
+
+    using std::chrono::duration_cast;
+    using std::chrono::nanoseconds;
+    printf("  RGB normalize: library float %.1f ns, fixed %.1f ns per color\n",
+           (double)duration_cast<nanoseconds>(floatTime).count() / BENCH_ITERATIONS,
+           (double)duration_cast<nanoseconds>(fixedTime).count() / BENCH_ITERATIONS);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_normalize_matches_library);
+    RUN_TEST(test_batch_matches_single);
+    RUN_TEST(test_temperature_matches_division);
+    RUN_TEST(test_level_matches_map);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
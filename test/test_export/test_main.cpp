@@ -0,0 +1,143 @@
+// lights.json export: the file is written to lights.json.tmp and renamed over the old export,
+// so a failed write or rename must leave the previous export intact and no temporary file.
+// LittleFS runs on a scratch directory of the host; its fault flags stand in for a full or
+// failing flash.
+#include <unity.h>
+#include <unistd.h>
+#include "fs.cpp"
+
+// The binary cache, NVS stores and bulb JSON codec are not under test here
+bool loadLightsFromCache(std::vector<WizBulbInfo> &bulbs)
+{
+    return false;
+}
+
+bool saveLightsToCache(const std::vector<WizBulbInfo> &bulbs)
+{
+    return true;
+}
+
+void eraseLightCache()
+{
+}
+
+void eraseBulbStates()
+{
+}
+
+void eraseEndpointAssignments()
+{
+}
+
+void wizBulbInfoToJson(const WizBulbInfo &bulbInfo, JsonObject doc)
+{
+    char ip[16];
+    snprintf(ip, sizeof(ip), "%s", IPAddress(bulbInfo.ip).toString().c_str());
+    doc["ip"] = ip;
+}
+
+WizBulbInfo wizBulbInfoFromJson(JsonObjectConst doc)
+{
+    return WizBulbInfo();
+}
+
+static char scratchDir[] = "/tmp/wiz2hue_export_XXXXXX";
+
+static std::vector<WizBulbInfo> exportBulbs(int count)
+{
+    std::vector<WizBulbInfo> bulbs;
+    for (int i = 0; i < count; i++)
+    {
+        WizBulbInfo bulb;
+        bulb.ip = IPAddress(192, 168, 1, 10 + i);
+        bulb.isValid = true;
+        bulbs.push_back(bulb);
+    }
+    return bulbs;
+}
+
+static std::string readExport(const char *path)
+{
+    std::string content;
+    File file = LittleFS.open(path, "r");
+    char buffer[256];
+    size_t length;
+    while (file && (length = file.readBytes(buffer, sizeof(buffer))) > 0)
+    {
+        content.append(buffer, length);
+    }
+    return content;
+}
+
+void setUp(void)
+{
+    LittleFS.failOpen = false;
+    LittleFS.failWrites = false;
+    LittleFS.failRename = false;
+    LittleFS.remove("/lights.json");
+    LittleFS.remove("/lights.json.tmp");
+}
+
+void tearDown(void)
+{
+}
+
+void test_export_replaces_the_file(void)
+{
+    TEST_ASSERT_TRUE(exportLightsToJson(exportBulbs(1)));
+    TEST_ASSERT_TRUE(exportLightsToJson(exportBulbs(2)));
+    TEST_ASSERT_FALSE(LittleFS.exists("/lights.json.tmp"));
+
+    std::string content = readExport("/lights.json");
+    TEST_ASSERT_TRUE(content.find("192.168.1.10") != std::string::npos);
+    TEST_ASSERT_TRUE(content.find("192.168.1.11") != std::string::npos);
+}
+
+void test_failed_write_keeps_previous_export(void)
+{
+    TEST_ASSERT_TRUE(exportLightsToJson(exportBulbs(1)));
+    std::string previous = readExport("/lights.json");
+
+    LittleFS.failWrites = true;
+    TEST_ASSERT_FALSE(exportLightsToJson(exportBulbs(3)));
+    TEST_ASSERT_TRUE(readExport("/lights.json") == previous);
+    TEST_ASSERT_FALSE(LittleFS.exists("/lights.json.tmp"));
+}
+
+void test_failed_rename_keeps_previous_export(void)
+{
+    TEST_ASSERT_TRUE(exportLightsToJson(exportBulbs(1)));
+    std::string previous = readExport("/lights.json");
+
+    LittleFS.failRename = true;
+    TEST_ASSERT_FALSE(exportLightsToJson(exportBulbs(3)));
+    TEST_ASSERT_TRUE(readExport("/lights.json") == previous);
+    TEST_ASSERT_FALSE(LittleFS.exists("/lights.json.tmp"));
+}
+
+void test_failed_open_keeps_previous_export(void)
+{
+    TEST_ASSERT_TRUE(exportLightsToJson(exportBulbs(1)));
+    std::string previous = readExport("/lights.json");
+
+    LittleFS.failOpen = true;
+    TEST_ASSERT_FALSE(exportLightsToJson(exportBulbs(3)));
+    LittleFS.failOpen = false;
+    TEST_ASSERT_TRUE(readExport("/lights.json") == previous);
+}
+
+int main(int argc, char **argv)
+{
+    LittleFS.root = mkdtemp(scratchDir);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_export_replaces_the_file);
+    RUN_TEST(test_failed_write_keeps_previous_export);
+    RUN_TEST(test_failed_rename_keeps_previous_export);
+    RUN_TEST(test_failed_open_keeps_previous_export);
+    int failures = UNITY_END();
+
+    clearFileSystemCache();
+    rmdir(LittleFS.root.c_str());
+    return failures;
+}
@@ -0,0 +1,306 @@
+// Binary light cache under power loss: every write and erase of a full save, of journal appends
+// and of a journal-full compaction is cut in turn. After the "reboot" the cache must load either
+// the image from before the sequence or one that includes the interrupted change, never a mix.
+// The partition is the RAM flash of test/host/esp_partition.h.
+#include <unity.h>
+#include <vector>
+#include "lightcache.cpp"
+
+// Module names are interned by wiz.cpp, which is not under test here
+uint8_t internModuleName(const char *moduleName)
+{
+    return 0;
+}
+
+const char *moduleNameOf(uint8_t moduleId)
+{
+    return "Unknown";
+}
+
+const int TEST_BULBS = 8;
+
+// One step of an update sequence: an address change, or a whole record for a new bulb
+struct CacheUpdate
+{
+    uint8_t mac[6];
+    uint32_t ip;
+    bool newRecord;
+};
+
+static WizBulbInfo testBulb(uint8_t id, uint32_t ip)
+{
+    WizBulbInfo bulb;
+    const uint8_t mac[6] = {0x44, 0x4F, 0x8E, 0xFA, 0x17, id};
+    memcpy(bulb.mac, mac, sizeof(bulb.mac));
+    bulb.ip = ip;
+    bulb.bulbClass = BulbClass::RGB;
+    bulb.features.brightness = true;
+    bulb.features.color = true;
+    bulb.isValid = true;
+    return bulb;
+}
+
+static std::vector<WizBulbInfo> testBulbs(uint8_t subnet)
+{
+    std::vector<WizBulbInfo> bulbs;
+    for (int i = 0; i < TEST_BULBS; i++)
+    {
+        bulbs.push_back(testBulb(i, IPAddress(192, 168, subnet, 10 + i)));
+    }
+    return bulbs;
+}
+
+static void applyUpdate(std::vector<WizBulbInfo> &bulbs, const CacheUpdate &update)
+{
+    for (WizBulbInfo &bulb : bulbs)
+    {
+        if (memcmp(bulb.mac, update.mac, sizeof(bulb.mac)) == 0)
+        {
+            bulb.ip = update.ip;
+            return;
+        }
+    }
+    if (update.newRecord)
+    {
+        bulbs.push_back(testBulb(update.mac[5], update.ip));
+    }
+}
+
+// Same bulbs with the same addresses, in any order
+static bool sameLights(const std::vector<WizBulbInfo> &loaded, const std::vector<WizBulbInfo> &expected)
+{
+    if (loaded.size() != expected.size())
+    {
+        return false;
+    }
+    for (const WizBulbInfo &want : expected)
+    {
+        bool found = false;
+        for (const WizBulbInfo &have : loaded)
+        {
+            if (memcmp(have.mac, want.mac, sizeof(have.mac)) == 0)
+            {
+                found = have.ip == want.ip && have.bulbClass == want.bulbClass &&
+                        have.features.color == want.features.color && have.isValid;
+            }
+        }
+        if (!found)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Power back on: nothing is known about the flash contents, as after a restart
+static bool reboot(std::vector<WizBulbInfo> &bulbs)
+{
+    hostFlash.restorePower();
+    cacheScanned = false;
+    bulbs.clear();
+    return loadLightsFromCache(bulbs);
+}
+
+static void writeBaseImage(const std::vector<WizBulbInfo> &bulbs)
+{
+    hostFlash.reset();
+    cacheScanned = false;
+    TEST_ASSERT_TRUE(saveLightsToCache(bulbs));
+}
+
+// Appends until one more IP update would not fit, so the next append compacts
+static void fillJournal(const WizBulbInfo &bulb)
+{
+    TEST_ASSERT_TRUE(takeCacheMutex());
+    scanCache();
+    LightJournalIpUpdate filler;
+    memcpy(filler.mac, bulb.mac, sizeof(filler.mac));
+    filler.reserved = 0xFFFF;
+    filler.ip = bulb.ip;
+    while (journalEnd + 2 * (sizeof(LightJournalEntry) + sizeof(filler)) <= LIGHT_CACHE_JOURNAL_SIZE)
+    {
+        TEST_ASSERT_TRUE(appendJournalLocked(LIGHT_JOURNAL_IP_UPDATE, &filler, sizeof(filler)));
+    }
+    xSemaphoreGive(cacheMutex);
+}
+
+static std::vector<CacheUpdate> updateSequence()
+{
+    std::vector<CacheUpdate> updates;
+    for (int i = 0; i < TEST_BULBS; i++)
+    {
+        CacheUpdate update = {{0x44, 0x4F, 0x8E, 0xFA, 0x17, (uint8_t)i}, IPAddress(192, 168, 2, 10 + i), false};
+        updates.push_back(update);
+        if (i == TEST_BULBS / 2)
+        {
+            CacheUpdate added = {{0x44, 0x4F, 0x8E, 0xFA, 0x17, 0x40}, IPAddress(192, 168, 2, 64), true};
+            updates.push_back(added);
+        }
+    }
+    return updates;
+}
+
+static void runUpdates(const std::vector<CacheUpdate> &updates)
+{
+    for (const CacheUpdate &update : updates)
+    {
+        if (update.newRecord)
+        {
+            journalLightRecord(testBulb(update.mac[5], update.ip));
+        }
+        else
+        {
+            journalLightIpUpdate(update.mac, update.ip);
+        }
+    }
+}
+
+// Cuts power at each operation of the update sequence in turn. The journal is ordered, so the
+// loaded lights must be the base image with the first k updates applied, for some k; once the
+// sequence runs through without reaching the cut, all of them.
+static void cutEveryUpdateOperation(bool journalFull)
+{
+    std::vector<WizBulbInfo> base = testBulbs(1);
+    std::vector<CacheUpdate> updates = updateSequence();
+    int cuts = 0;
+    for (int cut = 1;; cut++)
+    {
+        writeBaseImage(base);
+        if (journalFull)
+        {
+            fillJournal(base[0]);
+        }
+        hostFlash.cutPowerAt(cut);
+        runUpdates(updates);
+        bool finished = !hostFlash.cut;
+
+        std::vector<WizBulbInfo> loaded;
+        TEST_ASSERT_TRUE_MESSAGE(reboot(loaded), "no image after the power cut");
+        std::vector<WizBulbInfo> expected = base;
+        bool matched = !finished && sameLights(loaded, expected);
+        for (size_t applied = 0; applied < updates.size() && !matched; applied++)
+        {
+            applyUpdate(expected, updates[applied]);
+            matched = sameLights(loaded, expected) && (!finished || applied == updates.size() - 1);
+        }
+        char message[64];
+        snprintf(message, sizeof(message), "power cut at flash operation %d", cut);
+        TEST_ASSERT_TRUE_MESSAGE(matched, message);
+
+        // Whatever the load folded into a fresh image survives the next restart unchanged
+        std::vector<WizBulbInfo> reloaded;
+        TEST_ASSERT_TRUE_MESSAGE(reboot(reloaded), message);
+        TEST_ASSERT_TRUE_MESSAGE(sameLights(reloaded, loaded), message);
+
+        cuts++;
+        if (finished)
+        {
+            break;
+        }
+    }
+    TEST_ASSERT_TRUE(cuts > (int)updates.size());
+}
+
+void setUp(void)
+{
+    hostFlash.reset();
+    cacheScanned = false;
+}
+
+void tearDown(void)
+{
+}
+
+void test_save_and_load_round_trip(void)
+{
+    std::vector<WizBulbInfo> bulbs = testBulbs(1);
+    writeBaseImage(bulbs);
+    TEST_ASSERT_TRUE(journalLightIpUpdate(bulbs[3].mac, IPAddress(192, 168, 1, 99)));
+    bulbs[3].ip = IPAddress(192, 168, 1, 99);
+
+    std::vector<WizBulbInfo> loaded;
+    TEST_ASSERT_TRUE(reboot(loaded));
+    TEST_ASSERT_TRUE(sameLights(loaded, bulbs));
+
+    WizBulbInfo found;
+    TEST_ASSERT_TRUE(lightCacheLookup(bulbs[3].mac, found));
+    TEST_ASSERT_EQUAL_UINT32((uint32_t)IPAddress(192, 168, 1, 99), found.ip);
+}
+
+// A full save writes the other slot, header last, then erases the journal
+void test_power_cut_during_save(void)
+{
+    std::vector<WizBulbInfo> before = testBulbs(1);
+    std::vector<WizBulbInfo> after = testBulbs(3);
+    for (int withJournal = 0; withJournal < 2; withJournal++)
+    {
+        for (int cut = 1;; cut++)
+        {
+            writeBaseImage(before);
+            std::vector<WizBulbInfo> old = before;
+            if (withJournal)
+            {
+                TEST_ASSERT_TRUE(journalLightIpUpdate(before[0].mac, IPAddress(192, 168, 1, 99)));
+                old[0].ip = IPAddress(192, 168, 1, 99);
+            }
+            hostFlash.cutPowerAt(cut);
+            saveLightsToCache(after);
+            bool finished = !hostFlash.cut;
+
+            char message[64];
+            snprintf(message, sizeof(message), "journal %d, power cut at flash operation %d", withJournal, cut);
+            std::vector<WizBulbInfo> loaded;
+            TEST_ASSERT_TRUE_MESSAGE(reboot(loaded), message);
+            TEST_ASSERT_TRUE_MESSAGE(sameLights(loaded, after) || (!finished && sameLights(loaded, old)), message);
+            if (finished)
+            {
+                break;
+            }
+        }
+    }
+}
+
+// The first save ever: nothing or the new image
+void test_power_cut_during_first_save(void)
+{
+    std::vector<WizBulbInfo> bulbs = testBulbs(1);
+    for (int cut = 1;; cut++)
+    {
+        hostFlash.reset();
+        cacheScanned = false;
+        hostFlash.cutPowerAt(cut);
+        saveLightsToCache(bulbs);
+        bool finished = !hostFlash.cut;
+
+        std::vector<WizBulbInfo> loaded;
+        bool loadedAny = reboot(loaded);
+        TEST_ASSERT_TRUE(loadedAny ? sameLights(loaded, bulbs) : !finished);
+        if (finished)
+        {
+            break;
+        }
+    }
+}
+
+void test_power_cut_during_journal_appends(void)
+{
+    cutEveryUpdateOperation(false);
+}
+
+void test_power_cut_during_journal_compaction(void)
+{
+    cutEveryUpdateOperation(true);
+}
+
+int main(int argc, char **argv)
+{
+    initLightCache();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_save_and_load_round_trip);
+    RUN_TEST(test_power_cut_during_save);
+    RUN_TEST(test_power_cut_during_first_save);
+    RUN_TEST(test_power_cut_during_journal_appends);
+    RUN_TEST(test_power_cut_during_journal_compaction);
+    return UNITY_END();
+}